@@ -0,0 +1,292 @@
+/*
+ * Binding overhead: the same workloads run through raw unqlite calls and
+ * through UnQLite::Database methods, and the time per operation of each
+ * is reported in nanoseconds. The difference is what the Ruby wrapper
+ * costs per call: method dispatch, argument checks, GetDatabase2, the
+ * two-phase fetch into a Ruby String, CHECK and the allocations
+ * (including the GC time they cause).
+ *
+ * The fetch workload also runs the extension's two-phase fetch in plain
+ * C, which separates the cost of the second lookup from the cost of
+ * going through Ruby.
+ *
+ * Built and run against the compiled extension by
+ *
+ *   rake bench:native [RECORDS=100000]
+ *
+ * or by hand, with the directory holding unqlite/unqlite_native.so:
+ *
+ *   binding_overhead LIBDIR [RECORDS]
+ */
+
+#include <ruby.h>
+#include <unqlite.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEY_LEN   16
+#define VALUE_LEN 100
+
+struct bench
+{
+  long records;
+  char dir[64];
+  char *keys;             /* records keys of KEY_LEN bytes, then as many missing keys */
+  char value[VALUE_LEN];
+  unqlite *raw;           /* handle used by the raw workloads */
+  VALUE db;               /* UnQLite::Database on another file */
+  VALUE rkeys;            /* the keys as Ruby Strings */
+  VALUE rvalue;
+};
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *bench_key(struct bench *b, long i)
+{
+  return b->keys + i * KEY_LEN;
+}
+
+static void raw_check(int rc, const char *what)
+{
+  if (rc != UNQLITE_OK)
+  {
+    fprintf(stderr, "%s: unqlite error %d\n", what, rc);
+    exit(1);
+  }
+}
+
+static void report(const char *op, long n, double raw, double ext)
+{
+  printf("%-22s %12.1f %12.1f %12.1f %8.2fx\n", op, raw / n, ext / n, (ext - raw) / n, ext / raw);
+}
+
+/* Consumers of the raw cursor walk: count the bytes handed out */
+static int raw_consume(const void *data, unsigned int len, void *arg)
+{
+  *(long *)arg += len;
+  return UNQLITE_OK;
+}
+
+static VALUE ext_count_i(RB_BLOCK_CALL_FUNC_ARGLIST(yielded, arg))
+{
+  (*(long *)arg)++;
+  return Qnil;
+}
+
+static void bench_store(struct bench *b)
+{
+  ID id_store = rb_intern("store");
+  double t0, raw, ext;
+  long i;
+
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+    raw_check(unqlite_kv_store(b->raw, bench_key(b, i), KEY_LEN, b->value, VALUE_LEN), "store");
+  raw = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+    rb_funcall(b->db, id_store, 2, RARRAY_AREF(b->rkeys, i), b->rvalue);
+  ext = now_ns() - t0;
+
+  raw_check(unqlite_commit(b->raw), "commit");
+  rb_funcall(b->db, rb_intern("commit"), 0);
+
+  report("store", b->records, raw, ext);
+}
+
+static void bench_fetch(struct bench *b)
+{
+  ID id_fetch = rb_intern("fetch");
+  char buf[VALUE_LEN];
+  unqlite_int64 n;
+  double t0, raw, two_phase, ext;
+  long i;
+
+  // One lookup into a buffer of the right size
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+  {
+    n = sizeof(buf);
+    raw_check(unqlite_kv_fetch(b->raw, bench_key(b, i), KEY_LEN, buf, &n), "fetch");
+  }
+  raw = now_ns() - t0;
+
+  // What Database#fetch does, without Ruby method dispatch
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+  {
+    VALUE str;
+
+    raw_check(unqlite_kv_fetch(b->raw, bench_key(b, i), KEY_LEN, NULL, &n), "fetch");
+    str = rb_str_buf_new(n);
+    raw_check(unqlite_kv_fetch(b->raw, bench_key(b, i), KEY_LEN, RSTRING_PTR(str), &n), "fetch");
+    rb_str_set_len(str, n);
+  }
+  two_phase = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+    rb_funcall(b->db, id_fetch, 1, RARRAY_AREF(b->rkeys, i));
+  ext = now_ns() - t0;
+
+  report("fetch", b->records, raw, ext);
+  report("fetch (C two-phase)", b->records, raw, two_phase);
+}
+
+static void bench_fetch_missing(struct bench *b)
+{
+  ID id_fetch = rb_intern("fetch");
+  unqlite_int64 n;
+  double t0, raw, ext;
+  long i;
+  int rc;
+
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+  {
+    rc = unqlite_kv_fetch(b->raw, bench_key(b, b->records + i), KEY_LEN, NULL, &n);
+    if (rc != UNQLITE_NOTFOUND)
+      raw_check(rc, "fetch missing");
+  }
+  raw = now_ns() - t0;
+
+  t0 = now_ns();
+  for (i = 0; i < b->records; i++)
+    rb_funcall(b->db, id_fetch, 2, RARRAY_AREF(b->rkeys, b->records + i), Qnil);
+  ext = now_ns() - t0;
+
+  report("fetch missing", b->records, raw, ext);
+}
+
+static void bench_each(struct bench *b)
+{
+  unqlite_kv_cursor *cursor;
+  double t0, raw, ext;
+  long bytes = 0, count = 0;
+
+  t0 = now_ns();
+  raw_check(unqlite_kv_cursor_init(b->raw, &cursor), "cursor");
+  for (unqlite_kv_cursor_first_entry(cursor); unqlite_kv_cursor_valid_entry(cursor); unqlite_kv_cursor_next_entry(cursor))
+  {
+    unqlite_kv_cursor_key_callback(cursor, raw_consume, &bytes);
+    unqlite_kv_cursor_data_callback(cursor, raw_consume, &bytes);
+  }
+  unqlite_kv_cursor_release(b->raw, cursor);
+  raw = now_ns() - t0;
+
+  t0 = now_ns();
+  rb_block_call(b->db, rb_intern("each"), 0, NULL, ext_count_i, (VALUE)&count);
+  ext = now_ns() - t0;
+
+  if (count != b->records)
+  {
+    fprintf(stderr, "each: %ld records instead of %ld\n", count, b->records);
+    exit(1);
+  }
+
+  report("each (per record)", b->records, raw, ext);
+}
+
+static VALUE bench_run(VALUE arg)
+{
+  struct bench *b = (struct bench *)arg;
+  char path[96];
+  long i;
+
+  rb_require("unqlite");
+
+  snprintf(path, sizeof(path), "%s/raw.db", b->dir);
+  raw_check(unqlite_open(&b->raw, path, UNQLITE_OPEN_CREATE), "open");
+  snprintf(path, sizeof(path), "%s/ext.db", b->dir);
+  b->db = rb_funcall(rb_path2class("UnQLite::Database"), rb_intern("new"), 1, rb_str_new_cstr(path));
+  rb_gc_register_address(&b->db);
+
+  b->rkeys = rb_ary_new_capa(2 * b->records);
+  rb_gc_register_address(&b->rkeys);
+  for (i = 0; i < 2 * b->records; i++)
+    rb_ary_push(b->rkeys, rb_str_new(bench_key(b, i), KEY_LEN));
+  b->rvalue = rb_str_new(b->value, VALUE_LEN);
+  rb_gc_register_address(&b->rvalue);
+
+  printf("%ld records, %d byte keys, %d byte values; nanoseconds per operation\n\n", b->records, KEY_LEN, VALUE_LEN);
+  printf("%-22s %12s %12s %12s %9s\n", "", "raw unqlite", "extension", "overhead", "ratio");
+
+  bench_store(b);
+  bench_fetch(b);
+  bench_fetch_missing(b);
+  bench_each(b);
+
+  rb_funcall(b->db, rb_intern("close"), 0);
+  unqlite_close(b->raw);
+  return Qnil;
+}
+
+int main(int argc, char **argv)
+{
+  struct bench b;
+  char *options[] = { "ruby", "-e", "" };
+  long i;
+  int state = 0;
+
+  if (argc < 2)
+  {
+    fprintf(stderr, "usage: %s LIBDIR [RECORDS]\n", argv[0]);
+    return 2;
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.records = argc > 2 ? atol(argv[2]) : 100000;
+  if (b.records <= 0)
+    b.records = 100000;
+
+  // Keys in random order, so neither side benefits from locality
+  b.keys = malloc(2 * b.records * KEY_LEN);
+  for (i = 0; i < 2 * b.records; i++)
+  {
+    char key[KEY_LEN + 1];
+    snprintf(key, sizeof(key), "%c:%014ld", i < b.records ? 'k' : 'm', (i * 2654435761L) % 100000000000000L);
+    memcpy(b.keys + i * KEY_LEN, key, KEY_LEN);
+  }
+  memset(b.value, 'v', VALUE_LEN);
+
+  strcpy(b.dir, "/tmp/unqlite-bench-XXXXXX");
+  if (!mkdtemp(b.dir))
+  {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  ruby_sysinit(&argc, &argv);
+  {
+    RUBY_INIT_STACK;
+    ruby_init();
+    ruby_options(3, options);
+    rb_ary_unshift(rb_gv_get("$LOAD_PATH"), rb_str_new_cstr(argv[1]));
+
+    rb_protect(bench_run, (VALUE)&b, &state);
+    if (state)
+      rb_funcall(rb_mKernel, rb_intern("warn"), 1, rb_funcall(rb_errinfo(), rb_intern("full_message"), 0));
+    ruby_cleanup(0);
+  }
+
+  {
+    char path[96];
+    snprintf(path, sizeof(path), "%s/raw.db", b.dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/ext.db", b.dir);
+    unlink(path);
+    rmdir(b.dir);
+  }
+  free(b.keys);
+
+  return state ? 1 : 0;
+}
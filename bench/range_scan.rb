@@ -0,0 +1,52 @@
+# Range scans over time-series keys: the hash engine's storage-order
+# cursor (filter, then sort) against the in-memory key order B+tree kept
+# by the handle (#each_range).
+#
+#   ruby -Ilib bench/range_scan.rb [records] [scans]
+
+require 'benchmark'
+require 'tmpdir'
+require 'unqlite'
+
+records = (ARGV[0] || 200_000).to_i
+scans = (ARGV[1] || 200).to_i
+width = 1_000
+
+Dir.mktmpdir("unqlite-bench") do |dir|
+  db = UnQLite::Database.new("#{dir}/bench.db")
+  records.times { |i| db.store("sensor:42:%012d" % (i * 10), "v#{i}") }
+  db.commit
+
+  starts = Array.new(scans) { "sensor:42:%012d" % (rand(records - width) * 10) }
+  bounds = starts.map { |from| [from, "sensor:42:%012d" % (from[-12..-1].to_i + (width - 1) * 10)] }
+
+  puts "#{records} records, #{scans} scans of #{width} keys"
+  Benchmark.bm(24) do |x|
+    x.report("hash cursor + sort") do
+      bounds.each do |from, to|
+        pairs = []
+        db.each_pair { |key, value| pairs << [key, value] if key >= from && key <= to }
+        pairs.sort_by!(&:first)
+      end
+    end
+
+    x.report("key order: build") { db.enable_key_order }
+
+    x.report("key order: each_range") do
+      bounds.each do |from, to|
+        pairs = []
+        db.each_range(from, to) { |key, value| pairs << [key, value] }
+      end
+    end
+
+    x.report("key order: reverse") do
+      bounds.each do |from, to|
+        pairs = []
+        db.each_range(from, to, reverse: true) { |key, value| pairs << [key, value] }
+      end
+    end
+  end
+
+  p db.key_order_stats
+  db.close
+end
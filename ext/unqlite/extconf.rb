@@ -3,4 +3,19 @@ require 'mkmf'
 abort "unqlite.h is missing. Please, install unqlite." unless find_header 'unqlite.h'
 abort "unqlite is missing. Please, install unqlite" unless find_library 'unqlite', 'unqlite_open'
 
+# Database#parallel_scan runs its workers on OS threads when available
+have_library('pthread', 'pthread_create') if have_header('pthread.h')
+
+# Interned keys for Database#each(intern_keys: true), Ruby 3.0+
+have_func('rb_enc_interned_str', 'ruby.h')
+
+# GC compaction support for the wrapped objects, Ruby 2.7+
+have_func('rb_gc_mark_movable', 'ruby.h')
+
+# USDT probes for bpftrace/SystemTap (see unqlite_probes.h)
+have_header('sys/sdt.h')
+
+# UnQLite.enable_io_tracing wraps the built-in VFS, which unqlite.h does not declare
+have_func('unqliteExportBuiltinVfs')
+
 create_makefile('unqlite/unqlite_native')
@@ -6,7 +6,24 @@ void Init_unqlite_native()
 {
   mUnQLite = rb_define_module("UnQLite");
 
+  Init_unqlite_exception();
+
   Init_unqlite_database();
+  Init_unqlite_index();
+  Init_unqlite_bloom();
+  Init_unqlite_cache();
+  Init_unqlite_scan();
+  Init_unqlite_bulk();
+  Init_unqlite_backup();
+  Init_unqlite_stream();
+  Init_unqlite_sharded();
+  Init_unqlite_ttl();
+  Init_unqlite_trace();
+  Init_unqlite_compact();
+  Init_unqlite_collection();
+  Init_unqlite_order();
+  Init_unqlite_key();
+  Init_unqlite_fork();
   Init_unqlite_codes();
   Init_unqlite_cursor();
 }
@@ -0,0 +1,317 @@
+#include <unqlite_backup.h>
+#include <ruby/thread.h>
+#include <stdlib.h>
+
+/*
+ * Database#backup_to streams every record (internal entries included)
+ * to an IO in the backup format, one chunk at a time. File databases
+ * are read through a private read-only handle, opened after committing
+ * the pending transaction of this one, so that the backup does not see
+ * writes made through this handle meanwhile. UnQLite.restore loads a
+ * backup through the bulk loader.
+ */
+
+#define BACKUP_CHUNK_SIZE (1024 * 1024)
+
+static uint32_t crc32_table[256];
+
+static void crc32_init()
+{
+  uint32_t i, k, c;
+
+  for (i = 0; i < 256; i++)
+  {
+    c = i;
+    for (k = 0; k < 8; k++)
+      c = (c >> 1) ^ (0xedb88320UL & (0 - (c & 1)));
+    crc32_table[i] = c;
+  }
+}
+
+/* CRC-32 (IEEE), chained by passing the previous result; starts from 0 */
+uint32_t unqliteRuby_crc32(uint32_t crc, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  crc = ~crc;
+  while (len--)
+    crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+typedef struct
+{
+  unqliteRubyPtr ctx;
+  unqlite *db;              /* handle being read */
+  int private_db;           /* _db_ was opened for this backup */
+  int unlocked;             /* fill chunks without the GVL */
+  unqlite_kv_cursor *cursor;
+
+  VALUE io;
+  int close_io;
+
+  char *buf;
+  size_t len;
+  size_t cap;
+  size_t chunk_size;
+
+  uint64_t count;
+  uint32_t crc;
+  int done;
+  int rc;
+} backupWriter;
+
+static int backup_reserve(backupWriter *w, size_t n)
+{
+  if (w->len + n > w->cap)
+  {
+    size_t cap = w->cap ? w->cap : 64 * 1024;
+    char *buf;
+
+    while (cap < w->len + n)
+      cap *= 2;
+    buf = (char *)realloc(w->buf, cap);
+    if (!buf)
+      return UNQLITE_NOMEM;
+    w->buf = buf;
+    w->cap = cap;
+  }
+  return UNQLITE_OK;
+}
+
+static int backup_consumer(const void *data, unsigned int len, void *udata)
+{
+  backupWriter *w = (backupWriter *)udata;
+
+  if (backup_reserve(w, len) != UNQLITE_OK)
+    return UNQLITE_ABORT;
+  memcpy(w->buf + w->len, data, len);
+  w->len += len;
+  return UNQLITE_OK;
+}
+
+static void backup_put_u32(char *p, uint32_t n)
+{
+  p[0] = (char)(n >> 24);
+  p[1] = (char)(n >> 16);
+  p[2] = (char)(n >> 8);
+  p[3] = (char)n;
+}
+
+/* Serialize records until the chunk is full. Touches no Ruby object. */
+static void* backup_fill(void *arg)
+{
+  backupWriter *w = (backupWriter *)arg;
+  int rc = UNQLITE_OK;
+
+  while (w->len < w->chunk_size)
+  {
+    size_t start = w->len, klen;
+
+    if (!unqlite_kv_cursor_valid_entry(w->cursor))
+    {
+      w->done = 1;
+      break;
+    }
+
+    // Leave room for the lengths, then append the key and the value
+    rc = backup_reserve(w, 8);
+    if (rc != UNQLITE_OK)
+      break;
+    w->len += 8;
+    rc = unqlite_kv_cursor_key_callback(w->cursor, backup_consumer, w);
+    if (rc != UNQLITE_OK)
+      break;
+    klen = w->len - start - 8;
+    rc = unqlite_kv_cursor_data_callback(w->cursor, backup_consumer, w);
+    if (rc != UNQLITE_OK)
+      break;
+
+    backup_put_u32(w->buf + start, (uint32_t)klen);
+    backup_put_u32(w->buf + start + 4, (uint32_t)(w->len - start - 8 - klen));
+    w->crc = unqliteRuby_crc32(w->crc, w->buf + start, w->len - start);
+    w->count++;
+
+    unqlite_kv_cursor_next_entry(w->cursor);
+  }
+
+  w->rc = rc;
+  return NULL;
+}
+
+static VALUE backup_body(VALUE arg)
+{
+  backupWriter *w = (backupWriter *)arg;
+  ID id_write = rb_intern("write");
+  char trailer[UNQLITE_RUBY_BACKUP_TRAILER_LEN];
+
+  rb_funcall(w->io, id_write, 1, rb_str_new(UNQLITE_RUBY_BACKUP_MAGIC, UNQLITE_RUBY_BACKUP_MAGIC_LEN));
+
+  unqlite_kv_cursor_first_entry(w->cursor);
+  while (!w->done)
+  {
+    w->len = 0;
+    if (w->unlocked)
+      rb_thread_call_without_gvl(backup_fill, w, RUBY_UBF_IO, NULL);
+    else
+      backup_fill(w);
+    CHECK(w->db, w->rc);
+
+    if (w->len > 0)
+      rb_funcall(w->io, id_write, 1, rb_str_new(w->buf, w->len));
+
+    // The shared handle may have been closed by the IO
+    if (!w->private_db && w->ctx->pDb != w->db)
+      closed_database();
+  }
+
+  backup_put_u32(trailer, UNQLITE_RUBY_BACKUP_END);
+  backup_put_u32(trailer + 4, (uint32_t)(w->count >> 32));
+  backup_put_u32(trailer + 8, (uint32_t)w->count);
+  backup_put_u32(trailer + 12, w->crc);
+  rb_funcall(w->io, id_write, 1, rb_str_new(trailer, sizeof(trailer)));
+
+  return ULL2NUM(w->count);
+}
+
+static VALUE backup_ensure(VALUE arg)
+{
+  backupWriter *w = (backupWriter *)arg;
+
+  if (w->private_db)
+  {
+    unqlite_kv_cursor_release(w->db, w->cursor);
+    unqlite_close(w->db);
+  }
+  else if (w->ctx->pDb == w->db)
+    unqliteRuby_cursor_recycle(w->ctx, w->cursor);
+
+  if (w->close_io)
+    rb_funcall(w->io, rb_intern("close"), 0);
+  free(w->buf);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *     database.backup_to(io_or_path, chunk_size: 1024 * 1024) -> count
+ *
+ * Writes a backup of every record to _io_or_path_, _chunk_size_ bytes
+ * at a time, and returns the number of records written. The stream is
+ * length-prefixed and ends with the record count and a CRC-32; restore
+ * it with UnQLite.restore.
+ *
+ * File databases are read through a private read-only handle, after
+ * committing the pending writes of this one. While a transaction begun
+ * with #begin_transaction is open, or after #disable_auto_commit while
+ * writes are uncommitted, nothing is committed: the backup reads
+ * through this handle instead and includes those writes. In-memory
+ * databases are read through this handle too, so they should not be
+ * modified while the backup runs.
+ */
+static VALUE unqlite_database_backup_to(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  VALUE target, opts;
+  VALUE kwargs[1];
+  ID kwnames[1];
+  backupWriter writer;
+  int rc;
+
+  rb_scan_args(argc, argv, "1:", &target, &opts);
+
+  memset(&writer, 0, sizeof(writer));
+  writer.chunk_size = BACKUP_CHUNK_SIZE;
+
+  kwnames[0] = rb_intern("chunk_size");
+  kwargs[0] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 1, kwargs);
+  if (kwargs[0] != Qundef)
+    writer.chunk_size = NUM2SIZET(kwargs[0]);
+  if (writer.chunk_size == 0)
+    rb_raise(rb_eArgError, "chunk_size must be positive");
+
+  GetDatabase2(self, ctx, db);
+  writer.ctx = ctx;
+
+  // Accept a file name as target
+  if (RB_TYPE_P(target, T_STRING))
+  {
+    target = rb_funcall(rb_cFile, rb_intern("open"), 2, target, rb_str_new_cstr("wb"));
+    writer.close_io = 1;
+  }
+  writer.io = target;
+
+  // Never commit a transaction the caller still controls
+  if (!(ctx->flags & (UNQLITE_OPEN_IN_MEMORY | UNQLITE_OPEN_TEMP_DB)) && strcmp(ctx->path, ":mem:") != 0 &&
+      !ctx->in_transaction && !(ctx->no_auto_commit && ctx->pending))
+  {
+    writer.private_db = 1;
+    writer.unlocked = unqlite_lib_is_threadsafe();
+    rc = unqlite_commit(db);
+    if (rc == UNQLITE_OK)
+    {
+      ctx->pending = 0;
+      rc = unqlite_open(&writer.db, ctx->path, UNQLITE_OPEN_READONLY);
+    }
+    if (rc == UNQLITE_OK)
+    {
+      rc = unqlite_kv_cursor_init(writer.db, &writer.cursor);
+      if (rc != UNQLITE_OK)
+        unqlite_close(writer.db);
+    }
+  }
+  else
+  {
+    writer.db = db;
+    rc = unqliteRuby_cursor_acquire(ctx, &writer.cursor);
+  }
+
+  if (rc != UNQLITE_OK)
+  {
+    if (writer.close_io)
+      rb_funcall(target, rb_intern("close"), 0);
+    CHECK(writer.private_db ? 0 : db, rc);
+  }
+
+  return rb_ensure(backup_body, (VALUE)&writer, backup_ensure, (VALUE)&writer);
+}
+
+/*
+ * call-seq:
+ *     UnQLite.restore(path, io_or_path, commit_every: 16 * 1024 * 1024) -> count
+ *     UnQLite.restore(path, io_or_path, ...) { |records, bytes| ... } -> count
+ *
+ * Loads a backup written by Database#backup_to into the database at
+ * _path_ through UnQLite.bulk_load. The record count and checksum are
+ * verified at the end of the stream, raising UnQLite::CorruptException
+ * on mismatch; batches committed before that are kept.
+ */
+static VALUE unqlite_restore(int argc, VALUE* argv, VALUE self)
+{
+  VALUE path, source, opts;
+  VALUE kwargs[1];
+  ID kwnames[1];
+  size_t commit_every = 16 * 1024 * 1024;
+
+  rb_scan_args(argc, argv, "2:", &path, &source, &opts);
+
+  kwnames[0] = rb_intern("commit_every");
+  kwargs[0] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 1, kwargs);
+  if (kwargs[0] != Qundef)
+    commit_every = NUM2SIZET(kwargs[0]);
+
+  return unqliteRuby_bulk_load(path, source, UNQLITE_RUBY_BULK_BACKUP, commit_every, 0);
+}
+
+void Init_unqlite_backup()
+{
+  crc32_init();
+
+  rb_define_method(cUnQLiteDatabase, "backup_to", unqlite_database_backup_to, -1);
+  rb_define_singleton_method(mUnQLite, "restore", unqlite_restore, -1);
+}
@@ -0,0 +1,21 @@
+#ifndef UNQLITE_RUBY_BACKUP
+#define UNQLITE_RUBY_BACKUP
+
+#include <unqlite_ruby.h>
+#include <stdint.h>
+
+/*
+ * Backup stream: magic, then records (big-endian u32 key length, u32
+ * value length, key, value), then a trailer made of the END marker in
+ * place of a key length, the u64 record count and the CRC-32 of all
+ * the record bytes.
+ */
+#define UNQLITE_RUBY_BACKUP_MAGIC       "UNQLBAK1"
+#define UNQLITE_RUBY_BACKUP_MAGIC_LEN   8
+#define UNQLITE_RUBY_BACKUP_END         0xffffffffUL
+#define UNQLITE_RUBY_BACKUP_TRAILER_LEN 16
+
+void Init_unqlite_backup();
+uint32_t unqliteRuby_crc32(uint32_t crc, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,415 @@
+#include <unqlite_bloom.h>
+#include <unqlite_hash.h>
+#include <math.h>
+#include <stdio.h>
+#include <ruby/util.h>
+
+/*
+ * Optional per-handle Bloom filter over the stored keys. Lookups of
+ * keys the filter has never seen are answered without calling into
+ * unqlite. Deleted keys are not removed from the filter (they only
+ * cost a false positive), a #clear resets it.
+ */
+
+#define BLOOM_MAGIC     "UQBLOOM1"
+#define BLOOM_MAGIC_LEN 8
+
+static unqliteRubyBloom* bloom_new(uint64_t nbits, int nhashes)
+{
+  unqliteRubyBloom *bloom = ALLOC(unqliteRubyBloom);
+
+  // Round up to whole words
+  nbits = (nbits + 63) & ~(uint64_t)63;
+  if (nbits == 0) nbits = 64;
+
+  memset(bloom, 0, sizeof(unqliteRubyBloom));
+  bloom->nbits = nbits;
+  bloom->nhashes = nhashes;
+  bloom->bits = ZALLOC_N(uint64_t, nbits / 64);
+  return bloom;
+}
+
+static void bloom_free(unqliteRubyBloom *bloom)
+{
+  xfree(bloom->bits);
+  xfree(bloom->path);
+  xfree(bloom);
+}
+
+/* Kirsch-Mitzenmacher double hashing: the i-th bit is h1 + i * h2 */
+static void bloom_hashes(const char *key, long len, uint64_t *h1, uint64_t *h2)
+{
+  *h1 = unqliteRuby_hash(key, len, 0);
+  *h2 = unqliteRuby_hash(key, len, 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+static void bloom_set(unqliteRubyBloom *bloom, const char *key, long len)
+{
+  uint64_t h1, h2, bit;
+  int i;
+
+  bloom_hashes(key, len, &h1, &h2);
+  for (i = 0; i < bloom->nhashes; i++)
+  {
+    bit = (h1 + i * h2) % bloom->nbits;
+    bloom->bits[bit >> 6] |= (uint64_t)1 << (bit & 63);
+  }
+  bloom->items++;
+}
+
+static int bloom_test(unqliteRubyBloom *bloom, const char *key, long len)
+{
+  uint64_t h1, h2, bit;
+  int i;
+
+  bloom_hashes(key, len, &h1, &h2);
+  for (i = 0; i < bloom->nhashes; i++)
+  {
+    bit = (h1 + i * h2) % bloom->nbits;
+    if (!(bloom->bits[bit >> 6] & ((uint64_t)1 << (bit & 63))))
+      return 0;
+  }
+  return 1;
+}
+
+static void bloom_put64(unsigned char *p, uint64_t v)
+{
+  int i;
+  for (i = 0; i < 8; i++) p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static uint64_t bloom_get64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  int i;
+  for (i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+/* Write the filter to a sidecar file. Returns 0 on success. */
+static int bloom_save(unqliteRubyBloom *bloom, const char *path)
+{
+  unsigned char header[BLOOM_MAGIC_LEN + 24], word[8];
+  uint64_t i;
+  FILE *f = fopen(path, "wb");
+
+  if (!f) return -1;
+
+  memcpy(header, BLOOM_MAGIC, BLOOM_MAGIC_LEN);
+  bloom_put64(header + BLOOM_MAGIC_LEN, bloom->nbits);
+  bloom_put64(header + BLOOM_MAGIC_LEN + 8, bloom->nhashes);
+  bloom_put64(header + BLOOM_MAGIC_LEN + 16, bloom->items);
+  fwrite(header, sizeof(header), 1, f);
+
+  for (i = 0; i < bloom->nbits / 64; i++)
+  {
+    bloom_put64(word, bloom->bits[i]);
+    fwrite(word, sizeof(word), 1, f);
+  }
+
+  return (ferror(f) | fclose(f)) ? -1 : 0;
+}
+
+/* Read a filter from a sidecar file, or NULL if missing or invalid */
+static unqliteRubyBloom* bloom_load(const char *path)
+{
+  unsigned char header[BLOOM_MAGIC_LEN + 24], word[8];
+  unqliteRubyBloom *bloom;
+  uint64_t nbits, nhashes, i;
+  FILE *f = fopen(path, "rb");
+
+  if (!f) return NULL;
+
+  if (fread(header, sizeof(header), 1, f) != 1 || memcmp(header, BLOOM_MAGIC, BLOOM_MAGIC_LEN) != 0)
+  {
+    fclose(f);
+    return NULL;
+  }
+
+  nbits = bloom_get64(header + BLOOM_MAGIC_LEN);
+  nhashes = bloom_get64(header + BLOOM_MAGIC_LEN + 8);
+  if (nbits == 0 || (nbits & 63) || nhashes == 0 || nhashes > 64)
+  {
+    fclose(f);
+    return NULL;
+  }
+
+  bloom = bloom_new(nbits, (int)nhashes);
+  bloom->items = bloom_get64(header + BLOOM_MAGIC_LEN + 16);
+  for (i = 0; i < nbits / 64; i++)
+  {
+    if (fread(word, sizeof(word), 1, f) != 1)
+    {
+      fclose(f);
+      bloom_free(bloom);
+      return NULL;
+    }
+    bloom->bits[i] = bloom_get64(word);
+  }
+
+  fclose(f);
+  return bloom;
+}
+
+struct bloom_build_args
+{
+  unqliteRubyBloom *bloom;
+  unqlite *db;
+};
+
+/* Add every key of the database to the filter */
+static VALUE bloom_build(VALUE vargs)
+{
+  struct bloom_build_args *args = (struct bloom_build_args *)vargs;
+  unqlite_kv_cursor *cursor;
+  char *buf = NULL;
+  int cap = 0, len, rc;
+
+  rc = unqlite_kv_cursor_init(args->db, &cursor);
+  CHECK(args->db, rc);
+
+  rc = unqlite_kv_cursor_first_entry(cursor);
+  while (unqlite_kv_cursor_valid_entry(cursor))
+  {
+    rc = unqlite_kv_cursor_key(cursor, NULL, &len);
+    if (rc != UNQLITE_OK) break;
+    if (len > cap)
+    {
+      REALLOC_N(buf, char, len);
+      cap = len;
+    }
+    rc = unqlite_kv_cursor_key(cursor, buf, &len);
+    if (rc != UNQLITE_OK) break;
+
+    bloom_set(args->bloom, buf, len);
+    rc = unqlite_kv_cursor_next_entry(cursor);
+  }
+
+  xfree(buf);
+  unqlite_kv_cursor_release(args->db, cursor);
+  if (rc != UNQLITE_OK && rc != UNQLITE_DONE && rc != UNQLITE_EOF && rc != UNQLITE_NOTFOUND)
+    CHECK(args->db, rc);
+
+  return Qnil;
+}
+
+void unqliteRuby_bloom_add(unqliteRubyPtr ctx, const char *key, long len)
+{
+  if (ctx->bloom)
+    bloom_set(ctx->bloom, key, len);
+}
+
+/* Returns 0 if _key_ is definitely missing, 1 if it may exist */
+int unqliteRuby_bloom_check(unqliteRubyPtr ctx, const char *key, long len)
+{
+  unqliteRubyBloom *bloom = ctx->bloom;
+
+  if (!bloom)
+    return 1;
+
+  bloom->checks++;
+  if (bloom_test(bloom, key, len))
+    return 1;
+
+  bloom->negatives++;
+  return 0;
+}
+
+/* Record a key let through by the filter but not found by unqlite */
+void unqliteRuby_bloom_miss(unqliteRubyPtr ctx)
+{
+  if (ctx->bloom)
+    ctx->bloom->false_positives++;
+}
+
+/* All keys are gone: start over with an empty filter */
+void unqliteRuby_bloom_clear(unqliteRubyPtr ctx)
+{
+  if (ctx->bloom)
+  {
+    memset(ctx->bloom->bits, 0, ctx->bloom->nbits / 8);
+    ctx->bloom->items = 0;
+  }
+}
+
+size_t unqliteRuby_bloom_memsize(const struct _unqliteRuby *ctx)
+{
+  if (!ctx->bloom)
+    return 0;
+  return sizeof(unqliteRubyBloom) + ctx->bloom->nbits / 8 + (ctx->bloom->path ? strlen(ctx->bloom->path) + 1 : 0);
+}
+
+/* Save the filter to its sidecar file (if any) and release it */
+void unqliteRuby_bloom_close(unqliteRubyPtr ctx)
+{
+  if (ctx->bloom)
+  {
+    if (ctx->bloom->path)
+      bloom_save(ctx->bloom, ctx->bloom->path);
+    bloom_free(ctx->bloom);
+    ctx->bloom = NULL;
+  }
+}
+
+/*
+ * call-seq:
+ *     database.enable_bloom_filter(capacity: 100_000, error_rate: 0.01, path: nil)
+ *
+ * Keeps a Bloom filter of the stored keys in memory, so that #fetch,
+ * #[] and #has_key? answer most misses without a lookup. The filter is
+ * sized for _capacity_ keys at the given false positive _error_rate_
+ * and is built by scanning the keys of the database.
+ *
+ * If _path_ is given and holds a filter saved by a previous session,
+ * it is loaded instead of scanning the database; the filter is saved
+ * back to _path_ when the database is closed. A sidecar file is only
+ * valid if nobody else wrote to the database in between.
+ */
+static VALUE unqlite_database_enable_bloom_filter(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  unqliteRubyBloom *bloom = NULL;
+  VALUE opts;
+  VALUE kwargs[3];
+  ID kwnames[3];
+  double capacity = 100000, error_rate = 0.01, nbits;
+  int nhashes;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  kwnames[0] = rb_intern("capacity");
+  kwnames[1] = rb_intern("error_rate");
+  kwnames[2] = rb_intern("path");
+  kwargs[0] = kwargs[1] = kwargs[2] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 3, kwargs);
+
+  if (kwargs[0] != Qundef) capacity = NUM2DBL(kwargs[0]);
+  if (kwargs[1] != Qundef) error_rate = NUM2DBL(kwargs[1]);
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2])) FilePathValue(kwargs[2]);
+  if (capacity < 1 || error_rate <= 0 || error_rate >= 1)
+    rb_raise(rb_eArgError, "capacity must be positive and error_rate between 0 and 1");
+
+  GetDatabase2(self, ctx, db);
+
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2]))
+    bloom = bloom_load(StringValueCStr(kwargs[2]));
+
+  if (!bloom)
+  {
+    struct bloom_build_args args;
+    int state = 0;
+
+    // m = -n ln(p) / ln(2)^2, k = m/n ln(2)
+    nbits = ceil(-capacity * log(error_rate) / (M_LN2 * M_LN2));
+    nhashes = (int)round(nbits / capacity * M_LN2);
+    if (nhashes < 1) nhashes = 1;
+    if (nhashes > 30) nhashes = 30;
+
+    bloom = bloom_new((uint64_t)nbits, nhashes);
+    args.bloom = bloom;
+    args.db = db;
+    rb_protect(bloom_build, (VALUE)&args, &state);
+    if (state)
+    {
+      bloom_free(bloom);
+      rb_jump_tag(state);
+    }
+  }
+
+  unqliteRuby_bloom_close(ctx);
+  ctx->bloom = bloom;
+
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2]))
+    bloom->path = ruby_strdup(StringValueCStr(kwargs[2]));
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.disable_bloom_filter
+ *
+ * Drops the Bloom filter (saving it first if it has a sidecar file).
+ */
+static VALUE unqlite_database_disable_bloom_filter(VALUE self)
+{
+  unqliteRubyPtr ctx;
+
+  GetDatabase(self, ctx);
+  unqliteRuby_bloom_close(ctx);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.save_bloom_filter(path)
+ *
+ * Writes the Bloom filter to _path_, to be loaded by
+ * #enable_bloom_filter in a later session.
+ */
+static VALUE unqlite_database_save_bloom_filter(VALUE self, VALUE path)
+{
+  unqliteRubyPtr ctx;
+
+  FilePathValue(path);
+  GetDatabase(self, ctx);
+
+  if (!ctx->bloom)
+    rb_raise(rb_eRuntimeError, "Bloom filter is not enabled");
+
+  if (bloom_save(ctx->bloom, StringValueCStr(path)) != 0)
+    rb_sys_fail(StringValueCStr(path));
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.bloom_filter_stats -> hash or nil
+ *
+ * Returns counters of the Bloom filter: its size, the number of checks
+ * and negatives, the false positives seen and both the observed and the
+ * theoretical false positive rate. Returns nil if no filter is enabled.
+ */
+static VALUE unqlite_database_bloom_filter_stats(VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyBloom *bloom;
+  volatile VALUE stats;
+  double observed = 0.0, estimated;
+  uint64_t rejectable;
+
+  GetDatabase(self, ctx);
+
+  bloom = ctx->bloom;
+  if (!bloom)
+    return Qnil;
+
+  rejectable = bloom->negatives + bloom->false_positives;
+  if (rejectable > 0)
+    observed = (double)bloom->false_positives / rejectable;
+  estimated = pow(1.0 - exp(-(double)bloom->nhashes * bloom->items / bloom->nbits), bloom->nhashes);
+
+  stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("bits")), ULL2NUM(bloom->nbits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hashes")), INT2NUM(bloom->nhashes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("items")), ULL2NUM(bloom->items));
+  rb_hash_aset(stats, ID2SYM(rb_intern("checks")), ULL2NUM(bloom->checks));
+  rb_hash_aset(stats, ID2SYM(rb_intern("negatives")), ULL2NUM(bloom->negatives));
+  rb_hash_aset(stats, ID2SYM(rb_intern("false_positives")), ULL2NUM(bloom->false_positives));
+  rb_hash_aset(stats, ID2SYM(rb_intern("false_positive_rate")), DBL2NUM(observed));
+  rb_hash_aset(stats, ID2SYM(rb_intern("estimated_false_positive_rate")), DBL2NUM(estimated));
+
+  return stats;
+}
+
+void Init_unqlite_bloom()
+{
+  rb_define_method(cUnQLiteDatabase, "enable_bloom_filter", unqlite_database_enable_bloom_filter, -1);
+  rb_define_method(cUnQLiteDatabase, "disable_bloom_filter", unqlite_database_disable_bloom_filter, 0);
+  rb_define_method(cUnQLiteDatabase, "save_bloom_filter", unqlite_database_save_bloom_filter, 1);
+  rb_define_method(cUnQLiteDatabase, "bloom_filter_stats", unqlite_database_bloom_filter_stats, 0);
+}
@@ -0,0 +1,29 @@
+#ifndef UNQLITE_RUBY_BLOOM
+#define UNQLITE_RUBY_BLOOM
+
+#include <unqlite_ruby.h>
+#include <stdint.h>
+
+struct _unqliteRuby;
+
+typedef struct _unqliteRubyBloom
+{
+  uint64_t *bits;
+  uint64_t nbits;
+  int nhashes;
+  uint64_t items;           /* keys added since the filter was built */
+  uint64_t checks;          /* lookups answered by the filter */
+  uint64_t negatives;       /* lookups rejected without touching unqlite */
+  uint64_t false_positives; /* lookups let through that were not found */
+  char *path;               /* sidecar file saved on close, or NULL */
+} unqliteRubyBloom;
+
+void Init_unqlite_bloom();
+void unqliteRuby_bloom_add(struct _unqliteRuby *ctx, const char *key, long len);
+int unqliteRuby_bloom_check(struct _unqliteRuby *ctx, const char *key, long len);
+void unqliteRuby_bloom_miss(struct _unqliteRuby *ctx);
+void unqliteRuby_bloom_clear(struct _unqliteRuby *ctx);
+void unqliteRuby_bloom_close(struct _unqliteRuby *ctx);
+size_t unqliteRuby_bloom_memsize(const struct _unqliteRuby *ctx);
+
+#endif
@@ -0,0 +1,642 @@
+#include <unqlite_bulk.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+
+/*
+ * UnQLite.bulk_load: parses a stream of records in C and stores them
+ * through a private, non-journaled handle. Records are parsed into an
+ * arena holding one batch; every batch is stored (optionally sorted by
+ * key) and committed without the GVL.
+ */
+
+#define BULK_READ_SIZE    (256 * 1024)
+#define BULK_COMMIT_EVERY (16 * 1024 * 1024)
+
+typedef struct
+{
+  size_t offset;  /* of the key in the arena, the value follows it */
+  uint32_t klen;
+  uint32_t vlen;
+} bulkRecord;
+
+typedef struct
+{
+  unqlite *db;
+  int format;
+  size_t commit_every;
+  int presort;
+  int unlocked;           /* store batches without the GVL */
+
+  VALUE io;
+  int close_io;
+  VALUE chunk;
+
+  // Unparsed tail of the stream
+  char *buf;
+  size_t len;
+  size_t cap;
+  uint64_t line;
+
+  // Batch of parsed records
+  char *arena;
+  size_t arena_len;
+  size_t arena_cap;
+  bulkRecord *records;
+  size_t nrecords;
+  size_t records_cap;
+
+  // Backup framing
+  int header_seen;
+  int finished;
+  uint32_t crc;
+
+  uint64_t count;
+  uint64_t bytes;
+  int rc;
+} bulkLoader;
+
+static void bulk_corrupt(const char *what)
+{
+  rb_raise(rb_path2class("UnQLite::CorruptException"), "corrupt backup: %s", what);
+}
+
+static void bulk_malformed(bulkLoader *l, const char *what)
+{
+  if (l->format == UNQLITE_RUBY_BULK_BACKUP)
+    bulk_corrupt(what);
+  if (l->format == UNQLITE_RUBY_BULK_BINARY_LENPREFIXED)
+    rb_raise(rb_eArgError, "malformed record #%llu: %s", (unsigned long long)l->count + l->nrecords + 1, what);
+  rb_raise(rb_eArgError, "malformed record at line %llu: %s", (unsigned long long)l->line, what);
+}
+
+/* Make room for _n_ more bytes in the arena */
+static char* bulk_arena_reserve(bulkLoader *l, size_t n)
+{
+  if (l->arena_len + n > l->arena_cap)
+  {
+    size_t cap = l->arena_cap ? l->arena_cap : 64 * 1024;
+    while (cap < l->arena_len + n)
+      cap *= 2;
+    REALLOC_N(l->arena, char, cap);
+    l->arena_cap = cap;
+  }
+  return l->arena + l->arena_len;
+}
+
+/* Record the key and value just written at the end of the arena */
+static void bulk_push(bulkLoader *l, size_t klen, size_t vlen)
+{
+  bulkRecord *record;
+
+  if (klen == 0)
+    bulk_malformed(l, "empty key");
+  if (klen > 0xffffffffUL || vlen > 0xffffffffUL)
+    bulk_malformed(l, "record too large");
+
+  if (l->nrecords == l->records_cap)
+  {
+    l->records_cap = l->records_cap ? l->records_cap * 2 : 1024;
+    REALLOC_N(l->records, bulkRecord, l->records_cap);
+  }
+
+  record = &l->records[l->nrecords++];
+  record->offset = l->arena_len;
+  record->klen = (uint32_t)klen;
+  record->vlen = (uint32_t)vlen;
+  l->arena_len += klen + vlen;
+}
+
+static int bulk_record_cmp(const void *a, const void *b, void *arena)
+{
+  const bulkRecord *ra = (const bulkRecord *)a, *rb = (const bulkRecord *)b;
+  uint32_t n = ra->klen < rb->klen ? ra->klen : rb->klen;
+  int c = memcmp((char *)arena + ra->offset, (char *)arena + rb->offset, n);
+
+  if (c != 0)
+    return c;
+  return ra->klen < rb->klen ? -1 : ra->klen > rb->klen;
+}
+
+/* Store and commit the current batch. Runs without the GVL when possible. */
+static void* bulk_store_batch(void *arg)
+{
+  bulkLoader *l = (bulkLoader *)arg;
+  size_t i;
+  uint64_t gen;
+  int rc;
+
+  // Indexes are not maintained: make add_index rebuild them
+  rc = unqliteRuby_index_bump(l->db, &gen);
+  if (rc == UNQLITE_NOTFOUND)
+    rc = UNQLITE_OK;
+
+  if (l->presort)
+    ruby_qsort(l->records, l->nrecords, sizeof(bulkRecord), bulk_record_cmp, l->arena);
+
+  for (i = 0; i < l->nrecords && rc == UNQLITE_OK; i++)
+  {
+    bulkRecord *record = &l->records[i];
+    char *key = l->arena + record->offset;
+
+    rc = unqlite_kv_store(l->db, key, record->klen, key + record->klen, record->vlen);
+    if (rc == UNQLITE_OK)
+    {
+      l->count++;
+      l->bytes += record->klen + record->vlen;
+    }
+  }
+
+  if (rc == UNQLITE_OK)
+    rc = unqlite_commit(l->db);
+
+  l->rc = rc;
+  return NULL;
+}
+
+static void bulk_flush(bulkLoader *l)
+{
+  if (l->nrecords == 0)
+    return;
+
+  if (l->unlocked)
+    rb_thread_call_without_gvl(bulk_store_batch, l, RUBY_UBF_IO, NULL);
+  else
+    bulk_store_batch(l);
+
+  l->nrecords = 0;
+  l->arena_len = 0;
+  CHECK(l->db, l->rc);
+
+  if (rb_block_given_p())
+    rb_yield_values(2, ULL2NUM(l->count), ULL2NUM(l->bytes));
+}
+
+/* TSV: copy [p, end) to _out_, undoing \t \n \r \0 and \\ escapes */
+static size_t bulk_tsv_unescape(bulkLoader *l, const char *p, const char *end, char *out)
+{
+  char *o = out;
+
+  for (; p < end; p++)
+  {
+    if (*p != '\\')
+    {
+      *o++ = *p;
+      continue;
+    }
+    if (++p == end)
+      bulk_malformed(l, "dangling backslash");
+    switch (*p)
+    {
+      case 't': *o++ = '\t'; break;
+      case 'n': *o++ = '\n'; break;
+      case 'r': *o++ = '\r'; break;
+      case '0': *o++ = '\0'; break;
+      case '\\': *o++ = '\\'; break;
+      default:
+        bulk_malformed(l, "unknown escape");
+    }
+  }
+  return o - out;
+}
+
+/* TSV: "key<TAB>value" */
+static void bulk_parse_tsv(bulkLoader *l, const char *p, const char *end)
+{
+  const char *tab = memchr(p, '\t', end - p);
+  char *out;
+  size_t klen, vlen;
+
+  if (!tab)
+    bulk_malformed(l, "missing tab");
+
+  out = bulk_arena_reserve(l, end - p);
+  klen = bulk_tsv_unescape(l, p, tab, out);
+  vlen = bulk_tsv_unescape(l, tab + 1, end, out + klen);
+  bulk_push(l, klen, vlen);
+}
+
+static const char* bulk_json_ws(const char *p, const char *end)
+{
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+    p++;
+  return p;
+}
+
+static int bulk_json_hex(bulkLoader *l, const char *p, const char *end)
+{
+  int i, c = 0;
+
+  if (end - p < 4)
+    bulk_malformed(l, "truncated \\u escape");
+  for (i = 0; i < 4; i++)
+  {
+    c <<= 4;
+    if (p[i] >= '0' && p[i] <= '9') c |= p[i] - '0';
+    else if (p[i] >= 'a' && p[i] <= 'f') c |= p[i] - 'a' + 10;
+    else if (p[i] >= 'A' && p[i] <= 'F') c |= p[i] - 'A' + 10;
+    else bulk_malformed(l, "bad \\u escape");
+  }
+  return c;
+}
+
+/* Write code point _c_ as UTF-8 to _out_ (if not NULL). Returns its length. */
+static size_t bulk_utf8_encode(unsigned int c, char *out)
+{
+  if (c < 0x80)
+  {
+    if (out) out[0] = (char)c;
+    return 1;
+  }
+  if (c < 0x800)
+  {
+    if (out)
+    {
+      out[0] = (char)(0xc0 | (c >> 6));
+      out[1] = (char)(0x80 | (c & 0x3f));
+    }
+    return 2;
+  }
+  if (c < 0x10000)
+  {
+    if (out)
+    {
+      out[0] = (char)(0xe0 | (c >> 12));
+      out[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+      out[2] = (char)(0x80 | (c & 0x3f));
+    }
+    return 3;
+  }
+  if (out)
+  {
+    out[0] = (char)(0xf0 | (c >> 18));
+    out[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (c & 0x3f));
+  }
+  return 4;
+}
+
+/* JSON: decode the string starting at the quote _p_ into _out_ (if not NULL) */
+static const char* bulk_json_string(bulkLoader *l, const char *p, const char *end, char *out, size_t *len)
+{
+  size_t n = 0;
+
+  if (p == end || *p != '"')
+    bulk_malformed(l, "expected a string");
+
+  for (p++; p < end && *p != '"'; p++)
+  {
+    unsigned int c;
+
+    if (*p != '\\')
+    {
+      if (out) out[n] = *p;
+      n++;
+      continue;
+    }
+    if (++p == end)
+      break;
+    switch (*p)
+    {
+      case '"': c = '"'; break;
+      case '\\': c = '\\'; break;
+      case '/': c = '/'; break;
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'u':
+        c = bulk_json_hex(l, p + 1, end);
+        p += 4;
+        // Surrogate pair
+        if (c >= 0xd800 && c < 0xdc00 && end - p > 6 && p[1] == '\\' && p[2] == 'u')
+        {
+          unsigned int lo = bulk_json_hex(l, p + 3, end);
+          if (lo >= 0xdc00 && lo < 0xe000)
+          {
+            c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+            p += 6;
+          }
+        }
+        n += bulk_utf8_encode(c, out ? out + n : NULL);
+        continue;
+      default:
+        bulk_malformed(l, "unknown escape");
+    }
+    if (out) out[n] = (char)c;
+    n++;
+  }
+
+  if (p == end)
+    bulk_malformed(l, "unterminated string");
+
+  *len = n;
+  return p + 1;
+}
+
+/* NDJSON: {"key": "...", "value": "..."}, other string members are ignored */
+static void bulk_parse_ndjson(bulkLoader *l, const char *p, const char *end)
+{
+  char *out = bulk_arena_reserve(l, 2 * (end - p));
+  char *value = out + (end - p);
+  size_t klen = 0, vlen = 0, nlen;
+  int has_key = 0, has_value = 0;
+
+  p = bulk_json_ws(p, end);
+  if (p == end || *p++ != '{')
+    bulk_malformed(l, "expected an object");
+
+  p = bulk_json_ws(p, end);
+  while (p < end && *p != '}')
+  {
+    const char *name = p + 1;
+
+    p = bulk_json_string(l, p, end, NULL, &nlen);
+    p = bulk_json_ws(p, end);
+    if (p == end || *p++ != ':')
+      bulk_malformed(l, "expected ':'");
+    p = bulk_json_ws(p, end);
+
+    // Member names are matched undecoded
+    if (nlen == 3 && memcmp(name, "key", 3) == 0)
+    {
+      p = bulk_json_string(l, p, end, out, &klen);
+      has_key = 1;
+    }
+    else if (nlen == 5 && memcmp(name, "value", 5) == 0)
+    {
+      p = bulk_json_string(l, p, end, value, &vlen);
+      has_value = 1;
+    }
+    else
+      p = bulk_json_string(l, p, end, NULL, &nlen);
+
+    p = bulk_json_ws(p, end);
+    if (p < end && *p == ',')
+      p = bulk_json_ws(p + 1, end);
+    else if (p == end || *p != '}')
+      bulk_malformed(l, "expected ',' or '}'");
+  }
+
+  if (p == end || !has_key || !has_value)
+    bulk_malformed(l, "expected \"key\" and \"value\" strings");
+
+  // The value must follow the key in the arena
+  memmove(out + klen, value, vlen);
+  bulk_push(l, klen, vlen);
+}
+
+static uint32_t bulk_get_u32(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+/* Parse every complete record in the buffer. Returns the bytes consumed. */
+static size_t bulk_parse(bulkLoader *l, int eof)
+{
+  const char *p = l->buf, *end = l->buf + l->len;
+
+  while (p < end)
+  {
+    if (l->format >= UNQLITE_RUBY_BULK_BINARY_LENPREFIXED)
+    {
+      uint32_t klen, vlen;
+
+      if (l->format == UNQLITE_RUBY_BULK_BACKUP)
+      {
+        if (l->finished)
+          bulk_corrupt("data after the trailer");
+        if (!l->header_seen)
+        {
+          if (end - p < UNQLITE_RUBY_BACKUP_MAGIC_LEN)
+            break;
+          if (memcmp(p, UNQLITE_RUBY_BACKUP_MAGIC, UNQLITE_RUBY_BACKUP_MAGIC_LEN) != 0)
+            bulk_corrupt("bad magic");
+          l->header_seen = 1;
+          p += UNQLITE_RUBY_BACKUP_MAGIC_LEN;
+          continue;
+        }
+      }
+
+      if (end - p < 8)
+        break;
+      klen = bulk_get_u32(p);
+      vlen = bulk_get_u32(p + 4);
+
+      // Backup trailer: end marker, record count and checksum
+      if (l->format == UNQLITE_RUBY_BULK_BACKUP && klen == UNQLITE_RUBY_BACKUP_END)
+      {
+        uint64_t count;
+
+        if (end - p < UNQLITE_RUBY_BACKUP_TRAILER_LEN)
+          break;
+        count = ((uint64_t)vlen << 32) | bulk_get_u32(p + 8);
+        if (count != l->count + l->nrecords)
+          bulk_corrupt("record count mismatch");
+        if (bulk_get_u32(p + 12) != l->crc)
+          bulk_corrupt("checksum mismatch");
+        l->finished = 1;
+        p += UNQLITE_RUBY_BACKUP_TRAILER_LEN;
+        continue;
+      }
+
+      if ((size_t)(end - p - 8) < (size_t)klen + vlen)
+        break;
+
+      memcpy(bulk_arena_reserve(l, (size_t)klen + vlen), p + 8, (size_t)klen + vlen);
+      bulk_push(l, klen, vlen);
+      if (l->format == UNQLITE_RUBY_BULK_BACKUP)
+        l->crc = unqliteRuby_crc32(l->crc, p, 8 + (size_t)klen + vlen);
+      p += 8 + (size_t)klen + vlen;
+    }
+    else
+    {
+      const char *eol = memchr(p, '\n', end - p), *line_end;
+
+      if (!eol)
+      {
+        if (!eof)
+          break;
+        eol = end;
+      }
+
+      line_end = eol;
+      if (line_end > p && line_end[-1] == '\r')
+        line_end--;
+
+      l->line++;
+      if (line_end > p)
+      {
+        if (l->format == UNQLITE_RUBY_BULK_TSV)
+          bulk_parse_tsv(l, p, line_end);
+        else
+          bulk_parse_ndjson(l, p, line_end);
+      }
+      p = eol < end ? eol + 1 : end;
+    }
+
+    if (l->arena_len >= l->commit_every)
+      bulk_flush(l);
+  }
+
+  if (eof && p < end)
+    bulk_malformed(l, "truncated record");
+  if (eof && l->format == UNQLITE_RUBY_BULK_BACKUP && !l->finished)
+    bulk_corrupt("missing trailer");
+
+  return p - l->buf;
+}
+
+static VALUE bulk_load_body(VALUE arg)
+{
+  bulkLoader *l = (bulkLoader *)arg;
+  ID id_read = rb_intern("read");
+
+  for (;;)
+  {
+    VALUE chunk = rb_funcall(l->io, id_read, 2, SIZET2NUM(BULK_READ_SIZE), l->chunk);
+    size_t consumed;
+    int eof = NIL_P(chunk);
+
+    if (!eof)
+    {
+      StringValue(chunk);
+      if (l->len + RSTRING_LEN(chunk) > l->cap)
+      {
+        l->cap = (l->len + RSTRING_LEN(chunk)) * 2;
+        REALLOC_N(l->buf, char, l->cap);
+      }
+      memcpy(l->buf + l->len, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+      l->len += RSTRING_LEN(chunk);
+    }
+
+    consumed = bulk_parse(l, eof);
+    memmove(l->buf, l->buf + consumed, l->len - consumed);
+    l->len -= consumed;
+
+    if (eof)
+      break;
+  }
+
+  bulk_flush(l);
+  return ULL2NUM(l->count);
+}
+
+static VALUE bulk_load_ensure(VALUE arg)
+{
+  bulkLoader *l = (bulkLoader *)arg;
+
+  if (l->db)
+    unqlite_close(l->db);
+  if (l->close_io)
+    rb_funcall(l->io, rb_intern("close"), 0);
+  xfree(l->buf);
+  xfree(l->arena);
+  xfree(l->records);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *     UnQLite.bulk_load(path, source, format: :tsv, commit_every: 16 * 1024 * 1024, presort: false) -> count
+ *     UnQLite.bulk_load(path, source, ...) { |records, bytes| ... } -> count
+ *
+ * Loads the records read from _source_ (an IO, or the name of a file)
+ * into the database at _path_, creating it if needed. _format_ may be:
+ *
+ * * +:tsv+ - one <tt>key\tvalue</tt> per line; <tt>\t \n \r \0</tt>
+ *   and <tt>\\</tt> may be escaped with a backslash
+ * * +:ndjson+ - one <tt>{"key": "...", "value": "..."}</tt> object
+ *   per line
+ * * +:binary_lenprefixed+ - big-endian 32-bit key and value lengths
+ *   followed by the key and the value
+ *
+ * The database is opened with <tt>UnQLite::OMIT_JOURNALING</tt> and a
+ * commit happens every _commit_every_ bytes of records, after which the
+ * block, if given, receives the number of records and bytes loaded so
+ * far. With _presort_ every batch is stored in key order. Records are
+ * written directly: indexes and filters of open Database objects are
+ * not updated, so nothing else should use the database meanwhile.
+ */
+static VALUE unqlite_bulk_load(int argc, VALUE* argv, VALUE self)
+{
+  VALUE path, source, opts;
+  VALUE kwargs[3];
+  ID kwnames[3];
+  int format = UNQLITE_RUBY_BULK_TSV, presort = 0;
+  size_t commit_every = BULK_COMMIT_EVERY;
+
+  rb_scan_args(argc, argv, "2:", &path, &source, &opts);
+
+  kwnames[0] = rb_intern("format");
+  kwnames[1] = rb_intern("commit_every");
+  kwnames[2] = rb_intern("presort");
+  kwargs[0] = kwargs[1] = kwargs[2] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 3, kwargs);
+
+  if (kwargs[0] != Qundef)
+  {
+    ID id = rb_to_id(kwargs[0]);
+    if (id == rb_intern("tsv"))
+      format = UNQLITE_RUBY_BULK_TSV;
+    else if (id == rb_intern("ndjson"))
+      format = UNQLITE_RUBY_BULK_NDJSON;
+    else if (id == rb_intern("binary_lenprefixed"))
+      format = UNQLITE_RUBY_BULK_BINARY_LENPREFIXED;
+    else
+      rb_raise(rb_eArgError, "unknown format: %"PRIsVALUE, kwargs[0]);
+  }
+  if (kwargs[1] != Qundef)
+    commit_every = NUM2SIZET(kwargs[1]);
+  if (kwargs[2] != Qundef)
+    presort = RTEST(kwargs[2]);
+
+  return unqliteRuby_bulk_load(path, source, format, commit_every, presort);
+}
+
+/* Load _source_ into the database at _path_; the caller's block gets the progress */
+VALUE unqliteRuby_bulk_load(VALUE path, VALUE source, int format, size_t commit_every, int presort)
+{
+  bulkLoader loader;
+  int rc;
+
+  if (commit_every == 0)
+    rb_raise(rb_eArgError, "commit_every must be positive");
+
+  memset(&loader, 0, sizeof(loader));
+  loader.format = format;
+  loader.commit_every = commit_every;
+  loader.presort = presort;
+
+  FilePathValue(path);
+
+  // Accept a file name as source
+  if (RB_TYPE_P(source, T_STRING))
+  {
+    source = rb_funcall(rb_cFile, rb_intern("open"), 2, source, rb_str_new_cstr("rb"));
+    loader.close_io = 1;
+  }
+  loader.io = source;
+  loader.chunk = rb_str_buf_new(BULK_READ_SIZE);
+
+  // The handle is private to this call: batches may be stored without the GVL
+  loader.unlocked = unqlite_lib_is_threadsafe();
+
+  rc = unqlite_open(&loader.db, StringValueCStr(path), UNQLITE_OPEN_CREATE | UNQLITE_OPEN_OMIT_JOURNALING);
+  if (rc != UNQLITE_OK)
+  {
+    if (loader.close_io)
+      rb_funcall(source, rb_intern("close"), 0);
+    CHECK(loader.db, rc);
+  }
+
+  return rb_ensure(bulk_load_body, (VALUE)&loader, bulk_load_ensure, (VALUE)&loader);
+}
+
+void Init_unqlite_bulk()
+{
+  rb_define_singleton_method(mUnQLite, "bulk_load", unqlite_bulk_load, -1);
+}
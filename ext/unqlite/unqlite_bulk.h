@@ -0,0 +1,15 @@
+#ifndef UNQLITE_RUBY_BULK
+#define UNQLITE_RUBY_BULK
+
+#include <unqlite_ruby.h>
+
+/* Source formats understood by UnQLite.bulk_load */
+#define UNQLITE_RUBY_BULK_TSV                0
+#define UNQLITE_RUBY_BULK_NDJSON             1
+#define UNQLITE_RUBY_BULK_BINARY_LENPREFIXED 2
+#define UNQLITE_RUBY_BULK_BACKUP             3 /* Database#backup_to output */
+
+void Init_unqlite_bulk();
+VALUE unqliteRuby_bulk_load(VALUE path, VALUE source, int format, size_t commit_every, int presort);
+
+#endif
@@ -0,0 +1,328 @@
+#include <unqlite_cache.h>
+#include <unqlite_hash.h>
+
+/*
+ * Optional read-through object cache in front of #fetch and #[]. It
+ * keeps frozen value Strings in a hash table ordered by an LRU list and
+ * bounded by a byte budget. Every write going through the handle
+ * invalidates the affected key; #clear and #rollback flush it. Writes
+ * made by other handles or processes are not seen by the cache.
+ *
+ * Access is serialized by the GVL, so a single LRU is enough.
+ */
+
+#define CACHE_MIN_BUCKETS 64
+
+static unqliteRubyCacheEntry* cache_lookup(unqliteRubyCache *cache, const char *key, long len, uint64_t hash)
+{
+  unqliteRubyCacheEntry *entry = cache->buckets[hash & (cache->nbuckets - 1)];
+
+  for (; entry; entry = entry->hnext)
+  {
+    if (entry->hash == hash && entry->key_len == len && memcmp(entry->key, key, len) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+static void cache_lru_unlink(unqliteRubyCacheEntry *entry)
+{
+  entry->prev->next = entry->next;
+  entry->next->prev = entry->prev;
+}
+
+static void cache_lru_push(unqliteRubyCache *cache, unqliteRubyCacheEntry *entry)
+{
+  entry->prev = &cache->lru;
+  entry->next = cache->lru.next;
+  cache->lru.next->prev = entry;
+  cache->lru.next = entry;
+}
+
+static void cache_remove(unqliteRubyCache *cache, unqliteRubyCacheEntry *entry)
+{
+  unqliteRubyCacheEntry **slot = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+
+  while (*slot != entry)
+    slot = &(*slot)->hnext;
+  *slot = entry->hnext;
+
+  cache_lru_unlink(entry);
+  cache->count--;
+  cache->bytes -= entry->size;
+  xfree(entry);
+}
+
+static void cache_grow(unqliteRubyCache *cache)
+{
+  size_t i, nbuckets = cache->nbuckets * 2;
+  unqliteRubyCacheEntry **buckets = ZALLOC_N(unqliteRubyCacheEntry*, nbuckets);
+
+  for (i = 0; i < cache->nbuckets; i++)
+  {
+    unqliteRubyCacheEntry *entry = cache->buckets[i], *next;
+    for (; entry; entry = next)
+    {
+      next = entry->hnext;
+      entry->hnext = buckets[entry->hash & (nbuckets - 1)];
+      buckets[entry->hash & (nbuckets - 1)] = entry;
+    }
+  }
+
+  xfree(cache->buckets);
+  cache->buckets = buckets;
+  cache->nbuckets = nbuckets;
+}
+
+static void cache_flush(unqliteRubyCache *cache)
+{
+  while (cache->lru.next != &cache->lru)
+    cache_remove(cache, cache->lru.next);
+}
+
+/* Returns the cached value of _key_, or Qundef */
+VALUE unqliteRuby_cache_get(unqliteRubyPtr ctx, VALUE key)
+{
+  unqliteRubyCache *cache = ctx->cache;
+  unqliteRubyCacheEntry *entry;
+
+  if (!cache)
+    return Qundef;
+
+  entry = cache_lookup(cache, RSTRING_PTR(key), RSTRING_LEN(key),
+                       unqliteRuby_hash(RSTRING_PTR(key), RSTRING_LEN(key), 0));
+  if (!entry)
+  {
+    cache->misses++;
+    return Qundef;
+  }
+
+  cache->hits++;
+  cache_lru_unlink(entry);
+  cache_lru_push(cache, entry);
+  return entry->value;
+}
+
+/* Caches _value_ (frozen) under _key_. Returns the value to hand out. */
+VALUE unqliteRuby_cache_put(unqliteRubyPtr ctx, VALUE key, VALUE value)
+{
+  unqliteRubyCache *cache = ctx->cache;
+  unqliteRubyCacheEntry *entry;
+  long len = RSTRING_LEN(key);
+  uint64_t hash;
+  size_t size;
+
+  if (!cache)
+    return value;
+
+  rb_obj_freeze(value);
+
+  size = sizeof(unqliteRubyCacheEntry) + len + RSTRING_LEN(value);
+  if (size > cache->max_bytes)
+    return value;
+
+  hash = unqliteRuby_hash(RSTRING_PTR(key), len, 0);
+  entry = cache_lookup(cache, RSTRING_PTR(key), len, hash);
+  if (entry)
+    cache_remove(cache, entry);
+
+  // Make room, least recently used first
+  while (cache->bytes + size > cache->max_bytes && cache->lru.prev != &cache->lru)
+  {
+    cache_remove(cache, cache->lru.prev);
+    cache->evictions++;
+  }
+
+  entry = (unqliteRubyCacheEntry *)xmalloc(sizeof(unqliteRubyCacheEntry) + len);
+  entry->hash = hash;
+  entry->value = Qnil;
+  RB_OBJ_WRITE(ctx->self, &entry->value, value);
+  entry->size = size;
+  entry->key_len = len;
+  memcpy(entry->key, RSTRING_PTR(key), len);
+
+  entry->hnext = cache->buckets[hash & (cache->nbuckets - 1)];
+  cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+  cache_lru_push(cache, entry);
+  cache->count++;
+  cache->bytes += size;
+
+  if (cache->count > cache->nbuckets)
+    cache_grow(cache);
+
+  return value;
+}
+
+void unqliteRuby_cache_invalidate(unqliteRubyPtr ctx, const char *key, long len)
+{
+  unqliteRubyCache *cache = ctx->cache;
+  unqliteRubyCacheEntry *entry;
+
+  if (!cache)
+    return;
+
+  entry = cache_lookup(cache, key, len, unqliteRuby_hash(key, len, 0));
+  if (entry)
+  {
+    cache_remove(cache, entry);
+    cache->invalidations++;
+  }
+}
+
+void unqliteRuby_cache_clear(unqliteRubyPtr ctx)
+{
+  if (ctx->cache)
+  {
+    ctx->cache->invalidations += ctx->cache->count;
+    cache_flush(ctx->cache);
+  }
+}
+
+/* Wrapped object: mark cached values */
+void unqliteRuby_cache_mark(unqliteRubyPtr ctx)
+{
+  unqliteRubyCacheEntry *entry;
+
+  if (!ctx->cache)
+    return;
+
+  for (entry = ctx->cache->lru.next; entry != &ctx->cache->lru; entry = entry->next)
+    UNQLITE_RUBY_MARK(entry->value);
+}
+
+void unqliteRuby_cache_compact(unqliteRubyPtr ctx)
+{
+  unqliteRubyCacheEntry *entry;
+
+  if (!ctx->cache)
+    return;
+
+  for (entry = ctx->cache->lru.next; entry != &ctx->cache->lru; entry = entry->next)
+    UNQLITE_RUBY_MOVE(entry->value);
+}
+
+/* The cached Strings are reported by themselves */
+size_t unqliteRuby_cache_memsize(const struct _unqliteRuby *ctx)
+{
+  unqliteRubyCacheEntry *entry;
+  size_t size;
+
+  if (!ctx->cache)
+    return 0;
+
+  size = sizeof(unqliteRubyCache) + ctx->cache->nbuckets * sizeof(unqliteRubyCacheEntry *);
+  for (entry = ctx->cache->lru.next; entry != &ctx->cache->lru; entry = entry->next)
+    size += sizeof(unqliteRubyCacheEntry) + entry->key_len;
+  return size;
+}
+
+void unqliteRuby_cache_free(unqliteRubyPtr ctx)
+{
+  if (ctx->cache)
+  {
+    cache_flush(ctx->cache);
+    xfree(ctx->cache->buckets);
+    xfree(ctx->cache);
+    ctx->cache = NULL;
+  }
+}
+
+/*
+ * call-seq:
+ *     database.enable_cache(max_bytes: 64 * 1024 * 1024)
+ *
+ * Keeps recently fetched values in memory, up to _max_bytes_. While
+ * enabled, #fetch and #[] return frozen strings. Writes through this
+ * handle invalidate the cached keys, but writes made by other handles
+ * or processes are not noticed.
+ */
+static VALUE unqlite_database_enable_cache(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyCache *cache;
+  VALUE opts;
+  VALUE kwargs[1];
+  ID kwnames[1];
+  size_t max_bytes = 64 * 1024 * 1024;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  kwnames[0] = rb_intern("max_bytes");
+  kwargs[0] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 1, kwargs);
+  if (kwargs[0] != Qundef)
+    max_bytes = NUM2SIZET(kwargs[0]);
+
+  GetDatabase(self, ctx);
+
+  unqliteRuby_cache_free(ctx);
+
+  cache = ZALLOC(unqliteRubyCache);
+  cache->nbuckets = CACHE_MIN_BUCKETS;
+  cache->buckets = ZALLOC_N(unqliteRubyCacheEntry*, cache->nbuckets);
+  cache->max_bytes = max_bytes;
+  cache->lru.next = cache->lru.prev = &cache->lru;
+  ctx->cache = cache;
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.disable_cache
+ *
+ * Drops the object cache and all the values it holds.
+ */
+static VALUE unqlite_database_disable_cache(VALUE self)
+{
+  unqliteRubyPtr ctx;
+
+  GetDatabase(self, ctx);
+  unqliteRuby_cache_free(ctx);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.cache_stats -> hash or nil
+ *
+ * Returns the size of the object cache and its hit, miss, eviction and
+ * invalidation counters, along with the hit ratio. Returns nil if the
+ * cache is not enabled.
+ */
+static VALUE unqlite_database_cache_stats(VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyCache *cache;
+  volatile VALUE stats;
+  uint64_t lookups;
+
+  GetDatabase(self, ctx);
+
+  cache = ctx->cache;
+  if (!cache)
+    return Qnil;
+
+  lookups = cache->hits + cache->misses;
+
+  stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(cache->count));
+  rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(cache->bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(cache->max_bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULL2NUM(cache->hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULL2NUM(cache->misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), ULL2NUM(cache->evictions));
+  rb_hash_aset(stats, ID2SYM(rb_intern("invalidations")), ULL2NUM(cache->invalidations));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hit_ratio")), DBL2NUM(lookups ? (double)cache->hits / lookups : 0.0));
+
+  return stats;
+}
+
+void Init_unqlite_cache()
+{
+  rb_define_method(cUnQLiteDatabase, "enable_cache", unqlite_database_enable_cache, -1);
+  rb_define_method(cUnQLiteDatabase, "disable_cache", unqlite_database_disable_cache, 0);
+  rb_define_method(cUnQLiteDatabase, "cache_stats", unqlite_database_cache_stats, 0);
+}
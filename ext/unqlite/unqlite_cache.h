@@ -0,0 +1,45 @@
+#ifndef UNQLITE_RUBY_CACHE
+#define UNQLITE_RUBY_CACHE
+
+#include <unqlite_ruby.h>
+#include <stdint.h>
+
+struct _unqliteRuby;
+
+typedef struct _unqliteRubyCacheEntry
+{
+  struct _unqliteRubyCacheEntry *hnext; /* bucket chain */
+  struct _unqliteRubyCacheEntry *prev;  /* LRU list, most recent first */
+  struct _unqliteRubyCacheEntry *next;
+  uint64_t hash;
+  VALUE value;                          /* frozen String */
+  size_t size;                          /* bytes accounted for this entry */
+  long key_len;
+  char key[1];
+} unqliteRubyCacheEntry;
+
+typedef struct _unqliteRubyCache
+{
+  unqliteRubyCacheEntry **buckets;
+  size_t nbuckets;
+  size_t count;
+  size_t bytes;
+  size_t max_bytes;
+  unqliteRubyCacheEntry lru;            /* list sentinel */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+} unqliteRubyCache;
+
+void Init_unqlite_cache();
+VALUE unqliteRuby_cache_get(struct _unqliteRuby *ctx, VALUE key);
+VALUE unqliteRuby_cache_put(struct _unqliteRuby *ctx, VALUE key, VALUE value);
+void unqliteRuby_cache_invalidate(struct _unqliteRuby *ctx, const char *key, long len);
+void unqliteRuby_cache_clear(struct _unqliteRuby *ctx);
+void unqliteRuby_cache_mark(struct _unqliteRuby *ctx);
+void unqliteRuby_cache_compact(struct _unqliteRuby *ctx);
+size_t unqliteRuby_cache_memsize(const struct _unqliteRuby *ctx);
+void unqliteRuby_cache_free(struct _unqliteRuby *ctx);
+
+#endif
@@ -0,0 +1,1020 @@
+#include <unqlite_collection.h>
+#include <ruby/util.h>
+
+/*
+ * Document-class: UnQLite::Collection
+ *
+ * JSON document collections, driven through unqlite's built-in Jx9
+ * collection functions. Each operation is a small script compiled once
+ * per database handle and reused (reset) across calls; the collection
+ * name and the documents are bound as foreign variables, so a whole
+ * batch of documents is stored by a single script execution.
+ *
+ * Every script compiled by the binding can call the native helpers
+ * +prefix_match+, +in_range+ and +project+, and any function registered
+ * with Database#create_function.
+ */
+
+VALUE cUnQLiteCollection;
+
+/* Documents nested deeper than this are rejected (and cycles with them) */
+#define JX9_MAX_DEPTH 64
+
+/* Applies fetch_all's fields: projection to $result */
+#define JX9_PROJECT \
+  "if ($fields != null) {" \
+  "  $projected = [];" \
+  "  foreach ($result as $rec) { array_push($projected, project($rec, $fields)); }" \
+  "  $result = $projected;" \
+  "}"
+
+static const char *jx9_scripts[UNQLITE_RUBY_JX9_SCRIPTS] = {
+  /* UNQLITE_RUBY_JX9_INSERT */
+  "if (!db_exists($name)) { db_create($name); }"
+  "if (db_store($name, $docs)) { $result = db_last_record_id($name); } else { $result = null; }",
+  /* UNQLITE_RUBY_JX9_FETCH_ALL */
+  "$result = db_exists($name) ? db_fetch_all($name) : [];"
+  JX9_PROJECT,
+  /* UNQLITE_RUBY_JX9_FETCH_ID */
+  "$result = db_exists($name) ? db_fetch_by_id($name, $id) : null;",
+  /* UNQLITE_RUBY_JX9_COUNT */
+  "$result = db_exists($name) ? db_total_records($name) : 0;",
+  /* UNQLITE_RUBY_JX9_DROP */
+  "$result = db_exists($name) ? db_drop_collection($name) : false;"
+};
+
+/* The handle's script state, created on first use */
+static unqliteRubyJx9* jx9_get(unqliteRubyPtr ctx)
+{
+  int i;
+
+  if (!ctx->jx9)
+  {
+    ctx->jx9 = ALLOC(unqliteRubyJx9);
+    memset(ctx->jx9, 0, sizeof(unqliteRubyJx9));
+    for (i = 0; i < UNQLITE_RUBY_JX9_WHERE_CACHE; i++)
+      ctx->jx9->where[i] = Qnil;
+  }
+  return ctx->jx9;
+}
+
+/* Forget the compiled scripts, releasing them unless they are inherited */
+static void jx9_drop(unqliteRubyPtr ctx, int release)
+{
+  int i;
+
+  if (!ctx->jx9)
+    return;
+
+  for (i = 0; i < UNQLITE_RUBY_JX9_SLOTS; i++)
+  {
+    if (ctx->jx9->vms[i] && release)
+      unqlite_vm_release(ctx->jx9->vms[i]);
+    ctx->jx9->vms[i] = NULL;
+    ctx->jx9->busy[i] = 0;
+  }
+  for (i = 0; i < UNQLITE_RUBY_JX9_WHERE_CACHE; i++)
+    ctx->jx9->where[i] = Qnil;
+}
+
+/* Release the compiled scripts before their handle is closed */
+void unqliteRuby_jx9_close(unqliteRubyPtr ctx)
+{
+  jx9_drop(ctx, 1);
+}
+
+/* Forget the scripts compiled on a handle inherited across fork */
+void unqliteRuby_jx9_abandon(unqliteRubyPtr ctx)
+{
+  jx9_drop(ctx, 0);
+}
+
+void unqliteRuby_jx9_mark(unqliteRubyPtr ctx)
+{
+  int i;
+
+  if (!ctx->jx9)
+    return;
+
+  for (i = 0; i < UNQLITE_RUBY_JX9_WHERE_CACHE; i++)
+    UNQLITE_RUBY_MARK(ctx->jx9->where[i]);
+  for (i = 0; i < ctx->jx9->nfunctions; i++)
+    UNQLITE_RUBY_MARK(ctx->jx9->functions[i]->proc);
+}
+
+void unqliteRuby_jx9_compact(unqliteRubyPtr ctx)
+{
+  int i;
+
+  if (!ctx->jx9)
+    return;
+
+  for (i = 0; i < UNQLITE_RUBY_JX9_WHERE_CACHE; i++)
+    UNQLITE_RUBY_MOVE(ctx->jx9->where[i]);
+  for (i = 0; i < ctx->jx9->nfunctions; i++)
+    UNQLITE_RUBY_MOVE(ctx->jx9->functions[i]->proc);
+}
+
+/* Compiled VMs live in unqlite's allocator and are not counted */
+size_t unqliteRuby_jx9_memsize(const struct _unqliteRuby *ctx)
+{
+  size_t size;
+  int i;
+
+  if (!ctx->jx9)
+    return 0;
+
+  size = sizeof(unqliteRubyJx9) + ctx->jx9->nfunctions * sizeof(unqliteRubyJx9Function *);
+  for (i = 0; i < ctx->jx9->nfunctions; i++)
+    size += sizeof(unqliteRubyJx9Function) + strlen(ctx->jx9->functions[i]->name) + 1;
+  return size;
+}
+
+/* Registered functions outlive close (they are reinstalled on reopen) */
+void unqliteRuby_jx9_free(unqliteRubyPtr ctx)
+{
+  int i;
+
+  if (!ctx->jx9)
+    return;
+
+  unqliteRuby_jx9_close(ctx);
+  for (i = 0; i < ctx->jx9->nfunctions; i++)
+  {
+    xfree(ctx->jx9->functions[i]->name);
+    xfree(ctx->jx9->functions[i]);
+  }
+  xfree(ctx->jx9->functions);
+  xfree(ctx->jx9);
+  ctx->jx9 = NULL;
+}
+
+/* Raise for values a document cannot hold, before any is converted */
+static void jx9_check(VALUE obj, int depth);
+
+static int jx9_check_pair(VALUE key, VALUE value, VALUE depth)
+{
+  if (!RB_TYPE_P(key, T_STRING) && !SYMBOL_P(key) && !RB_INTEGER_TYPE_P(key))
+    rb_raise(rb_eTypeError, "document keys must be strings, symbols or integers, not %s", rb_obj_classname(key));
+  jx9_check(value, NUM2INT(depth));
+  return ST_CONTINUE;
+}
+
+static void jx9_check(VALUE obj, int depth)
+{
+  long i;
+
+  if (depth > JX9_MAX_DEPTH)
+    rb_raise(rb_eArgError, "document nested too deeply");
+
+  switch (TYPE(obj))
+  {
+    case T_HASH:
+      rb_hash_foreach(obj, jx9_check_pair, INT2NUM(depth + 1));
+      break;
+    case T_ARRAY:
+      for (i = 0; i < RARRAY_LEN(obj); i++)
+        jx9_check(RARRAY_AREF(obj, i), depth + 1);
+      break;
+    case T_STRING:
+    case T_SYMBOL:
+    case T_FIXNUM:
+    case T_BIGNUM:
+    case T_FLOAT:
+    case T_TRUE:
+    case T_FALSE:
+    case T_NIL:
+      break;
+    default:
+      rb_raise(rb_eTypeError, "cannot store %s in a document", rb_obj_classname(obj));
+  }
+}
+
+/*
+ * Values are created either by a VM (bound variables) or by a function
+ * call context (function results); this picks the matching allocator.
+ */
+typedef struct
+{
+  unqlite_vm *vm;
+  unqlite_context *context;
+} jx9Alloc;
+
+static unqlite_value* jx9_new(jx9Alloc *alloc, int array)
+{
+  if (alloc->context)
+    return array ? unqlite_context_new_array(alloc->context) : unqlite_context_new_scalar(alloc->context);
+  return array ? unqlite_vm_new_array(alloc->vm) : unqlite_vm_new_scalar(alloc->vm);
+}
+
+static void jx9_release(jx9Alloc *alloc, unqlite_value *value)
+{
+  if (alloc->context)
+    unqlite_context_release_value(alloc->context, value);
+  else
+    unqlite_vm_release_value(alloc->vm, value);
+}
+
+static unqlite_value* jx9_from_ruby(jx9Alloc *alloc, VALUE obj);
+
+struct jx9_hash_args
+{
+  jx9Alloc *alloc;
+  unqlite_value *array;
+};
+
+static void jx9_add(jx9Alloc *alloc, unqlite_value *array, unqlite_value *key, VALUE value)
+{
+  unqlite_value *element = jx9_from_ruby(alloc, value);
+
+  unqlite_array_add_elem(array, key, element);
+  jx9_release(alloc, element);
+}
+
+static int jx9_hash_i(VALUE key, VALUE value, VALUE arg)
+{
+  struct jx9_hash_args *args = (struct jx9_hash_args *)arg;
+  unqlite_value *rkey = jx9_from_ruby(args->alloc, SYMBOL_P(key) || RB_TYPE_P(key, T_STRING) ? key : rb_obj_as_string(key));
+
+  jx9_add(args->alloc, args->array, rkey, value);
+  jx9_release(args->alloc, rkey);
+  return ST_CONTINUE;
+}
+
+/* Convert a value accepted by jx9_check into a new VM value */
+static unqlite_value* jx9_from_ruby(jx9Alloc *alloc, VALUE obj)
+{
+  unqlite_value *value;
+  long i;
+
+  value = jx9_new(alloc, RB_TYPE_P(obj, T_HASH) || RB_TYPE_P(obj, T_ARRAY));
+  if (!value)
+    CHECK(0, UNQLITE_NOMEM);
+
+  switch (TYPE(obj))
+  {
+    case T_HASH:
+    {
+      struct jx9_hash_args args;
+      args.alloc = alloc;
+      args.array = value;
+      rb_hash_foreach(obj, jx9_hash_i, (VALUE)&args);
+      break;
+    }
+    case T_ARRAY:
+      for (i = 0; i < RARRAY_LEN(obj); i++)
+        jx9_add(alloc, value, NULL, RARRAY_AREF(obj, i));
+      break;
+    case T_SYMBOL:
+      obj = rb_sym2str(obj);
+      /* fall through */
+    case T_STRING:
+      unqlite_value_string(value, RSTRING_PTR(obj), (int)RSTRING_LEN(obj));
+      break;
+    case T_FIXNUM:
+    case T_BIGNUM:
+      unqlite_value_int64(value, NUM2LL(obj));
+      break;
+    case T_FLOAT:
+      unqlite_value_double(value, RFLOAT_VALUE(obj));
+      break;
+    case T_TRUE:
+    case T_FALSE:
+      unqlite_value_bool(value, obj == Qtrue);
+      break;
+    default:
+      unqlite_value_null(value);
+  }
+
+  return value;
+}
+
+static const rb_data_type_t unqlite_collection_type;
+static VALUE jx9_to_ruby(unqlite_value *value);
+
+static int jx9_object_i(unqlite_value *key, unqlite_value *value, void *arg)
+{
+  int len;
+  const char *str = unqlite_value_to_string(key, &len);
+
+  rb_hash_aset((VALUE)arg, rb_utf8_str_new(str, len), jx9_to_ruby(value));
+  return UNQLITE_OK;
+}
+
+static int jx9_array_i(unqlite_value *key, unqlite_value *value, void *arg)
+{
+  rb_ary_push((VALUE)arg, jx9_to_ruby(value));
+  return UNQLITE_OK;
+}
+
+/* Convert a VM value into Ruby: objects become Hashes, arrays Arrays */
+static VALUE jx9_to_ruby(unqlite_value *value)
+{
+  VALUE result;
+  const char *str;
+  int len;
+
+  if (unqlite_value_is_json_object(value))
+  {
+    result = rb_hash_new();
+    unqlite_array_walk(value, jx9_object_i, (void *)result);
+  }
+  else if (unqlite_value_is_json_array(value))
+  {
+    result = rb_ary_new_capa(unqlite_array_count(value));
+    unqlite_array_walk(value, jx9_array_i, (void *)result);
+  }
+  else if (unqlite_value_is_null(value))
+    result = Qnil;
+  else if (unqlite_value_is_bool(value))
+    result = unqlite_value_to_bool(value) ? Qtrue : Qfalse;
+  else if (unqlite_value_is_int(value))
+    result = LL2NUM(unqlite_value_to_int64(value));
+  else if (unqlite_value_is_float(value))
+    result = DBL2NUM(unqlite_value_to_double(value));
+  else
+  {
+    str = unqlite_value_to_string(value, &len);
+    result = rb_utf8_str_new(str, len);
+  }
+
+  return result;
+}
+
+/*
+ * Native helpers, callable from every script
+ */
+
+/* prefix_match($str, $prefix): whether $str is a string starting with $prefix */
+static int jx9_prefix_match(unqlite_context *context, int argc, unqlite_value **argv)
+{
+  const char *str, *prefix;
+  int len, plen;
+
+  if (argc < 2 || !unqlite_value_is_string(argv[0]))
+  {
+    unqlite_result_bool(context, 0);
+    return UNQLITE_OK;
+  }
+
+  str = unqlite_value_to_string(argv[0], &len);
+  prefix = unqlite_value_to_string(argv[1], &plen);
+  unqlite_result_bool(context, plen <= len && memcmp(str, prefix, plen) == 0);
+  return UNQLITE_OK;
+}
+
+/* in_range($num, $lo, $hi): whether $lo <= $num <= $hi; a null bound is open */
+static int jx9_in_range(unqlite_context *context, int argc, unqlite_value **argv)
+{
+  double num;
+  int ok;
+
+  if (argc < 3 || !(unqlite_value_is_int(argv[0]) || unqlite_value_is_float(argv[0])))
+  {
+    unqlite_result_bool(context, 0);
+    return UNQLITE_OK;
+  }
+
+  num = unqlite_value_to_double(argv[0]);
+  ok = (unqlite_value_is_null(argv[1]) || num >= unqlite_value_to_double(argv[1])) &&
+       (unqlite_value_is_null(argv[2]) || num <= unqlite_value_to_double(argv[2]));
+  unqlite_result_bool(context, ok);
+  return UNQLITE_OK;
+}
+
+struct jx9_project_args
+{
+  unqlite_value *doc;
+  unqlite_value *result;
+};
+
+static int jx9_project_i(unqlite_value *key, unqlite_value *field, void *arg)
+{
+  struct jx9_project_args *args = (struct jx9_project_args *)arg;
+  unqlite_value *value;
+  const char *name;
+  int len;
+
+  name = unqlite_value_to_string(field, &len);
+  value = unqlite_array_fetch(args->doc, name, len);
+  if (value)
+    unqlite_array_add_elem(args->result, field, value);
+  return UNQLITE_OK;
+}
+
+/* project($doc, $fields): a copy of $doc holding only the listed fields */
+static int jx9_project(unqlite_context *context, int argc, unqlite_value **argv)
+{
+  struct jx9_project_args args;
+
+  if (argc < 2 || !unqlite_value_is_json_object(argv[0]) || !unqlite_value_is_json_array(argv[1]))
+  {
+    unqlite_result_null(context);
+    return UNQLITE_OK;
+  }
+
+  args.doc = argv[0];
+  args.result = unqlite_context_new_array(context);
+  if (!args.result)
+    return UNQLITE_NOMEM;
+  unqlite_array_walk(argv[1], jx9_project_i, &args);
+  unqlite_result_value(context, args.result);
+  unqlite_context_release_value(context, args.result);
+  return UNQLITE_OK;
+}
+
+struct jx9_call
+{
+  unqliteRubyJx9Function *function;
+  unqlite_context *context;
+  int argc;
+  unqlite_value **argv;
+};
+
+static VALUE jx9_call_body(VALUE arg)
+{
+  struct jx9_call *call = (struct jx9_call *)arg;
+  unqlite_value *value;
+  jx9Alloc alloc;
+  VALUE args, result;
+  int i;
+
+  args = rb_ary_new_capa(call->argc);
+  for (i = 0; i < call->argc; i++)
+    rb_ary_push(args, jx9_to_ruby(call->argv[i]));
+
+  result = rb_proc_call(call->function->proc, args);
+  jx9_check(result, 0);
+
+  alloc.vm = NULL;
+  alloc.context = call->context;
+  value = jx9_from_ruby(&alloc, result);
+  unqlite_result_value(call->context, value);
+  unqlite_context_release_value(call->context, value);
+  return Qnil;
+}
+
+/*
+ * Calls a function registered with Database#create_function. Ruby
+ * exceptions must not unwind through the VM: they abort the script and
+ * are raised again once unqlite_vm_exec has returned.
+ */
+static int jx9_call(unqlite_context *context, int argc, unqlite_value **argv)
+{
+  struct jx9_call call;
+  int state = 0;
+
+  call.function = (unqliteRubyJx9Function *)unqlite_context_user_data(context);
+  if (call.function->jx9->state)
+    return UNQLITE_ABORT;
+
+  call.context = context;
+  call.argc = argc;
+  call.argv = argv;
+  rb_protect(jx9_call_body, (VALUE)&call, &state);
+  if (state)
+  {
+    call.function->jx9->state = state;
+    return UNQLITE_ABORT;
+  }
+  return UNQLITE_OK;
+}
+
+/* Install the native helpers and the registered functions into _vm_ */
+static int jx9_install(unqliteRubyJx9 *jx9, unqlite_vm *vm)
+{
+  int i, rc;
+
+  rc = unqlite_create_function(vm, "prefix_match", jx9_prefix_match, NULL);
+  if (rc == UNQLITE_OK)
+    rc = unqlite_create_function(vm, "in_range", jx9_in_range, NULL);
+  if (rc == UNQLITE_OK)
+    rc = unqlite_create_function(vm, "project", jx9_project, NULL);
+  for (i = 0; rc == UNQLITE_OK && i < jx9->nfunctions; i++)
+    rc = unqlite_create_function(vm, jx9->functions[i]->name, jx9_call, jx9->functions[i]);
+  return rc;
+}
+
+static unqlite_vm* jx9_compile(unqlite *db, unqliteRubyJx9 *jx9, const char *script)
+{
+  unqlite_vm *vm;
+  int rc;
+
+  rc = unqlite_compile(db, script, -1, &vm);
+  CHECK(db, rc);
+
+  rc = jx9_install(jx9, vm);
+  if (rc != UNQLITE_OK)
+  {
+    unqlite_vm_release(vm);
+    CHECK(db, rc);
+  }
+  return vm;
+}
+
+struct jx9_run
+{
+  unqliteRubyPtr ctx;
+  unqlite *db;
+  unqlite_vm *vm;
+  int slot;
+  int temporary;      /* compiled for this call, the cached VM being busy */
+  VALUE name;
+  VALUE docs;         /* Qundef when not bound */
+  VALUE id;           /* Qundef when not bound */
+  VALUE fields;       /* Qundef when not bound */
+  VALUE result;
+};
+
+static void jx9_bind(unqlite_vm *vm, const char *name, VALUE obj)
+{
+  unqlite_value *value;
+  jx9Alloc alloc;
+
+  alloc.vm = vm;
+  alloc.context = NULL;
+  value = jx9_from_ruby(&alloc, obj);
+  unqlite_vm_config(vm, UNQLITE_VM_CONFIG_CREATE_VAR, name, value);
+  unqlite_vm_release_value(vm, value);
+}
+
+static VALUE jx9_run_body(VALUE arg)
+{
+  struct jx9_run *run = (struct jx9_run *)arg;
+  unqlite_value *result;
+  int rc, state;
+
+  jx9_bind(run->vm, "name", run->name);
+  if (run->docs != Qundef)
+    jx9_bind(run->vm, "docs", run->docs);
+  if (run->id != Qundef)
+    jx9_bind(run->vm, "id", run->id);
+  if (run->fields != Qundef)
+    jx9_bind(run->vm, "fields", run->fields);
+
+  rc = unqlite_vm_exec(run->vm);
+
+  // An exception raised by a registered function wins over the VM's code
+  state = run->ctx->jx9->state;
+  if (state)
+  {
+    run->ctx->jx9->state = 0;
+    rb_jump_tag(state);
+  }
+  CHECK(run->db, rc);
+
+  result = unqlite_vm_extract_variable(run->vm, "result");
+  run->result = result ? jx9_to_ruby(result) : Qnil;
+  return run->result;
+}
+
+static VALUE jx9_run_ensure(VALUE arg)
+{
+  struct jx9_run *run = (struct jx9_run *)arg;
+
+  if (run->temporary)
+    unqlite_vm_release(run->vm);
+  else
+  {
+    unqlite_vm_reset(run->vm);
+    run->ctx->jx9->busy[run->slot] = 0;
+  }
+  return Qnil;
+}
+
+static void jx9_run_init(struct jx9_run *run, VALUE self)
+{
+  unqliteRubyCollection *rcollection;
+
+  TypedData_Get_Struct(self, unqliteRubyCollection, &unqlite_collection_type, rcollection);
+  GetDatabase2(rcollection->database, run->ctx, run->db);
+
+  run->name = rcollection->name;
+  run->docs = Qundef;
+  run->id = Qundef;
+  run->fields = Qundef;
+  run->result = Qnil;
+}
+
+/* Execute _run_ on the VM cached in _slot_, compiling _script_ if needed */
+static VALUE jx9_run_slot(struct jx9_run *run, int slot, const char *script)
+{
+  unqliteRubyJx9 *jx9 = jx9_get(run->ctx);
+
+  run->slot = slot;
+  run->temporary = jx9->busy[slot];
+
+  if (run->temporary || !jx9->vms[slot])
+  {
+    run->vm = jx9_compile(run->db, jx9, script);
+    if (!run->temporary)
+      jx9->vms[slot] = run->vm;
+  }
+  else
+    run->vm = jx9->vms[slot];
+
+  if (!run->temporary)
+    jx9->busy[slot] = 1;
+
+  return rb_ensure(jx9_run_body, (VALUE)run, jx9_run_ensure, (VALUE)run);
+}
+
+/* Run one of the collection scripts against the collection _self_ */
+static VALUE jx9_run(VALUE self, int script, VALUE docs, VALUE id)
+{
+  struct jx9_run run;
+
+  jx9_run_init(&run, self);
+  if (docs != Qundef)
+    jx9_check(docs, 0);
+  run.docs = docs;
+  run.id = id;
+  if (script == UNQLITE_RUBY_JX9_FETCH_ALL)
+    run.fields = Qnil;
+  if (script == UNQLITE_RUBY_JX9_INSERT || script == UNQLITE_RUBY_JX9_DROP)
+    unqliteRuby_write_begin(run.ctx);
+
+  return jx9_run_slot(&run, script, jx9_scripts[script]);
+}
+
+/*
+ * Run fetch_all filtered by the Jx9 expression _where_. The compiled
+ * script is cached in one of a few slots keyed by the expression;
+ * slots are reused round-robin.
+ */
+static VALUE jx9_run_where(VALUE self, VALUE where, VALUE fields)
+{
+  struct jx9_run run;
+  unqliteRubyJx9 *jx9;
+  VALUE script;
+  int i, slot, cached = -1;
+
+  jx9_run_init(&run, self);
+  run.fields = fields;
+  jx9 = jx9_get(run.ctx);
+
+  script = rb_str_new_cstr("if (!db_exists($name)) { $result = []; } else {"
+                           "  $result = db_fetch_all($name, function($rec) { return (");
+  rb_str_append(script, where);
+  rb_str_cat_cstr(script, "); });"
+                          "}"
+                          JX9_PROJECT);
+
+  for (i = 0; i < UNQLITE_RUBY_JX9_WHERE_CACHE; i++)
+    if (!NIL_P(jx9->where[i]) && rb_str_equal(jx9->where[i], where) == Qtrue)
+      cached = i;
+
+  if (cached < 0)
+  {
+    cached = jx9->where_next;
+    slot = UNQLITE_RUBY_JX9_SCRIPTS + cached;
+
+    // A busy slot is left alone; jx9_run_slot then compiles a temporary VM
+    if (!jx9->busy[slot])
+    {
+      if (jx9->vms[slot])
+        unqlite_vm_release(jx9->vms[slot]);
+      jx9->vms[slot] = NULL;
+      RB_OBJ_WRITE(run.ctx->self, &jx9->where[cached], rb_str_new_frozen(where));
+      jx9->where_next = (cached + 1) % UNQLITE_RUBY_JX9_WHERE_CACHE;
+    }
+  }
+
+  return jx9_run_slot(&run, UNQLITE_RUBY_JX9_SCRIPTS + cached, StringValueCStr(script));
+}
+
+/* Wrapped object: mark */
+static void unqlite_collection_mark(void *ptr)
+{
+  unqliteRubyCollection *rcollection = (unqliteRubyCollection *)ptr;
+  UNQLITE_RUBY_MARK(rcollection->database);
+  UNQLITE_RUBY_MARK(rcollection->name);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+/* Wrapped object: compact */
+static void unqlite_collection_compact(void *ptr)
+{
+  unqliteRubyCollection *rcollection = (unqliteRubyCollection *)ptr;
+  UNQLITE_RUBY_MOVE(rcollection->database);
+  UNQLITE_RUBY_MOVE(rcollection->name);
+}
+#endif
+
+static const rb_data_type_t unqlite_collection_type = {
+  "UnQLite::Collection",
+  {
+    unqlite_collection_mark,
+    RUBY_TYPED_DEFAULT_FREE,
+    NULL,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    unqlite_collection_compact,
+#endif
+  },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+/* Wrapped object: allocate */
+static VALUE unqlite_collection_allocate(VALUE klass)
+{
+  unqliteRubyCollection *rcollection;
+  VALUE self = TypedData_Make_Struct(klass, unqliteRubyCollection, &unqlite_collection_type, rcollection);
+  rcollection->database = Qnil;
+  rcollection->name = Qnil;
+  return self;
+}
+
+/*
+ * call-seq:
+ *    UnQLite::Collection.new(database, name)
+ *
+ * A handle on the JSON collection _name_ of _database_. The collection
+ * is created by the first insert.
+ */
+static VALUE unqlite_collection_initialize(VALUE self, VALUE database, VALUE name)
+{
+  unqliteRubyCollection *rcollection;
+  unqliteRubyPtr ctx;
+
+  Check_Type(name, T_STRING);
+  GetDatabase(database, ctx);
+
+  TypedData_Get_Struct(self, unqliteRubyCollection, &unqlite_collection_type, rcollection);
+  RB_OBJ_WRITE(self, &rcollection->database, database);
+  RB_OBJ_WRITE(self, &rcollection->name, rb_str_new_frozen(name));
+  return self;
+}
+
+/*
+ * call-seq:
+ *    database.collection(name) -> collection
+ *
+ * Returns the UnQLite::Collection named _name_.
+ */
+static VALUE unqlite_database_collection(VALUE self, VALUE name)
+{
+  VALUE args[2];
+  args[0] = self;
+  args[1] = name;
+  return rb_class_new_instance(2, args, cUnQLiteCollection);
+}
+
+/*
+ * call-seq:
+ *    collection.insert_many(documents) -> ids
+ *
+ * Stores every Hash of _documents_ through a single script execution
+ * and returns the record ids given to them, in order. Documents may
+ * hold Hashes, Arrays, Strings, Symbols, Integers, Floats, true, false
+ * and nil.
+ */
+static VALUE unqlite_collection_insert_many(VALUE self, VALUE docs)
+{
+  VALUE last, ids;
+  long i, n;
+
+  Check_Type(docs, T_ARRAY);
+  n = RARRAY_LEN(docs);
+  if (n == 0)
+    return rb_ary_new();
+
+  for (i = 0; i < n; i++)
+    Check_Type(RARRAY_AREF(docs, i), T_HASH);
+
+  last = jx9_run(self, UNQLITE_RUBY_JX9_INSERT, docs, Qundef);
+  if (NIL_P(last))
+    rb_raise(rb_path2class("UnQLite::AbortException"), "db_store failed");
+
+  ids = rb_ary_new_capa(n);
+  for (i = 0; i < n; i++)
+    rb_ary_push(ids, LL2NUM(NUM2LL(last) - n + 1 + i));
+  return ids;
+}
+
+/*
+ * call-seq:
+ *    collection.insert(document) -> id
+ *
+ * Stores the Hash _document_ and returns its record id.
+ */
+static VALUE unqlite_collection_insert(VALUE self, VALUE doc)
+{
+  Check_Type(doc, T_HASH);
+  return rb_ary_entry(unqlite_collection_insert_many(self, rb_ary_new_from_args(1, doc)), 0);
+}
+
+/*
+ * call-seq:
+ *    collection.fetch_all -> documents
+ *    collection.fetch_all(where: expression, fields: nil) -> documents
+ *
+ * Returns every document of the collection, each with its record id
+ * under <tt>"__id"</tt>.
+ *
+ * _where_ is a Jx9 expression evaluated inside the VM for each document,
+ * bound to <tt>$rec</tt>; only the documents it is true for are
+ * converted to Ruby. It may call the native helpers and any function
+ * registered with Database#create_function:
+ *
+ *    users.fetch_all(where: 'prefix_match($rec.name, "ad") && in_range($rec.age, 18, null)')
+ *
+ * _fields_ (an Array of field names) keeps only those fields of each
+ * returned document.
+ *
+ * The expression is pasted into a script: never build it from untrusted
+ * input.
+ */
+static VALUE unqlite_collection_fetch_all(int argc, VALUE *argv, VALUE self)
+{
+  static ID keywords[2];
+  VALUE opts, kwargs[2], where, fields, result;
+  long i;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  where = Qnil;
+  fields = Qnil;
+  if (!NIL_P(opts))
+  {
+    if (!keywords[0])
+    {
+      keywords[0] = rb_intern("where");
+      keywords[1] = rb_intern("fields");
+    }
+    rb_get_kwargs(opts, keywords, 0, 2, kwargs);
+    if (kwargs[0] != Qundef)
+      where = kwargs[0];
+    if (kwargs[1] != Qundef)
+      fields = kwargs[1];
+  }
+
+  if (!NIL_P(fields))
+  {
+    Check_Type(fields, T_ARRAY);
+    fields = rb_ary_dup(fields);
+    for (i = 0; i < RARRAY_LEN(fields); i++)
+    {
+      VALUE field = RARRAY_AREF(fields, i);
+      if (SYMBOL_P(field))
+        rb_ary_store(fields, i, rb_sym2str(field));
+      else
+        Check_Type(field, T_STRING);
+    }
+  }
+
+  if (NIL_P(where))
+  {
+    struct jx9_run run;
+    jx9_run_init(&run, self);
+    run.fields = fields;
+    result = jx9_run_slot(&run, UNQLITE_RUBY_JX9_FETCH_ALL, jx9_scripts[UNQLITE_RUBY_JX9_FETCH_ALL]);
+  }
+  else
+  {
+    StringValue(where);
+    result = jx9_run_where(self, where, fields);
+  }
+
+  return RB_TYPE_P(result, T_ARRAY) ? result : rb_ary_new();
+}
+
+/*
+ * call-seq:
+ *    collection.fetch_by_id(id) -> document or nil
+ *
+ * Returns the document with record id _id_, or nil.
+ */
+static VALUE unqlite_collection_fetch_by_id(VALUE self, VALUE id)
+{
+  VALUE result = jx9_run(self, UNQLITE_RUBY_JX9_FETCH_ID, Qundef, LL2NUM(NUM2LL(id)));
+  return RB_TYPE_P(result, T_HASH) ? result : Qnil;
+}
+
+/*
+ * call-seq:
+ *    collection.count -> integer
+ *
+ * Returns the number of documents in the collection.
+ */
+static VALUE unqlite_collection_count(VALUE self)
+{
+  return jx9_run(self, UNQLITE_RUBY_JX9_COUNT, Qundef, Qundef);
+}
+
+/*
+ * call-seq:
+ *    collection.drop -> true or false
+ *
+ * Removes the collection and its documents. Returns false if it did
+ * not exist.
+ */
+static VALUE unqlite_collection_drop(VALUE self)
+{
+  return RTEST(jx9_run(self, UNQLITE_RUBY_JX9_DROP, Qundef, Qundef)) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    collection.name -> string
+ */
+static VALUE unqlite_collection_name(VALUE self)
+{
+  unqliteRubyCollection *rcollection;
+  TypedData_Get_Struct(self, unqliteRubyCollection, &unqlite_collection_type, rcollection);
+  return rcollection->name;
+}
+
+/*
+ * call-seq:
+ *    collection.database -> database
+ */
+static VALUE unqlite_collection_database(VALUE self)
+{
+  unqliteRubyCollection *rcollection;
+  TypedData_Get_Struct(self, unqliteRubyCollection, &unqlite_collection_type, rcollection);
+  return rcollection->database;
+}
+
+/*
+ * call-seq:
+ *    database.create_function(name) { |*args| ... } -> nil
+ *
+ * Makes the block callable as the Jx9 function _name_ from the scripts
+ * run by this handle, e.g. in Collection#fetch_all's +where+ expression.
+ * Arguments and the block's result are converted like documents.
+ * Registering _name_ again replaces its block. An exception raised by
+ * the block aborts the script and is raised by the calling method.
+ */
+static VALUE unqlite_database_create_function(VALUE self, VALUE name)
+{
+  unqliteRubyJx9Function *function = NULL;
+  unqliteRubyJx9 *jx9;
+  unqliteRubyPtr ctx;
+  const char *cname;
+  VALUE proc;
+  long i;
+  int rc;
+
+  proc = rb_block_proc();
+  if (SYMBOL_P(name))
+    name = rb_sym2str(name);
+  cname = StringValueCStr(name);
+
+  // Jx9 identifiers
+  for (i = 0; i < RSTRING_LEN(name); i++)
+    if (!(ISALNUM(cname[i]) || cname[i] == '_') || (i == 0 && ISDIGIT(cname[i])))
+      rb_raise(rb_eArgError, "invalid function name: %s", cname);
+  if (RSTRING_LEN(name) == 0)
+    rb_raise(rb_eArgError, "invalid function name: %s", cname);
+
+  GetDatabase(self, ctx);
+  jx9 = jx9_get(ctx);
+
+  for (i = 0; i < jx9->nfunctions; i++)
+    if (strcmp(jx9->functions[i]->name, cname) == 0)
+      function = jx9->functions[i];
+
+  if (function)
+  {
+    RB_OBJ_WRITE(self, &function->proc, proc);
+    return Qnil;
+  }
+
+  function = ALLOC(unqliteRubyJx9Function);
+  function->jx9 = jx9;
+  function->name = ruby_strdup(cname);
+  function->proc = Qnil;
+  REALLOC_N(jx9->functions, unqliteRubyJx9Function *, jx9->nfunctions + 1);
+  jx9->functions[jx9->nfunctions++] = function;
+  RB_OBJ_WRITE(self, &function->proc, proc);
+
+  // Scripts compiled from now on install it in jx9_install
+  for (i = 0; i < UNQLITE_RUBY_JX9_SLOTS; i++)
+  {
+    if (!jx9->vms[i])
+      continue;
+    rc = unqlite_create_function(jx9->vms[i], function->name, jx9_call, function);
+    CHECK(ctx->pDb, rc);
+  }
+
+  return Qnil;
+}
+
+void Init_unqlite_collection()
+{
+  cUnQLiteCollection = rb_define_class_under(mUnQLite, "Collection", rb_cObject);
+  rb_define_alloc_func(cUnQLiteCollection, unqlite_collection_allocate);
+  rb_define_method(cUnQLiteCollection, "initialize", unqlite_collection_initialize, 2);
+  rb_define_method(cUnQLiteCollection, "insert", unqlite_collection_insert, 1);
+  rb_define_method(cUnQLiteCollection, "insert_many", unqlite_collection_insert_many, 1);
+  rb_define_method(cUnQLiteCollection, "fetch_all", unqlite_collection_fetch_all, -1);
+  rb_define_method(cUnQLiteCollection, "fetch_by_id", unqlite_collection_fetch_by_id, 1);
+  rb_define_method(cUnQLiteCollection, "count", unqlite_collection_count, 0);
+  rb_define_method(cUnQLiteCollection, "drop", unqlite_collection_drop, 0);
+  rb_define_method(cUnQLiteCollection, "name", unqlite_collection_name, 0);
+  rb_define_method(cUnQLiteCollection, "database", unqlite_collection_database, 0);
+
+  rb_define_method(cUnQLiteDatabase, "collection", unqlite_database_collection, 1);
+  rb_define_method(cUnQLiteDatabase, "create_function", unqlite_database_create_function, 1);
+}
@@ -0,0 +1,58 @@
+#ifndef UNQLITE_RUBY_COLLECTION
+#define UNQLITE_RUBY_COLLECTION
+
+#include <unqlite_ruby.h>
+
+struct _unqliteRuby;
+
+/* Jx9 scripts compiled once per handle */
+#define UNQLITE_RUBY_JX9_INSERT    0
+#define UNQLITE_RUBY_JX9_FETCH_ALL 1
+#define UNQLITE_RUBY_JX9_FETCH_ID  2
+#define UNQLITE_RUBY_JX9_COUNT     3
+#define UNQLITE_RUBY_JX9_DROP      4
+#define UNQLITE_RUBY_JX9_SCRIPTS   5
+
+/* fetch_all(where:) scripts cached per handle, keyed by expression */
+#define UNQLITE_RUBY_JX9_WHERE_CACHE 8
+#define UNQLITE_RUBY_JX9_SLOTS (UNQLITE_RUBY_JX9_SCRIPTS + UNQLITE_RUBY_JX9_WHERE_CACHE)
+
+struct _unqliteRubyJx9;
+
+/* A Ruby callable registered with Database#create_function */
+typedef struct
+{
+  struct _unqliteRubyJx9 *jx9;
+  char *name;
+  VALUE proc;
+} unqliteRubyJx9Function;
+
+typedef struct _unqliteRubyJx9
+{
+  unqlite_vm *vms[UNQLITE_RUBY_JX9_SLOTS];
+  int busy[UNQLITE_RUBY_JX9_SLOTS];
+  VALUE where[UNQLITE_RUBY_JX9_WHERE_CACHE];  /* frozen String, or Qnil */
+  int where_next;                             /* next cache slot to reuse */
+
+  unqliteRubyJx9Function **functions;
+  int nfunctions;
+  int state;          /* tag of an exception raised by a function */
+} unqliteRubyJx9;
+
+typedef struct
+{
+  VALUE database;
+  VALUE name;     /* frozen String */
+} unqliteRubyCollection;
+
+extern VALUE cUnQLiteCollection;
+
+void Init_unqlite_collection();
+void unqliteRuby_jx9_close(struct _unqliteRuby *ctx);
+void unqliteRuby_jx9_abandon(struct _unqliteRuby *ctx);
+void unqliteRuby_jx9_mark(struct _unqliteRuby *ctx);
+void unqliteRuby_jx9_compact(struct _unqliteRuby *ctx);
+size_t unqliteRuby_jx9_memsize(const struct _unqliteRuby *ctx);
+void unqliteRuby_jx9_free(struct _unqliteRuby *ctx);
+
+#endif
@@ -0,0 +1,511 @@
+#include <unqlite_compact.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+ * Database#compact copies every live record (internal entries included)
+ * into a fresh file, in large sequential transactions, then swaps it
+ * with the database file and reopens the handle on it.
+ *
+ * The pending transaction is committed and a new one is opened on the
+ * source so that other processes cannot commit while records are being
+ * copied; in place, it is held until the copy has been renamed over the
+ * database file. Other threads get UnQLite::BusyException from this
+ * handle until the compaction ends. Batches are copied without the GVL
+ * when the library is thread-safe, and the copy rate can be capped.
+ *
+ * Handles other processes have open on the database keep using the old,
+ * now unlinked, file: whatever they write after the swap is lost. They
+ * must be reopened.
+ */
+
+#define COMPACT_COMMIT_EVERY (16 * 1024 * 1024)
+
+#define COMPACT_ORDER_STORAGE 0
+#define COMPACT_ORDER_KEY     1
+
+typedef struct
+{
+  size_t offset;              /* into the key arena */
+  int len;
+} compactKey;
+
+typedef struct
+{
+  unqliteRubyPtr ctx;
+  unqlite *src;
+  unqlite *dst;
+  unqlite_kv_cursor *cursor;
+  int locked;                 /* write-transaction opened on _src_ */
+  int unlocked;               /* copy without the GVL */
+
+  char *target;               /* file the records are copied to */
+  int in_place;
+  int order;
+  size_t commit_every;
+  double rate;                /* bytes per second, 0 for no limit */
+
+  compactKey *keys;           /* keys in order, for COMPACT_ORDER_KEY */
+  size_t nkeys;
+  size_t keys_cap;
+  size_t next_key;
+  char *arena;
+  size_t arena_len;
+  size_t arena_cap;
+
+  char *key;                  /* current record */
+  int key_cap;
+  char *value;
+  size_t value_len;
+  size_t value_cap;
+
+  uint64_t records;
+  uint64_t bytes;
+  int done;
+  int rc;
+} compactJob;
+
+static double compact_clock()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long compact_file_size(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+/* Grow a malloc'ed buffer; the copy runs without the GVL */
+static int compact_reserve(char **buf, size_t *cap, size_t n)
+{
+  if (n > *cap)
+  {
+    size_t new_cap = *cap ? *cap : 4096;
+    char *p;
+
+    while (new_cap < n)
+      new_cap *= 2;
+    p = (char *)realloc(*buf, new_cap);
+    if (!p)
+      return UNQLITE_NOMEM;
+    *buf = p;
+    *cap = new_cap;
+  }
+  return UNQLITE_OK;
+}
+
+static int compact_value_consumer(const void *data, unsigned int len, void *udata)
+{
+  compactJob *job = (compactJob *)udata;
+
+  if (compact_reserve(&job->value, &job->value_cap, job->value_len + len) != UNQLITE_OK)
+    return UNQLITE_ABORT;
+  memcpy(job->value + job->value_len, data, len);
+  job->value_len += len;
+  return UNQLITE_OK;
+}
+
+static int compact_key_cmp(const void *a, const void *b, void *arena)
+{
+  const compactKey *ka = (const compactKey *)a, *kb = (const compactKey *)b;
+  int n = ka->len < kb->len ? ka->len : kb->len;
+  int c = memcmp((char *)arena + ka->offset, (char *)arena + kb->offset, n);
+
+  if (c != 0)
+    return c;
+  return ka->len < kb->len ? -1 : ka->len > kb->len;
+}
+
+/* Read every key of the source and sort them */
+static void* compact_collect_keys(void *arg)
+{
+  compactJob *job = (compactJob *)arg;
+  int rc = UNQLITE_OK, len;
+
+  unqlite_kv_cursor_first_entry(job->cursor);
+  while (unqlite_kv_cursor_valid_entry(job->cursor))
+  {
+    rc = unqlite_kv_cursor_key(job->cursor, NULL, &len);
+    if (rc != UNQLITE_OK)
+      break;
+
+    if (job->nkeys == job->keys_cap)
+    {
+      size_t cap = job->keys_cap ? job->keys_cap * 2 : 1024;
+      compactKey *keys = (compactKey *)realloc(job->keys, cap * sizeof(compactKey));
+      if (!keys)
+      {
+        rc = UNQLITE_NOMEM;
+        break;
+      }
+      job->keys = keys;
+      job->keys_cap = cap;
+    }
+
+    rc = compact_reserve(&job->arena, &job->arena_cap, job->arena_len + len);
+    if (rc != UNQLITE_OK)
+      break;
+    rc = unqlite_kv_cursor_key(job->cursor, job->arena + job->arena_len, &len);
+    if (rc != UNQLITE_OK)
+      break;
+
+    job->keys[job->nkeys].offset = job->arena_len;
+    job->keys[job->nkeys].len = len;
+    job->nkeys++;
+    job->arena_len += len;
+
+    unqlite_kv_cursor_next_entry(job->cursor);
+  }
+
+  if (rc == UNQLITE_OK)
+    ruby_qsort(job->keys, job->nkeys, sizeof(compactKey), compact_key_cmp, job->arena);
+
+  job->rc = rc;
+  return NULL;
+}
+
+/* Copy records until _commit_every_ bytes are written, then commit */
+static void* compact_copy_batch(void *arg)
+{
+  compactJob *job = (compactJob *)arg;
+  size_t batch = 0;
+  const char *key;
+  int rc = UNQLITE_OK, klen;
+
+  while (batch < job->commit_every)
+  {
+    job->value_len = 0;
+
+    if (job->order == COMPACT_ORDER_KEY)
+    {
+      if (job->next_key == job->nkeys)
+      {
+        job->done = 1;
+        break;
+      }
+      key = job->arena + job->keys[job->next_key].offset;
+      klen = job->keys[job->next_key].len;
+      job->next_key++;
+      rc = unqlite_kv_fetch_callback(job->src, key, klen, compact_value_consumer, job);
+    }
+    else
+    {
+      if (!unqlite_kv_cursor_valid_entry(job->cursor))
+      {
+        job->done = 1;
+        break;
+      }
+      rc = unqlite_kv_cursor_key(job->cursor, NULL, &klen);
+      if (rc == UNQLITE_OK && klen > job->key_cap)
+      {
+        char *p = (char *)realloc(job->key, klen);
+        if (p)
+        {
+          job->key = p;
+          job->key_cap = klen;
+        }
+        else
+          rc = UNQLITE_NOMEM;
+      }
+      if (rc == UNQLITE_OK)
+        rc = unqlite_kv_cursor_key(job->cursor, job->key, &klen);
+      if (rc == UNQLITE_OK)
+        rc = unqlite_kv_cursor_data_callback(job->cursor, compact_value_consumer, job);
+      key = job->key;
+      unqlite_kv_cursor_next_entry(job->cursor);
+    }
+    if (rc != UNQLITE_OK)
+      break;
+
+    rc = unqlite_kv_store(job->dst, key, klen, job->value, job->value_len);
+    if (rc != UNQLITE_OK)
+      break;
+
+    job->records++;
+    job->bytes += klen + job->value_len;
+    batch += klen + job->value_len;
+  }
+
+  if (rc == UNQLITE_OK)
+    rc = unqlite_commit(job->dst);
+
+  job->rc = rc;
+  return NULL;
+}
+
+static void compact_run(compactJob *job, void *(*fn)(void *))
+{
+  if (job->unlocked)
+    rb_thread_call_without_gvl(fn, job, RUBY_UBF_IO, NULL);
+  else
+    fn(job);
+}
+
+/* Sleep as long as needed to keep the copy under _rate_ bytes per second */
+static void compact_throttle(compactJob *job, double start)
+{
+  double due, elapsed;
+  struct timeval tv;
+
+  if (job->rate <= 0)
+    return;
+
+  due = job->bytes / job->rate;
+  elapsed = compact_clock() - start;
+  if (due > elapsed)
+  {
+    tv.tv_sec = (time_t)(due - elapsed);
+    tv.tv_usec = (long)((due - elapsed - tv.tv_sec) * 1e6);
+    rb_thread_wait_for(tv);
+  }
+}
+
+/* Remove a database file and the journal it may have left */
+static void compact_unlink(const char *path)
+{
+  VALUE journal = rb_str_new_cstr(path);
+
+  rb_str_cat_cstr(journal, UNQLITE_RUBY_JOURNAL_SUFFIX);
+  remove(path);
+  remove(StringValueCStr(journal));
+}
+
+static VALUE compact_body(VALUE arg)
+{
+  compactJob *job = (compactJob *)arg;
+  unqliteRubyPtr ctx = job->ctx;
+  double start = compact_clock();
+  long bytes_before, bytes_after;
+  int rc;
+  VALUE result;
+
+  bytes_before = compact_file_size(ctx->path);
+
+  // Flush this handle, then keep other writers out while copying
+  if (!(ctx->flags & (UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP)))
+  {
+    rc = unqlite_commit(job->src);
+    CHECK(job->src, rc);
+    ctx->pending = 0;
+
+    rc = unqlite_begin(job->src);
+    CHECK(job->src, rc);
+    job->locked = 1;
+  }
+
+  rc = unqliteRuby_cursor_acquire(ctx, &job->cursor);
+  CHECK(job->src, rc);
+
+  if (job->order == COMPACT_ORDER_KEY)
+  {
+    compact_run(job, compact_collect_keys);
+    CHECK(job->src, job->rc);
+  }
+  else
+    unqlite_kv_cursor_first_entry(job->cursor);
+
+  // A copy left behind by an interrupted compaction
+  if (job->in_place)
+    compact_unlink(job->target);
+  rc = unqlite_open(&job->dst, job->target, UNQLITE_OPEN_CREATE | UNQLITE_OPEN_OMIT_JOURNALING);
+  CHECK(job->dst, rc);
+
+  while (!job->done)
+  {
+    compact_run(job, compact_copy_batch);
+    CHECK(job->dst, job->rc);
+    compact_throttle(job, start);
+  }
+
+  rc = unqlite_close(job->dst);
+  job->dst = NULL;
+  CHECK(0, rc);
+
+  // Done reading
+  unqliteRuby_cursor_recycle(ctx, job->cursor);
+  job->cursor = NULL;
+
+  // Swap the files while other writers are still locked out
+  if (job->in_place && rename(job->target, ctx->path) != 0)
+    rb_sys_fail(job->target);
+
+  if (job->locked)
+  {
+    unqlite_rollback(job->src);
+    job->locked = 0;
+  }
+
+  if (job->in_place)
+  {
+    // Open cursors and compiled scripts point into the old file
+    unqliteRuby_cursors_close(ctx);
+    unqliteRuby_jx9_close(ctx);
+
+    rc = unqlite_close(job->src);
+    ctx->pDb = NULL;
+    CHECK(0, rc);
+
+    rc = unqlite_open(&ctx->pDb, ctx->path, ctx->flags);
+    CHECK(ctx->pDb, rc);
+    if (ctx->max_page_cache > 0)
+      unqlite_config(ctx->pDb, UNQLITE_CONFIG_MAX_PAGE_CACHE, ctx->max_page_cache);
+    unqliteRuby_page_cache_account(ctx);
+    bytes_after = compact_file_size(ctx->path);
+  }
+  else
+    bytes_after = compact_file_size(job->target);
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("records")), ULL2NUM(job->records));
+  rb_hash_aset(result, ID2SYM(rb_intern("bytes_before")), LONG2NUM(bytes_before));
+  rb_hash_aset(result, ID2SYM(rb_intern("bytes_after")), LONG2NUM(bytes_after));
+  rb_hash_aset(result, ID2SYM(rb_intern("reclaimed")), LONG2NUM(bytes_before - bytes_after));
+  rb_hash_aset(result, ID2SYM(rb_intern("elapsed")), DBL2NUM(compact_clock() - start));
+  return result;
+}
+
+static VALUE compact_ensure(VALUE arg)
+{
+  compactJob *job = (compactJob *)arg;
+  unqliteRubyPtr ctx = job->ctx;
+
+  // Failed midway: drop the partial copy (the target did not exist before)
+  if (job->dst)
+  {
+    unqlite_close(job->dst);
+    compact_unlink(job->target);
+  }
+  if (job->cursor && ctx->pDb == job->src)
+    unqliteRuby_cursor_recycle(ctx, job->cursor);
+  if (job->locked && ctx->pDb == job->src)
+    unqlite_rollback(job->src);
+
+  ctx->compacting = 0;
+
+  free(job->keys);
+  free(job->arena);
+  free(job->key);
+  free(job->value);
+  xfree(job->target);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *     database.compact(target_path = nil, order: :storage, rate: nil, commit_every: 16 * 1024 * 1024) -> hash
+ *
+ * Rewrites the live records into a fresh file, reclaiming the space
+ * left by deleted and overwritten records and laying out pages in copy
+ * order. Records are copied in the order of a cursor (+:storage+) or
+ * sorted by key (+:key+), committing every _commit_every_ bytes; _rate_
+ * caps the copy at that many bytes per second so that other I/O is not
+ * starved.
+ *
+ * Without _target_path_ the database file is replaced by the compacted
+ * copy and the handle is reopened on it (open UnQLite::Cursor objects
+ * are released). Handles other processes have open keep writing to the
+ * replaced file, so they must be reopened. With _target_path_, which
+ * must not exist, the copy is written there and the database is left
+ * alone.
+ *
+ * Returns a hash with +:records+, +:bytes_before+, +:bytes_after+,
+ * +:reclaimed+ and +:elapsed+ (seconds). Other threads using this
+ * database meanwhile get UnQLite::BusyException. Pending writes are
+ * committed first, but inside #begin_transaction, or after
+ * #disable_auto_commit while writes are uncommitted, it raises
+ * UnQLite::BusyException instead. Raises UnQLite::UnsupportedException
+ * for in-memory databases.
+ */
+static VALUE unqlite_database_compact(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  VALUE target, opts;
+  VALUE kwargs[3];
+  ID kwnames[3];
+  compactJob job;
+
+  rb_scan_args(argc, argv, "01:", &target, &opts);
+
+  memset(&job, 0, sizeof(job));
+  job.commit_every = COMPACT_COMMIT_EVERY;
+
+  kwnames[0] = rb_intern("order");
+  kwnames[1] = rb_intern("rate");
+  kwnames[2] = rb_intern("commit_every");
+  kwargs[0] = kwargs[1] = kwargs[2] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 3, kwargs);
+
+  if (kwargs[0] != Qundef && !NIL_P(kwargs[0]))
+  {
+    ID order = SYM2ID(kwargs[0]);
+    if (order == rb_intern("key"))
+      job.order = COMPACT_ORDER_KEY;
+    else if (order != rb_intern("storage"))
+      rb_raise(rb_eArgError, "unknown order (expected :storage or :key)");
+  }
+  if (kwargs[1] != Qundef && !NIL_P(kwargs[1]))
+  {
+    job.rate = NUM2DBL(kwargs[1]);
+    if (!(job.rate > 0))
+      rb_raise(rb_eArgError, "rate must be positive");
+  }
+  if (kwargs[2] != Qundef)
+    job.commit_every = NUM2SIZET(kwargs[2]);
+  if (job.commit_every == 0)
+    rb_raise(rb_eArgError, "commit_every must be positive");
+
+  if (!NIL_P(target))
+    FilePathValue(target);
+
+  GetDatabase2(self, ctx, db);
+
+  if ((ctx->flags & (UNQLITE_OPEN_IN_MEMORY | UNQLITE_OPEN_TEMP_DB)) || strcmp(ctx->path, ":mem:") == 0)
+    rb_raise(rb_path2class("UnQLite::UnsupportedException"), "in-memory databases cannot be compacted");
+
+  job.in_place = NIL_P(target);
+  if (job.in_place && (ctx->flags & (UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP)))
+    CHECK(0, UNQLITE_READ_ONLY);
+
+  // Compacting commits first: never on behalf of a transaction the caller controls
+  if (ctx->in_transaction || (ctx->no_auto_commit && ctx->pending))
+    rb_raise(rb_path2class("UnQLite::BusyException"), "Database has a transaction open");
+
+  if (job.in_place)
+  {
+    VALUE tmp = rb_str_new_cstr(ctx->path);
+    rb_str_cat_cstr(tmp, UNQLITE_RUBY_COMPACT_SUFFIX);
+    job.target = ruby_strdup(StringValueCStr(tmp));
+  }
+  else
+  {
+    struct stat st;
+
+    // Never overwrite a file, least of all the database itself
+    if (lstat(StringValueCStr(target), &st) == 0)
+      rb_syserr_fail_str(EEXIST, target);
+    job.target = ruby_strdup(StringValueCStr(target));
+  }
+
+  job.ctx = ctx;
+  job.src = db;
+  job.unlocked = unqlite_lib_is_threadsafe();
+  ctx->compacting = 1;
+
+  return rb_ensure(compact_body, (VALUE)&job, compact_ensure, (VALUE)&job);
+}
+
+void Init_unqlite_compact()
+{
+  rb_define_method(cUnQLiteDatabase, "compact", unqlite_database_compact, -1);
+}
@@ -0,0 +1,11 @@
+#ifndef UNQLITE_RUBY_COMPACT
+#define UNQLITE_RUBY_COMPACT
+
+#include <unqlite_ruby.h>
+
+/* Suffix of the file an in-place compaction is written to before the swap */
+#define UNQLITE_RUBY_COMPACT_SUFFIX ".compact"
+
+void Init_unqlite_compact();
+
+#endif
@@ -1,16 +1,18 @@
 #include <unqlite_cursor.h>
+#include <ruby/encoding.h>
 
 /*
  * Document-class: UnQLite::Cursor
  *
  * Cursors provide a mechanism by which you can iterate over the
  * records in a database. Using cursors, you can seek, fetch, move,
- * and delete database records.
+ * and delete database records. Cursors step over the records kept for
+ * secondary indexes and key expiry, whose keys start with a NUL byte.
  */
 
 /* Get cursor context pointer from Ruby object */
 #define GetCursor(obj, cursp) {                         \
-    Data_Get_Struct((obj), unqliteRubyCursor, (cursp)); \
+    TypedData_Get_Struct((obj), unqliteRubyCursor, &unqlite_cursor_type, (cursp)); \
     if ((cursp) == 0) released_cursor();                \
     if ((cursp)->cursor == 0) released_cursor();        \
   }
@@ -21,6 +23,200 @@
     (curs) = (cursp)->cursor;                 \
   }
 
+static const rb_data_type_t unqlite_cursor_type;
+static VALUE unqlite_cursor_key(VALUE self);
+
+/* Consumer appending the chunks handed out by unqlite to a Ruby String */
+static int unqlite_cursor_append_consumer(const void *data, unsigned int len, void *str)
+{
+  rb_str_buf_cat((VALUE)str, (const char *)data, len);
+  return UNQLITE_OK;
+}
+
+/* Read the key under _cursor_ in a single pass */
+int unqliteRuby_cursor_read_key(unqlite_kv_cursor *cursor, VALUE *out)
+{
+  *out = rb_str_buf_new(0);
+  return unqlite_kv_cursor_key_callback(cursor, unqlite_cursor_append_consumer, (void *)*out);
+}
+
+/*
+ * Read the key under _cursor_ as a deduplicated frozen String. _buf_ is
+ * scratch space, so no String is allocated when the key was seen before.
+ */
+int unqliteRuby_cursor_read_interned_key(unqlite_kv_cursor *cursor, VALUE buf, VALUE *out)
+{
+  int rc;
+
+  rb_str_set_len(buf, 0);
+  rc = unqlite_kv_cursor_key_callback(cursor, unqlite_cursor_append_consumer, (void *)buf);
+  if (rc != UNQLITE_OK)
+    return rc;
+
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  *out = rb_enc_interned_str(RSTRING_PTR(buf), RSTRING_LEN(buf), rb_ascii8bit_encoding());
+#else
+  *out = rb_funcall(rb_str_new(RSTRING_PTR(buf), RSTRING_LEN(buf)), rb_intern("-@"), 0);
+#endif
+  return UNQLITE_OK;
+}
+
+/* Consumer keeping the first byte of the key handed out by unqlite */
+static int unqlite_cursor_first_byte_consumer(const void *data, unsigned int len, void *first)
+{
+  if (*(int *)first < 0 && len > 0)
+    *(int *)first = *(const unsigned char *)data;
+  return UNQLITE_OK;
+}
+
+/* True if _cursor_ points to a record the binding keeps under the "\0" prefix */
+int unqliteRuby_cursor_internal(unqlite_kv_cursor *cursor)
+{
+  int first = -1;
+
+  unqlite_kv_cursor_key_callback(cursor, unqlite_cursor_first_byte_consumer, &first);
+  return first == 0;
+}
+
+/*
+ * Step _cursor_ past internal records (index entries, expiry records),
+ * which are not part of the user's data. Running off either end leaves
+ * the cursor invalid, as on an empty database.
+ */
+int unqliteRuby_cursor_skip_internal(unqlite_kv_cursor *cursor, int reverse)
+{
+  int rc = UNQLITE_OK;
+
+  while (unqlite_kv_cursor_valid_entry(cursor) && unqliteRuby_cursor_internal(cursor))
+  {
+    rc = reverse ? unqlite_kv_cursor_prev_entry(cursor) : unqlite_kv_cursor_next_entry(cursor);
+    if (rc != UNQLITE_OK)
+      break;
+  }
+  return rc == UNQLITE_EOF || rc == UNQLITE_DONE ? UNQLITE_OK : rc;
+}
+
+/* Read the data under _cursor_ in a single pass */
+int unqliteRuby_cursor_read_data(unqlite_kv_cursor *cursor, VALUE *out)
+{
+  *out = rb_str_buf_new(0);
+  return unqlite_kv_cursor_data_callback(cursor, unqlite_cursor_append_consumer, (void *)*out);
+}
+
+/*
+ * Take a native cursor from the handle's pool, or allocate a new one.
+ * Short-lived iterations (#each, #empty?, #clear) and UnQLite::Cursor
+ * objects share the pool, so a cursor released by one is reused by the
+ * next instead of going back to unqlite.
+ */
+int unqliteRuby_cursor_acquire(unqliteRubyPtr ctx, unqlite_kv_cursor **out)
+{
+  int rc = UNQLITE_OK;
+
+  if (ctx->ncursor_pool > 0)
+    *out = ctx->cursor_pool[--ctx->ncursor_pool];
+  else
+    rc = unqlite_kv_cursor_init(ctx->pDb, out);
+
+  if (rc == UNQLITE_OK)
+    ctx->ncursors_out++;
+  return rc;
+}
+
+/* Give a native cursor back to the pool, releasing it if the pool is full */
+void unqliteRuby_cursor_recycle(unqliteRubyPtr ctx, unqlite_kv_cursor *cursor)
+{
+  ctx->ncursors_out--;
+
+  if (ctx->ncursor_pool < UNQLITE_RUBY_CURSOR_POOL_SIZE &&
+      unqlite_kv_cursor_reset(cursor) == UNQLITE_OK)
+  {
+    ctx->cursor_pool[ctx->ncursor_pool++] = cursor;
+    return;
+  }
+  unqlite_kv_cursor_release(ctx->pDb, cursor);
+}
+
+/* Link an open cursor into its handle's list */
+static void unqlite_cursor_link(unqliteRubyPtr ctx, unqliteRubyCursor *rcursor)
+{
+  rcursor->ctx = ctx;
+  rcursor->prev = NULL;
+  rcursor->next = ctx->cursors;
+  if (ctx->cursors)
+    ctx->cursors->prev = rcursor;
+  ctx->cursors = rcursor;
+}
+
+/* Unlink a cursor from its handle's list */
+static void unqlite_cursor_unlink(unqliteRubyCursor *rcursor)
+{
+  if (rcursor->prev)
+    rcursor->prev->next = rcursor->next;
+  else
+    rcursor->ctx->cursors = rcursor->next;
+  if (rcursor->next)
+    rcursor->next->prev = rcursor->prev;
+  rcursor->prev = rcursor->next = NULL;
+}
+
+/* Detach every open UnQLite::Cursor and empty the pool */
+static void unqlite_cursors_drop(unqliteRubyPtr ctx, int release)
+{
+  unqliteRubyCursor *rcursor, *next;
+
+  for (rcursor = ctx->cursors; rcursor; rcursor = next)
+  {
+    next = rcursor->next;
+    if (release)
+      unqlite_kv_cursor_release(ctx->pDb, rcursor->cursor);
+    rcursor->cursor = NULL;
+    rcursor->ctx = NULL;
+    rcursor->prev = rcursor->next = NULL;
+  }
+  ctx->cursors = NULL;
+
+  while (ctx->ncursor_pool > 0)
+  {
+    ctx->ncursor_pool--;
+    if (release)
+      unqlite_kv_cursor_release(ctx->pDb, ctx->cursor_pool[ctx->ncursor_pool]);
+  }
+  ctx->ncursors_out = 0;
+}
+
+/*
+ * Called before the handle is closed: release the native cursor of every
+ * open UnQLite::Cursor (they raise "Released cursor" from now on) and
+ * drain the pool.
+ */
+void unqliteRuby_cursors_close(unqliteRubyPtr ctx)
+{
+  unqlite_cursors_drop(ctx, 1);
+}
+
+/*
+ * Same, for a handle inherited across fork: the native cursors belong
+ * to the parent's handle and are left to it.
+ */
+void unqliteRuby_cursors_abandon(unqliteRubyPtr ctx)
+{
+  unqlite_cursors_drop(ctx, 0);
+}
+
+/* Hand the native cursor of _rcursor_ back to its handle */
+static void unqlite_cursor_detach(unqliteRubyCursor *rcursor)
+{
+  if (rcursor->ctx && rcursor->cursor)
+  {
+    unqliteRubyPtr ctx = rcursor->ctx;
+    unqlite_cursor_unlink(rcursor);
+    unqliteRuby_cursor_recycle(ctx, rcursor->cursor);
+  }
+  rcursor->cursor = NULL;
+  rcursor->ctx = NULL;
+}
+
 /* Raise error for already released cursor */
 static void released_cursor()
 {
@@ -28,31 +224,52 @@ static void released_cursor()
 }
 
 /* Wrapped object: mark */
-static void unqlite_cursor_mark(unqliteRubyCursor* rcursor)
+static void unqlite_cursor_mark(void *ptr)
 {
-  rb_gc_mark(rcursor->rb_database);
+  unqliteRubyCursor *rcursor = (unqliteRubyCursor *)ptr;
+  UNQLITE_RUBY_MARK(rcursor->rb_database);
 }
 
 /* Wrapped object: deallocate */
-static void unqlite_cursor_deallocate(unqliteRubyCursor* rcursor)
+static void unqlite_cursor_deallocate(void *ptr)
 {
-  int rc;
-  if (rcursor->cursor) {
-    unqliteRubyPtr rdatabase;
-    Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
-    rc = unqlite_kv_cursor_release(rdatabase->pDb, rcursor->cursor);
-    CHECK(0, rc);
-  }
+  unqliteRubyCursor *rcursor = (unqliteRubyCursor *)ptr;
+  unqlite_cursor_detach(rcursor);
   xfree(rcursor);
 }
 
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+/* Wrapped object: compact */
+static void unqlite_cursor_compact(void *ptr)
+{
+  unqliteRubyCursor *rcursor = (unqliteRubyCursor *)ptr;
+  UNQLITE_RUBY_MOVE(rcursor->rb_database);
+}
+#endif
+
+static const rb_data_type_t unqlite_cursor_type = {
+  "UnQLite::Cursor",
+  {
+    unqlite_cursor_mark,
+    unqlite_cursor_deallocate,
+    NULL,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    unqlite_cursor_compact,
+#endif
+  },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
 /* Wrapped object: allocate */
 VALUE unqlite_cursor_allocate(VALUE klass)
 {
   unqliteRubyCursor *rcursor = ALLOC(unqliteRubyCursor);
   rcursor->cursor = 0;
   rcursor->rb_database = Qnil;
-  return Data_Wrap_Struct(klass, unqlite_cursor_mark, unqlite_cursor_deallocate, rcursor);
+  rcursor->ctx = NULL;
+  rcursor->prev = rcursor->next = NULL;
+  return TypedData_Wrap_Struct(klass, &unqlite_cursor_type, rcursor);
 }
 
 /*
@@ -64,14 +281,19 @@ VALUE unqlite_cursor_allocate(VALUE klass)
 static VALUE unqlite_cursor_initialize(VALUE self, VALUE rb_database)
 {
   unqliteRubyCursor* rcursor;
-  unqliteRuby* rdatabase;
+  unqliteRubyPtr rdatabase;
+  unqlite* db;
   int rc;
-  Data_Get_Struct(self, unqliteRubyCursor, rcursor);
-  Data_Get_Struct(rb_database, unqliteRuby, rdatabase);
-  rcursor->rb_database = rb_database;
-  rb_ary_push(rdatabase->acursors, self);
-  rc = unqlite_kv_cursor_init(rdatabase->pDb, &rcursor->cursor);
-  CHECK(rdatabase->pDb, rc);
+  TypedData_Get_Struct(self, unqliteRubyCursor, &unqlite_cursor_type, rcursor);
+  GetDatabase2(rb_database, rdatabase, db);
+
+  // Re-initializing drops the previous native cursor
+  unqlite_cursor_detach(rcursor);
+
+  rc = unqliteRuby_cursor_acquire(rdatabase, &rcursor->cursor);
+  CHECK(db, rc);
+  RB_OBJ_WRITE(self, &rcursor->rb_database, rb_database);
+  unqlite_cursor_link(rdatabase, rcursor);
   return self;
 }
 
@@ -89,8 +311,10 @@ static VALUE unqlite_cursor_reset(VALUE self)
   int rc;
 
   GetCursor2(self, rcursor, cursor);
-  Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
   rc = unqlite_kv_cursor_reset(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, 0);
   CHECK(rdatabase->pDb, rc);
   return Qtrue;
 }
@@ -109,8 +333,12 @@ static VALUE unqlite_cursor_first(VALUE self)
   int rc;
 
   GetCursor2(self, rcursor, cursor);
-  Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
+  UNQLITE_RUBY_PROBE2(cursor__entry, UNQLITE_RUBY_PROBE_CURSOR_FIRST, 0L);
   rc = unqlite_kv_cursor_first_entry(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, 0);
+  UNQLITE_RUBY_PROBE2(cursor__return, UNQLITE_RUBY_PROBE_CURSOR_FIRST, rc);
   CHECK(rdatabase->pDb, rc);
   return Qtrue;
 }
@@ -129,8 +357,12 @@ static VALUE unqlite_cursor_last(VALUE self)
   int rc;
 
   GetCursor2(self, rcursor, cursor);
-  Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
+  UNQLITE_RUBY_PROBE2(cursor__entry, UNQLITE_RUBY_PROBE_CURSOR_LAST, 0L);
   rc = unqlite_kv_cursor_last_entry(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, 1);
+  UNQLITE_RUBY_PROBE2(cursor__return, UNQLITE_RUBY_PROBE_CURSOR_LAST, rc);
   CHECK(rdatabase->pDb, rc);
   return Qtrue;
 }
@@ -164,8 +396,12 @@ static VALUE unqlite_cursor_next(VALUE self)
   int rc;
 
   GetCursor2(self, rcursor, cursor);
-  Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
+  UNQLITE_RUBY_PROBE2(cursor__entry, UNQLITE_RUBY_PROBE_CURSOR_NEXT, 0L);
   rc = unqlite_kv_cursor_next_entry(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, 0);
+  UNQLITE_RUBY_PROBE2(cursor__return, UNQLITE_RUBY_PROBE_CURSOR_NEXT, rc);
   CHECK(rdatabase->pDb, rc);
   return Qtrue;
 }
@@ -184,29 +420,130 @@ static VALUE unqlite_cursor_prev(VALUE self)
   int rc;
 
   GetCursor2(self, rcursor, cursor);
-  Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
+  UNQLITE_RUBY_PROBE2(cursor__entry, UNQLITE_RUBY_PROBE_CURSOR_PREV, 0L);
   rc = unqlite_kv_cursor_prev_entry(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, 1);
+  UNQLITE_RUBY_PROBE2(cursor__return, UNQLITE_RUBY_PROBE_CURSOR_PREV, rc);
   CHECK(rdatabase->pDb, rc);
   return Qtrue;
 }
 
+/* Step _cursor_ forwards or backwards */
+static int unqlite_cursor_step(unqlite_kv_cursor *cursor, int reverse)
+{
+  int rc;
+
+  UNQLITE_RUBY_PROBE2(cursor__entry, reverse ? UNQLITE_RUBY_PROBE_CURSOR_PREV : UNQLITE_RUBY_PROBE_CURSOR_NEXT, 0L);
+  rc = reverse ? unqlite_kv_cursor_prev_entry(cursor) : unqlite_kv_cursor_next_entry(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, reverse);
+  UNQLITE_RUBY_PROBE2(cursor__return, reverse ? UNQLITE_RUBY_PROBE_CURSOR_PREV : UNQLITE_RUBY_PROBE_CURSOR_NEXT, rc);
+  return rc;
+}
+
+/* Step the cursor; false at either end of the database instead of raising */
+static VALUE unqlite_cursor_step_p(VALUE self, int reverse)
+{
+  unqliteRubyCursor* rcursor;
+  unqlite_kv_cursor* cursor;
+  unqliteRuby* rdatabase;
+  int rc;
+
+  GetCursor2(self, rcursor, cursor);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
+  rc = unqlite_cursor_step(cursor, reverse);
+  if (rc == UNQLITE_EOF || rc == UNQLITE_DONE)
+    return Qfalse;
+  CHECK(rdatabase->pDb, rc);
+  return unqlite_kv_cursor_valid_entry(cursor) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *    cursor.next -> true or false
+ *
+ * Step cursor forwards to the next entry. Returns false, instead of
+ * raising like #next!, once it moves past the last entry.
+ */
+static VALUE unqlite_cursor_next_p(VALUE self)
+{
+  return unqlite_cursor_step_p(self, 0);
+}
+
+/*
+ * call-seq:
+ *    cursor.prev -> true or false
+ *
+ * Step cursor backwards to the previous entry. Returns false, instead
+ * of raising like #prev!, once it moves past the first entry.
+ */
+static VALUE unqlite_cursor_prev_p(VALUE self)
+{
+  return unqlite_cursor_step_p(self, 1);
+}
+
 /*
  * call-seq:
  *    cursor.delete!
  *
- * Delete the entry referenced by the cursor.
+ * Delete the entry referenced by the cursor and step it forwards. Index
+ * entries and the expiry of the key are removed with it, as by
+ * Database#delete.
  */
 static VALUE unqlite_cursor_delete(VALUE self)
 {
   unqliteRubyCursor* rcursor;
   unqlite_kv_cursor* cursor;
   unqliteRuby* rdatabase;
+  volatile VALUE rkey, next = Qnil;
   int rc;
 
   GetCursor2(self, rcursor, cursor);
-  Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
-  rc = unqlite_kv_cursor_delete_entry(cursor);
+  TypedData_Get_Struct(rcursor->rb_database, unqliteRuby, &unqliteRuby_type, rdatabase);
+
+  if (!unqlite_kv_cursor_valid_entry(cursor))
+    CHECK(rdatabase->pDb, UNQLITE_EOF);
+  rkey = unqlite_cursor_key(self);
+
+  unqliteRuby_cache_invalidate(rdatabase, RSTRING_PTR(rkey), RSTRING_LEN(rkey));
+  unqliteRuby_write_begin(rdatabase);
+
+  // Step off the entry, as unqlite_kv_cursor_delete_entry does, and
+  // remember where to: the index and expiry records deleted below may be
+  // the cells that follow it
+  if (rdatabase->nindexes > 0)
+  {
+    rc = unqlite_kv_cursor_next_entry(cursor);
+    if (rc == UNQLITE_EOF || rc == UNQLITE_DONE)
+      rc = UNQLITE_OK;
+  }
+  else
+    rc = unqlite_kv_cursor_delete_entry(cursor);
+  if (rc == UNQLITE_OK)
+    rc = unqliteRuby_cursor_skip_internal(cursor, 0);
+  if (rc == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor))
+    rc = unqliteRuby_cursor_read_key(cursor, (VALUE *)&next);
   CHECK(rdatabase->pDb, rc);
+
+  if (rdatabase->nindexes > 0)
+  {
+    unqliteRuby_index_write(rdatabase, rkey, Qnil, UNQLITE_RUBY_WRITE_DELETE);
+    // Extractors may have released the cursor or closed the database
+    GetCursor2(self, rcursor, cursor);
+  }
+  unqliteRuby_order_remove(rdatabase, RSTRING_PTR(rkey), RSTRING_LEN(rkey));
+  rc = unqliteRuby_ttl_delete(rdatabase, RSTRING_PTR(rkey), RSTRING_LEN(rkey));
+  CHECK(rdatabase->pDb, rc);
+
+  // Back to the entry that followed, which the deletes may have moved
+  if (!NIL_P(next))
+  {
+    rc = unqlite_kv_cursor_seek(cursor, RSTRING_PTR(next), RSTRING_LEN(next), UNQLITE_CURSOR_MATCH_EXACT);
+    if (rc != UNQLITE_NOTFOUND)
+      CHECK(rdatabase->pDb, rc);
+  }
   return Qtrue;
 }
 
@@ -234,7 +571,11 @@ static VALUE unqlite_cursor_seek(int argc, VALUE* argv, VALUE self)
   rb_scan_args(argc, argv, "11", &key, &direction);
   if (NIL_P(direction))
     direction = INT2NUM(0);
+  UNQLITE_RUBY_PROBE2(cursor__entry, UNQLITE_RUBY_PROBE_CURSOR_SEEK, RSTRING_LEN(key));
   rc = unqlite_kv_cursor_seek(cursor, RSTRING_PTR(key), RSTRING_LEN(key), NUM2INT(direction));
+  if (rc == UNQLITE_OK && NUM2INT(direction) != UNQLITE_CURSOR_MATCH_EXACT)
+    rc = unqliteRuby_cursor_skip_internal(cursor, NUM2INT(direction) == UNQLITE_CURSOR_MATCH_LE);
+  UNQLITE_RUBY_PROBE2(cursor__return, UNQLITE_RUBY_PROBE_CURSOR_SEEK, rc);
   CHECK(0, rc);
   return Qtrue;
 }
@@ -250,16 +591,11 @@ static VALUE unqlite_cursor_key(VALUE self)
   unqliteRubyCursor* rcursor;
   unqlite_kv_cursor* cursor;
   int rc;
-  volatile VALUE rkey;
-  int key_size;
+  VALUE rkey;
 
   GetCursor2(self, rcursor, cursor);
-  rc = unqlite_kv_cursor_key(cursor, NULL, &key_size);
-  CHECK(0, rc);
-  rkey = rb_str_buf_new(key_size);
-  rc = unqlite_kv_cursor_key(cursor, RSTRING_PTR(rkey), &key_size);
+  rc = unqliteRuby_cursor_read_key(cursor, &rkey);
   CHECK(0, rc);
-  rb_str_set_len(rkey, key_size);
   return rkey;
 }
 
@@ -275,19 +611,120 @@ static VALUE unqlite_cursor_value(VALUE self)
   unqliteRubyCursor* rcursor;
   unqlite_kv_cursor* cursor;
   int rc;
-  volatile VALUE rvalue;
-  unqlite_int64 data_size;
+  VALUE rvalue;
 
   GetCursor2(self, rcursor, cursor);
-  rc = unqlite_kv_cursor_data(cursor, NULL, &data_size);
-  CHECK(0, rc);
-  rvalue = rb_str_buf_new(data_size);
-  rc = unqlite_kv_cursor_data(cursor, RSTRING_PTR(rvalue), &data_size);
+  rc = unqliteRuby_cursor_read_data(cursor, &rvalue);
   CHECK(0, rc);
-  rb_str_set_len(rvalue, data_size);
   return rvalue;
 }
 
+/* Read the entry under the cursor and step it; returns the [key, value] pair or nil */
+static VALUE unqlite_cursor_pair_and_step(VALUE self, int reverse)
+{
+  unqliteRubyCursor* rcursor;
+  unqlite_kv_cursor* cursor;
+  int rc;
+  VALUE rkey, rvalue;
+
+  GetCursor2(self, rcursor, cursor);
+
+  if (!unqlite_kv_cursor_valid_entry(cursor))
+    return Qnil;
+
+  rc = unqliteRuby_cursor_read_key(cursor, &rkey);
+  CHECK(0, rc);
+  rc = unqliteRuby_cursor_read_data(cursor, &rvalue);
+  CHECK(0, rc);
+
+  rc = unqlite_cursor_step(cursor, reverse);
+  CHECK(0, rc);
+
+  return rb_assoc_new(rkey, rvalue);
+}
+
+/*
+ * call-seq:
+ *    cursor.next_pair -> [key, value] or nil
+ *
+ * Returns the entry pointed to by the cursor and steps it forwards.
+ * Returns nil once the cursor is past the last entry.
+ */
+static VALUE unqlite_cursor_next_pair(VALUE self)
+{
+  return unqlite_cursor_pair_and_step(self, 0);
+}
+
+/*
+ * call-seq:
+ *    cursor.prev_pair -> [key, value] or nil
+ *
+ * Returns the entry pointed to by the cursor and steps it backwards.
+ * Returns nil once the cursor is before the first entry.
+ */
+static VALUE unqlite_cursor_prev_pair(VALUE self)
+{
+  return unqlite_cursor_pair_and_step(self, 1);
+}
+
+/*
+ * call-seq:
+ *    cursor.read(n, keys_only: false, reverse: false) -> array
+ *
+ * Reads up to _n_ entries starting at the one pointed to by the cursor,
+ * stepping forwards (or backwards if _reverse_ is true). Returns an
+ * array of [key, value] pairs, or of keys if _keys_only_ is true. The
+ * array is shorter than _n_ when the cursor runs out of entries.
+ */
+static VALUE unqlite_cursor_read(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyCursor* rcursor;
+  unqlite_kv_cursor* cursor;
+  int rc = UNQLITE_OK, keys_only = 0, reverse = 0;
+  long i, n;
+  VALUE vn, opts, rkey, rvalue;
+  VALUE kwargs[2];
+  ID kwnames[2];
+  volatile VALUE result;
+
+  rb_scan_args(argc, argv, "1:", &vn, &opts);
+  n = NUM2LONG(vn);
+  if (n < 0)
+    rb_raise(rb_eArgError, "negative count");
+
+  kwnames[0] = rb_intern("keys_only");
+  kwnames[1] = rb_intern("reverse");
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 2, kwargs);
+  if (kwargs[0] != Qundef) keys_only = RTEST(kwargs[0]);
+  if (kwargs[1] != Qundef) reverse = RTEST(kwargs[1]);
+
+  GetCursor2(self, rcursor, cursor);
+
+  result = rb_ary_new2(n < 1024 ? n : 1024);
+  for (i = 0; i < n && unqlite_kv_cursor_valid_entry(cursor); i++)
+  {
+    rc = unqliteRuby_cursor_read_key(cursor, &rkey);
+    if (rc != UNQLITE_OK) break;
+
+    if (keys_only)
+      rb_ary_push(result, rkey);
+    else
+    {
+      rc = unqliteRuby_cursor_read_data(cursor, &rvalue);
+      if (rc != UNQLITE_OK) break;
+      rb_ary_push(result, rb_assoc_new(rkey, rvalue));
+    }
+
+    rc = unqlite_cursor_step(cursor, reverse);
+    if (rc != UNQLITE_OK) break;
+  }
+  CHECK(0, rc);
+
+  return result;
+}
+
 /*
  * call-seq:
  *   cursor.release
@@ -299,19 +736,11 @@ VALUE unqlite_cursor_release(VALUE self)
 {
   unqliteRubyCursor* rcursor;
   unqlite_kv_cursor* cursor;
-  int rc;
 
   GetCursor2(self, rcursor, cursor);
 
-  if (rcursor->cursor) {
-    unqliteRubyPtr rdatabase;
-    Data_Get_Struct(rcursor->rb_database, unqliteRuby, rdatabase);
-    rc = unqlite_kv_cursor_release(rdatabase->pDb, rcursor->cursor);
-    CHECK(0, rc);
-    rcursor->cursor = NULL;
-    rcursor->rb_database = Qnil;
-    rb_ary_delete(rdatabase->acursors, self);
-  }
+  unqlite_cursor_detach(rcursor);
+  rcursor->rb_database = Qnil;
 
   return Qtrue;
 }
@@ -332,8 +761,13 @@ void Init_unqlite_cursor()
   rb_define_method(cUnQLiteCursor, "valid?", unqlite_cursor_valid, 0);
   rb_define_method(cUnQLiteCursor, "next!", unqlite_cursor_next, 0);
   rb_define_method(cUnQLiteCursor, "prev!", unqlite_cursor_prev, 0);
+  rb_define_method(cUnQLiteCursor, "next", unqlite_cursor_next_p, 0);
+  rb_define_method(cUnQLiteCursor, "prev", unqlite_cursor_prev_p, 0);
   rb_define_method(cUnQLiteCursor, "key", unqlite_cursor_key, 0);
   rb_define_method(cUnQLiteCursor, "value", unqlite_cursor_value, 0);
   rb_define_method(cUnQLiteCursor, "data", unqlite_cursor_value, 0);
   rb_define_method(cUnQLiteCursor, "delete!", unqlite_cursor_delete, 0);
+  rb_define_method(cUnQLiteCursor, "next_pair", unqlite_cursor_next_pair, 0);
+  rb_define_method(cUnQLiteCursor, "prev_pair", unqlite_cursor_prev_pair, 0);
+  rb_define_method(cUnQLiteCursor, "read", unqlite_cursor_read, -1);
 }
@@ -3,13 +3,27 @@
 
 #include <unqlite_ruby.h>
 
+struct _unqliteRuby;
+
 void Init_unqlite_cursor();
 VALUE unqlite_cursor_release(VALUE self);
+int unqliteRuby_cursor_read_key(unqlite_kv_cursor *cursor, VALUE *out);
+int unqliteRuby_cursor_read_data(unqlite_kv_cursor *cursor, VALUE *out);
+int unqliteRuby_cursor_read_interned_key(unqlite_kv_cursor *cursor, VALUE buf, VALUE *out);
+int unqliteRuby_cursor_internal(unqlite_kv_cursor *cursor);
+int unqliteRuby_cursor_skip_internal(unqlite_kv_cursor *cursor, int reverse);
+int unqliteRuby_cursor_acquire(struct _unqliteRuby *ctx, unqlite_kv_cursor **out);
+void unqliteRuby_cursor_recycle(struct _unqliteRuby *ctx, unqlite_kv_cursor *cursor);
+void unqliteRuby_cursors_close(struct _unqliteRuby *ctx);
+void unqliteRuby_cursors_abandon(struct _unqliteRuby *ctx);
 
-typedef struct
+typedef struct _unqliteRubyCursor
 {
   unqlite_kv_cursor* cursor;
   VALUE rb_database;
+  struct _unqliteRuby *ctx;        /* owning handle, NULL once detached */
+  struct _unqliteRubyCursor *prev; /* open cursors of the same handle */
+  struct _unqliteRubyCursor *next;
 } unqliteRubyCursor;
 
 #endif /* _unqlite_cursor_h */
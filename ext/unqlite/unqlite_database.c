@@ -1,71 +1,175 @@
 #include <unqlite_database.h>
 #include <unqlite_cursor.h>
+#include <ruby/util.h>
+#include <sys/stat.h>
 
-VALUE cUnQLiteDatabase;
-
-/* Get database context pointer from Ruby object */
-#define GetDatabase(obj, databasep) {                 \
-    Data_Get_Struct((obj), unqliteRuby, (databasep)); \
-    if ((databasep) == 0) closed_database();          \
-    if ((databasep)->pDb == 0) closed_database();     \
-  }
+/*
+ * unqlite's pager does not report the memory its page cache holds. It
+ * is estimated as the part of the database file that max_page_cache
+ * pages of this size can hold, assuming this many pages until
+ * Database#max_page_cache= sets it.
+ */
+#define UNQLITE_RUBY_PAGE_SIZE          4096
+#define UNQLITE_RUBY_PAGE_CACHE_DEFAULT 1024
 
-/* Get database context pointer and native unqlite pointer from Ruby object */
-#define GetDatabase2(obj, databasep, database) { \
-    GetDatabase((obj), (databasep));             \
-    (database) = (databasep)->pDb;               \
-  }
+VALUE cUnQLiteDatabase;
 
 /* Raise error for already closed database */
-static void closed_database()
+void closed_database()
 {
   rb_raise(rb_eRuntimeError, "Closed database");
 }
 
-static void unqliteRuby_close(unqliteRubyPtr ctx)
+/* Raise error for a database being compacted, or used by a native call that must not be re-entered */
+void busy_database(unqliteRubyPtr ctx)
 {
-  if (ctx->pDb)
+  rb_raise(rb_path2class("UnQLite::BusyException"),
+           ctx->compacting ? "Database is being compacted" : "Database is in use by another call");
+}
+
+/*
+ * Refresh the page cache estimate of _ctx_ (see UNQLITE_RUBY_PAGE_SIZE)
+ * and report the difference to the GC, so large handles count towards
+ * its malloc pressure.
+ */
+void unqliteRuby_page_cache_account(unqliteRubyPtr ctx)
+{
+  struct stat st;
+  size_t bytes = 0, budget;
+
+  if (ctx->pDb && ctx->path && !(ctx->flags & (UNQLITE_OPEN_IN_MEMORY | UNQLITE_OPEN_TEMP_DB)) &&
+      strcmp(ctx->path, ":mem:") != 0 && stat(ctx->path, &st) == 0)
   {
-    VALUE cur;
-    int rc;
+    budget = (size_t)(ctx->max_page_cache > 0 ? ctx->max_page_cache : UNQLITE_RUBY_PAGE_CACHE_DEFAULT) * UNQLITE_RUBY_PAGE_SIZE;
+    bytes = (size_t)st.st_size < budget ? (size_t)st.st_size : budget;
+  }
+
+  if (bytes != ctx->page_cache_bytes)
+  {
+    rb_gc_adjust_memory_usage((ssize_t)bytes - (ssize_t)ctx->page_cache_bytes);
+    ctx->page_cache_bytes = bytes;
+  }
+}
+
+/* Close the handle of _ctx_; never raises, as the GC calls it too */
+static int unqliteRuby_close(unqliteRubyPtr ctx)
+{
+  int rc = UNQLITE_OK;
 
+  if (ctx->pDb)
+  {
     /* close lingering cursors */
-    if (!NIL_P(ctx->acursors) && RARRAY_LEN(ctx->acursors) > 0) {
-      while ((cur = rb_ary_pop(ctx->acursors)) != Qnil)
-        unqlite_cursor_release(cur);
-    }
+    unqliteRuby_cursors_close(ctx);
+
+    unqliteRuby_bloom_close(ctx);
+    unqliteRuby_cache_free(ctx);
+    unqliteRuby_ttl_free(ctx);
+    unqliteRuby_jx9_close(ctx);
+    unqliteRuby_order_free(ctx);
 
     // Close database
     rc = unqlite_close(ctx->pDb);
-
-    // Check for errors
-    CHECK(ctx->pDb, rc);
   }
 
   ctx->pDb = 0;
+  unqliteRuby_handle_unlink(ctx);
+  unqliteRuby_page_cache_account(ctx);
+  return rc;
 }
 
 /* Wrapped object: mark */
-static void unqlite_database_mark(unqliteRubyPtr rdatabase)
+static void unqlite_database_mark(void *ptr)
 {
-  rb_gc_mark(rdatabase->acursors);
+  unqliteRubyPtr rdatabase = (unqliteRubyPtr)ptr;
+  unqliteRuby_index_mark(rdatabase);
+  unqliteRuby_cache_mark(rdatabase);
+  unqliteRuby_ttl_mark(rdatabase);
+  unqliteRuby_jx9_mark(rdatabase);
 }
 
 /* Wrapped object: deallocate */
-static void unqlite_database_deallocate(unqliteRubyPtr c)
+static void unqlite_database_deallocate(void *ptr)
 {
+  unqliteRubyPtr c = (unqliteRubyPtr)ptr;
   unqliteRuby_close(c);
+  unqliteRuby_index_free(c);
+  unqliteRuby_jx9_free(c);
+  xfree(c->path);
   xfree(c);
 }
 
+/* Wrapped object: native memory, including the estimated page cache */
+static size_t unqlite_database_memsize(const void *ptr)
+{
+  const unqliteRuby *ctx = (const unqliteRuby *)ptr;
+  size_t size = sizeof(unqliteRuby) + ctx->page_cache_bytes;
+
+  if (ctx->path)
+    size += strlen(ctx->path) + 1;
+  size += unqliteRuby_index_memsize(ctx);
+  size += unqliteRuby_bloom_memsize(ctx);
+  size += unqliteRuby_cache_memsize(ctx);
+  size += unqliteRuby_ttl_memsize(ctx);
+  size += unqliteRuby_jx9_memsize(ctx);
+  size += unqliteRuby_order_memsize(ctx);
+  return size;
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+/* Wrapped object: reload references moved by GC compaction */
+static void unqlite_database_compact(void *ptr)
+{
+  unqliteRubyPtr ctx = (unqliteRubyPtr)ptr;
+  UNQLITE_RUBY_MOVE(ctx->self);
+  unqliteRuby_index_compact(ctx);
+  unqliteRuby_cache_compact(ctx);
+  unqliteRuby_ttl_compact(ctx);
+  unqliteRuby_jx9_compact(ctx);
+}
+#endif
+
+const rb_data_type_t unqliteRuby_type = {
+  "UnQLite::Database",
+  {
+    unqlite_database_mark,
+    unqlite_database_deallocate,
+    unqlite_database_memsize,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    unqlite_database_compact,
+#endif
+  },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
 /* Wrapped object: allocate */
 static VALUE unqlite_database_allocate(VALUE klass)
 {
-  unqliteRubyPtr ctx = ALLOC(unqliteRuby);
-  volatile VALUE rb_database;
+  unqliteRubyPtr ctx;
+  volatile VALUE rb_database = TypedData_Make_Struct(klass, unqliteRuby, &unqliteRuby_type, ctx);
+  ctx->self = rb_database;
   ctx->pDb = NULL;
-  ctx->acursors = Qnil;
-  rb_database = Data_Wrap_Struct(klass, unqlite_database_mark, unqlite_database_deallocate, ctx);
+  ctx->path = NULL;
+  ctx->flags = 0;
+  ctx->cursors = NULL;
+  ctx->ncursor_pool = 0;
+  ctx->ncursors_out = 0;
+  ctx->pending = 0;
+  ctx->transactions = 0;
+  ctx->in_transaction = 0;
+  ctx->compacting = 0;
+  ctx->busy = 0;
+  ctx->indexes = NULL;
+  ctx->nindexes = 0;
+  ctx->bloom = NULL;
+  ctx->cache = NULL;
+  ctx->ttl = NULL;
+  ctx->jx9 = NULL;
+  ctx->order = NULL;
+  ctx->page_cache_bytes = 0;
+  ctx->max_page_cache = 0;
+  ctx->no_auto_commit = 0;
+  ctx->prev = ctx->next = NULL;
   return rb_database;
 }
 
@@ -107,16 +211,23 @@ static VALUE initialize(int argc, VALUE* argv, VALUE self)
   // Ensure the given argument is a ruby string
   Check_Type(filename, T_STRING);
 
-  Data_Get_Struct(self, unqliteRuby, ctx);
+  TypedData_Get_Struct(self, unqliteRuby, &unqliteRuby_type, ctx);
 
   // Open database
   rc = unqlite_open(&ctx->pDb, StringValueCStr(filename), flags);
 
-  ctx->acursors = rb_ary_new();
-
   // Check if any exception should be raised
   CHECK(ctx->pDb, rc);
 
+  // Remember how it was opened, for the read-only handles of parallel_scan
+  xfree(ctx->path);
+  ctx->path = ruby_strdup(StringValueCStr(filename));
+  ctx->flags = flags;
+
+  unqliteRuby_ttl_open(ctx);
+  unqliteRuby_page_cache_account(ctx);
+  unqliteRuby_handle_link(ctx);
+
   return self;
 }
 
@@ -131,9 +242,12 @@ static VALUE unqlite_database_close(VALUE self)
   unqliteRubyPtr ctx;
 
   // Get class context
-  Data_Get_Struct(self, unqliteRuby, ctx);
+  TypedData_Get_Struct(self, unqliteRuby, &unqliteRuby_type, ctx);
 
-  unqliteRuby_close(ctx);
+  if (ctx->compacting || ctx->busy)
+    busy_database(ctx);
+
+  CHECK(0, unqliteRuby_close(ctx));
   return Qtrue;
 }
 
@@ -148,7 +262,7 @@ static VALUE unqlite_database_closed(VALUE self)
   unqliteRubyPtr ctx;
   unqlite* db;
 
-  Data_Get_Struct(self, unqliteRuby, ctx);
+  TypedData_Get_Struct(self, unqliteRuby, &unqliteRuby_type, ctx);
   db = ctx->pDb;
 
   if (db)
@@ -194,30 +308,90 @@ static VALUE unqlite_database_open(int argc, VALUE* argv, VALUE klass)
 }
 
 
+/* Store _value_ under _key_; _ttl_ is the seconds before it expires, or nil */
+static void unqliteRuby_store(unqliteRubyPtr ctx, VALUE key, VALUE value, VALUE ttl)
+{
+  int rc = UNQLITE_OK;
+  unqlite* db = ctx->pDb;
+
+  UNQLITE_RUBY_PROBE2(store__entry, RSTRING_LEN(key), RSTRING_LEN(value));
+
+  unqliteRuby_bloom_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_cache_invalidate(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_write_begin(ctx);
+
+  if (ctx->nindexes > 0)
+    unqliteRuby_index_write(ctx, key, value, UNQLITE_RUBY_WRITE_STORE);
+  else
+  {
+    // Store it
+    rc = unqlite_kv_store(db, StringValuePtr(key), RSTRING_LEN(key), StringValuePtr(value), RSTRING_LEN(value));
+  }
+
+  UNQLITE_RUBY_PROBE3(store__return, RSTRING_LEN(key), RSTRING_LEN(value), rc);
+
+  // Check for errors
+  CHECK(db, rc);
+
+  unqliteRuby_order_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_ttl_write(ctx, key, ttl);
+}
+
 /*
  * call-seq:
  *    database.store key, value
+ *    database.store key, value, ttl: seconds
+ *
+ * Associates the value _value_ with the specified _key_. With _ttl_,
+ * the key expires after that many seconds: reads no longer find it,
+ * and the sweeper started by #enable_expiry deletes it. Storing a key
+ * without _ttl_ removes its expiry.
+ */
+static VALUE unqlite_database_store(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  VALUE key, value, opts;
+  VALUE kwargs[1];
+  ID kwnames[1];
+
+  rb_scan_args(argc, argv, "2:", &key, &value, &opts);
+
+  kwnames[0] = rb_intern("ttl");
+  kwargs[0] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 1, kwargs);
+
+  // Ensure the given argument is a ruby string
+  Check_Type(key, T_STRING);
+  Check_Type(value, T_STRING);
+  if (kwargs[0] == Qundef)
+    kwargs[0] = Qnil;
+  unqliteRuby_ttl_check(kwargs[0]);
+
+  GetDatabase(self, ctx);
+
+  unqliteRuby_store(ctx, key, value, kwargs[0]);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
  *    database[key] = value
  *
  * Associates the value _value_ with the specified _key_.
  */
-static VALUE unqlite_database_store(VALUE self, VALUE key, VALUE value)
+static VALUE unqlite_database_aset(VALUE self, VALUE key, VALUE value)
 {
-  int rc;
   unqliteRubyPtr ctx;
-  unqlite* db;
 
   // Ensure the given argument is a ruby string
   Check_Type(key, T_STRING);
   Check_Type(value, T_STRING);
 
-  GetDatabase2(self, ctx, db);
+  GetDatabase(self, ctx);
 
-  // Store it
-  rc = unqlite_kv_store(db, StringValuePtr(key), RSTRING_LEN(key), StringValuePtr(value), RSTRING_LEN(value));
-
-  // Check for errors
-  CHECK(db, rc);
+  unqliteRuby_store(ctx, key, value, Qnil);
 
   return Qtrue;
 }
@@ -227,6 +401,7 @@ static VALUE unqlite_database_store(VALUE self, VALUE key, VALUE value)
  *     database.append key, value
  *
  * Appends the _value_ to an already existing value associated with _key_.
+ * The expiry of _key_, if any, is kept; an expired _key_ is replaced.
  */
 static VALUE unqlite_database_append(VALUE self, VALUE key, VALUE value)
 {
@@ -240,12 +415,26 @@ static VALUE unqlite_database_append(VALUE self, VALUE key, VALUE value)
 
   GetDatabase2(self, ctx, db);
 
+  unqliteRuby_bloom_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_cache_invalidate(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_write_begin(ctx);
+  unqliteRuby_ttl_purge(ctx, key);
+
+  if (ctx->nindexes > 0)
+  {
+    unqliteRuby_index_write(ctx, key, value, UNQLITE_RUBY_WRITE_APPEND);
+    unqliteRuby_order_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+    return Qtrue;
+  }
+
   // Append it
   rc = unqlite_kv_append(db, StringValuePtr(key), RSTRING_LEN(key), StringValuePtr(value), RSTRING_LEN(value));
 
   // Check for errors
   CHECK(db, rc);
 
+  unqliteRuby_order_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+
   return Qtrue;
 }
 
@@ -266,38 +455,102 @@ static VALUE unqlite_database_delete(VALUE self, VALUE key)
 
   GetDatabase2(self, ctx, db);
 
-  // Delete it
-  rc = unqlite_kv_delete(db, StringValuePtr(key), RSTRING_LEN(key));
+  unqliteRuby_cache_invalidate(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_write_begin(ctx);
 
-  // Check for errors
+  if (ctx->nindexes > 0)
+    unqliteRuby_index_write(ctx, key, Qnil, UNQLITE_RUBY_WRITE_DELETE);
+  else
+  {
+    // Delete it
+    rc = unqlite_kv_delete(db, StringValuePtr(key), RSTRING_LEN(key));
+
+    // Check for errors
+    CHECK(db, rc);
+  }
+
+  unqliteRuby_order_remove(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+
+  rc = unqliteRuby_ttl_delete(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
   CHECK(db, rc);
 
   return Qtrue;
 }
 
+/* Value of fetch for a missing key: the block's, the default, or an exception */
+static VALUE unqliteRuby_fetch_missing(int argc, VALUE key, VALUE ifnone)
+{
+  if (rb_block_given_p())
+    return rb_yield(key);
+  if (argc > 1)
+    return ifnone;
+  CHECK(0, UNQLITE_NOTFOUND);
+  return Qnil;
+}
+
 /*
  * call-seq:
  *    database.fetch(key) -> value
+ *    database.fetch(key, default) -> value
+ *    database.fetch(key) { |key| ... } -> value
  *
  * Retrieves the _value_ corresponding to _key_. If there is no value
- * associated with _key_, an exception will be raised.
+ * associated with _key_, returns the result of the block or _default_,
+ * like Hash#fetch; without either an exception will be raised. Misses
+ * answered with a default raise nothing, so they are as cheap as hits.
  */
-static VALUE unqlite_database_fetch(VALUE self, VALUE collection_name)
+static VALUE unqlite_database_fetch(int argc, VALUE* argv, VALUE self)
 {
   unqlite_int64 n_bytes;
   int rc;
   unqliteRubyPtr ctx;
   unqlite* db;
+  VALUE collection_name, ifnone;
   volatile VALUE filename;
 
+  rb_scan_args(argc, argv, "11", &collection_name, &ifnone);
+
   // Ensure the given argument is a ruby string
   Check_Type(collection_name, T_STRING);
 
   GetDatabase2(self, ctx, db);
 
+  UNQLITE_RUBY_PROBE1(fetch__entry, RSTRING_LEN(collection_name));
+
+  // Expired but not swept yet?
+  if (unqliteRuby_ttl_expired(ctx, RSTRING_PTR(collection_name), RSTRING_LEN(collection_name)))
+  {
+    UNQLITE_RUBY_PROBE3(fetch__return, RSTRING_LEN(collection_name), -1L, UNQLITE_NOTFOUND);
+    return unqliteRuby_fetch_missing(argc, collection_name, ifnone);
+  }
+
+  // Served from the object cache?
+  filename = unqliteRuby_cache_get(ctx, collection_name);
+  if (filename != Qundef)
+  {
+    UNQLITE_RUBY_PROBE3(fetch__return, RSTRING_LEN(collection_name), RSTRING_LEN(filename), UNQLITE_OK);
+    return filename;
+  }
+
+  // Definitely missing according to the Bloom filter?
+  if (!unqliteRuby_bloom_check(ctx, RSTRING_PTR(collection_name), RSTRING_LEN(collection_name)))
+  {
+    UNQLITE_RUBY_PROBE3(fetch__return, RSTRING_LEN(collection_name), -1L, UNQLITE_NOTFOUND);
+    return unqliteRuby_fetch_missing(argc, collection_name, ifnone);
+  }
+
   // Extract the data size, check for errors and return if any
   rc = unqlite_kv_fetch(db, StringValuePtr(collection_name), RSTRING_LEN(collection_name), NULL, &n_bytes);
 
+  if (rc == UNQLITE_NOTFOUND)
+  {
+    UNQLITE_RUBY_PROBE3(fetch__return, RSTRING_LEN(collection_name), -1L, rc);
+    unqliteRuby_bloom_miss(ctx);
+    return unqliteRuby_fetch_missing(argc, collection_name, ifnone);
+  }
+
+  if (rc != UNQLITE_OK)
+    UNQLITE_RUBY_PROBE3(fetch__return, RSTRING_LEN(collection_name), -1L, rc);
   CHECK(db, rc);
   if( rc != UNQLITE_OK ) { return Qnil; }
 
@@ -306,11 +559,12 @@ static VALUE unqlite_database_fetch(VALUE self, VALUE collection_name)
 
   // Now, fetch the data
   rc = unqlite_kv_fetch(db, StringValuePtr(collection_name), RSTRING_LEN(collection_name), RSTRING_PTR(filename), &n_bytes);
+  UNQLITE_RUBY_PROBE3(fetch__return, RSTRING_LEN(collection_name), rc == UNQLITE_OK ? (long)n_bytes : -1L, rc);
   CHECK(db, rc);
 
   rb_str_set_len(filename, n_bytes);
 
-  return filename;
+  return unqliteRuby_cache_put(ctx, collection_name, filename);
 }
 
 /*
@@ -335,10 +589,19 @@ static VALUE unqlite_database_has_key(VALUE self, VALUE collection_name)
 
   GetDatabase2(self, ctx, db);
 
+  // Definitely missing according to the Bloom filter?
+  if (!unqliteRuby_bloom_check(ctx, RSTRING_PTR(collection_name), RSTRING_LEN(collection_name)))
+    return Qfalse;
+
+  // Expired but not swept yet?
+  if (unqliteRuby_ttl_expired(ctx, RSTRING_PTR(collection_name), RSTRING_LEN(collection_name)))
+    return Qfalse;
+
   // Extract the data size, check for errors and return if any
   rc = unqlite_kv_fetch(db, StringValuePtr(collection_name), RSTRING_LEN(collection_name), NULL, &n_bytes);
   if (rc == UNQLITE_NOTFOUND)
   {
+     unqliteRuby_bloom_miss(ctx);
      return Qfalse;
   }
   else
@@ -368,11 +631,27 @@ static VALUE unqlite_database_aref(VALUE self, VALUE collection_name)
 
   GetDatabase2(self, ctx, db);
 
+  // Expired but not swept yet?
+  if (unqliteRuby_ttl_expired(ctx, RSTRING_PTR(collection_name), RSTRING_LEN(collection_name)))
+    return Qnil;
+
+  // Served from the object cache?
+  rb_string = unqliteRuby_cache_get(ctx, collection_name);
+  if (rb_string != Qundef)
+    return rb_string;
+
+  // Definitely missing according to the Bloom filter?
+  if (!unqliteRuby_bloom_check(ctx, RSTRING_PTR(collection_name), RSTRING_LEN(collection_name)))
+    return Qnil;
+
   // Extract the data size, check for errors and return if any
   rc = unqlite_kv_fetch(db, StringValuePtr(collection_name), RSTRING_LEN(collection_name), NULL, &n_bytes);
 
   if (rc == UNQLITE_NOTFOUND)
+  {
+     unqliteRuby_bloom_miss(ctx);
      return Qnil;
+  }
 
   CHECK(db, rc);
   if( rc != UNQLITE_OK ) { return Qnil; }
@@ -386,7 +665,7 @@ static VALUE unqlite_database_aref(VALUE self, VALUE collection_name)
 
   rb_str_set_len(rb_string, n_bytes);
 
-  return rb_string;
+  return unqliteRuby_cache_put(ctx, collection_name, rb_string);
 }
 
 /*
@@ -410,6 +689,9 @@ static VALUE unqlite_database_begin_transaction(VALUE self)
   // Check for errors
   CHECK(db, rc);
 
+  unqliteRuby_write_begin(ctx);
+  ctx->in_transaction = 1;
+
   return Qtrue;
 }
 
@@ -428,11 +710,17 @@ static VALUE unqlite_database_commit(VALUE self)
   GetDatabase2(self, ctx, db);
 
   // Commit transaction
+  UNQLITE_RUBY_PROBE0(commit__entry);
   rc = unqlite_commit(db);
+  UNQLITE_RUBY_PROBE1(commit__return, rc);
 
   // Check for errors
   CHECK(db, rc);
 
+  ctx->pending = 0;
+  ctx->in_transaction = 0;
+  unqliteRuby_page_cache_account(ctx);
+
   return Qtrue;
 }
 
@@ -451,7 +739,9 @@ static VALUE unqlite_database_rollback(VALUE self)
   GetDatabase2(self, ctx, db);
 
   // Rollback transaction
-  rc = unqlite_rollback(db);
+  UNQLITE_RUBY_PROBE0(rollback__entry);
+  rc = unqliteRuby_rollback(ctx);
+  UNQLITE_RUBY_PROBE1(rollback__return, rc);
 
   // Check for errors
   CHECK(db, rc);
@@ -507,151 +797,390 @@ static VALUE unqlite_database_transaction(VALUE self)
   return Qtrue;
 }
 
+/* Fetch the value of _key_ into a new Ruby String, or nil if missing */
+VALUE unqliteRuby_fetch(unqlite *db, VALUE key)
+{
+  unqlite_int64 n_bytes;
+  int rc;
+  volatile VALUE rb_string;
+
+  rc = unqlite_kv_fetch(db, RSTRING_PTR(key), RSTRING_LEN(key), NULL, &n_bytes);
+  if (rc == UNQLITE_NOTFOUND)
+    return Qnil;
+  CHECK(db, rc);
+
+  rb_string = rb_str_buf_new(n_bytes);
+  rc = unqlite_kv_fetch(db, RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(rb_string), &n_bytes);
+  CHECK(db, rc);
+  rb_str_set_len(rb_string, n_bytes);
+
+  return rb_string;
+}
+
 /*
- * call-seq:
- *    database.each { |key, value|  ... }
- *    database.each_pair { |key, value|  ... }
- *
- * Executes _block_ for each key in the database, passing the _key_
- * and the corresponding _value_ as parameters.
+ * Note that _ctx_ is about to write. The first write of a transaction
+ * bumps the index generation (see unqliteRuby_index_touch).
  */
-static VALUE unqlite_database_each(VALUE self)
+void unqliteRuby_write_begin(unqliteRubyPtr ctx)
 {
   int rc;
-  unqliteRubyPtr ctx;
-  unqlite* db;
-  unqlite_kv_cursor *cursor;
 
-  GetDatabase2(self, ctx, db);
+  if (ctx->pending)
+    return;
 
-  rc = unqlite_kv_cursor_init(db, &cursor);
-  CHECK(db, rc);
+  rc = unqliteRuby_index_touch(ctx);
+  CHECK(ctx->pDb, rc);
+  ctx->pending = 1;
+  ctx->transactions++;
+}
 
-  rc = unqlite_kv_cursor_first_entry(cursor);
-  while (unqlite_kv_cursor_valid_entry(cursor))
+/* Rollback the current transaction, dropping cached values it may have touched */
+int unqliteRuby_rollback(unqliteRubyPtr ctx)
+{
+  unqliteRuby_cache_clear(ctx);
+  unqliteRuby_order_invalidate(ctx);
+  ctx->pending = 0;
+  ctx->in_transaction = 0;
+  return unqlite_rollback(ctx->pDb);
+}
+
+/*
+ * Rollback the transaction opened by a compound operation and raise. A
+ * transaction begun by the caller is left for the caller to end.
+ */
+static void unqliteRuby_abort(unqliteRubyPtr ctx, int rc)
+{
+  if (!ctx->in_transaction)
+    unqliteRuby_rollback(ctx);
+  CHECK(ctx->pDb, rc);
+}
+
+/*
+ * Swap the value of _key_ from _expected_ to _value_ inside a single
+ * write-transaction, or inside the one begun by begin_transaction. nil
+ * as _expected_ means "key must be missing" and nil as _value_ removes
+ * the key. Returns 1 if the swap happened.
+ */
+static int unqliteRuby_compare_and_set(unqliteRubyPtr ctx, VALUE key, VALUE expected, VALUE value)
+{
+  unqlite *db = ctx->pDb;
+  unqlite_int64 n_bytes;
+  int rc, matches;
+  volatile VALUE current = Qnil;
+  volatile VALUE visible;
+  volatile VALUE new_entries = Qnil;
+
+  // Run index extractors before touching anything
+  if (ctx->nindexes > 0)
+    new_entries = unqliteRuby_index_entries(ctx, key, value);
+
+  if (!ctx->in_transaction)
   {
-     int key_size;
-     unqlite_int64 data_size;
-     volatile VALUE rb_key, rb_data;
+    rc = unqlite_begin(db);
+    CHECK(db, rc);
+  }
 
-     // Create Ruby String with key
-     rc = unqlite_kv_cursor_key(cursor, NULL, &key_size);
-     CHECK(db, rc);
-     rb_key = rb_str_buf_new(key_size);
-     rc = unqlite_kv_cursor_key(cursor, RSTRING_PTR(rb_key), &key_size);
-     CHECK(db, rc);
-     rb_str_set_len(rb_key, key_size);
+  if (!ctx->pending)
+  {
+    rc = unqliteRuby_index_touch(ctx);
+    if (rc != UNQLITE_OK) unqliteRuby_abort(ctx, rc);
+  }
 
-     // Create Ruby String with data
-     rc = unqlite_kv_cursor_data(cursor, NULL, &data_size);
-     CHECK(db, rc);
-     rb_data = rb_str_buf_new(data_size);
-     rc = unqlite_kv_cursor_data(cursor, RSTRING_PTR(rb_data), &data_size);
-     CHECK(db, rc);
-     rb_str_set_len(rb_data, data_size);
+  // Read the current value without leaving the transaction
+  rc = unqlite_kv_fetch(db, RSTRING_PTR(key), RSTRING_LEN(key), NULL, &n_bytes);
+  if (rc == UNQLITE_OK)
+  {
+    current = rb_str_buf_new(n_bytes);
+    rc = unqlite_kv_fetch(db, RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(current), &n_bytes);
+    if (rc != UNQLITE_OK) unqliteRuby_abort(ctx, rc);
+    rb_str_set_len(current, n_bytes);
+  }
+  else if (rc != UNQLITE_NOTFOUND)
+    unqliteRuby_abort(ctx, rc);
 
-     // Yield to block
-     rb_yield_values(2, rb_key, rb_data);
+  // An expired value is compared as missing, but still replaced
+  visible = current;
+  if (!NIL_P(current) && unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+    visible = Qnil;
+
+  if (NIL_P(expected))
+    matches = NIL_P(visible);
+  else
+    matches = !NIL_P(visible) &&
+      RSTRING_LEN(visible) == RSTRING_LEN(expected) &&
+      memcmp(RSTRING_PTR(visible), RSTRING_PTR(expected), RSTRING_LEN(expected)) == 0;
 
-     rc = unqlite_kv_cursor_next_entry(cursor);
+  if (matches)
+  {
+    unqliteRuby_cache_invalidate(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+
+    if (NIL_P(value))
+      rc = NIL_P(current) ? UNQLITE_OK : unqlite_kv_delete(db, RSTRING_PTR(key), RSTRING_LEN(key));
+    else
+    {
+      unqliteRuby_bloom_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+      rc = unqlite_kv_store(db, RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(value), RSTRING_LEN(value));
+    }
+    if (rc != UNQLITE_OK) unqliteRuby_abort(ctx, rc);
+
+    if (ctx->nindexes > 0)
+    {
+      rc = unqliteRuby_index_apply(db, unqliteRuby_index_entries(ctx, key, current), new_entries);
+      if (rc != UNQLITE_OK) unqliteRuby_abort(ctx, rc);
+    }
+
+    // Like store without ttl:, the new value does not expire
+    rc = unqliteRuby_ttl_delete(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+    if (rc != UNQLITE_OK) unqliteRuby_abort(ctx, rc);
   }
 
-  rc = unqlite_kv_cursor_release(db, cursor);
-  CHECK(db, rc);
+  if (!ctx->in_transaction)
+  {
+    rc = unqlite_commit(db);
+    CHECK(db, rc);
+    ctx->pending = 0;
+  }
 
-  return Qtrue;
+  if (matches && NIL_P(value))
+    unqliteRuby_order_remove(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  else if (matches)
+    unqliteRuby_order_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+
+  return matches;
 }
 
 /*
  * call-seq:
- *    database.each_value { |value|  ... }
+ *     database.compare_and_set(key, expected, value) -> true or false
  *
- * Executes _block_ for each value in the database, passing the
- * _value_ as parameter.
+ * Atomically replaces the value associated with _key_ by _value_, but
+ * only if it currently equals _expected_. The read and the write happen
+ * inside a single write-transaction, which is committed, unless a
+ * transaction begun with #begin_transaction is open: then they join it
+ * and it is neither committed nor rolled back. Use nil as
+ * _expected_ to require the key to be missing and nil as _value_ to
+ * delete the key. Returns true if the swap happened, false otherwise.
+ * Expired keys count as missing, and a swapped key no longer expires.
  */
-static VALUE unqlite_database_each_value(VALUE self)
+static VALUE unqlite_database_compare_and_set(VALUE self, VALUE key, VALUE expected, VALUE value)
 {
-  int rc;
   unqliteRubyPtr ctx;
-  unqlite* db;
-  unqlite_kv_cursor *cursor;
 
-  GetDatabase2(self, ctx, db);
+  // Ensure the given arguments are ruby strings
+  Check_Type(key, T_STRING);
+  if (!NIL_P(expected)) Check_Type(expected, T_STRING);
+  if (!NIL_P(value)) Check_Type(value, T_STRING);
 
-  rc = unqlite_kv_cursor_init(db, &cursor);
-  CHECK(db, rc);
+  GetDatabase(self, ctx);
 
-  rc = unqlite_kv_cursor_first_entry(cursor);
-  while (unqlite_kv_cursor_valid_entry(cursor))
-  {
-     unqlite_int64 data_size;
-     volatile VALUE rb_data;
+  return unqliteRuby_compare_and_set(ctx, key, expected, value) ? Qtrue : Qfalse;
+}
 
-     // Create Ruby String with data
-     rc = unqlite_kv_cursor_data(cursor, NULL, &data_size);
-     CHECK(db, rc);
-     rb_data = rb_str_buf_new(data_size);
-     rc = unqlite_kv_cursor_data(cursor, RSTRING_PTR(rb_data), &data_size);
-     CHECK(db, rc);
-     rb_str_set_len(rb_data, data_size);
+/*
+ * call-seq:
+ *     database.update(key) { |old| new } -> true
+ *
+ * Replaces the value associated with _key_ by the result of _block_,
+ * which receives the current value (or nil if _key_ is missing). The
+ * write is a compare-and-set against the value given to the block; if
+ * another writer changed _key_ in between, the block is called again
+ * with the fresh value. Returning nil from _block_ removes the key.
+ */
+static VALUE unqlite_database_update(VALUE self, VALUE key)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  volatile VALUE old, value;
 
-     // Yield to block
-     rb_yield_values(1, rb_data);
+  // Ensure the given argument is a ruby string
+  Check_Type(key, T_STRING);
+  rb_need_block();
 
-     rc = unqlite_kv_cursor_next_entry(cursor);
-  }
+  do
+  {
+    GetDatabase2(self, ctx, db);
+    old = unqliteRuby_fetch(db, key);
+    if (!NIL_P(old) && unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+      old = Qnil;
 
-  rc = unqlite_kv_cursor_release(db, cursor);
-  CHECK(db, rc);
+    value = rb_yield(old);
+    if (!NIL_P(value)) Check_Type(value, T_STRING);
+
+    // The block may have closed the database or let other threads in
+    GetDatabase2(self, ctx, db);
+  } while (!unqliteRuby_compare_and_set(ctx, key, old, value));
 
   return Qtrue;
 }
 
-/*
- * call-seq:
- *    database.each_key { |key|  ... }
- *
- * Executes _block_ for each key in the database, passing the _key_
- * and as parameter.
- */
-static VALUE unqlite_database_each_key(VALUE self)
+#define UNQLITE_RUBY_EACH_PAIR  0
+#define UNQLITE_RUBY_EACH_KEY   1
+#define UNQLITE_RUBY_EACH_VALUE 2
+
+struct unqliteRuby_each_args
 {
-  int rc;
   unqliteRubyPtr ctx;
-  unqlite* db;
+  unqlite *db;
   unqlite_kv_cursor *cursor;
+  int mode;
+  int intern_keys;  /* yield deduplicated frozen keys */
+  int freeze;       /* yield frozen keys and values */
+  VALUE key_buffer; /* scratch space for interned keys */
+  long count;       /* records yielded, for the each__return probe */
+  int rc;
+};
 
-  GetDatabase2(self, ctx, db);
-
-  rc = unqlite_kv_cursor_init(db, &cursor);
-  CHECK(db, rc);
+static VALUE unqliteRuby_each_body(VALUE vargs)
+{
+  struct unqliteRuby_each_args *args = (struct unqliteRuby_each_args *)vargs;
+  int rc;
+  VALUE rb_key = Qnil, rb_data = Qnil;
 
-  rc = unqlite_kv_cursor_first_entry(cursor);
-  while (unqlite_kv_cursor_valid_entry(cursor))
+  rc = args->rc = unqlite_kv_cursor_first_entry(args->cursor);
+  while (unqlite_kv_cursor_valid_entry(args->cursor))
   {
-     int key_size;
-     volatile VALUE rb_key;
-
-     // Create Ruby String with key
-     rc = unqlite_kv_cursor_key(cursor, NULL, &key_size);
-     CHECK(db, rc);
-     rb_key = rb_str_buf_new(key_size);
-     rc = unqlite_kv_cursor_key(cursor, RSTRING_PTR(rb_key), &key_size);
-     CHECK(db, rc);
-     rb_str_set_len(rb_key, key_size);
+     // Index entries and expiry records are not the user's
+     if (unqliteRuby_cursor_internal(args->cursor))
+     {
+       rc = args->rc = unqlite_kv_cursor_next_entry(args->cursor);
+       continue;
+     }
+
+     // Create Ruby Strings with key and/or data
+     if (args->mode != UNQLITE_RUBY_EACH_VALUE)
+     {
+       if (args->intern_keys)
+         rc = unqliteRuby_cursor_read_interned_key(args->cursor, args->key_buffer, &rb_key);
+       else
+         rc = unqliteRuby_cursor_read_key(args->cursor, &rb_key);
+       CHECK(args->db, rc);
+       if (args->freeze)
+         rb_obj_freeze(rb_key);
+     }
+     if (args->mode != UNQLITE_RUBY_EACH_KEY)
+     {
+       rc = unqliteRuby_cursor_read_data(args->cursor, &rb_data);
+       CHECK(args->db, rc);
+       if (args->freeze)
+         rb_obj_freeze(rb_data);
+     }
 
      // Yield to block
-     rb_yield_values(1, rb_key);
-
-     rc = unqlite_kv_cursor_next_entry(cursor);
+     switch (args->mode)
+     {
+       case UNQLITE_RUBY_EACH_PAIR:
+         rb_yield_values(2, rb_key, rb_data);
+         break;
+       case UNQLITE_RUBY_EACH_KEY:
+         rb_yield_values(1, rb_key);
+         break;
+       default:
+         rb_yield_values(1, rb_data);
+     }
+
+     args->count++;
+
+     // The block may have closed the database
+     if (args->ctx->pDb != args->db)
+       break;
+
+     rc = args->rc = unqlite_kv_cursor_next_entry(args->cursor);
   }
 
-  rc = unqlite_kv_cursor_release(db, cursor);
-  CHECK(db, rc);
-
   return Qtrue;
 }
 
+static VALUE unqliteRuby_each_ensure(VALUE vargs)
+{
+  struct unqliteRuby_each_args *args = (struct unqliteRuby_each_args *)vargs;
+
+  UNQLITE_RUBY_PROBE3(each__return, args->mode, args->count, args->rc);
+
+  if (args->ctx->pDb == args->db)
+    unqliteRuby_cursor_recycle(args->ctx, args->cursor);
+
+  return Qnil;
+}
+
+/* Walk the database with a pooled cursor, yielding pairs, keys or values */
+static VALUE unqliteRuby_each(int argc, VALUE* argv, VALUE self, int mode)
+{
+  int rc;
+  struct unqliteRuby_each_args args;
+  VALUE opts;
+  VALUE kwargs[2];
+  ID kwnames[2];
+  volatile VALUE key_buffer = Qnil;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  kwnames[0] = rb_intern("intern_keys");
+  kwnames[1] = rb_intern("freeze");
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 2, kwargs);
+
+  args.intern_keys = kwargs[0] != Qundef && RTEST(kwargs[0]);
+  args.freeze = kwargs[1] != Qundef && RTEST(kwargs[1]);
+  if (args.intern_keys)
+    key_buffer = rb_str_buf_new(64);
+  args.key_buffer = key_buffer;
+
+  GetDatabase2(self, args.ctx, args.db);
+  args.mode = mode;
+  args.count = 0;
+  args.rc = UNQLITE_OK;
+
+  UNQLITE_RUBY_PROBE1(each__entry, mode);
+  rc = unqliteRuby_cursor_acquire(args.ctx, &args.cursor);
+  if (rc != UNQLITE_OK)
+    UNQLITE_RUBY_PROBE3(each__return, mode, 0L, rc);
+  CHECK(args.db, rc);
+
+  return rb_ensure(unqliteRuby_each_body, (VALUE)&args, unqliteRuby_each_ensure, (VALUE)&args);
+}
+
+/*
+ * call-seq:
+ *    database.each(intern_keys: false, freeze: false) { |key, value|  ... }
+ *    database.each_pair(intern_keys: false, freeze: false) { |key, value|  ... }
+ *
+ * Executes _block_ for each key in the database, passing the _key_
+ * and the corresponding _value_ as parameters.
+ *
+ * With _intern_keys_ the keys are deduplicated frozen strings (as
+ * returned by String#-@), which Hash uses as is, saving a copy and an
+ * allocation per repeated key. With _freeze_ keys and values are frozen.
+ */
+static VALUE unqlite_database_each(int argc, VALUE* argv, VALUE self)
+{
+  return unqliteRuby_each(argc, argv, self, UNQLITE_RUBY_EACH_PAIR);
+}
+
+/*
+ * call-seq:
+ *    database.each_value(freeze: false) { |value|  ... }
+ *
+ * Executes _block_ for each value in the database, passing the
+ * _value_ as parameter.
+ */
+static VALUE unqlite_database_each_value(int argc, VALUE* argv, VALUE self)
+{
+  return unqliteRuby_each(argc, argv, self, UNQLITE_RUBY_EACH_VALUE);
+}
+
+/*
+ * call-seq:
+ *    database.each_key(intern_keys: false, freeze: false) { |key|  ... }
+ *
+ * Executes _block_ for each key in the database, passing the _key_
+ * and as parameter. See #each for the options.
+ */
+static VALUE unqlite_database_each_key(int argc, VALUE* argv, VALUE self)
+{
+  return unqliteRuby_each(argc, argv, self, UNQLITE_RUBY_EACH_KEY);
+}
+
 /*
  * call-seq:
  *     database.clear
@@ -667,19 +1196,28 @@ static VALUE unqlite_database_clear(VALUE self)
 
   GetDatabase2(self, ctx, db);
 
-  rc = unqlite_kv_cursor_init(db, &cursor);
+  rc = unqliteRuby_cursor_acquire(ctx, &cursor);
   CHECK(db, rc);
+  unqliteRuby_write_begin(ctx);
 
   rc = unqlite_kv_cursor_first_entry(cursor);
   while (unqlite_kv_cursor_valid_entry(cursor))
   {
      rc = unqlite_kv_cursor_delete_entry(cursor);
-     CHECK(db, rc);
+     if (rc != UNQLITE_OK) break;
 
      rc = unqlite_kv_cursor_first_entry(cursor);
   }
 
-  rc = unqlite_kv_cursor_release(db, cursor);
+  unqliteRuby_cursor_recycle(ctx, cursor);
+  unqliteRuby_bloom_clear(ctx);
+  unqliteRuby_cache_clear(ctx);
+  unqliteRuby_ttl_clear(ctx);
+  if (rc == UNQLITE_OK)
+    unqliteRuby_order_clear(ctx);
+  else
+    unqliteRuby_order_invalidate(ctx);
+
   CHECK(db, rc);
 
   return Qtrue;
@@ -702,14 +1240,14 @@ static VALUE unqlite_database_empty(VALUE self)
 
   GetDatabase2(self, ctx, db);
 
-  rc = unqlite_kv_cursor_init(db, &cursor);
+  rc = unqliteRuby_cursor_acquire(ctx, &cursor);
   CHECK(db, rc);
 
-  rc = unqlite_kv_cursor_first_entry(cursor);
+  unqlite_kv_cursor_first_entry(cursor);
+  unqliteRuby_cursor_skip_internal(cursor, 0);
   result = unqlite_kv_cursor_valid_entry(cursor) ? Qfalse : Qtrue;
 
-  rc = unqlite_kv_cursor_release(db, cursor);
-  CHECK(db, rc);
+  unqliteRuby_cursor_recycle(ctx, cursor);
 
   return result;
 }
@@ -732,6 +1270,9 @@ static VALUE unqlite_database_set_max_page_cache(VALUE self, VALUE count)
   rc = unqlite_config(db, UNQLITE_CONFIG_MAX_PAGE_CACHE, NUM2INT(count));
   CHECK(db, rc);
 
+  ctx->max_page_cache = NUM2INT(count);
+  unqliteRuby_page_cache_account(ctx);
+
   return count;
 }
 
@@ -798,6 +1339,8 @@ static VALUE unqlite_database_disable_auto_commit(VALUE self)
   rc = unqlite_config(db, UNQLITE_CONFIG_DISABLE_AUTO_COMMIT, 0);
   CHECK(db, rc);
 
+  ctx->no_auto_commit = 1;
+
   return Qnil;
 }
 
@@ -833,14 +1376,16 @@ void Init_unqlite_database()
 
   rb_define_singleton_method(cUnQLiteDatabase, "open", unqlite_database_open, -1);
 
-  rb_define_method(cUnQLiteDatabase, "store", unqlite_database_store, 2);
+  rb_define_method(cUnQLiteDatabase, "store", unqlite_database_store, -1);
   rb_define_method(cUnQLiteDatabase, "append", unqlite_database_append, 2);
-  rb_define_method(cUnQLiteDatabase, "fetch", unqlite_database_fetch, 1);
+  rb_define_method(cUnQLiteDatabase, "fetch", unqlite_database_fetch, -1);
   rb_define_method(cUnQLiteDatabase, "delete", unqlite_database_delete, 1);
+  rb_define_method(cUnQLiteDatabase, "compare_and_set", unqlite_database_compare_and_set, 3);
+  rb_define_method(cUnQLiteDatabase, "update", unqlite_database_update, 1);
 
   rb_define_method(cUnQLiteDatabase, "closed?", unqlite_database_closed, 0);
   rb_define_method(cUnQLiteDatabase, "[]", unqlite_database_aref, 1);
-  rb_define_method(cUnQLiteDatabase, "[]=", unqlite_database_store, 2);
+  rb_define_method(cUnQLiteDatabase, "[]=", unqlite_database_aset, 2);
   rb_define_method(cUnQLiteDatabase, "has_key?", unqlite_database_has_key, 1);
   rb_define_method(cUnQLiteDatabase, "include?", unqlite_database_has_key, 1);
   rb_define_method(cUnQLiteDatabase, "key?", unqlite_database_has_key, 1);
@@ -848,10 +1393,10 @@ void Init_unqlite_database()
   rb_define_method(cUnQLiteDatabase, "clear", unqlite_database_clear, 0);
   rb_define_method(cUnQLiteDatabase, "empty?", unqlite_database_empty, 0);
 
-  rb_define_method(cUnQLiteDatabase, "each", unqlite_database_each, 0);
-  rb_define_method(cUnQLiteDatabase, "each_pair", unqlite_database_each, 0);
-  rb_define_method(cUnQLiteDatabase, "each_key", unqlite_database_each_key, 0);
-  rb_define_method(cUnQLiteDatabase, "each_value", unqlite_database_each_value, 0);
+  rb_define_method(cUnQLiteDatabase, "each", unqlite_database_each, -1);
+  rb_define_method(cUnQLiteDatabase, "each_pair", unqlite_database_each, -1);
+  rb_define_method(cUnQLiteDatabase, "each_key", unqlite_database_each_key, -1);
+  rb_define_method(cUnQLiteDatabase, "each_value", unqlite_database_each_value, -1);
 
   rb_define_method(cUnQLiteDatabase, "begin_transaction", unqlite_database_begin_transaction, 0);
   rb_define_method(cUnQLiteDatabase, "end_transaction", unqlite_database_end_transaction, 1);
@@ -3,16 +3,78 @@
 
 #include <unqlite_ruby.h>
 
+/* Number of released native cursors kept for reuse by each handle */
+#define UNQLITE_RUBY_CURSOR_POOL_SIZE 8
+
+struct _unqliteRubyCursor;
+struct _unqliteRubyIndex;
+struct _unqliteRubyBloom;
+struct _unqliteRubyCache;
+struct _unqliteRubyTtl;
+struct _unqliteRubyJx9;
+struct _unqliteRubyOrder;
+
 struct _unqliteRuby {
+  VALUE self;                         /* the wrapping object, for write barriers */
   unqlite *pDb;
-  VALUE acursors;
+  char *path;                         /* name the database was opened with */
+  int flags;                          /* UNQLITE_OPEN_* flags it was opened with */
+  struct _unqliteRubyCursor *cursors; /* open UnQLite::Cursor objects */
+  unqlite_kv_cursor *cursor_pool[UNQLITE_RUBY_CURSOR_POOL_SIZE];
+  int ncursor_pool;
+  int ncursors_out;                   /* pooled cursors currently handed out */
+  int pending;                        /* uncommitted writes made through this handle */
+  unsigned long transactions;         /* write transactions begun, counting the implicit ones */
+  int in_transaction;                 /* begin_transaction was called and not yet ended */
+  int compacting;                     /* Database#compact owns the handle */
+  int busy;                           /* a call that must not be re-entered owns the handle */
+  struct _unqliteRubyIndex *indexes;
+  int nindexes;
+  struct _unqliteRubyBloom *bloom;
+  struct _unqliteRubyCache *cache;
+  struct _unqliteRubyTtl *ttl;
+  struct _unqliteRubyJx9 *jx9;        /* compiled collection scripts */
+  struct _unqliteRubyOrder *order;    /* key order tree, or NULL */
+  size_t page_cache_bytes;            /* estimated pager memory reported to the GC */
+  int max_page_cache;                 /* pages, as set by max_page_cache= (0: default) */
+  int no_auto_commit;                 /* disable_auto_commit was called */
+  struct _unqliteRuby *prev;          /* open handles, reopened after fork */
+  struct _unqliteRuby *next;
 };
 
 typedef struct _unqliteRuby unqliteRuby;
 typedef unqliteRuby * unqliteRubyPtr;
 
+extern const rb_data_type_t unqliteRuby_type;
+
+/*
+ * Database objects are write-barrier protected: every VALUE stored in
+ * memory reachable from unqlite_database_mark must be written with
+ * RB_OBJ_WRITE(ctx->self, ...) or announced with RB_OBJ_WRITTEN.
+ */
+
+/* Get database context pointer from Ruby object */
+#define GetDatabase(obj, databasep) {                                        \
+    TypedData_Get_Struct((obj), unqliteRuby, &unqliteRuby_type, (databasep)); \
+    if ((databasep) == 0) closed_database();                                 \
+    if ((databasep)->pDb == 0) closed_database();                            \
+    if ((databasep)->compacting || (databasep)->busy) busy_database(databasep); \
+  }
+
+/* Get database context pointer and native unqlite pointer from Ruby object */
+#define GetDatabase2(obj, databasep, database) { \
+    GetDatabase((obj), (databasep));             \
+    (database) = (databasep)->pDb;               \
+  }
+
 extern VALUE cUnQLiteDatabase;
 
 void Init_unqlite_database();
+void closed_database();
+void busy_database(struct _unqliteRuby *ctx);
+VALUE unqliteRuby_fetch(unqlite *db, VALUE key);
+void unqliteRuby_write_begin(unqliteRubyPtr ctx);
+int unqliteRuby_rollback(unqliteRubyPtr ctx);
+void unqliteRuby_page_cache_account(unqliteRubyPtr ctx);
 
 #endif
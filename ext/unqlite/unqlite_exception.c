@@ -1,78 +1,60 @@
 #include <unqlite_exception.h>
 
+/* Exception class of each error code, resolved once at load time */
+static struct
+{
+  int rc;
+  const char *name;
+  VALUE klass;
+} exception_classes[] = {
+  { UNQLITE_NOMEM,          "UnQLite::MemoryException",                Qnil },
+  { UNQLITE_ABORT,          "UnQLite::AbortException",                 Qnil },
+  { UNQLITE_IOERR,          "UnQLite::IOException",                    Qnil },
+  { UNQLITE_CORRUPT,        "UnQLite::CorruptException",               Qnil },
+  { UNQLITE_LOCKED,         "UnQLite::LockedException",                Qnil },
+  { UNQLITE_BUSY,           "UnQLite::BusyException",                  Qnil },
+/* Not sure if it is an error or not (check lib/unqlite/errors.rb)
+  { UNQLITE_DONE,           "UnQLite::DoneException",                  Qnil },
+*/
+  { UNQLITE_PERM,           "UnQLite::PermissionException",            Qnil },
+  { UNQLITE_NOTIMPLEMENTED, "UnQLite::NotImplementedException",        Qnil },
+  { UNQLITE_NOTFOUND,       "UnQLite::NotFoundException",              Qnil },
+  { UNQLITE_EMPTY,          "UnQLite::EmptyException",                 Qnil },
+  { UNQLITE_INVALID,        "UnQLite::InvalidParameterException",      Qnil },
+  { UNQLITE_EOF,            "UnQLite::EOFException",                   Qnil },
+  { UNQLITE_UNKNOWN,        "UnQLite::UnknownConfigurationException",  Qnil },
+  { UNQLITE_LIMIT,          "UnQLite::LimitReachedException",          Qnil },
+  { UNQLITE_FULL,           "UnQLite::FullDatabaseException",          Qnil },
+  { UNQLITE_CANTOPEN,       "UnQLite::CantOpenDatabaseException",      Qnil },
+  { UNQLITE_READ_ONLY,      "UnQLite::ReadOnlyException",              Qnil },
+  { UNQLITE_LOCKERR,        "UnQLite::LockProtocolException",          Qnil },
+  { UNQLITE_COMPILE_ERR,    "UnQLite::CompileException",               Qnil },
+  { UNQLITE_VM_ERR,         "UnQLite::VMException",                    Qnil }
+};
+
+#define EXCEPTION_CLASSES (sizeof(exception_classes) / sizeof(exception_classes[0]))
+
 void rb_unqlite_raise(unqlite *db, int rc)
 {
   VALUE klass = Qnil;
+  size_t i;
 
-  switch(rc) {
-    case UNQLITE_NOMEM:
-      klass = rb_path2class("UnQLite::MemoryException");
-      break;
-    case UNQLITE_ABORT:
-      klass = rb_path2class("UnQLite::AbortException");
-      break;
-    case UNQLITE_IOERR:
-      klass = rb_path2class("UnQLite::IOException");
-      break;
-    case UNQLITE_CORRUPT:
-      klass = rb_path2class("UnQLite::CorruptException");
-      break;
-    case UNQLITE_LOCKED:
-      klass = rb_path2class("UnQLite::LockedException");
-      break;
-    case UNQLITE_BUSY:
-      klass = rb_path2class("UnQLite::BusyException");
-      break;
-/* Not sure if it is an error or not (check lib/unqlite/errors.rb)
-    case UNQLITE_DONE:
-      klass = rb_path2class("UnQLite::DoneException");
-      break;
-*/
-    case UNQLITE_PERM:
-      klass = rb_path2class("UnQLite::PermissionException");
-      break;
-    case UNQLITE_NOTIMPLEMENTED:
-      klass = rb_path2class("UnQLite::NotImplementedException");
-      break;
-    case UNQLITE_NOTFOUND:
-      klass = rb_path2class("UnQLite::NotFoundException");
-      break;
-    case UNQLITE_EMPTY:
-      klass = rb_path2class("UnQLite::EmptyException");
-      break;
-    case UNQLITE_INVALID:
-      klass = rb_path2class("UnQLite::InvalidParameterException");
-      break;
-    case UNQLITE_EOF:
-      klass = rb_path2class("UnQLite::EOFException");
-      break;
-    case UNQLITE_UNKNOWN:
-      klass = rb_path2class("UnQLite::UnknownConfigurationException");
-      break;
-    case UNQLITE_LIMIT:
-      klass = rb_path2class("UnQLite::LimitReachedException");
-      break;
-    case UNQLITE_FULL:
-      klass = rb_path2class("UnQLite::FullDatabaseException");
-      break;
-    case UNQLITE_CANTOPEN:
-      klass = rb_path2class("UnQLite::CantOpenDatabaseException");
-      break;
-    case UNQLITE_READ_ONLY:
-      klass = rb_path2class("UnQLite::ReadOnlyException");
-      break;
-    case UNQLITE_LOCKERR:
-      klass = rb_path2class("UnQLite::LockProtocolException");
+  for (i = 0; i < EXCEPTION_CLASSES; i++)
+  {
+    if (exception_classes[i].rc == rc)
+    {
+      klass = exception_classes[i].klass;
       break;
+    }
   }
 
   if( !NIL_P(klass) ) { // Is really an error?
     const char *buffer;
     int length = 0;
 
-    /* Get error from log */
+    /* Get error from log (Jx9 keeps its compiler errors apart) */
     if (db)
-      unqlite_config(db, UNQLITE_CONFIG_ERR_LOG, &buffer, &length);
+      unqlite_config(db, rc == UNQLITE_COMPILE_ERR ? UNQLITE_CONFIG_JX9_ERR_LOG : UNQLITE_CONFIG_ERR_LOG, &buffer, &length);
 
     // Raise it!
     if( length > 0 )
@@ -83,3 +65,17 @@ void rb_unqlite_raise(unqlite *db, int rc)
     }
   }
 }
+
+void Init_unqlite_exception()
+{
+  size_t i;
+
+  // The classes are defined in Ruby
+  rb_require("unqlite/errors");
+
+  for (i = 0; i < EXCEPTION_CLASSES; i++)
+  {
+    exception_classes[i].klass = rb_path2class(exception_classes[i].name);
+    rb_gc_register_mark_object(exception_classes[i].klass);
+  }
+}
@@ -4,7 +4,12 @@
 #include <unqlite_ruby.h>
 
 /* Macro to raise the proper exception given a return code */
-#define CHECK(_db, _rc) rb_unqlite_raise(_db, _rc);
+#define CHECK(_db, _rc) do {                                   \
+    int _check_rc = (_rc);                                     \
+    if (_check_rc != UNQLITE_OK) rb_unqlite_raise(_db, _check_rc); \
+  } while (0)
+
+void Init_unqlite_exception();
 void rb_unqlite_raise(unqlite *db, int rc);
 
 #endif
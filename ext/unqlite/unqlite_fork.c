@@ -0,0 +1,175 @@
+#include <unqlite_fork.h>
+#include <unistd.h>
+
+/*
+ * Fork handling
+ *
+ * A handle inherited across fork shares its file descriptor, its lock
+ * bookkeeping and its mutexes with the parent's, so the child must not
+ * write through it. Every open handle is kept in a list; around fork
+ * (lib/unqlite/fork.rb hooks Process._fork) the parent commits the
+ * pending writes of its write handles, and the child replaces them with
+ * fresh handles on the same file.
+ *
+ * Read-only handles (READONLY, or MMAP which implies it) and private
+ * in-memory or temporary databases are kept: the child reads the
+ * parent's mapping and page cache copy-on-write, so workers start warm.
+ */
+
+static unqliteRubyPtr handles = NULL;
+
+/* Process the handles belong to; after_fork does nothing in it */
+static pid_t handles_pid;
+
+/* Remember an open handle */
+void unqliteRuby_handle_link(unqliteRubyPtr ctx)
+{
+  if (ctx->prev || handles == ctx)
+    return;
+
+  ctx->next = handles;
+  if (handles)
+    handles->prev = ctx;
+  handles = ctx;
+}
+
+/* Forget a handle being closed */
+void unqliteRuby_handle_unlink(unqliteRubyPtr ctx)
+{
+  if (!ctx->prev && handles != ctx)
+    return;
+
+  if (ctx->prev)
+    ctx->prev->next = ctx->next;
+  else
+    handles = ctx->next;
+  if (ctx->next)
+    ctx->next->prev = ctx->prev;
+  ctx->prev = ctx->next = NULL;
+}
+
+/* Handles the child gets its own copy of */
+static int fork_reopens(unqliteRubyPtr ctx)
+{
+  if (ctx->flags & (UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP))
+    return 0;
+  if ((ctx->flags & (UNQLITE_OPEN_IN_MEMORY | UNQLITE_OPEN_TEMP_DB)) || strcmp(ctx->path, ":mem:") == 0)
+    return 0;
+  return 1;
+}
+
+/*
+ * Give _ctx_ a handle of its own. The inherited one is left untouched,
+ * not closed: closing would commit or roll back on behalf of the parent
+ * and release locks it holds. Its memory stays allocated in the child.
+ * If the file cannot be opened, _ctx_ is left closed.
+ */
+static int fork_reopen(unqliteRubyPtr ctx)
+{
+  int pending = ctx->pending;
+  int rc;
+
+  unqliteRuby_cursors_abandon(ctx);
+  unqliteRuby_jx9_abandon(ctx);
+  ctx->pDb = NULL;
+  ctx->pending = 0;
+  ctx->in_transaction = 0;
+
+  rc = unqlite_open(&ctx->pDb, ctx->path, ctx->flags);
+  if (rc != UNQLITE_OK)
+  {
+    // Raising would leave the handles after this one inherited
+    ctx->pDb = NULL;
+    unqliteRuby_handle_unlink(ctx);
+    return rc;
+  }
+
+  if (ctx->max_page_cache > 0)
+    unqlite_config(ctx->pDb, UNQLITE_CONFIG_MAX_PAGE_CACHE, ctx->max_page_cache);
+  if (ctx->no_auto_commit)
+    unqlite_config(ctx->pDb, UNQLITE_CONFIG_DISABLE_AUTO_COMMIT, 0);
+
+  // Writes the parent did not commit are not in the file
+  if (pending)
+  {
+    unqliteRuby_cache_clear(ctx);
+    unqliteRuby_order_invalidate(ctx);
+  }
+
+  unqliteRuby_ttl_after_fork(ctx);
+  return UNQLITE_OK;
+}
+
+/*
+ * call-seq:
+ *     UnQLite::Database.before_fork -> nil
+ *
+ * Commits the pending writes of every open write handle, so the child
+ * does not inherit a transaction. Called by Process._fork; call it
+ * yourself before forking on Rubies older than 3.1.
+ */
+static VALUE unqlite_database_s_before_fork(VALUE klass)
+{
+  unqliteRubyPtr ctx;
+  int rc;
+
+  for (ctx = handles; ctx; ctx = ctx->next)
+  {
+    if (!ctx->pending || ctx->compacting || !fork_reopens(ctx))
+      continue;
+
+    rc = unqlite_commit(ctx->pDb);
+    CHECK(ctx->pDb, rc);
+    ctx->pending = 0;
+    ctx->in_transaction = 0;
+  }
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *     UnQLite::Database.after_fork -> count
+ *
+ * In a forked child, reopens every open write handle on its file and
+ * returns how many were reopened. Open cursors of these handles are
+ * released, and expiry sweepers are restarted. A handle whose file
+ * cannot be opened again is closed instead; it does not raise. Called
+ * by Process._fork; call it yourself in the child on Rubies older than
+ * 3.1 (e.g. from the after_fork hook of the server).
+ *
+ * Returns 0 without doing anything in the process that opened the
+ * handles, and when the handles were already reopened in this child.
+ */
+static VALUE unqlite_database_s_after_fork(VALUE klass)
+{
+  unqliteRubyPtr ctx, next;
+  pid_t pid = getpid();
+  long count = 0;
+
+  if (pid == handles_pid)
+    return INT2FIX(0);
+  handles_pid = pid;
+
+  for (ctx = handles; ctx; ctx = next)
+  {
+    next = ctx->next;
+    if (!fork_reopens(ctx))
+      continue;
+
+    // The thread compacting or using it was not forked
+    ctx->compacting = 0;
+    ctx->busy = 0;
+    if (fork_reopen(ctx) == UNQLITE_OK)
+      count++;
+  }
+
+  return LONG2NUM(count);
+}
+
+void Init_unqlite_fork()
+{
+  handles_pid = getpid();
+  rb_define_singleton_method(cUnQLiteDatabase, "before_fork", unqlite_database_s_before_fork, 0);
+  rb_define_singleton_method(cUnQLiteDatabase, "after_fork", unqlite_database_s_after_fork, 0);
+}
@@ -0,0 +1,12 @@
+#ifndef UNQLITE_RUBY_FORK
+#define UNQLITE_RUBY_FORK
+
+#include <unqlite_ruby.h>
+
+struct _unqliteRuby;
+
+void Init_unqlite_fork();
+void unqliteRuby_handle_link(struct _unqliteRuby *ctx);
+void unqliteRuby_handle_unlink(struct _unqliteRuby *ctx);
+
+#endif
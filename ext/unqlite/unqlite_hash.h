@@ -0,0 +1,28 @@
+#ifndef UNQLITE_RUBY_HASH
+#define UNQLITE_RUBY_HASH
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64-bit FNV-1a over a byte buffer, finalized with the splitmix64 mixer */
+static inline uint64_t unqliteRuby_hash(const void *data, size_t len, uint64_t seed)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+  {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+#endif
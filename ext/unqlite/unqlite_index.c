@@ -0,0 +1,692 @@
+#include <unqlite_index.h>
+
+/*
+ * Secondary indexes map an extracted part of each value back to the
+ * keys holding it. Index entries are regular records stored under
+ * UNQLITE_RUBY_INDEX_PREFIX and are written in the same transaction as
+ * the primary record, so they can not drift apart from it.
+ *
+ * Handles which did not register an index write without maintaining
+ * it. A database that ever had an index keeps a generation counter
+ * under the bare prefix, bumped by the first write of every transaction
+ * (unqliteRuby_index_touch); the marker of each index records the
+ * generation at which it was last maintained and its extractor, and
+ * add_index rebuilds an index whose marker does not match.
+ */
+
+#define INDEX_STAMP_LEN 34
+
+/* Find a registered index by name, or NULL */
+static unqliteRubyIndex* index_find(unqliteRubyPtr ctx, VALUE name)
+{
+  int i;
+
+  for (i = 0; i < ctx->nindexes; i++)
+  {
+    unqliteRubyIndex *idx = &ctx->indexes[i];
+    if (idx->name_len == RSTRING_LEN(name) && memcmp(idx->name, RSTRING_PTR(name), idx->name_len) == 0)
+      return idx;
+  }
+  return NULL;
+}
+
+/* Accept both symbols and strings as index names */
+static VALUE index_name(VALUE name)
+{
+  if (SYMBOL_P(name))
+    name = rb_sym2str(name);
+  Check_Type(name, T_STRING);
+  if (RSTRING_LEN(name) == 0 || memchr(RSTRING_PTR(name), '\0', RSTRING_LEN(name)))
+    rb_raise(rb_eArgError, "invalid index name");
+  return name;
+}
+
+/* Build "\0idx\0<name>" (the marker telling the index has been built) */
+static VALUE index_marker(unqliteRubyIndex *idx)
+{
+  volatile VALUE marker = rb_str_buf_new(UNQLITE_RUBY_INDEX_PREFIX_LEN + idx->name_len);
+  rb_str_buf_cat(marker, UNQLITE_RUBY_INDEX_PREFIX, UNQLITE_RUBY_INDEX_PREFIX_LEN);
+  rb_str_buf_cat(marker, idx->name, idx->name_len);
+  return marker;
+}
+
+static void index_encode64(unsigned char *p, uint64_t n)
+{
+  int i;
+  for (i = 7; i >= 0; i--, n >>= 8)
+    p[i] = n & 0xff;
+}
+
+/* Read the index generation of _db_; UNQLITE_NOTFOUND if it never had an index */
+static int index_generation(unqlite *db, uint64_t *gen)
+{
+  unsigned char buf[8];
+  unqlite_int64 n = sizeof(buf);
+  int rc, i;
+
+  rc = unqlite_kv_fetch(db, UNQLITE_RUBY_INDEX_PREFIX, UNQLITE_RUBY_INDEX_PREFIX_LEN, buf, &n);
+  if (rc != UNQLITE_OK)
+    return rc;
+
+  *gen = 0;
+  for (i = 0; i < n && i < 8; i++)
+    *gen = (*gen << 8) | buf[i];
+  return UNQLITE_OK;
+}
+
+/*
+ * Bump the index generation of _db_, if it has one, and return the new
+ * one in _gen_. Uses no Ruby objects, so it runs without the GVL.
+ */
+int unqliteRuby_index_bump(unqlite *db, uint64_t *gen)
+{
+  unsigned char buf[8];
+  int rc;
+
+  rc = index_generation(db, gen);
+  if (rc != UNQLITE_OK)
+    return rc;
+
+  index_encode64(buf, ++*gen);
+  return unqlite_kv_store(db, UNQLITE_RUBY_INDEX_PREFIX, UNQLITE_RUBY_INDEX_PREFIX_LEN, buf, sizeof(buf));
+}
+
+/* Value of the marker of _idx_: the generation, then the extractor */
+static void index_stamp_value(unqliteRubyIndex *idx, uint64_t gen, unsigned char *stamp)
+{
+  memset(stamp, 0, INDEX_STAMP_LEN);
+  index_encode64(stamp, gen);
+  stamp[8] = idx->kind;
+  index_encode64(stamp + 9, (uint64_t)idx->offset);
+  index_encode64(stamp + 17, (uint64_t)idx->length);
+  stamp[25] = idx->delimiter;
+  index_encode64(stamp + 26, (uint64_t)idx->field);
+}
+
+/* Record that _idx_ is up to date at generation _gen_ */
+static int index_stamp(unqlite *db, unqliteRubyIndex *idx, uint64_t gen)
+{
+  unsigned char stamp[INDEX_STAMP_LEN];
+  volatile VALUE marker = index_marker(idx);
+
+  index_stamp_value(idx, gen, stamp);
+  return unqlite_kv_store(db, RSTRING_PTR(marker), RSTRING_LEN(marker), stamp, sizeof(stamp));
+}
+
+/* True if the marker of _idx_ says it is up to date at generation _gen_ */
+static int index_current(unqlite *db, unqliteRubyIndex *idx, uint64_t gen)
+{
+  unsigned char stamp[INDEX_STAMP_LEN];
+  volatile VALUE marker = index_marker(idx);
+  volatile VALUE value = unqliteRuby_fetch(db, marker);
+
+  index_stamp_value(idx, gen, stamp);
+  return !NIL_P(value) && RSTRING_LEN(value) == sizeof(stamp) &&
+    memcmp(RSTRING_PTR(value), stamp, sizeof(stamp)) == 0;
+}
+
+/*
+ * Called by the first write of a transaction: bump the index generation
+ * and stamp the indexes this handle maintains. Returns an unqlite
+ * error code.
+ */
+int unqliteRuby_index_touch(unqliteRubyPtr ctx)
+{
+  uint64_t gen;
+  int rc, i;
+
+  rc = unqliteRuby_index_bump(ctx->pDb, &gen);
+  if (rc == UNQLITE_NOTFOUND)
+    return UNQLITE_OK;
+
+  for (i = 0; i < ctx->nindexes && rc == UNQLITE_OK; i++)
+    rc = index_stamp(ctx->pDb, &ctx->indexes[i], gen);
+  return rc;
+}
+
+/* Build "\0idx\0<name>\0<len><value>", the prefix shared by all keys indexed under _ivalue_ */
+static VALUE index_entry_prefix(unqliteRubyIndex *idx, VALUE ivalue)
+{
+  unsigned char len[4];
+  long n = RSTRING_LEN(ivalue);
+  volatile VALUE prefix = index_marker(idx);
+
+  len[0] = (n >> 24) & 0xff;
+  len[1] = (n >> 16) & 0xff;
+  len[2] = (n >> 8) & 0xff;
+  len[3] = n & 0xff;
+
+  rb_str_buf_cat(prefix, "\0", 1);
+  rb_str_buf_cat(prefix, (const char *)len, 4);
+  rb_str_buf_cat(prefix, RSTRING_PTR(ivalue), n);
+  return prefix;
+}
+
+/* Extract the indexed part of _value_, or nil if it should not be indexed */
+static VALUE index_extract(unqliteRubyIndex *idx, VALUE key, VALUE value)
+{
+  const char *p, *end;
+  long field;
+  volatile VALUE ivalue;
+
+  switch (idx->kind)
+  {
+    case UNQLITE_RUBY_INDEX_PROC:
+      ivalue = rb_funcall(idx->proc, rb_intern("call"), 2, key, value);
+      if (!NIL_P(ivalue)) Check_Type(ivalue, T_STRING);
+      return ivalue;
+
+    case UNQLITE_RUBY_INDEX_OFFSET:
+      if (idx->length < 0)
+      {
+        if (RSTRING_LEN(value) < idx->offset) return Qnil;
+        return rb_str_new(RSTRING_PTR(value) + idx->offset, RSTRING_LEN(value) - idx->offset);
+      }
+      if (RSTRING_LEN(value) < idx->offset + idx->length) return Qnil;
+      return rb_str_new(RSTRING_PTR(value) + idx->offset, idx->length);
+
+    case UNQLITE_RUBY_INDEX_DELIMITER:
+      p = RSTRING_PTR(value);
+      end = p + RSTRING_LEN(value);
+      for (field = 0; field < idx->field; field++)
+      {
+        p = memchr(p, idx->delimiter, end - p);
+        if (!p) return Qnil;
+        p++;
+      }
+      {
+        const char *stop = memchr(p, idx->delimiter, end - p);
+        return rb_str_new(p, (stop ? stop : end) - p);
+      }
+  }
+
+  return Qnil;
+}
+
+/*
+ * Returns the index entry keys of a record, one slot per registered
+ * index (nil for unindexed slots). A nil _value_ yields no entries.
+ */
+VALUE unqliteRuby_index_entries(unqliteRubyPtr ctx, VALUE key, VALUE value)
+{
+  int i;
+  volatile VALUE entries = rb_ary_new2(ctx->nindexes);
+
+  for (i = 0; i < ctx->nindexes; i++)
+  {
+    volatile VALUE ivalue = Qnil;
+    volatile VALUE entry = Qnil;
+
+    if (!NIL_P(value))
+      ivalue = index_extract(&ctx->indexes[i], key, value);
+
+    if (!NIL_P(ivalue))
+    {
+      entry = index_entry_prefix(&ctx->indexes[i], ivalue);
+      rb_str_buf_cat(entry, RSTRING_PTR(key), RSTRING_LEN(key));
+    }
+
+    rb_ary_push(entries, entry);
+  }
+
+  return entries;
+}
+
+/* Replace the index entries of a record. Returns an unqlite error code. */
+int unqliteRuby_index_apply(unqlite *db, VALUE old_entries, VALUE new_entries)
+{
+  long i;
+  int rc;
+
+  for (i = 0; i < RARRAY_LEN(new_entries); i++)
+  {
+    VALUE old_entry = i < RARRAY_LEN(old_entries) ? RARRAY_AREF(old_entries, i) : Qnil;
+    VALUE new_entry = RARRAY_AREF(new_entries, i);
+
+    if (!NIL_P(old_entry) && !NIL_P(new_entry) && rb_str_equal(old_entry, new_entry) == Qtrue)
+      continue;
+
+    if (!NIL_P(old_entry))
+    {
+      rc = unqlite_kv_delete(db, RSTRING_PTR(old_entry), RSTRING_LEN(old_entry));
+      if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND) return rc;
+    }
+
+    if (!NIL_P(new_entry))
+    {
+      rc = unqlite_kv_store(db, RSTRING_PTR(new_entry), RSTRING_LEN(new_entry), "", 0);
+      if (rc != UNQLITE_OK) return rc;
+    }
+  }
+
+  return UNQLITE_OK;
+}
+
+/*
+ * Write path used while indexes are registered: extractors run before
+ * anything is written, then the record and its index entries are
+ * written in the current transaction (which is rolled back on error).
+ */
+void unqliteRuby_index_write(unqliteRubyPtr ctx, VALUE key, VALUE value, int op)
+{
+  unqlite *db = ctx->pDb;
+  int rc;
+  volatile VALUE old_value, new_value, old_entries, new_entries;
+
+  old_value = unqliteRuby_fetch(db, key);
+
+  switch (op)
+  {
+    case UNQLITE_RUBY_WRITE_STORE:
+      new_value = value;
+      break;
+    case UNQLITE_RUBY_WRITE_APPEND:
+      new_value = NIL_P(old_value) ? value : rb_str_plus(old_value, value);
+      break;
+    default:
+      new_value = Qnil;
+  }
+
+  old_entries = unqliteRuby_index_entries(ctx, key, old_value);
+  new_entries = unqliteRuby_index_entries(ctx, key, new_value);
+
+  switch (op)
+  {
+    case UNQLITE_RUBY_WRITE_STORE:
+      rc = unqlite_kv_store(db, RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(value), RSTRING_LEN(value));
+      break;
+    case UNQLITE_RUBY_WRITE_APPEND:
+      rc = unqlite_kv_append(db, RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(value), RSTRING_LEN(value));
+      break;
+    default:
+      rc = unqlite_kv_delete(db, RSTRING_PTR(key), RSTRING_LEN(key));
+  }
+  CHECK(db, rc);
+
+  rc = unqliteRuby_index_apply(db, old_entries, new_entries);
+  if (rc != UNQLITE_OK)
+  {
+    unqliteRuby_rollback(ctx);
+    CHECK(db, rc);
+  }
+}
+
+/* Wrapped object: mark index procs */
+void unqliteRuby_index_mark(unqliteRubyPtr ctx)
+{
+  int i;
+  for (i = 0; i < ctx->nindexes; i++)
+    UNQLITE_RUBY_MARK(ctx->indexes[i].proc);
+}
+
+void unqliteRuby_index_compact(unqliteRubyPtr ctx)
+{
+  int i;
+  for (i = 0; i < ctx->nindexes; i++)
+    UNQLITE_RUBY_MOVE(ctx->indexes[i].proc);
+}
+
+size_t unqliteRuby_index_memsize(const struct _unqliteRuby *ctx)
+{
+  size_t size = ctx->nindexes * sizeof(unqliteRubyIndex);
+  int i;
+  for (i = 0; i < ctx->nindexes; i++)
+    size += ctx->indexes[i].name_len;
+  return size;
+}
+
+/* Wrapped object: free index definitions */
+void unqliteRuby_index_free(unqliteRubyPtr ctx)
+{
+  int i;
+  for (i = 0; i < ctx->nindexes; i++)
+    xfree(ctx->indexes[i].name);
+  xfree(ctx->indexes);
+  ctx->indexes = NULL;
+  ctx->nindexes = 0;
+}
+
+/* Read the key under the cursor into a growable buffer */
+static int index_cursor_key(unqlite_kv_cursor *cursor, char **buf, int *cap, int *len)
+{
+  int rc = unqlite_kv_cursor_key(cursor, NULL, len);
+  if (rc != UNQLITE_OK) return rc;
+  if (*len > *cap)
+  {
+    REALLOC_N(*buf, char, *len);
+    *cap = *len;
+  }
+  return unqlite_kv_cursor_key(cursor, *buf, len);
+}
+
+/* Hash-based engines can not position a cursor on a key prefix */
+static int index_ordered_engine(unqlite *db)
+{
+  const char *name = NULL;
+
+  if (unqlite_config(db, UNQLITE_CONFIG_GET_KV_NAME, &name) != UNQLITE_OK || !name)
+    return 0;
+  return STRCASECMP(name, "hash") != 0 && STRCASECMP(name, "mem") != 0;
+}
+
+/*
+ * Collect the suffixes of every key starting with _prefix_. Ordered
+ * engines seek straight to the prefix; hash engines need a full scan.
+ */
+static VALUE index_prefix_scan(unqlite *db, VALUE prefix)
+{
+  unqlite_kv_cursor *cursor;
+  char *buf = NULL;
+  int cap = 0, len = 0, rc, ordered;
+  long plen = RSTRING_LEN(prefix);
+  volatile VALUE result = rb_ary_new();
+
+  ordered = index_ordered_engine(db);
+
+  rc = unqlite_kv_cursor_init(db, &cursor);
+  CHECK(db, rc);
+
+  if (ordered)
+    rc = unqlite_kv_cursor_seek(cursor, RSTRING_PTR(prefix), plen, UNQLITE_CURSOR_MATCH_GE);
+  else
+    rc = unqlite_kv_cursor_first_entry(cursor);
+
+  while (rc == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor))
+  {
+    rc = index_cursor_key(cursor, &buf, &cap, &len);
+    if (rc != UNQLITE_OK) break;
+
+    if (len > plen && memcmp(buf, RSTRING_PTR(prefix), plen) == 0)
+      rb_ary_push(result, rb_str_new(buf + plen, len - plen));
+    else if (ordered)
+      break;
+
+    rc = unqlite_kv_cursor_next_entry(cursor);
+  }
+
+  xfree(buf);
+  unqlite_kv_cursor_release(db, cursor);
+  if (rc != UNQLITE_NOTFOUND && rc != UNQLITE_DONE && rc != UNQLITE_EOF)
+    CHECK(db, rc);
+
+  return result;
+}
+
+/* Delete every entry of _idx_, but not its marker */
+static void index_clear(unqlite *db, unqliteRubyIndex *idx)
+{
+  long i;
+  int rc;
+  volatile VALUE prefix, suffixes;
+
+  prefix = index_marker(idx);
+  rb_str_buf_cat(prefix, "\0", 1);
+
+  suffixes = index_prefix_scan(db, prefix);
+  for (i = 0; i < RARRAY_LEN(suffixes); i++)
+  {
+    volatile VALUE entry = rb_str_plus(prefix, RARRAY_AREF(suffixes, i));
+    rc = unqlite_kv_delete(db, RSTRING_PTR(entry), RSTRING_LEN(entry));
+    if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND)
+      CHECK(db, rc);
+  }
+}
+
+/* Index every record already in the database under _idx_ */
+static void index_build(unqliteRubyPtr ctx, unqliteRubyIndex *idx)
+{
+  unqlite *db = ctx->pDb;
+  unqlite_kv_cursor *cursor;
+  int rc;
+  long i;
+  volatile VALUE pairs = rb_ary_new();
+
+  // Collect entries first: writing while the cursor walks is not safe
+  rc = unqlite_kv_cursor_init(db, &cursor);
+  CHECK(db, rc);
+
+  rc = unqlite_kv_cursor_first_entry(cursor);
+  while (unqlite_kv_cursor_valid_entry(cursor))
+  {
+    int key_size;
+    unqlite_int64 data_size;
+    volatile VALUE rb_key, rb_data, ivalue;
+
+    rc = unqlite_kv_cursor_key(cursor, NULL, &key_size);
+    if (rc != UNQLITE_OK) break;
+    rb_key = rb_str_buf_new(key_size);
+    rc = unqlite_kv_cursor_key(cursor, RSTRING_PTR(rb_key), &key_size);
+    if (rc != UNQLITE_OK) break;
+    rb_str_set_len(rb_key, key_size);
+
+    if (key_size > 0 && RSTRING_PTR(rb_key)[0] != '\0')
+    {
+      rc = unqlite_kv_cursor_data(cursor, NULL, &data_size);
+      if (rc != UNQLITE_OK) break;
+      rb_data = rb_str_buf_new(data_size);
+      rc = unqlite_kv_cursor_data(cursor, RSTRING_PTR(rb_data), &data_size);
+      if (rc != UNQLITE_OK) break;
+      rb_str_set_len(rb_data, data_size);
+
+      ivalue = index_extract(idx, rb_key, rb_data);
+      if (!NIL_P(ivalue))
+      {
+        volatile VALUE entry = index_entry_prefix(idx, ivalue);
+        rb_str_buf_cat(entry, RSTRING_PTR(rb_key), RSTRING_LEN(rb_key));
+        rb_ary_push(pairs, entry);
+      }
+    }
+
+    rc = unqlite_kv_cursor_next_entry(cursor);
+  }
+
+  unqlite_kv_cursor_release(db, cursor);
+  if (rc != UNQLITE_OK && rc != UNQLITE_DONE && rc != UNQLITE_EOF && rc != UNQLITE_NOTFOUND)
+    CHECK(db, rc);
+
+  for (i = 0; i < RARRAY_LEN(pairs); i++)
+  {
+    VALUE entry = RARRAY_AREF(pairs, i);
+    rc = unqlite_kv_store(db, RSTRING_PTR(entry), RSTRING_LEN(entry), "", 0);
+    if (rc != UNQLITE_OK)
+    {
+      unqliteRuby_rollback(ctx);
+      CHECK(db, rc);
+    }
+  }
+
+}
+
+/*
+ * call-seq:
+ *     database.add_index(name) { |key, value| ... }
+ *     database.add_index(name, offset: 0, length: 8)
+ *     database.add_index(name, delimiter: ",", field: 1)
+ *
+ * Registers the secondary index _name_. The indexed part of each value
+ * is either returned by _block_ (nil means "do not index"), a fixed
+ * byte range (_offset_ and optional _length_) or the _field_-th field
+ * (zero-based) of a _delimiter_ separated value.
+ *
+ * From now on #store, #append, #delete, #compare_and_set and #update
+ * write the index entries in the same transaction as the record. Index
+ * entries are stored as records prefixed by <tt>"\0idx\0"</tt> (keys
+ * starting with a NUL byte are reserved). The index must be registered
+ * again every time the database is opened.
+ *
+ * Existing records are indexed the first time an index is added, and
+ * again when it is added after records were written by a handle which
+ * had not registered it, or with other _offset_, _length_, _delimiter_
+ * or _field_ options.
+ */
+static VALUE unqlite_database_add_index(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  unqliteRubyIndex idx;
+  VALUE name, opts, block;
+  VALUE kwargs[4];
+  ID kwnames[4];
+  int rc, current;
+  uint64_t gen;
+
+  rb_scan_args(argc, argv, "1:&", &name, &opts, &block);
+  name = index_name(name);
+
+  GetDatabase2(self, ctx, db);
+
+  if (index_find(ctx, name))
+    rb_raise(rb_eArgError, "index %s already exists", StringValueCStr(name));
+
+  kwnames[0] = rb_intern("offset");
+  kwnames[1] = rb_intern("length");
+  kwnames[2] = rb_intern("delimiter");
+  kwnames[3] = rb_intern("field");
+  kwargs[0] = kwargs[1] = kwargs[2] = kwargs[3] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 4, kwargs);
+
+  memset(&idx, 0, sizeof(idx));
+  idx.proc = Qnil;
+  idx.length = -1;
+
+  if (!NIL_P(block))
+  {
+    idx.kind = UNQLITE_RUBY_INDEX_PROC;
+    idx.proc = block;
+  }
+  else if (kwargs[0] != Qundef)
+  {
+    idx.kind = UNQLITE_RUBY_INDEX_OFFSET;
+    idx.offset = NUM2LONG(kwargs[0]);
+    if (kwargs[1] != Qundef) idx.length = NUM2LONG(kwargs[1]);
+    if (idx.offset < 0 || (kwargs[1] != Qundef && idx.length < 0))
+      rb_raise(rb_eArgError, "offset and length must be positive");
+  }
+  else if (kwargs[2] != Qundef)
+  {
+    Check_Type(kwargs[2], T_STRING);
+    if (RSTRING_LEN(kwargs[2]) != 1)
+      rb_raise(rb_eArgError, "delimiter must be a single byte");
+    idx.kind = UNQLITE_RUBY_INDEX_DELIMITER;
+    idx.delimiter = RSTRING_PTR(kwargs[2])[0];
+    idx.field = kwargs[3] != Qundef ? NUM2LONG(kwargs[3]) : 0;
+    if (idx.field < 0)
+      rb_raise(rb_eArgError, "field must be positive");
+  }
+  else
+    rb_raise(rb_eArgError, "an extractor block, offset: or delimiter: is required");
+
+  // Borrow the name until the index is registered, so raising leaks nothing
+  idx.name_len = RSTRING_LEN(name);
+  idx.name = RSTRING_PTR(name);
+
+  // Trust the entries only if every write since they were stamped maintained them
+  rc = index_generation(db, &gen);
+  if (rc == UNQLITE_NOTFOUND)
+    current = 0;
+  else
+  {
+    CHECK(db, rc);
+    current = index_current(db, &idx, gen);
+  }
+
+  // Bumps the generation if this starts a transaction
+  unqliteRuby_write_begin(ctx);
+
+  rc = index_generation(db, &gen);
+  if (rc == UNQLITE_NOTFOUND)
+  {
+    unsigned char buf[8];
+    gen = 0;
+    index_encode64(buf, gen);
+    rc = unqlite_kv_store(db, UNQLITE_RUBY_INDEX_PREFIX, UNQLITE_RUBY_INDEX_PREFIX_LEN, buf, sizeof(buf));
+  }
+  CHECK(db, rc);
+
+  idx.name = ALLOC_N(char, idx.name_len);
+  memcpy(idx.name, RSTRING_PTR(name), idx.name_len);
+
+  REALLOC_N(ctx->indexes, unqliteRubyIndex, ctx->nindexes + 1);
+  ctx->indexes[ctx->nindexes++] = idx;
+  RB_OBJ_WRITTEN(self, Qundef, idx.proc);
+
+  if (!current)
+  {
+    index_clear(db, &ctx->indexes[ctx->nindexes - 1]);
+    index_build(ctx, &ctx->indexes[ctx->nindexes - 1]);
+  }
+  rc = index_stamp(db, &ctx->indexes[ctx->nindexes - 1], gen);
+  CHECK(db, rc);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.drop_index(name)
+ *
+ * Unregisters the secondary index _name_ and deletes its entries.
+ */
+static VALUE unqlite_database_drop_index(VALUE self, VALUE name)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  unqliteRubyIndex *idx;
+  int rc;
+  volatile VALUE marker;
+
+  name = index_name(name);
+
+  GetDatabase2(self, ctx, db);
+
+  idx = index_find(ctx, name);
+  if (!idx)
+    rb_raise(rb_eArgError, "unknown index %s", StringValueCStr(name));
+
+  unqliteRuby_write_begin(ctx);
+  index_clear(db, idx);
+
+  marker = index_marker(idx);
+  rc = unqlite_kv_delete(db, RSTRING_PTR(marker), RSTRING_LEN(marker));
+  if (rc != UNQLITE_NOTFOUND)
+    CHECK(db, rc);
+
+  xfree(idx->name);
+  ctx->nindexes--;
+  memmove(idx, idx + 1, (ctx->indexes + ctx->nindexes - idx) * sizeof(unqliteRubyIndex));
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.lookup_by(name, value) -> array of keys
+ *
+ * Returns the keys whose records are indexed under _value_ by the
+ * secondary index _name_.
+ */
+static VALUE unqlite_database_lookup_by(VALUE self, VALUE name, VALUE value)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  unqliteRubyIndex *idx;
+
+  name = index_name(name);
+  Check_Type(value, T_STRING);
+
+  GetDatabase2(self, ctx, db);
+
+  idx = index_find(ctx, name);
+  if (!idx)
+    rb_raise(rb_eArgError, "unknown index %s", StringValueCStr(name));
+
+  return index_prefix_scan(db, index_entry_prefix(idx, value));
+}
+
+void Init_unqlite_index()
+{
+  rb_define_method(cUnQLiteDatabase, "add_index", unqlite_database_add_index, -1);
+  rb_define_method(cUnQLiteDatabase, "drop_index", unqlite_database_drop_index, 1);
+  rb_define_method(cUnQLiteDatabase, "lookup_by", unqlite_database_lookup_by, 2);
+}
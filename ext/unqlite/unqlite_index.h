@@ -0,0 +1,50 @@
+#ifndef UNQLITE_RUBY_INDEX
+#define UNQLITE_RUBY_INDEX
+
+#include <unqlite_ruby.h>
+#include <stdint.h>
+
+struct _unqliteRuby;
+
+/*
+ * Index entries live under this prefix: "\0idx\0<name>\0<len><value><key>".
+ * "\0idx\0<name>" is the marker of an index, and the bare prefix holds
+ * the index generation.
+ */
+#define UNQLITE_RUBY_INDEX_PREFIX     "\0idx\0"
+#define UNQLITE_RUBY_INDEX_PREFIX_LEN 5
+
+/* Kind of value extractor used by an index */
+#define UNQLITE_RUBY_INDEX_PROC      0
+#define UNQLITE_RUBY_INDEX_OFFSET    1
+#define UNQLITE_RUBY_INDEX_DELIMITER 2
+
+/* Write operations going through the indexed write path */
+#define UNQLITE_RUBY_WRITE_STORE  0
+#define UNQLITE_RUBY_WRITE_APPEND 1
+#define UNQLITE_RUBY_WRITE_DELETE 2
+
+typedef struct _unqliteRubyIndex
+{
+  char *name;
+  long name_len;
+  int kind;
+  long offset;    /* INDEX_OFFSET: first byte of the value to index */
+  long length;    /* INDEX_OFFSET: number of bytes (-1 means up to the end) */
+  char delimiter; /* INDEX_DELIMITER: field separator */
+  long field;     /* INDEX_DELIMITER: zero-based field number */
+  VALUE proc;     /* INDEX_PROC: callable receiving (key, value) */
+} unqliteRubyIndex;
+
+void Init_unqlite_index();
+void unqliteRuby_index_mark(struct _unqliteRuby *ctx);
+void unqliteRuby_index_compact(struct _unqliteRuby *ctx);
+size_t unqliteRuby_index_memsize(const struct _unqliteRuby *ctx);
+void unqliteRuby_index_free(struct _unqliteRuby *ctx);
+VALUE unqliteRuby_index_entries(struct _unqliteRuby *ctx, VALUE key, VALUE value);
+int unqliteRuby_index_apply(unqlite *db, VALUE old_entries, VALUE new_entries);
+void unqliteRuby_index_write(struct _unqliteRuby *ctx, VALUE key, VALUE value, int op);
+int unqliteRuby_index_bump(unqlite *db, uint64_t *gen);
+int unqliteRuby_index_touch(struct _unqliteRuby *ctx);
+
+#endif
@@ -0,0 +1,345 @@
+#include <unqlite_key.h>
+#include <ruby/encoding.h>
+
+/*
+ * Document-module: UnQLite::Key
+ *
+ * Memcomparable key encoding: the byte order of encoded keys, the order
+ * of unqlite's cursors and Database#each_range, matches the order of
+ * the values they encode. An Array is encoded as the concatenation of
+ * its elements, so the encoding of a tuple is a prefix of the encodings
+ * of its extensions and tuple prefixes select contiguous ranges.
+ *
+ * Each element is a type tag followed by a payload:
+ *
+ * - Integer (64 bits): big-endian two's complement with the sign bit
+ *   flipped.
+ * - Float: big-endian IEEE 754 bits; the sign bit flipped for positive
+ *   numbers, every bit for negative ones. NaN sorts after Infinity.
+ * - Time: seconds as an Integer, then 32 bits of nanoseconds.
+ * - String and Symbol: the bytes, with 0x00 escaped as 0x00 0xFF, then
+ *   0x00. Binary (ASCII-8BIT) Strings and text Strings, stored as UTF-8,
+ *   have different tags.
+ * - nil, false and true: the tag alone.
+ * - Nested Array: its elements, then 0x00.
+ *
+ * Values of different types sort by tag: nil, false, true, Integer,
+ * Float, Time, binary String, text String, Symbol, Array. Encoded keys
+ * never start with 0x00, so they do not collide with the keys the
+ * binding stores for itself.
+ */
+
+VALUE mUnQLiteKey;
+
+static void key_put_u64(VALUE buf, unsigned char tag, uint64_t u)
+{
+  unsigned char bytes[9];
+  int i;
+
+  bytes[0] = tag;
+  for (i = 8; i > 0; i--)
+  {
+    bytes[i] = (unsigned char)u;
+    u >>= 8;
+  }
+  rb_str_cat(buf, (const char *)bytes, sizeof(bytes));
+}
+
+static uint64_t key_get_u64(const unsigned char *p)
+{
+  uint64_t u = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    u = (u << 8) | p[i];
+  return u;
+}
+
+/* Escaped bytes and terminator; memchr skips the runs without 0x00 */
+static void key_put_bytes(VALUE buf, unsigned char tag, const char *data, long len)
+{
+  static const char escape[] = { 0x00, (char)0xFF };
+  const char *end = data + len, *zero;
+  char t = (char)tag;
+
+  rb_str_cat(buf, &t, 1);
+  while ((zero = memchr(data, 0, end - data)) != NULL)
+  {
+    rb_str_cat(buf, data, zero - data);
+    rb_str_cat(buf, escape, sizeof(escape));
+    data = zero + 1;
+  }
+  rb_str_cat(buf, data, end - data);
+  rb_str_cat(buf, escape, 1);
+}
+
+static void key_put(VALUE buf, VALUE obj, int depth);
+
+static void key_put_elements(VALUE buf, VALUE ary, int depth)
+{
+  long i;
+
+  if (depth > UNQLITE_RUBY_KEY_MAX_DEPTH)
+    rb_raise(rb_eArgError, "key nested too deeply");
+
+  for (i = 0; i < RARRAY_LEN(ary); i++)
+    key_put(buf, RARRAY_AREF(ary, i), depth);
+}
+
+static void key_put(VALUE buf, VALUE obj, int depth)
+{
+  char tag;
+
+  if (NIL_P(obj) || obj == Qfalse || obj == Qtrue)
+  {
+    tag = NIL_P(obj) ? UNQLITE_RUBY_KEY_NIL : obj == Qtrue ? UNQLITE_RUBY_KEY_TRUE : UNQLITE_RUBY_KEY_FALSE;
+    rb_str_cat(buf, &tag, 1);
+  }
+  else if (RB_INTEGER_TYPE_P(obj))
+    key_put_u64(buf, UNQLITE_RUBY_KEY_INT, (uint64_t)NUM2LL(obj) ^ ((uint64_t)1 << 63));
+  else if (RB_FLOAT_TYPE_P(obj))
+  {
+    double d = RFLOAT_VALUE(obj);
+    uint64_t u;
+
+    if (d != d)
+      u = UINT64_C(0x7ff8000000000000);
+    else
+      memcpy(&u, &d, sizeof(u));
+    u = (u >> 63) ? ~u : u ^ ((uint64_t)1 << 63);
+    key_put_u64(buf, UNQLITE_RUBY_KEY_FLOAT, u);
+  }
+  else if (rb_obj_is_kind_of(obj, rb_cTime))
+  {
+    struct timespec ts = rb_time_timespec(obj);
+    unsigned char nsec[4];
+
+    key_put_u64(buf, UNQLITE_RUBY_KEY_TIME, (uint64_t)(int64_t)ts.tv_sec ^ ((uint64_t)1 << 63));
+    nsec[0] = (unsigned char)(ts.tv_nsec >> 24);
+    nsec[1] = (unsigned char)(ts.tv_nsec >> 16);
+    nsec[2] = (unsigned char)(ts.tv_nsec >> 8);
+    nsec[3] = (unsigned char)ts.tv_nsec;
+    rb_str_cat(buf, (const char *)nsec, sizeof(nsec));
+  }
+  else if (RB_TYPE_P(obj, T_STRING))
+  {
+    if (rb_enc_get_index(obj) == rb_ascii8bit_encindex())
+      key_put_bytes(buf, UNQLITE_RUBY_KEY_BYTES, RSTRING_PTR(obj), RSTRING_LEN(obj));
+    else
+    {
+      VALUE utf8 = rb_str_conv_enc(obj, rb_enc_get(obj), rb_utf8_encoding());
+      key_put_bytes(buf, UNQLITE_RUBY_KEY_TEXT, RSTRING_PTR(utf8), RSTRING_LEN(utf8));
+      RB_GC_GUARD(utf8);
+    }
+  }
+  else if (SYMBOL_P(obj))
+  {
+    VALUE name = rb_sym2str(obj);
+    key_put_bytes(buf, UNQLITE_RUBY_KEY_SYMBOL, RSTRING_PTR(name), RSTRING_LEN(name));
+  }
+  else if (RB_TYPE_P(obj, T_ARRAY))
+  {
+    tag = UNQLITE_RUBY_KEY_ARRAY;
+    rb_str_cat(buf, &tag, 1);
+    key_put_elements(buf, obj, depth + 1);
+    tag = UNQLITE_RUBY_KEY_END;
+    rb_str_cat(buf, &tag, 1);
+  }
+  else
+    rb_raise(rb_eTypeError, "can't encode %"PRIsVALUE" in a key", rb_obj_class(obj));
+}
+
+/* Encode _tuple_, an Array or a single value */
+VALUE unqliteRuby_key_encode(VALUE tuple)
+{
+  VALUE buf = rb_str_buf_new(32);
+
+  if (RB_TYPE_P(tuple, T_ARRAY))
+    key_put_elements(buf, tuple, 0);
+  else
+    key_put(buf, tuple, 0);
+  rb_enc_associate_index(buf, rb_ascii8bit_encindex());
+  return buf;
+}
+
+/*
+ * A range bound: Strings are taken as they are, anything else is
+ * encoded. An _upper_ bound given as an Array also covers every key
+ * extending it.
+ */
+VALUE unqliteRuby_key_bound(VALUE bound, int upper)
+{
+  static const char extend = (char)UNQLITE_RUBY_KEY_UPPER;
+  VALUE key;
+
+  if (NIL_P(bound) || RB_TYPE_P(bound, T_STRING))
+    return bound;
+
+  key = unqliteRuby_key_encode(bound);
+  if (upper && RB_TYPE_P(bound, T_ARRAY))
+    rb_str_cat(key, &extend, 1);
+  return key;
+}
+
+static void key_malformed()
+{
+  rb_raise(rb_eArgError, "malformed key");
+}
+
+static VALUE key_get_bytes(const unsigned char **pp, const unsigned char *end, rb_encoding *enc)
+{
+  const unsigned char *p = *pp, *zero;
+  VALUE str = rb_str_buf_new(end - p);
+
+  for (;;)
+  {
+    zero = memchr(p, 0, end - p);
+    if (!zero)
+      key_malformed();
+    rb_str_cat(str, (const char *)p, zero - p);
+    if (zero + 1 < end && zero[1] == 0xFF)
+    {
+      rb_str_cat(str, "", 1);
+      p = zero + 2;
+    }
+    else
+    {
+      *pp = zero + 1;
+      break;
+    }
+  }
+  rb_enc_associate(str, enc);
+  return str;
+}
+
+static VALUE key_get(const unsigned char **pp, const unsigned char *end, int depth)
+{
+  const unsigned char *p = *pp;
+  unsigned char tag = *p++;
+  VALUE obj;
+  uint64_t u;
+
+  switch (tag)
+  {
+    case UNQLITE_RUBY_KEY_NIL:
+      obj = Qnil;
+      break;
+    case UNQLITE_RUBY_KEY_FALSE:
+      obj = Qfalse;
+      break;
+    case UNQLITE_RUBY_KEY_TRUE:
+      obj = Qtrue;
+      break;
+    case UNQLITE_RUBY_KEY_INT:
+      if (end - p < 8)
+        key_malformed();
+      obj = LL2NUM((int64_t)(key_get_u64(p) ^ ((uint64_t)1 << 63)));
+      p += 8;
+      break;
+    case UNQLITE_RUBY_KEY_FLOAT:
+    {
+      double d;
+
+      if (end - p < 8)
+        key_malformed();
+      u = key_get_u64(p);
+      u = (u >> 63) ? u ^ ((uint64_t)1 << 63) : ~u;
+      memcpy(&d, &u, sizeof(d));
+      obj = DBL2NUM(d);
+      p += 8;
+      break;
+    }
+    case UNQLITE_RUBY_KEY_TIME:
+    {
+      long nsec;
+
+      if (end - p < 12)
+        key_malformed();
+      u = key_get_u64(p) ^ ((uint64_t)1 << 63);
+      nsec = ((long)p[8] << 24) | ((long)p[9] << 16) | ((long)p[10] << 8) | p[11];
+      if (nsec >= 1000000000)
+        key_malformed();
+      obj = rb_time_nano_new((time_t)(int64_t)u, nsec);
+      p += 12;
+      break;
+    }
+    case UNQLITE_RUBY_KEY_BYTES:
+      obj = key_get_bytes(&p, end, rb_ascii8bit_encoding());
+      break;
+    case UNQLITE_RUBY_KEY_TEXT:
+      obj = key_get_bytes(&p, end, rb_utf8_encoding());
+      break;
+    case UNQLITE_RUBY_KEY_SYMBOL:
+      obj = rb_str_intern(key_get_bytes(&p, end, rb_utf8_encoding()));
+      break;
+    case UNQLITE_RUBY_KEY_ARRAY:
+      if (depth >= UNQLITE_RUBY_KEY_MAX_DEPTH)
+        key_malformed();
+      obj = rb_ary_new();
+      for (;;)
+      {
+        if (p >= end)
+          key_malformed();
+        if (*p == UNQLITE_RUBY_KEY_END)
+        {
+          p++;
+          break;
+        }
+        rb_ary_push(obj, key_get(&p, end, depth + 1));
+      }
+      break;
+    default:
+      key_malformed();
+      obj = Qnil;
+  }
+
+  *pp = p;
+  return obj;
+}
+
+/*
+ * call-seq:
+ *     UnQLite::Key.encode(tuple) -> String
+ *
+ * Encodes _tuple_, an Array of Integers, Floats, Times, Strings,
+ * Symbols, booleans, nils and nested Arrays, or one such value, into a
+ * binary String whose byte order follows the order of the values.
+ *
+ *     UnQLite::Key.encode([42, Time.now, "name"])
+ */
+static VALUE unqlite_key_s_encode(VALUE klass, VALUE tuple)
+{
+  return unqliteRuby_key_encode(tuple);
+}
+
+/*
+ * call-seq:
+ *     UnQLite::Key.decode(key) -> Array
+ *
+ * Decodes a key made by UnQLite::Key.encode. The result is always an
+ * Array: encoding a single value and a one-element Array give the same
+ * key. Raises ArgumentError for malformed keys.
+ */
+static VALUE unqlite_key_s_decode(VALUE klass, VALUE key)
+{
+  const unsigned char *p, *end;
+  VALUE tuple = rb_ary_new();
+
+  StringValue(key);
+  p = (const unsigned char *)RSTRING_PTR(key);
+  end = p + RSTRING_LEN(key);
+
+  while (p < end)
+    rb_ary_push(tuple, key_get(&p, end, 0));
+
+  RB_GC_GUARD(key);
+  return tuple;
+}
+
+void Init_unqlite_key()
+{
+  mUnQLiteKey = rb_define_module_under(mUnQLite, "Key");
+
+  rb_define_singleton_method(mUnQLiteKey, "encode", unqlite_key_s_encode, 1);
+  rb_define_singleton_method(mUnQLiteKey, "decode", unqlite_key_s_decode, 1);
+}
@@ -0,0 +1,31 @@
+#ifndef UNQLITE_RUBY_KEY
+#define UNQLITE_RUBY_KEY
+
+#include <unqlite_ruby.h>
+
+/* Type tags of the key encoding; none is 0x00 (internal keys) or 0xFF */
+#define UNQLITE_RUBY_KEY_END    0x00  /* closes a nested Array */
+#define UNQLITE_RUBY_KEY_NIL    0x05
+#define UNQLITE_RUBY_KEY_FALSE  0x06
+#define UNQLITE_RUBY_KEY_TRUE   0x07
+#define UNQLITE_RUBY_KEY_INT    0x10
+#define UNQLITE_RUBY_KEY_FLOAT  0x20
+#define UNQLITE_RUBY_KEY_TIME   0x30
+#define UNQLITE_RUBY_KEY_BYTES  0x40
+#define UNQLITE_RUBY_KEY_TEXT   0x41
+#define UNQLITE_RUBY_KEY_SYMBOL 0x42
+#define UNQLITE_RUBY_KEY_ARRAY  0x50
+
+/* Byte sorting after every encoding that starts with a given one */
+#define UNQLITE_RUBY_KEY_UPPER  0xFF
+
+/* Arrays nested deeper than this are rejected */
+#define UNQLITE_RUBY_KEY_MAX_DEPTH 32
+
+extern VALUE mUnQLiteKey;
+
+void Init_unqlite_key();
+VALUE unqliteRuby_key_encode(VALUE tuple);
+VALUE unqliteRuby_key_bound(VALUE bound, int upper);
+
+#endif
@@ -0,0 +1,986 @@
+#include <unqlite_order.h>
+
+/*
+ * Key order
+ *
+ * unqlite's on-disk engine is a hash table: cursors walk keys in storage
+ * order and MATCH_GE/MATCH_LE seeks are of little use. Once enabled, a
+ * handle keeps every user key in an in-memory B+tree maintained by the
+ * binding's write paths, so range scans visit keys in byte order and
+ * only fetch the values they yield.
+ *
+ * Leaves store each key minus the prefix shared by the whole leaf (long
+ * for time-series keys) and are linked to their siblings, so scans in
+ * either direction step through leaves without descending the tree.
+ * Writes that cannot be tracked key by key, like a rollback, mark the
+ * tree stale and it is rebuilt by a full scan on next use.
+ *
+ * This is not a storage engine: the file is still written by the hash
+ * engine and Database#kv_engine is unaffected. An ordered engine would
+ * be an unqlite_kv_methods implementation laying out B+tree pages
+ * through the unqlite_kv_io methods of the pager (which provides
+ * paging, journaling and locking) and registered with
+ * UNQLITE_LIB_CONFIG_STORAGE_ENGINE; this extension does not ship one.
+ */
+
+#define ORDER_FANOUT UNQLITE_RUBY_ORDER_FANOUT
+
+/* Keys under the "\0" prefix belong to the binding (indexes, expiry) */
+#define ORDER_INTERNAL(key, len) ((len) > 0 && (key)[0] == '\0')
+
+static void order_key_copy(unqliteRubyOrderKey *dst, const char *data, long len)
+{
+  dst->data = ALLOC_N(char, len > 0 ? len : 1);
+  if (len > 0)
+    memcpy(dst->data, data, len);
+  dst->len = len;
+}
+
+static int order_cmp(const char *a, long alen, const char *b, long blen)
+{
+  long n = alen < blen ? alen : blen;
+  int c = n > 0 ? memcmp(a, b, n) : 0;
+
+  if (c)
+    return c;
+  return alen < blen ? -1 : alen > blen;
+}
+
+static unqliteRubyOrderNode* order_node_new(int leaf)
+{
+  unqliteRubyOrderNode *node = ALLOC(unqliteRubyOrderNode);
+  memset(node, 0, sizeof(unqliteRubyOrderNode));
+  node->leaf = leaf;
+  return node;
+}
+
+/* Drop the keys of a leaf, keeping its links */
+static void order_leaf_reset(unqliteRubyOrderNode *node)
+{
+  int i;
+
+  for (i = 0; i < node->count; i++)
+    xfree(node->keys[i].data);
+  xfree(node->prefix);
+  node->prefix = NULL;
+  node->plen = 0;
+  node->count = 0;
+}
+
+static void order_node_free(unqliteRubyOrderNode *node)
+{
+  int i;
+
+  if (node->leaf)
+    order_leaf_reset(node);
+  else
+  {
+    for (i = 0; i < node->count; i++)
+    {
+      if (i > 0)
+        xfree(node->keys[i - 1].data);
+      order_node_free(node->children[i]);
+    }
+  }
+  xfree(node);
+}
+
+/* The full key _i_ of a leaf, in a new buffer */
+static void order_leaf_key(unqliteRubyOrderNode *node, int i, unqliteRubyOrderKey *out)
+{
+  out->len = node->plen + node->keys[i].len;
+  out->data = ALLOC_N(char, out->len > 0 ? out->len : 1);
+  if (node->plen > 0)
+    memcpy(out->data, node->prefix, node->plen);
+  if (node->keys[i].len > 0)
+    memcpy(out->data + node->plen, node->keys[i].data, node->keys[i].len);
+}
+
+/* Fill an empty leaf with the _n_ sorted full keys, factoring out their common prefix */
+static void order_leaf_fill(unqliteRubyOrderNode *node, unqliteRubyOrderKey *full, int n)
+{
+  long plen = 0, max;
+  int i;
+
+  // The keys being sorted, the first and last share the shortest prefix
+  if (n > 1)
+  {
+    max = full[0].len < full[n - 1].len ? full[0].len : full[n - 1].len;
+    while (plen < max && full[0].data[plen] == full[n - 1].data[plen])
+      plen++;
+  }
+
+  node->prefix = ALLOC_N(char, plen > 0 ? plen : 1);
+  if (plen > 0)
+    memcpy(node->prefix, full[0].data, plen);
+  node->plen = plen;
+
+  for (i = 0; i < n; i++)
+    order_key_copy(&node->keys[i], full[i].data + plen, full[i].len - plen);
+  node->count = n;
+}
+
+/* Index of the first key of a leaf not less than _key_ */
+static int order_leaf_search(unqliteRubyOrderNode *node, const char *key, long len, int *found)
+{
+  long n = node->plen < len ? node->plen : len;
+  int c = n > 0 ? memcmp(node->prefix, key, n) : 0;
+  int lo = 0, hi = node->count, mid;
+
+  *found = 0;
+
+  // Keys outside the shared prefix sort before or after the whole leaf
+  if (c > 0 || (c == 0 && len < node->plen))
+    return 0;
+  if (c < 0)
+    return node->count;
+
+  key += node->plen;
+  len -= node->plen;
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (order_cmp(node->keys[mid].data, node->keys[mid].len, key, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *found = lo < node->count && order_cmp(node->keys[lo].data, node->keys[lo].len, key, len) == 0;
+  return lo;
+}
+
+/* Index of the child of a branch whose range holds _key_ */
+static int order_branch_search(unqliteRubyOrderNode *node, const char *key, long len)
+{
+  int lo = 0, hi = node->count - 1, mid;
+
+  while (lo < hi)
+  {
+    mid = (lo + hi) / 2;
+    if (order_cmp(node->keys[mid].data, node->keys[mid].len, key, len) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Compare key _i_ of a leaf with _key_ */
+static int order_leaf_cmp(unqliteRubyOrderNode *node, int i, const char *key, long len)
+{
+  long n = node->plen < len ? node->plen : len;
+  int c = n > 0 ? memcmp(node->prefix, key, n) : 0;
+
+  if (c)
+    return c;
+  if (len < node->plen)
+    return 1;
+  return order_cmp(node->keys[i].data, node->keys[i].len, key + node->plen, len - node->plen);
+}
+
+struct order_split
+{
+  unqliteRubyOrderNode *right;  /* new right sibling, or NULL */
+  unqliteRubyOrderKey sep;      /* smallest key under _right_ */
+};
+
+static int order_leaf_insert(unqliteRubyOrderNode *node, const char *key, long len, struct order_split *split)
+{
+  unqliteRubyOrderKey full[ORDER_FANOUT + 1];
+  unqliteRubyOrderNode *right;
+  int found, pos, i, j, n, h;
+
+  pos = order_leaf_search(node, key, len, &found);
+  if (found)
+    return 0;
+
+  // Common case: room left and the key shares the leaf's prefix
+  if (node->count < ORDER_FANOUT && len >= node->plen &&
+      (node->plen == 0 || memcmp(node->prefix, key, node->plen) == 0))
+  {
+    memmove(&node->keys[pos + 1], &node->keys[pos], (node->count - pos) * sizeof(unqliteRubyOrderKey));
+    order_key_copy(&node->keys[pos], key + node->plen, len - node->plen);
+    node->count++;
+    return 1;
+  }
+
+  // Otherwise rebuild the leaf (or two) from the full keys
+  n = node->count + 1;
+  for (i = 0, j = 0; i < n; i++)
+  {
+    if (i == pos)
+      order_key_copy(&full[i], key, len);
+    else
+      order_leaf_key(node, j++, &full[i]);
+  }
+  order_leaf_reset(node);
+
+  if (n <= ORDER_FANOUT)
+    order_leaf_fill(node, full, n);
+  else
+  {
+    h = n / 2;
+    right = order_node_new(1);
+    order_leaf_fill(node, full, h);
+    order_leaf_fill(right, full + h, n - h);
+
+    right->prev = node;
+    right->next = node->next;
+    if (node->next)
+      node->next->prev = right;
+    node->next = right;
+
+    split->right = right;
+    order_key_copy(&split->sep, full[h].data, full[h].len);
+  }
+
+  for (i = 0; i < n; i++)
+    xfree(full[i].data);
+  return 1;
+}
+
+static int order_insert(unqliteRubyOrderNode *node, const char *key, long len, struct order_split *split)
+{
+  struct order_split child;
+  unqliteRubyOrderNode *right;
+  int i, h, inserted;
+
+  if (node->leaf)
+    return order_leaf_insert(node, key, len, split);
+
+  i = order_branch_search(node, key, len);
+  child.right = NULL;
+  inserted = order_insert(node->children[i], key, len, &child);
+  if (!child.right)
+    return inserted;
+
+  memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i - 1) * sizeof(unqliteRubyOrderNode *));
+  memmove(&node->keys[i + 1], &node->keys[i], (node->count - 1 - i) * sizeof(unqliteRubyOrderKey));
+  node->children[i + 1] = child.right;
+  node->keys[i] = child.sep;
+  node->count++;
+
+  if (node->count > ORDER_FANOUT)
+  {
+    // The left half keeps _h_ children; the separator between the halves moves up
+    h = node->count / 2;
+    right = order_node_new(0);
+    right->count = node->count - h;
+    memcpy(right->children, &node->children[h], right->count * sizeof(unqliteRubyOrderNode *));
+    memcpy(right->keys, &node->keys[h], (right->count - 1) * sizeof(unqliteRubyOrderKey));
+    split->right = right;
+    split->sep = node->keys[h - 1];
+    node->count = h;
+  }
+
+  return inserted;
+}
+
+/* Remove _key_; *emptied tells the parent to drop this node */
+static int order_delete(unqliteRubyOrderNode *node, const char *key, long len, int *emptied)
+{
+  unqliteRubyOrderNode *child;
+  int i, h, found, removed, child_emptied = 0;
+
+  *emptied = 0;
+
+  if (node->leaf)
+  {
+    i = order_leaf_search(node, key, len, &found);
+    if (!found)
+      return 0;
+    xfree(node->keys[i].data);
+    memmove(&node->keys[i], &node->keys[i + 1], (node->count - i - 1) * sizeof(unqliteRubyOrderKey));
+    node->count--;
+    *emptied = node->count == 0;
+    return 1;
+  }
+
+  i = order_branch_search(node, key, len);
+  child = node->children[i];
+  removed = order_delete(child, key, len, &child_emptied);
+  if (!child_emptied)
+    return removed;
+
+  // Underfull nodes are left alone; only empty ones go away
+  if (child->leaf)
+  {
+    if (child->prev)
+      child->prev->next = child->next;
+    if (child->next)
+      child->next->prev = child->prev;
+  }
+  order_node_free(child);
+
+  if (node->count > 1)
+  {
+    h = i > 0 ? i - 1 : 0;
+    xfree(node->keys[h].data);
+    memmove(&node->keys[h], &node->keys[h + 1], (node->count - 2 - h) * sizeof(unqliteRubyOrderKey));
+    memmove(&node->children[i], &node->children[i + 1], (node->count - 1 - i) * sizeof(unqliteRubyOrderNode *));
+  }
+  node->count--;
+  *emptied = node->count == 0;
+  return removed;
+}
+
+static void order_add(unqliteRubyOrder *order, const char *key, long len)
+{
+  struct order_split split;
+  unqliteRubyOrderNode *root;
+
+  split.right = NULL;
+  if (!order_insert(order->root, key, len, &split))
+    return;
+
+  if (split.right)
+  {
+    root = order_node_new(0);
+    root->children[0] = order->root;
+    root->children[1] = split.right;
+    root->keys[0] = split.sep;
+    root->count = 2;
+    order->root = root;
+  }
+  order->nkeys++;
+  order->version++;
+}
+
+static void order_remove(unqliteRubyOrder *order, const char *key, long len)
+{
+  unqliteRubyOrderNode *root;
+  int emptied;
+
+  if (!order_delete(order->root, key, len, &emptied))
+    return;
+
+  if (emptied && !order->root->leaf)
+  {
+    order_node_free(order->root);
+    order->root = order_node_new(1);
+  }
+  while (!order->root->leaf && order->root->count == 1)
+  {
+    root = order->root;
+    order->root = root->children[0];
+    xfree(root);
+  }
+  order->nkeys--;
+  order->version++;
+}
+
+/* Leaf and position of the first key >= _key_ (the first key if NULL), or NULL */
+static unqliteRubyOrderNode* order_seek_ge(unqliteRubyOrder *order, const char *key, long len, int *pos)
+{
+  unqliteRubyOrderNode *node = order->root;
+  int found;
+
+  while (!node->leaf)
+    node = node->children[key ? order_branch_search(node, key, len) : 0];
+  *pos = key ? order_leaf_search(node, key, len, &found) : 0;
+
+  while (node && *pos >= node->count)
+  {
+    node = node->next;
+    *pos = 0;
+  }
+  return node;
+}
+
+/* Leaf and position of the last key <= _key_ (the last key if NULL), or NULL */
+static unqliteRubyOrderNode* order_seek_le(unqliteRubyOrder *order, const char *key, long len, int *pos)
+{
+  unqliteRubyOrderNode *node = order->root;
+  int found;
+
+  while (!node->leaf)
+    node = node->children[key ? order_branch_search(node, key, len) : node->count - 1];
+  if (key)
+  {
+    *pos = order_leaf_search(node, key, len, &found);
+    if (!found)
+      (*pos)--;
+  }
+  else
+    *pos = node->count - 1;
+
+  while (node && *pos < 0)
+  {
+    node = node->prev;
+    if (node)
+      *pos = node->count - 1;
+  }
+  return node;
+}
+
+static VALUE order_key_str(unqliteRubyOrderNode *node, int i)
+{
+  VALUE key = rb_str_new(NULL, node->plen + node->keys[i].len);
+
+  if (node->plen > 0)
+    memcpy(RSTRING_PTR(key), node->prefix, node->plen);
+  if (node->keys[i].len > 0)
+    memcpy(RSTRING_PTR(key) + node->plen, node->keys[i].data, node->keys[i].len);
+  return key;
+}
+
+static void order_reset(unqliteRubyOrder *order)
+{
+  if (order->root)
+    order_node_free(order->root);
+  order->root = order_node_new(1);
+  order->nkeys = 0;
+  order->version++;
+}
+
+/* Load every user key of the database */
+static void order_build(unqliteRubyPtr ctx)
+{
+  unqliteRubyOrder *order = ctx->order;
+  unqlite *db = ctx->pDb;
+  unqlite_kv_cursor *cursor;
+  char *buf = NULL;
+  int cap = 0, klen, rc;
+
+  order_reset(order);
+  order->stale = 0;
+
+  rc = unqliteRuby_cursor_acquire(ctx, &cursor);
+  CHECK(db, rc);
+
+  unqlite_kv_cursor_first_entry(cursor);
+  while (rc == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor))
+  {
+    rc = unqlite_kv_cursor_key(cursor, NULL, &klen);
+    if (rc == UNQLITE_OK)
+    {
+      if (klen > cap)
+      {
+        cap = klen;
+        REALLOC_N(buf, char, cap);
+      }
+      rc = unqlite_kv_cursor_key(cursor, buf, &klen);
+      if (rc == UNQLITE_OK && !ORDER_INTERNAL(buf, klen))
+        order_add(order, buf, klen);
+    }
+    unqlite_kv_cursor_next_entry(cursor);
+  }
+
+  unqliteRuby_cursor_recycle(ctx, cursor);
+  xfree(buf);
+  if (rc != UNQLITE_OK)
+    order->stale = 1;
+  CHECK(db, rc);
+}
+
+/* The handle's tree, enabling and loading it if needed */
+static unqliteRubyOrder* order_get(unqliteRubyPtr ctx)
+{
+  if (!ctx->order)
+  {
+    ctx->order = ALLOC(unqliteRubyOrder);
+    memset(ctx->order, 0, sizeof(unqliteRubyOrder));
+    ctx->order->stale = 1;
+  }
+  if (ctx->order->stale)
+    order_build(ctx);
+  return ctx->order;
+}
+
+static size_t order_node_memsize(const unqliteRubyOrderNode *node)
+{
+  size_t size = sizeof(unqliteRubyOrderNode);
+  int i;
+
+  if (node->leaf)
+  {
+    size += node->plen;
+    for (i = 0; i < node->count; i++)
+      size += node->keys[i].len;
+  }
+  else
+  {
+    for (i = 0; i < node->count; i++)
+      size += (i > 0 ? node->keys[i - 1].len : 0) + order_node_memsize(node->children[i]);
+  }
+  return size;
+}
+
+size_t unqliteRuby_order_memsize(const struct _unqliteRuby *ctx)
+{
+  if (!ctx->order)
+    return 0;
+  return sizeof(unqliteRubyOrder) + (ctx->order->root ? order_node_memsize(ctx->order->root) : 0);
+}
+
+/* A key was written */
+void unqliteRuby_order_add(unqliteRubyPtr ctx, const char *key, long len)
+{
+  if (ctx->order && !ctx->order->stale && !ORDER_INTERNAL(key, len))
+    order_add(ctx->order, key, len);
+}
+
+/* A key was deleted */
+void unqliteRuby_order_remove(unqliteRubyPtr ctx, const char *key, long len)
+{
+  if (ctx->order && !ctx->order->stale && !ORDER_INTERNAL(key, len))
+    order_remove(ctx->order, key, len);
+}
+
+/* The database changed in ways the tree cannot follow */
+void unqliteRuby_order_invalidate(unqliteRubyPtr ctx)
+{
+  if (!ctx->order)
+    return;
+  ctx->order->stale = 1;
+  ctx->order->version++;
+}
+
+/* Every key was deleted */
+void unqliteRuby_order_clear(unqliteRubyPtr ctx)
+{
+  if (!ctx->order)
+    return;
+  order_reset(ctx->order);
+  ctx->order->stale = 0;
+}
+
+void unqliteRuby_order_free(unqliteRubyPtr ctx)
+{
+  if (!ctx->order)
+    return;
+  if (ctx->order->root)
+    order_node_free(ctx->order->root);
+  xfree(ctx->order);
+  ctx->order = NULL;
+}
+
+/*
+ * call-seq:
+ *     database.enable_key_order -> true
+ *
+ * Keeps the keys of this handle in an in-memory B+tree, so #each_range,
+ * #first_key and #last_key walk them in byte order. Loading it scans
+ * the database once; from then on writes through this handle update it.
+ * Writes by other handles or processes are not seen. The database file
+ * itself keeps the storage order of its kv_engine.
+ */
+static VALUE unqlite_database_enable_key_order(VALUE self)
+{
+  unqliteRubyPtr ctx;
+
+  GetDatabase(self, ctx);
+  order_get(ctx);
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.disable_key_order -> true
+ *
+ * Frees the key order tree.
+ */
+static VALUE unqlite_database_disable_key_order(VALUE self)
+{
+  unqliteRubyPtr ctx;
+
+  GetDatabase(self, ctx);
+  unqliteRuby_order_free(ctx);
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.key_order? -> true or false
+ */
+static VALUE unqlite_database_key_order_p(VALUE self)
+{
+  unqliteRubyPtr ctx;
+
+  GetDatabase(self, ctx);
+  return ctx->order ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *     database.each_range(from = nil, to = nil, reverse: false, keys_only: false) { |key, value| ... }
+ *
+ * Yields the keys between _from_ and _to_ (both inclusive, nil meaning
+ * unbounded) in byte order, or in reverse order with _reverse_, together
+ * with their values unless _keys_only_. Expired keys are skipped.
+ * Enables the key order (see #enable_key_order) on first use.
+ *
+ * Bounds other than Strings are encoded with UnQLite::Key.encode. An
+ * Array _to_ also covers the keys extending it, so a tuple prefix
+ * selects every key starting with it:
+ *
+ *     database.each_range([tenant_id], [tenant_id]) { |key, value| ... }
+ *     database.each_range([tenant_id, from_time], [tenant_id, to_time]) { |key, value| ... }
+ *
+ * The block may write to the database; the scan then resumes after the
+ * last key it yielded.
+ */
+static VALUE unqlite_database_each_range(int argc, VALUE* argv, VALUE self)
+{
+  static ID kwnames[2];
+  unqliteRubyPtr ctx;
+  unqliteRubyOrder *order;
+  unqliteRubyOrderNode *node = NULL;
+  VALUE from, to, opts, kwargs[2], key, value;
+  volatile VALUE last = Qnil;
+  unsigned long version = 0;
+  int reverse = 0, keys_only = 0, pos = 0, started = 0;
+
+  rb_scan_args(argc, argv, "02:", &from, &to, &opts);
+
+  if (!kwnames[0])
+  {
+    kwnames[0] = rb_intern("reverse");
+    kwnames[1] = rb_intern("keys_only");
+  }
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 2, kwargs);
+  reverse = kwargs[0] != Qundef && RTEST(kwargs[0]);
+  keys_only = kwargs[1] != Qundef && RTEST(kwargs[1]);
+
+  from = unqliteRuby_key_bound(from, 0);
+  to = unqliteRuby_key_bound(to, 1);
+  rb_need_block();
+
+  GetDatabase(self, ctx);
+  order_get(ctx);
+
+  for (;;)
+  {
+    // Closed or disabled by the block?
+    GetDatabase(self, ctx);
+    if (!ctx->order)
+      break;
+    order = order_get(ctx);
+
+    // Changed since the last step: find our place again
+    if (!started || order->version != version)
+    {
+      if (!started)
+      {
+        VALUE bound = reverse ? to : from;
+        if (reverse)
+          node = order_seek_le(order, NIL_P(bound) ? NULL : RSTRING_PTR(bound), NIL_P(bound) ? 0 : RSTRING_LEN(bound), &pos);
+        else
+          node = order_seek_ge(order, NIL_P(bound) ? NULL : RSTRING_PTR(bound), NIL_P(bound) ? 0 : RSTRING_LEN(bound), &pos);
+        started = 1;
+      }
+      else if (reverse)
+      {
+        node = order_seek_le(order, RSTRING_PTR(last), RSTRING_LEN(last), &pos);
+        if (node && order_leaf_cmp(node, pos, RSTRING_PTR(last), RSTRING_LEN(last)) == 0)
+          pos--;
+      }
+      else
+      {
+        node = order_seek_ge(order, RSTRING_PTR(last), RSTRING_LEN(last), &pos);
+        if (node && order_leaf_cmp(node, pos, RSTRING_PTR(last), RSTRING_LEN(last)) == 0)
+          pos++;
+      }
+      version = order->version;
+    }
+
+    // Step over the leaf boundary
+    while (node && pos >= node->count)
+    {
+      node = node->next;
+      pos = 0;
+    }
+    while (node && pos < 0)
+    {
+      node = node->prev;
+      if (node)
+        pos = node->count - 1;
+    }
+    if (!node)
+      break;
+
+    key = order_key_str(node, pos);
+    if (reverse ? !NIL_P(from) && order_cmp(RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(from), RSTRING_LEN(from)) < 0
+                : !NIL_P(to) && order_cmp(RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(to), RSTRING_LEN(to)) > 0)
+      break;
+    last = key;
+    pos += reverse ? -1 : 1;
+
+    if (unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+      continue;
+
+    if (keys_only)
+      rb_yield(key);
+    else
+    {
+      value = unqliteRuby_fetch(ctx->pDb, key);
+      if (NIL_P(value))
+        continue;
+      rb_yield_values(2, key, value);
+    }
+  }
+
+  return self;
+}
+
+/* The first (or last) live key in order, or nil */
+static VALUE order_edge(VALUE self, int last)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyOrder *order;
+  unqliteRubyOrderNode *node;
+  VALUE key;
+  int pos;
+
+  GetDatabase(self, ctx);
+  order = order_get(ctx);
+
+  node = last ? order_seek_le(order, NULL, 0, &pos) : order_seek_ge(order, NULL, 0, &pos);
+  while (node)
+  {
+    key = order_key_str(node, pos);
+    if (!unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+      return key;
+
+    pos += last ? -1 : 1;
+    while (node && pos >= node->count)
+    {
+      node = node->next;
+      pos = 0;
+    }
+    while (node && pos < 0)
+    {
+      node = node->prev;
+      if (node)
+        pos = node->count - 1;
+    }
+  }
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *     database.first_key -> key or nil
+ *
+ * The smallest key in byte order. Enables the key order on first use.
+ */
+static VALUE unqlite_database_first_key(VALUE self)
+{
+  return order_edge(self, 0);
+}
+
+/*
+ * call-seq:
+ *     database.last_key -> key or nil
+ *
+ * The greatest key in byte order. Enables the key order on first use.
+ */
+static VALUE unqlite_database_last_key(VALUE self)
+{
+  return order_edge(self, 1);
+}
+
+/* Continuation tokens of #page: the last key returned, in hex */
+static VALUE order_token_encode(VALUE key)
+{
+  static const char digits[] = "0123456789abcdef";
+  const unsigned char *p = (const unsigned char *)RSTRING_PTR(key);
+  long i, len = RSTRING_LEN(key);
+  VALUE token = rb_usascii_str_new(NULL, 2 * len);
+  char *out = RSTRING_PTR(token);
+
+  for (i = 0; i < len; i++)
+  {
+    out[2 * i] = digits[p[i] >> 4];
+    out[2 * i + 1] = digits[p[i] & 0x0f];
+  }
+  return rb_obj_freeze(token);
+}
+
+static int order_hex_digit(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static VALUE order_token_decode(VALUE token)
+{
+  const char *p;
+  long i, len;
+  VALUE key;
+  char *out;
+
+  StringValue(token);
+  p = RSTRING_PTR(token);
+  len = RSTRING_LEN(token);
+  if (len % 2)
+    rb_raise(rb_eArgError, "invalid page token");
+
+  key = rb_str_new(NULL, len / 2);
+  out = RSTRING_PTR(key);
+  for (i = 0; i < len / 2; i++)
+  {
+    int hi = order_hex_digit(p[2 * i]), lo = order_hex_digit(p[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      rb_raise(rb_eArgError, "invalid page token");
+    out[i] = (char)(hi << 4 | lo);
+  }
+  return key;
+}
+
+/*
+ * call-seq:
+ *     database.page(after: nil, limit: 100, keys_only: false) -> [entries, token]
+ *
+ * Returns up to _limit_ entries in key byte order, as [key, value]
+ * pairs or, with _keys_only_, keys, along with the token to pass as
+ * _after_ to get the next page; the token is nil on the last page.
+ * Expired keys are skipped. Enables the key order (see
+ * #enable_key_order) on first use, so the first call on a handle scans
+ * the whole database to load it.
+ *
+ * A page seeks straight to the key following the token, so it costs the
+ * same at any depth. Tokens are opaque strings naming the last key
+ * returned: keys written or deleted through this handle between two
+ * calls are seen, or not, according to their place relative to it.
+ * Keys deleted by other handles or processes are left out, but keys
+ * they add are not listed until the tree is reloaded (#disable_key_order
+ * then #enable_key_order).
+ *
+ *     entries, token = database.page(limit: 50)
+ *     entries, token = database.page(after: token, limit: 50) while token
+ */
+static VALUE unqlite_database_page(int argc, VALUE* argv, VALUE self)
+{
+  static ID kwnames[3];
+  unqliteRubyPtr ctx;
+  unqliteRubyOrderNode *node;
+  VALUE opts, kwargs[3], entries, key, value;
+  volatile VALUE after = Qnil, last = Qnil;
+  long limit = 100, count = 0;
+  unqlite_int64 n_bytes;
+  int keys_only, pos, rc;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  if (!kwnames[0])
+  {
+    kwnames[0] = rb_intern("after");
+    kwnames[1] = rb_intern("limit");
+    kwnames[2] = rb_intern("keys_only");
+  }
+  kwargs[0] = kwargs[1] = kwargs[2] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 3, kwargs);
+  if (kwargs[0] != Qundef && !NIL_P(kwargs[0]))
+    after = order_token_decode(kwargs[0]);
+  if (kwargs[1] != Qundef)
+    limit = NUM2LONG(kwargs[1]);
+  if (limit <= 0)
+    rb_raise(rb_eArgError, "limit must be positive");
+  keys_only = kwargs[2] != Qundef && RTEST(kwargs[2]);
+
+  GetDatabase(self, ctx);
+
+  // Nothing below calls back into Ruby code, so the tree does not change
+  node = order_seek_ge(order_get(ctx), NIL_P(after) ? NULL : RSTRING_PTR(after), NIL_P(after) ? 0 : RSTRING_LEN(after), &pos);
+  if (node && !NIL_P(after) && pos < node->count && order_leaf_cmp(node, pos, RSTRING_PTR(after), RSTRING_LEN(after)) == 0)
+    pos++;
+
+  entries = rb_ary_new_capa(limit < 1024 ? limit : 1024);
+  for (;;)
+  {
+    while (node && pos >= node->count)
+    {
+      node = node->next;
+      pos = 0;
+    }
+    if (!node || count == limit)
+      break;
+
+    key = order_key_str(node, pos++);
+    if (unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+      continue;
+
+    if (keys_only)
+    {
+      // The tree may lag behind other handles: check the key is still there
+      rc = unqlite_kv_fetch(ctx->pDb, RSTRING_PTR(key), RSTRING_LEN(key), NULL, &n_bytes);
+      if (rc == UNQLITE_NOTFOUND)
+        continue;
+      CHECK(ctx->pDb, rc);
+      rb_ary_push(entries, key);
+    }
+    else
+    {
+      value = unqliteRuby_fetch(ctx->pDb, key);
+      if (NIL_P(value))
+        continue;
+      rb_ary_push(entries, rb_assoc_new(key, value));
+    }
+    last = key;
+    count++;
+  }
+
+  // Keys left after the last one returned: hand out a token
+  return rb_assoc_new(entries, node && !NIL_P(last) ? order_token_encode(last) : Qnil);
+}
+
+/*
+ * call-seq:
+ *     database.key_order_stats -> hash
+ *
+ * Returns the number of +keys+ and +leaves+ of the key order tree, its
+ * +height+ and the +prefix_bytes_saved+ by storing each leaf's shared
+ * prefix once. All zero while the key order is disabled.
+ */
+static VALUE unqlite_database_key_order_stats(VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyOrderNode *node;
+  VALUE stats = rb_hash_new();
+  size_t leaves = 0, height = 0, saved = 0;
+
+  GetDatabase(self, ctx);
+
+  if (ctx->order && !ctx->order->stale)
+  {
+    for (node = ctx->order->root; !node->leaf; node = node->children[0])
+      height++;
+    height++;
+
+    // Leaves are linked: no need to walk the branches
+    for (; node; node = node->next)
+    {
+      leaves++;
+      if (node->count > 1)
+        saved += node->plen * (node->count - 1);
+    }
+  }
+
+  rb_hash_aset(stats, ID2SYM(rb_intern("keys")), SIZET2NUM(ctx->order ? ctx->order->nkeys : 0));
+  rb_hash_aset(stats, ID2SYM(rb_intern("leaves")), SIZET2NUM(leaves));
+  rb_hash_aset(stats, ID2SYM(rb_intern("height")), SIZET2NUM(height));
+  rb_hash_aset(stats, ID2SYM(rb_intern("prefix_bytes_saved")), SIZET2NUM(saved));
+  return stats;
+}
+
+void Init_unqlite_order()
+{
+  rb_define_method(cUnQLiteDatabase, "enable_key_order", unqlite_database_enable_key_order, 0);
+  rb_define_method(cUnQLiteDatabase, "disable_key_order", unqlite_database_disable_key_order, 0);
+  rb_define_method(cUnQLiteDatabase, "key_order?", unqlite_database_key_order_p, 0);
+  rb_define_method(cUnQLiteDatabase, "each_range", unqlite_database_each_range, -1);
+  rb_define_method(cUnQLiteDatabase, "first_key", unqlite_database_first_key, 0);
+  rb_define_method(cUnQLiteDatabase, "last_key", unqlite_database_last_key, 0);
+  rb_define_method(cUnQLiteDatabase, "page", unqlite_database_page, -1);
+  rb_define_method(cUnQLiteDatabase, "key_order_stats", unqlite_database_key_order_stats, 0);
+}
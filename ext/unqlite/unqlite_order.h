@@ -0,0 +1,49 @@
+#ifndef UNQLITE_RUBY_ORDER
+#define UNQLITE_RUBY_ORDER
+
+#include <unqlite_ruby.h>
+
+struct _unqliteRuby;
+
+/* Keys per leaf and children per branch of the key order B+tree */
+#define UNQLITE_RUBY_ORDER_FANOUT 64
+
+typedef struct
+{
+  char *data;
+  long len;
+} unqliteRubyOrderKey;
+
+typedef struct _unqliteRubyOrderNode
+{
+  int leaf;
+  int count;                                  /* keys of a leaf, children of a branch */
+  /*
+   * Leaf: the keys, minus the prefix they all share.
+   * Branch: keys[i] is the smallest key under children[i + 1].
+   */
+  unqliteRubyOrderKey keys[UNQLITE_RUBY_ORDER_FANOUT + 1];
+  struct _unqliteRubyOrderNode *children[UNQLITE_RUBY_ORDER_FANOUT + 1];
+  char *prefix;                               /* leaf only */
+  long plen;
+  struct _unqliteRubyOrderNode *prev;         /* leaf siblings */
+  struct _unqliteRubyOrderNode *next;
+} unqliteRubyOrderNode;
+
+typedef struct _unqliteRubyOrder
+{
+  unqliteRubyOrderNode *root;
+  size_t nkeys;
+  int stale;                /* out of sync with the database, rebuilt on next use */
+  unsigned long version;    /* bumped by every change, so scans notice them */
+} unqliteRubyOrder;
+
+void Init_unqlite_order();
+void unqliteRuby_order_add(struct _unqliteRuby *ctx, const char *key, long len);
+void unqliteRuby_order_remove(struct _unqliteRuby *ctx, const char *key, long len);
+void unqliteRuby_order_invalidate(struct _unqliteRuby *ctx);
+void unqliteRuby_order_clear(struct _unqliteRuby *ctx);
+void unqliteRuby_order_free(struct _unqliteRuby *ctx);
+size_t unqliteRuby_order_memsize(const struct _unqliteRuby *ctx);
+
+#endif
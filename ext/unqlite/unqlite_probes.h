@@ -0,0 +1,47 @@
+#ifndef UNQLITE_RUBY_PROBES
+#define UNQLITE_RUBY_PROBES
+
+/*
+ * USDT probes of the "unqlite" provider, compiled in when sys/sdt.h is
+ * available. Until a tracer attaches, a probe is a single nop and its
+ * arguments, lengths and return codes already at hand, cost nothing.
+ *
+ *   store__entry(key_len, value_len)     store__return(key_len, value_len, rc)
+ *   fetch__entry(key_len)                fetch__return(key_len, value_len, rc)
+ *   commit__entry()                      commit__return(rc)
+ *   rollback__entry()                    rollback__return(rc)
+ *   each__entry(mode)                    each__return(mode, records, rc)
+ *   cursor__entry(op, key_len)           cursor__return(op, rc)
+ *
+ * _rc_ is the unqlite result code (0 for UNQLITE_OK, -6 for
+ * UNQLITE_NOTFOUND); fetch__return reports a _value_len_ of -1 for a
+ * missing key. Cursor _op_ is one of the UNQLITE_RUBY_PROBE_CURSOR_*
+ * values below. For instance, the latency distribution of #fetch:
+ *
+ *   bpftrace -e '
+ *     usdt:unqlite_native.so:unqlite:fetch__entry { @start[tid] = nsecs; }
+ *     usdt:unqlite_native.so:unqlite:fetch__return /@start[tid]/ {
+ *       @ns = hist(nsecs - @start[tid]); delete(@start[tid]);
+ *     }' -p PID
+ */
+
+#define UNQLITE_RUBY_PROBE_CURSOR_FIRST 0
+#define UNQLITE_RUBY_PROBE_CURSOR_LAST  1
+#define UNQLITE_RUBY_PROBE_CURSOR_NEXT  2
+#define UNQLITE_RUBY_PROBE_CURSOR_PREV  3
+#define UNQLITE_RUBY_PROBE_CURSOR_SEEK  4
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define UNQLITE_RUBY_PROBE0(name)             DTRACE_PROBE(unqlite, name)
+#define UNQLITE_RUBY_PROBE1(name, a)          DTRACE_PROBE1(unqlite, name, a)
+#define UNQLITE_RUBY_PROBE2(name, a, b)       DTRACE_PROBE2(unqlite, name, a, b)
+#define UNQLITE_RUBY_PROBE3(name, a, b, c)    DTRACE_PROBE3(unqlite, name, a, b, c)
+#else
+#define UNQLITE_RUBY_PROBE0(name)             ((void)0)
+#define UNQLITE_RUBY_PROBE1(name, a)          ((void)0)
+#define UNQLITE_RUBY_PROBE2(name, a, b)       ((void)0)
+#define UNQLITE_RUBY_PROBE3(name, a, b, c)    ((void)0)
+#endif
+
+#endif
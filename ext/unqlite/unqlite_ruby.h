@@ -3,11 +3,40 @@
 
 #include <ruby.h>
 #include <unqlite.h>
+#include <unqlite_probes.h>
+
+/*
+ * Mark a VALUE referenced from a wrapped struct, letting GC compaction
+ * move it; the struct's dcompact function then reloads it with
+ * UNQLITE_RUBY_MOVE. Without compaction (Ruby < 2.7) both are plain.
+ */
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+#define UNQLITE_RUBY_MARK(value) rb_gc_mark_movable(value)
+#define UNQLITE_RUBY_MOVE(value) ((value) = rb_gc_location(value))
+#else
+#define UNQLITE_RUBY_MARK(value) rb_gc_mark(value)
+#define UNQLITE_RUBY_MOVE(value) ((void)0)
+#endif
 
 #include <unqlite_database.h>
 #include <unqlite_codes.h>
 #include <unqlite_exception.h>
 #include <unqlite_cursor.h>
+#include <unqlite_index.h>
+#include <unqlite_bloom.h>
+#include <unqlite_cache.h>
+#include <unqlite_scan.h>
+#include <unqlite_bulk.h>
+#include <unqlite_backup.h>
+#include <unqlite_stream.h>
+#include <unqlite_sharded.h>
+#include <unqlite_ttl.h>
+#include <unqlite_trace.h>
+#include <unqlite_compact.h>
+#include <unqlite_collection.h>
+#include <unqlite_order.h>
+#include <unqlite_key.h>
+#include <unqlite_fork.h>
 
 extern VALUE mUnQLite;
 
@@ -0,0 +1,556 @@
+#include <unqlite_scan.h>
+#include <unqlite_hash.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ruby/thread.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*
+ * Database#parallel_scan: full scans computing a few native reducers
+ * (record count, byte sums, key prefix histogram, filtered export).
+ *
+ * unqlite's on-disk engine is a linear hash and its cursors cannot be
+ * started at a bucket, so the walk itself cannot be split. Instead every
+ * worker opens its own read-only handle on the database file, walks all
+ * the keys and only reduces the records of its hash partition: each
+ * worker reads every key page, and only the value reads and the
+ * reductions are divided. Workers run on OS threads without the GVL and
+ * never touch Ruby objects; their results are merged afterwards.
+ */
+
+/* Growable byte buffer filled by the unqlite consumer callbacks */
+typedef struct
+{
+  char *ptr;
+  size_t len;
+  size_t cap;
+} scanBuffer;
+
+/* Key prefix histogram entry */
+typedef struct _scanBucket
+{
+  struct _scanBucket *next;
+  uint64_t hash;
+  uint64_t count;
+  size_t len;
+  char key[1];
+} scanBucket;
+
+typedef struct
+{
+  scanBucket **buckets;
+  size_t nbuckets;
+  size_t count;
+} scanHistogram;
+
+typedef struct
+{
+  // Configuration, shared by all the workers
+  const char *path;
+  unqlite *db;            /* handle to scan, NULL to open _path_ read-only */
+  int partition;
+  int npartitions;
+  const char *prefix;
+  size_t prefix_len;
+  size_t histogram_len;   /* 0 if no histogram was requested */
+  volatile int *cancel;
+
+  // Results
+  int rc;
+  uint64_t count;
+  uint64_t key_bytes;
+  uint64_t value_bytes;
+  scanHistogram histogram;
+  FILE *out;              /* export spool, or NULL */
+
+  scanBuffer key;
+  scanBuffer data;
+} scanWorker;
+
+typedef struct
+{
+  scanWorker *workers;
+  int nworkers;
+  char *prefix;           /* private copy, the workers run without the GVL */
+  volatile int cancel;
+} scanJob;
+
+static int scan_buffer_consumer(const void *data, unsigned int len, void *udata)
+{
+  scanBuffer *buf = (scanBuffer *)udata;
+
+  if (buf->len + len > buf->cap)
+  {
+    size_t cap = buf->cap ? buf->cap : 256;
+    char *ptr;
+
+    while (cap < buf->len + len)
+      cap *= 2;
+    ptr = (char *)realloc(buf->ptr, cap);
+    if (!ptr)
+      return UNQLITE_ABORT;
+    buf->ptr = ptr;
+    buf->cap = cap;
+  }
+
+  memcpy(buf->ptr + buf->len, data, len);
+  buf->len += len;
+  return UNQLITE_OK;
+}
+
+static int scan_histogram_add(scanHistogram *h, const char *key, size_t len)
+{
+  uint64_t hash = unqliteRuby_hash(key, len, 0);
+  scanBucket *bucket;
+
+  if (!h->buckets)
+  {
+    h->nbuckets = 64;
+    h->buckets = (scanBucket **)calloc(h->nbuckets, sizeof(scanBucket *));
+    if (!h->buckets)
+      return UNQLITE_NOMEM;
+  }
+
+  for (bucket = h->buckets[hash & (h->nbuckets - 1)]; bucket; bucket = bucket->next)
+  {
+    if (bucket->hash == hash && bucket->len == len && memcmp(bucket->key, key, len) == 0)
+    {
+      bucket->count++;
+      return UNQLITE_OK;
+    }
+  }
+
+  bucket = (scanBucket *)malloc(sizeof(scanBucket) + len);
+  if (!bucket)
+    return UNQLITE_NOMEM;
+  bucket->hash = hash;
+  bucket->count = 1;
+  bucket->len = len;
+  memcpy(bucket->key, key, len);
+  bucket->next = h->buckets[hash & (h->nbuckets - 1)];
+  h->buckets[hash & (h->nbuckets - 1)] = bucket;
+
+  // Keep chains short
+  if (++h->count > h->nbuckets)
+  {
+    size_t i, nbuckets = h->nbuckets * 2;
+    scanBucket **buckets = (scanBucket **)calloc(nbuckets, sizeof(scanBucket *));
+    scanBucket *next;
+
+    if (!buckets)
+      return UNQLITE_OK;
+    for (i = 0; i < h->nbuckets; i++)
+    {
+      for (bucket = h->buckets[i]; bucket; bucket = next)
+      {
+        next = bucket->next;
+        bucket->next = buckets[bucket->hash & (nbuckets - 1)];
+        buckets[bucket->hash & (nbuckets - 1)] = bucket;
+      }
+    }
+    free(h->buckets);
+    h->buckets = buckets;
+    h->nbuckets = nbuckets;
+  }
+  return UNQLITE_OK;
+}
+
+static void scan_histogram_free(scanHistogram *h)
+{
+  size_t i;
+  scanBucket *bucket, *next;
+
+  for (i = 0; i < h->nbuckets; i++)
+  {
+    for (bucket = h->buckets[i]; bucket; bucket = next)
+    {
+      next = bucket->next;
+      free(bucket);
+    }
+  }
+  free(h->buckets);
+  h->buckets = NULL;
+  h->nbuckets = h->count = 0;
+}
+
+static void scan_put_u32(unsigned char *p, uint32_t n)
+{
+  p[0] = (unsigned char)(n >> 24);
+  p[1] = (unsigned char)(n >> 16);
+  p[2] = (unsigned char)(n >> 8);
+  p[3] = (unsigned char)n;
+}
+
+/* Reduce the record under _cursor_, whose key is in w->key */
+static int scan_reduce(scanWorker *w, unqlite_kv_cursor *cursor)
+{
+  int rc;
+  unqlite_int64 nbytes;
+
+  if (w->out)
+  {
+    unsigned char header[8];
+
+    w->data.len = 0;
+    rc = unqlite_kv_cursor_data_callback(cursor, scan_buffer_consumer, &w->data);
+    if (rc != UNQLITE_OK)
+      return rc;
+    nbytes = w->data.len;
+
+    // Same layout as the binary_lenprefixed format: u32 key length, u32 value length, key, value
+    scan_put_u32(header, (uint32_t)w->key.len);
+    scan_put_u32(header + 4, (uint32_t)w->data.len);
+    if (fwrite(header, 1, sizeof(header), w->out) != sizeof(header) ||
+        fwrite(w->key.ptr, 1, w->key.len, w->out) != w->key.len ||
+        fwrite(w->data.ptr, 1, w->data.len, w->out) != w->data.len)
+      return UNQLITE_IOERR;
+  }
+  else
+  {
+    rc = unqlite_kv_cursor_data(cursor, NULL, &nbytes);
+    if (rc != UNQLITE_OK)
+      return rc;
+  }
+
+  w->count++;
+  w->key_bytes += w->key.len;
+  w->value_bytes += nbytes;
+
+  if (w->histogram_len > 0)
+    return scan_histogram_add(&w->histogram, w->key.ptr,
+                              w->key.len < w->histogram_len ? w->key.len : w->histogram_len);
+  return UNQLITE_OK;
+}
+
+/* Does the key in w->key belong to this worker and match the filter? */
+static int scan_accept(scanWorker *w)
+{
+  // Skip the entries maintained by the extension itself (indexes, ...)
+  if (w->key.len > 0 && w->key.ptr[0] == '\0')
+    return 0;
+  if (w->key.len < w->prefix_len || memcmp(w->key.ptr, w->prefix, w->prefix_len) != 0)
+    return 0;
+  if (w->npartitions > 1 &&
+      unqliteRuby_hash(w->key.ptr, w->key.len, 0) % w->npartitions != (uint64_t)w->partition)
+    return 0;
+  return 1;
+}
+
+/* Worker body: runs without the GVL unless it scans the caller's handle */
+static void* scan_worker_run(void *arg)
+{
+  scanWorker *w = (scanWorker *)arg;
+  unqlite *db = w->db;
+  unqlite_kv_cursor *cursor;
+  int rc;
+
+  if (!db)
+  {
+    rc = unqlite_open(&db, w->path, UNQLITE_OPEN_READONLY);
+    if (rc != UNQLITE_OK)
+    {
+      w->rc = rc;
+      return NULL;
+    }
+  }
+
+  rc = unqlite_kv_cursor_init(db, &cursor);
+  if (rc == UNQLITE_OK)
+  {
+    unqlite_kv_cursor_first_entry(cursor);
+    while (unqlite_kv_cursor_valid_entry(cursor))
+    {
+      if (*w->cancel)
+      {
+        rc = UNQLITE_ABORT;
+        break;
+      }
+
+      w->key.len = 0;
+      rc = unqlite_kv_cursor_key_callback(cursor, scan_buffer_consumer, &w->key);
+      if (rc == UNQLITE_OK && scan_accept(w))
+        rc = scan_reduce(w, cursor);
+      if (rc != UNQLITE_OK)
+        break;
+
+      unqlite_kv_cursor_next_entry(cursor);
+    }
+    unqlite_kv_cursor_release(db, cursor);
+  }
+
+  if (!w->db)
+    unqlite_close(db);
+
+  w->rc = rc;
+  return NULL;
+}
+
+static void* scan_job_run(void *arg)
+{
+  scanJob *job = (scanJob *)arg;
+  int i;
+#ifdef HAVE_PTHREAD_H
+  pthread_t *threads = (pthread_t *)calloc(job->nworkers, sizeof(pthread_t));
+  char *started = (char *)calloc(job->nworkers, 1);
+
+  if (threads && started)
+  {
+    for (i = 1; i < job->nworkers; i++)
+      started[i] = pthread_create(&threads[i], NULL, scan_worker_run, &job->workers[i]) == 0;
+
+    // The calling thread takes the first partition, and any worker that failed to start
+    scan_worker_run(&job->workers[0]);
+    for (i = 1; i < job->nworkers; i++)
+    {
+      if (started[i])
+        pthread_join(threads[i], NULL);
+      else
+        scan_worker_run(&job->workers[i]);
+    }
+  }
+  else
+#endif
+  {
+    for (i = 0; i < job->nworkers; i++)
+      scan_worker_run(&job->workers[i]);
+  }
+
+#ifdef HAVE_PTHREAD_H
+  free(threads);
+  free(started);
+#endif
+  return NULL;
+}
+
+/* Unblocking function: ask the workers to stop at the next record */
+static void scan_job_cancel(void *arg)
+{
+  ((scanJob *)arg)->cancel = 1;
+}
+
+/* Append the export spools to _path_ */
+static int scan_job_export(scanJob *job, const char *path)
+{
+  char chunk[64 * 1024];
+  size_t n;
+  int i, rc = UNQLITE_OK;
+  FILE *out = fopen(path, "wb");
+
+  if (!out)
+    return UNQLITE_IOERR;
+
+  for (i = 0; i < job->nworkers && rc == UNQLITE_OK; i++)
+  {
+    FILE *spool = job->workers[i].out;
+
+    rewind(spool);
+    while ((n = fread(chunk, 1, sizeof(chunk), spool)) > 0)
+    {
+      if (fwrite(chunk, 1, n, out) != n)
+      {
+        rc = UNQLITE_IOERR;
+        break;
+      }
+    }
+  }
+
+  if (fclose(out) != 0 && rc == UNQLITE_OK)
+    rc = UNQLITE_IOERR;
+  return rc;
+}
+
+static void scan_job_free(scanJob *job)
+{
+  int i;
+
+  for (i = 0; i < job->nworkers; i++)
+  {
+    scanWorker *w = &job->workers[i];
+    scan_histogram_free(&w->histogram);
+    if (w->out)
+      fclose(w->out);
+    free(w->key.ptr);
+    free(w->data.ptr);
+  }
+  xfree(job->workers);
+  xfree(job->prefix);
+}
+
+/*
+ * call-seq:
+ *     database.parallel_scan(threads: 4, prefix: nil, histogram: nil, export: nil) -> hash
+ *
+ * Scans the whole database on _threads_ OS threads and returns the
+ * merged reductions:
+ *
+ * * +:count+ - number of records
+ * * +:key_bytes+, +:value_bytes+ - total size of their keys and values
+ * * +:histogram+ - with <tt>histogram: n</tt>, a Hash counting the
+ *   records by the first _n_ bytes of their key
+ *
+ * Only the keys starting with _prefix_ are taken into account. With
+ * <tt>export: path</tt> the matching records are also written to _path_
+ * in the binary_lenprefixed format (big-endian 32-bit key and value
+ * lengths followed by the key and the value).
+ *
+ * Each thread walks every key of the file and keeps those of its hash
+ * partition, so more threads do not read the file faster: they divide
+ * the value reads, the export and the reductions, which pays off on
+ * large values or a file already in the page cache.
+ *
+ * The workers read the database file through their own read-only
+ * handles, so the pending writes of this handle are committed first.
+ * While a transaction begun with #begin_transaction is open, or after
+ * #disable_auto_commit while writes are uncommitted, nothing is
+ * committed and the scan runs on the calling thread through this
+ * handle instead. In-memory databases, and builds of unqlite without
+ * thread support, are scanned on the calling thread too.
+ */
+static VALUE unqlite_database_parallel_scan(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  VALUE opts, prefix = Qnil, export_path = Qnil;
+  VALUE kwargs[4];
+  ID kwnames[4];
+  volatile VALUE result, histogram;
+  scanJob job;
+  long nthreads = 4, histogram_len = 0;
+  int i, rc = UNQLITE_OK, shared;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  kwnames[0] = rb_intern("threads");
+  kwnames[1] = rb_intern("prefix");
+  kwnames[2] = rb_intern("histogram");
+  kwnames[3] = rb_intern("export");
+  kwargs[0] = kwargs[1] = kwargs[2] = kwargs[3] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 4, kwargs);
+
+  if (kwargs[0] != Qundef)
+    nthreads = NUM2LONG(kwargs[0]);
+  if (kwargs[1] != Qundef && !NIL_P(kwargs[1]))
+    prefix = StringValue(kwargs[1]);
+  if (kwargs[2] != Qundef && !NIL_P(kwargs[2]))
+    histogram_len = NUM2LONG(kwargs[2]);
+  if (kwargs[3] != Qundef && !NIL_P(kwargs[3]))
+  {
+    export_path = kwargs[3];
+    FilePathValue(export_path);
+  }
+
+  if (nthreads < 1 || nthreads > UNQLITE_RUBY_SCAN_MAX_THREADS)
+    rb_raise(rb_eArgError, "threads must be between 1 and %d", UNQLITE_RUBY_SCAN_MAX_THREADS);
+  if (histogram_len < 0)
+    rb_raise(rb_eArgError, "histogram must be a positive prefix length");
+
+  GetDatabase2(self, ctx, db);
+
+  // Read handles cannot be opened on private databases
+  shared = !(ctx->flags & (UNQLITE_OPEN_IN_MEMORY | UNQLITE_OPEN_TEMP_DB)) &&
+           strcmp(ctx->path, ":mem:") != 0 &&
+           unqlite_lib_is_threadsafe();
+  // Nor without committing a transaction the caller still controls
+  if (ctx->in_transaction || (ctx->no_auto_commit && ctx->pending))
+    shared = 0;
+#ifndef HAVE_PTHREAD_H
+  shared = 0;
+#endif
+
+  if (shared)
+  {
+    // Make our writes visible to (and our locks compatible with) the read handles
+    rc = unqlite_commit(db);
+    CHECK(db, rc);
+    ctx->pending = 0;
+  }
+  else
+    nthreads = 1;
+
+  job.nworkers = (int)nthreads;
+  job.cancel = 0;
+  job.prefix = ALLOC_N(char, NIL_P(prefix) ? 1 : RSTRING_LEN(prefix) + 1);
+  job.prefix[0] = '\0';
+  if (!NIL_P(prefix))
+    memcpy(job.prefix, RSTRING_PTR(prefix), RSTRING_LEN(prefix));
+  job.workers = ZALLOC_N(scanWorker, job.nworkers);
+
+  for (i = 0; i < job.nworkers; i++)
+  {
+    scanWorker *w = &job.workers[i];
+    w->path = ctx->path;
+    w->db = shared ? NULL : db;
+    w->partition = i;
+    w->npartitions = job.nworkers;
+    w->prefix = job.prefix;
+    w->prefix_len = NIL_P(prefix) ? 0 : RSTRING_LEN(prefix);
+    w->histogram_len = histogram_len;
+    w->cancel = &job.cancel;
+    if (!NIL_P(export_path) && !(w->out = tmpfile()))
+    {
+      scan_job_free(&job);
+      rb_sys_fail("tmpfile");
+    }
+  }
+
+  if (shared)
+    rb_thread_call_without_gvl(scan_job_run, &job, scan_job_cancel, &job);
+  else
+    scan_job_run(&job);
+
+  // Merge the partial results
+  result = rb_hash_new();
+  histogram = histogram_len > 0 ? rb_hash_new() : Qnil;
+  {
+    uint64_t count = 0, key_bytes = 0, value_bytes = 0;
+
+    for (i = 0; i < job.nworkers; i++)
+    {
+      scanWorker *w = &job.workers[i];
+      size_t b;
+
+      if (w->rc != UNQLITE_OK && rc == UNQLITE_OK)
+        rc = w->rc;
+      count += w->count;
+      key_bytes += w->key_bytes;
+      value_bytes += w->value_bytes;
+
+      for (b = 0; b < w->histogram.nbuckets; b++)
+      {
+        scanBucket *bucket;
+        for (bucket = w->histogram.buckets[b]; bucket; bucket = bucket->next)
+        {
+          VALUE key = rb_str_new(bucket->key, bucket->len);
+          VALUE current = rb_hash_lookup2(histogram, key, INT2FIX(0));
+          rb_hash_aset(histogram, key, rb_funcall(current, '+', 1, ULL2NUM(bucket->count)));
+        }
+      }
+    }
+
+    rb_hash_aset(result, ID2SYM(rb_intern("count")), ULL2NUM(count));
+    rb_hash_aset(result, ID2SYM(rb_intern("key_bytes")), ULL2NUM(key_bytes));
+    rb_hash_aset(result, ID2SYM(rb_intern("value_bytes")), ULL2NUM(value_bytes));
+    if (!NIL_P(histogram))
+      rb_hash_aset(result, ID2SYM(rb_intern("histogram")), histogram);
+  }
+
+  if (rc == UNQLITE_OK && !NIL_P(export_path))
+    rc = scan_job_export(&job, StringValueCStr(export_path));
+
+  scan_job_free(&job);
+
+  // An interrupt cancels the workers; let it be raised rather than the abort
+  rb_thread_check_ints();
+  CHECK(shared ? 0 : db, rc);
+
+  return result;
+}
+
+void Init_unqlite_scan()
+{
+  rb_define_method(cUnQLiteDatabase, "parallel_scan", unqlite_database_parallel_scan, -1);
+}
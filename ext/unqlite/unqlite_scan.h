@@ -0,0 +1,11 @@
+#ifndef UNQLITE_RUBY_SCAN
+#define UNQLITE_RUBY_SCAN
+
+#include <unqlite_ruby.h>
+
+/* Upper bound for Database#parallel_scan(threads:) */
+#define UNQLITE_RUBY_SCAN_MAX_THREADS 64
+
+void Init_unqlite_scan();
+
+#endif
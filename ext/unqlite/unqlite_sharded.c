@@ -0,0 +1,559 @@
+#include <unqlite_sharded.h>
+#include <unqlite_hash.h>
+#include <stdlib.h>
+#include <ruby/thread.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*
+ * Document-class: UnQLite::ShardedDatabase
+ *
+ * Spreads keys over several database files, each with its own handle
+ * and writer lock, by hashing them. Single-key methods are forwarded to
+ * the UnQLite::Database owning the key, so every Database feature
+ * (indexes, caches, filters) works per shard.
+ */
+
+VALUE cUnQLiteShardedDatabase;
+
+static const rb_data_type_t unqlite_sharded_type;
+
+#define SHARDS_FILE "SHARDS"
+
+/*
+ * Seed of the routing hash. Bloom filters, object caches and scan
+ * partitions hash keys with seed 0: with the same seed, every key of a
+ * shard would share the low bits those use.
+ */
+#define SHARDS_SEED 0x243f6a8885a308d3ULL
+
+/* Forward a call, with its keywords and block */
+#ifdef RB_PASS_CALLED_KEYWORDS
+#define sharded_call(recv, mid, argc, argv) \
+  rb_funcall_with_block_kw((recv), (mid), (argc), (argv), rb_block_given_p() ? rb_block_proc() : Qnil, RB_PASS_CALLED_KEYWORDS)
+#else
+#define sharded_call(recv, mid, argc, argv) \
+  rb_funcall_with_block((recv), (mid), (argc), (argv), rb_block_given_p() ? rb_block_proc() : Qnil)
+#endif
+
+#define GetSharded(obj, shardedp) {                           \
+    TypedData_Get_Struct((obj), unqliteRubySharded, &unqlite_sharded_type, (shardedp)); \
+    if (NIL_P((shardedp)->shards)) closed_database();         \
+  }
+
+static void unqlite_sharded_mark(void *ptr)
+{
+  unqliteRubySharded *sharded = (unqliteRubySharded *)ptr;
+  UNQLITE_RUBY_MARK(sharded->shards);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void unqlite_sharded_compact(void *ptr)
+{
+  unqliteRubySharded *sharded = (unqliteRubySharded *)ptr;
+  UNQLITE_RUBY_MOVE(sharded->shards);
+}
+#endif
+
+static const rb_data_type_t unqlite_sharded_type = {
+  "UnQLite::ShardedDatabase",
+  {
+    unqlite_sharded_mark,
+    RUBY_TYPED_DEFAULT_FREE,
+    NULL,
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+    unqlite_sharded_compact,
+#endif
+  },
+  0, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static VALUE unqlite_sharded_allocate(VALUE klass)
+{
+  unqliteRubySharded *sharded;
+  VALUE self = TypedData_Make_Struct(klass, unqliteRubySharded, &unqlite_sharded_type, sharded);
+  sharded->shards = Qnil;
+  sharded->nshards = 0;
+  return self;
+}
+
+static int sharded_index(unqliteRubySharded *sharded, const char *key, long len)
+{
+  return (int)(unqliteRuby_hash(key, len, SHARDS_SEED) % sharded->nshards);
+}
+
+static VALUE sharded_shard(unqliteRubySharded *sharded, VALUE key)
+{
+  StringValue(key);
+  return RARRAY_AREF(sharded->shards, sharded_index(sharded, RSTRING_PTR(key), RSTRING_LEN(key)));
+}
+
+/*
+ * call-seq:
+ *     UnQLite::ShardedDatabase.new(dir, shards: 16, flags: nil)
+ *
+ * Opens (creating them if needed) _shards_ database files in the
+ * directory _dir_. The shard count of a directory is recorded in it,
+ * and reopening it with another count raises ArgumentError since keys
+ * would be looked up in the wrong shards. _flags_ are passed to every
+ * UnQLite::Database.new.
+ */
+static VALUE unqlite_sharded_initialize(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubySharded *sharded;
+  VALUE dir, opts, flags = Qnil, count_file;
+  VALUE kwargs[2];
+  ID kwnames[2];
+  volatile VALUE shards;
+  long nshards = 16, i;
+
+  rb_scan_args(argc, argv, "1:", &dir, &opts);
+
+  kwnames[0] = rb_intern("shards");
+  kwnames[1] = rb_intern("flags");
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 2, kwargs);
+  if (kwargs[0] != Qundef)
+    nshards = NUM2LONG(kwargs[0]);
+  if (kwargs[1] != Qundef)
+    flags = kwargs[1];
+
+  if (nshards < 1 || nshards > UNQLITE_RUBY_MAX_SHARDS)
+    rb_raise(rb_eArgError, "shards must be between 1 and %d", UNQLITE_RUBY_MAX_SHARDS);
+
+  FilePathValue(dir);
+  TypedData_Get_Struct(self, unqliteRubySharded, &unqlite_sharded_type, sharded);
+
+  if (!RTEST(rb_funcall(rb_cFile, rb_intern("directory?"), 1, dir)))
+    rb_funcall(rb_cDir, rb_intern("mkdir"), 1, dir);
+
+  // Record the shard count, or check it matches the recorded one
+  count_file = rb_str_plus(dir, rb_str_new_cstr("/" SHARDS_FILE));
+  if (RTEST(rb_funcall(rb_cFile, rb_intern("exist?"), 1, count_file)))
+  {
+    long recorded = NUM2LONG(rb_funcall(rb_funcall(rb_cFile, rb_intern("read"), 1, count_file), rb_intern("to_i"), 0));
+    if (recorded != nshards)
+      rb_raise(rb_eArgError, "%"PRIsVALUE" holds %ld shards, not %ld", dir, recorded, nshards);
+  }
+  else
+    rb_funcall(rb_cFile, rb_intern("write"), 2, count_file, rb_sprintf("%ld\n", nshards));
+
+  shards = rb_ary_new_capa(nshards);
+  for (i = 0; i < nshards; i++)
+  {
+    VALUE args[2];
+    args[0] = rb_sprintf("%"PRIsVALUE"/shard-%03ld.db", dir, i);
+    args[1] = flags;
+    rb_ary_push(shards, rb_class_new_instance(2, args, cUnQLiteDatabase));
+  }
+
+  RB_OBJ_WRITE(self, &sharded->shards, rb_ary_freeze(shards));
+  sharded->nshards = (int)nshards;
+
+  return self;
+}
+
+/* Forward a single-key method to the shard owning the key (first argument) */
+static VALUE unqlite_sharded_route(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubySharded *sharded;
+
+  GetSharded(self, sharded);
+  rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+
+  return sharded_call(sharded_shard(sharded, argv[0]), rb_frame_this_func(), argc, argv);
+}
+
+/* Forward a method to every shard in turn */
+static VALUE unqlite_sharded_broadcast(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubySharded *sharded;
+  ID mid = rb_frame_this_func();
+  long i;
+
+  GetSharded(self, sharded);
+
+  for (i = 0; i < sharded->nshards; i++)
+    sharded_call(RARRAY_AREF(sharded->shards, i), mid, argc, argv);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     sharded.empty? -> true or false
+ *
+ * Returns _true_ if no shard holds any key-value pair.
+ */
+static VALUE unqlite_sharded_empty(VALUE self)
+{
+  unqliteRubySharded *sharded;
+  long i;
+
+  GetSharded(self, sharded);
+
+  for (i = 0; i < sharded->nshards; i++)
+  {
+    if (!RTEST(rb_funcall(RARRAY_AREF(sharded->shards, i), rb_intern("empty?"), 0)))
+      return Qfalse;
+  }
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     sharded.transaction(key) { |shard| ... }
+ *
+ * Runs Database#transaction on the shard owning _key_. Transactions
+ * never span shards.
+ */
+static VALUE unqlite_sharded_transaction(VALUE self, VALUE key)
+{
+  unqliteRubySharded *sharded;
+
+  GetSharded(self, sharded);
+  return rb_funcall_with_block(sharded_shard(sharded, key), rb_intern("transaction"), 0, NULL, rb_block_proc());
+}
+
+/*
+ * call-seq:
+ *     sharded.shard_for(key) -> database
+ *
+ * Returns the UnQLite::Database holding _key_.
+ */
+static VALUE unqlite_sharded_shard_for(VALUE self, VALUE key)
+{
+  unqliteRubySharded *sharded;
+
+  GetSharded(self, sharded);
+  return sharded_shard(sharded, key);
+}
+
+/*
+ * call-seq:
+ *     sharded.shards -> array
+ *
+ * Returns the UnQLite::Database of every shard.
+ */
+static VALUE unqlite_sharded_shards(VALUE self)
+{
+  unqliteRubySharded *sharded;
+
+  GetSharded(self, sharded);
+  return sharded->shards;
+}
+
+/*
+ * call-seq:
+ *     sharded.close
+ *
+ * Closes every shard.
+ */
+static VALUE unqlite_sharded_close(VALUE self)
+{
+  unqliteRubySharded *sharded;
+  long i;
+
+  TypedData_Get_Struct(self, unqliteRubySharded, &unqlite_sharded_type, sharded);
+  if (NIL_P(sharded->shards))
+    return Qtrue;
+
+  for (i = 0; i < sharded->nshards; i++)
+    rb_funcall(RARRAY_AREF(sharded->shards, i), rb_intern("close"), 0);
+  sharded->shards = Qnil;
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     sharded.closed? -> true or false
+ */
+static VALUE unqlite_sharded_closed(VALUE self)
+{
+  unqliteRubySharded *sharded;
+
+  TypedData_Get_Struct(self, unqliteRubySharded, &unqlite_sharded_type, sharded);
+  return NIL_P(sharded->shards) ? Qtrue : Qfalse;
+}
+
+/* fetch_many: one looked up key */
+typedef struct
+{
+  size_t offset;          /* of the key in the key arena */
+  long klen;
+  char *value;            /* malloc'ed */
+  int found;
+  size_t vlen;
+  size_t vcap;
+} fetchItem;
+
+/* fetch_many: the keys of one shard */
+typedef struct
+{
+  unqlite *db;
+  size_t *items;          /* indexes into the item array */
+  size_t nitems;
+  int rc;
+} fetchShard;
+
+typedef struct
+{
+  const char *arena;
+  fetchItem *items;
+  fetchShard *shards;
+  int nshards;
+  int nthreads;
+} fetchJob;
+
+static int fetch_consumer(const void *data, unsigned int len, void *udata)
+{
+  fetchItem *item = (fetchItem *)udata;
+
+  if (item->vlen + len > item->vcap)
+  {
+    size_t cap = item->vcap ? item->vcap * 2 : 256;
+    char *value;
+
+    while (cap < item->vlen + len)
+      cap *= 2;
+    value = (char *)realloc(item->value, cap);
+    if (!value)
+      return UNQLITE_ABORT;
+    item->value = value;
+    item->vcap = cap;
+  }
+  memcpy(item->value + item->vlen, data, len);
+  item->vlen += len;
+  return UNQLITE_OK;
+}
+
+static void fetch_shard(fetchJob *job, fetchShard *shard)
+{
+  size_t i;
+
+  for (i = 0; i < shard->nitems; i++)
+  {
+    fetchItem *item = &job->items[shard->items[i]];
+    int rc;
+
+    rc = unqlite_kv_fetch_callback(shard->db, job->arena + item->offset, (int)item->klen, fetch_consumer, item);
+    if (rc == UNQLITE_NOTFOUND)
+      continue;
+    item->found = 1;
+    if (rc != UNQLITE_OK)
+    {
+      shard->rc = rc;
+      return;
+    }
+  }
+}
+
+typedef struct
+{
+  fetchJob *job;
+  int thread;
+} fetchWorker;
+
+/* Thread _t_ takes shards t, t + nthreads, ... */
+static void* fetch_worker_run(void *arg)
+{
+  fetchWorker *worker = (fetchWorker *)arg;
+  int i;
+
+  for (i = worker->thread; i < worker->job->nshards; i += worker->job->nthreads)
+    fetch_shard(worker->job, &worker->job->shards[i]);
+  return NULL;
+}
+
+static void* fetch_job_run(void *arg)
+{
+  fetchJob *job = (fetchJob *)arg;
+  fetchWorker workers[UNQLITE_RUBY_FETCH_THREADS];
+  int i;
+#ifdef HAVE_PTHREAD_H
+  pthread_t threads[UNQLITE_RUBY_FETCH_THREADS];
+  int started[UNQLITE_RUBY_FETCH_THREADS];
+
+  for (i = 0; i < job->nthreads; i++)
+  {
+    workers[i].job = job;
+    workers[i].thread = i;
+    started[i] = i > 0 && pthread_create(&threads[i], NULL, fetch_worker_run, &workers[i]) == 0;
+  }
+  fetch_worker_run(&workers[0]);
+  for (i = 1; i < job->nthreads; i++)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      fetch_worker_run(&workers[i]);
+  }
+#else
+  for (i = 0; i < job->nthreads; i++)
+  {
+    workers[i].job = job;
+    workers[i].thread = i;
+    fetch_worker_run(&workers[i]);
+  }
+#endif
+  return NULL;
+}
+
+/*
+ * call-seq:
+ *     sharded.fetch_many(keys) -> array
+ *
+ * Returns the values of _keys_, in order, with nil for missing and
+ * expired keys. The shards are read in parallel on OS threads, without
+ * the GVL; meanwhile other threads get UnQLite::BusyException from the
+ * shards. Object caches and Bloom filters of the shards are bypassed.
+ */
+static VALUE unqlite_sharded_fetch_many(VALUE self, VALUE keys)
+{
+  unqliteRubySharded *sharded;
+  fetchJob job;
+  unqliteRubyPtr *ctxs;
+  size_t nkeys, i, arena_len = 0, *slots, *next;
+  char *arena;
+  volatile VALUE result;
+  int parallel = 1, rc = UNQLITE_OK, s;
+
+  GetSharded(self, sharded);
+  keys = rb_Array(keys);
+  nkeys = RARRAY_LEN(keys);
+
+  for (i = 0; i < nkeys; i++)
+  {
+    Check_Type(RARRAY_AREF(keys, i), T_STRING);
+    arena_len += RSTRING_LEN(RARRAY_AREF(keys, i));
+  }
+
+  // Whether the handles can be used from other threads
+  for (s = 0; s < sharded->nshards; s++)
+  {
+    unqliteRubyPtr ctx;
+    GetDatabase(RARRAY_AREF(sharded->shards, s), ctx);
+    if (ctx->flags & UNQLITE_OPEN_NOMUTEX)
+      parallel = 0;
+  }
+  if (!unqlite_lib_is_threadsafe())
+    parallel = 0;
+
+  job.nshards = sharded->nshards;
+  job.shards = ZALLOC_N(fetchShard, job.nshards);
+  ctxs = ALLOC_N(unqliteRubyPtr, job.nshards);
+  for (s = 0; s < job.nshards; s++)
+  {
+    TypedData_Get_Struct(RARRAY_AREF(sharded->shards, s), unqliteRuby, &unqliteRuby_type, ctxs[s]);
+    job.shards[s].db = ctxs[s]->pDb;
+  }
+
+  // Copy the keys, the workers run without the GVL
+  arena = ALLOC_N(char, arena_len + 1);
+  job.arena = arena;
+  job.items = ZALLOC_N(fetchItem, nkeys + 1);
+  slots = ALLOC_N(size_t, nkeys + 1);
+  next = ZALLOC_N(size_t, job.nshards + 1);
+
+  arena_len = 0;
+  for (i = 0; i < nkeys; i++)
+  {
+    VALUE key = RARRAY_AREF(keys, i);
+    job.items[i].offset = arena_len;
+    job.items[i].klen = RSTRING_LEN(key);
+    memcpy(arena + arena_len, RSTRING_PTR(key), RSTRING_LEN(key));
+    arena_len += RSTRING_LEN(key);
+    job.shards[sharded_index(sharded, RSTRING_PTR(key), RSTRING_LEN(key))].nitems++;
+  }
+
+  // Group the item indexes by shard
+  for (s = 1; s <= job.nshards; s++)
+    next[s] = next[s - 1] + job.shards[s - 1].nitems;
+  for (s = 0; s < job.nshards; s++)
+    job.shards[s].items = slots + next[s];
+  for (i = 0; i < nkeys; i++)
+  {
+    s = sharded_index(sharded, arena + job.items[i].offset, job.items[i].klen);
+    slots[next[s]++] = i;
+  }
+
+  job.nthreads = job.nshards < UNQLITE_RUBY_FETCH_THREADS ? job.nshards : UNQLITE_RUBY_FETCH_THREADS;
+  if ((size_t)job.nthreads > nkeys)
+    job.nthreads = nkeys > 0 ? (int)nkeys : 1;
+
+  // Keep other threads off the handles the workers use
+  for (s = 0; s < job.nshards; s++)
+    ctxs[s]->busy = 1;
+  if (parallel && job.nthreads > 1)
+    rb_thread_call_without_gvl(fetch_job_run, &job, RUBY_UBF_IO, NULL);
+  else
+  {
+    job.nthreads = 1;
+    fetch_job_run(&job);
+  }
+  for (s = 0; s < job.nshards; s++)
+    ctxs[s]->busy = 0;
+
+  result = rb_ary_new_capa(nkeys);
+  for (i = 0; i < nkeys; i++)
+  {
+    fetchItem *item = &job.items[i];
+    const char *key = arena + item->offset;
+
+    if (item->found && unqliteRuby_ttl_expired(ctxs[sharded_index(sharded, key, item->klen)], key, item->klen))
+      item->found = 0;
+    rb_ary_push(result, item->found ? rb_str_new(item->value, item->vlen) : Qnil);
+    free(item->value);
+  }
+  for (s = 0; s < job.nshards; s++)
+  {
+    if (job.shards[s].rc != UNQLITE_OK && rc == UNQLITE_OK)
+      rc = job.shards[s].rc;
+  }
+
+  xfree(arena);
+  xfree(ctxs);
+  xfree(job.items);
+  xfree(job.shards);
+  xfree(slots);
+  xfree(next);
+
+  CHECK(0, rc);
+  return result;
+}
+
+void Init_unqlite_sharded()
+{
+  static const char *routed[] = {
+    "store", "[]=", "append", "fetch", "[]", "delete", "has_key?", "key?",
+    "include?", "member?", "compare_and_set", "update", "fetch_to",
+    "store_from", "append_from", "ttl"
+  };
+  static const char *broadcast[] = {
+    "each", "each_pair", "each_key", "each_value", "commit", "rollback", "clear",
+    "enable_expiry", "disable_expiry"
+  };
+  size_t i;
+
+  /* Spreads keys over several database files by hashing them. */
+  cUnQLiteShardedDatabase = rb_define_class_under(mUnQLite, "ShardedDatabase", rb_cObject);
+  rb_define_alloc_func(cUnQLiteShardedDatabase, unqlite_sharded_allocate);
+  rb_define_method(cUnQLiteShardedDatabase, "initialize", unqlite_sharded_initialize, -1);
+
+  for (i = 0; i < sizeof(routed) / sizeof(routed[0]); i++)
+    rb_define_method(cUnQLiteShardedDatabase, routed[i], unqlite_sharded_route, -1);
+  for (i = 0; i < sizeof(broadcast) / sizeof(broadcast[0]); i++)
+    rb_define_method(cUnQLiteShardedDatabase, broadcast[i], unqlite_sharded_broadcast, -1);
+
+  rb_define_method(cUnQLiteShardedDatabase, "empty?", unqlite_sharded_empty, 0);
+  rb_define_method(cUnQLiteShardedDatabase, "transaction", unqlite_sharded_transaction, 1);
+  rb_define_method(cUnQLiteShardedDatabase, "shard_for", unqlite_sharded_shard_for, 1);
+  rb_define_method(cUnQLiteShardedDatabase, "shards", unqlite_sharded_shards, 0);
+  rb_define_method(cUnQLiteShardedDatabase, "fetch_many", unqlite_sharded_fetch_many, 1);
+  rb_define_method(cUnQLiteShardedDatabase, "close", unqlite_sharded_close, 0);
+  rb_define_method(cUnQLiteShardedDatabase, "closed?", unqlite_sharded_closed, 0);
+}
@@ -0,0 +1,20 @@
+#ifndef UNQLITE_RUBY_SHARDED
+#define UNQLITE_RUBY_SHARDED
+
+#include <unqlite_ruby.h>
+
+/* Upper bound for ShardedDatabase.new(shards:) */
+#define UNQLITE_RUBY_MAX_SHARDS 1024
+
+/* Threads used by ShardedDatabase#fetch_many */
+#define UNQLITE_RUBY_FETCH_THREADS 16
+
+typedef struct
+{
+  VALUE shards;   /* Array of UnQLite::Database */
+  int nshards;
+} unqliteRubySharded;
+
+void Init_unqlite_sharded();
+
+#endif
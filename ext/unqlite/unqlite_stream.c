@@ -0,0 +1,210 @@
+#include <unqlite_stream.h>
+
+/*
+ * Values streamed between the database and IO objects, so that large
+ * values are never materialized as a single Ruby String.
+ */
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+typedef struct
+{
+  VALUE io;
+  int state;              /* tag of an exception raised while writing */
+  unqlite_int64 written;
+} streamSink;
+
+struct stream_write_args
+{
+  VALUE io;
+  const void *data;
+  unsigned int len;
+};
+
+static VALUE stream_write(VALUE arg)
+{
+  struct stream_write_args *args = (struct stream_write_args *)arg;
+  return rb_funcall(args->io, rb_intern("write"), 1, rb_str_new((const char *)args->data, args->len));
+}
+
+/*
+ * Hand a chunk of the value to io.write. Everything that may raise runs
+ * under rb_protect, as nothing may jump out of unqlite: exceptions abort
+ * the fetch instead.
+ */
+static int stream_consumer(const void *data, unsigned int len, void *udata)
+{
+  streamSink *sink = (streamSink *)udata;
+  struct stream_write_args args;
+
+  args.io = sink->io;
+  args.data = data;
+  args.len = len;
+  rb_protect(stream_write, (VALUE)&args, &sink->state);
+  if (sink->state)
+    return UNQLITE_ABORT;
+
+  sink->written += len;
+  return UNQLITE_OK;
+}
+
+/*
+ * call-seq:
+ *     database.fetch_to(key, io) -> bytes
+ *
+ * Writes the value of _key_ to _io_ as it is read from the database,
+ * and returns its size. Raises UnQLite::NotFoundException if the key
+ * does not exist. Until it returns, other calls on this database (from
+ * io.write or from other threads) raise UnQLite::BusyException.
+ */
+static VALUE unqlite_database_fetch_to(VALUE self, VALUE key, VALUE io)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  streamSink sink;
+  VALUE cached;
+  int rc;
+
+  Check_Type(key, T_STRING);
+
+  GetDatabase2(self, ctx, db);
+
+  if (unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+    CHECK(0, UNQLITE_NOTFOUND);
+
+  cached = unqliteRuby_cache_get(ctx, key);
+  if (cached != Qundef)
+  {
+    rb_funcall(io, rb_intern("write"), 1, cached);
+    return LONG2NUM(RSTRING_LEN(cached));
+  }
+
+  if (!unqliteRuby_bloom_check(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+    CHECK(0, UNQLITE_NOTFOUND);
+
+  sink.io = io;
+  sink.state = 0;
+  sink.written = 0;
+
+  // io.write runs inside unqlite: calls on this handle must not
+  ctx->busy = 1;
+  rc = unqlite_kv_fetch_callback(db, RSTRING_PTR(key), RSTRING_LEN(key), stream_consumer, &sink);
+  ctx->busy = 0;
+
+  // Re-raise what io.write raised
+  if (sink.state)
+    rb_jump_tag(sink.state);
+
+  if (rc == UNQLITE_NOTFOUND)
+    unqliteRuby_bloom_miss(ctx);
+  CHECK(db, rc);
+
+  return LL2NUM(sink.written);
+}
+
+/* Read _io_ in chunks, storing (or appending) each one under _key_ */
+static VALUE unqliteRuby_stream_from(int argc, VALUE* argv, VALUE self, int append)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  VALUE key, io, opts, chunk;
+  volatile VALUE buffer;
+  VALUE kwargs[1];
+  ID kwnames[1];
+  ID id_read = rb_intern("read");
+  long chunk_size = STREAM_CHUNK_SIZE;
+  unqlite_int64 written = 0;
+  int rc;
+
+  rb_scan_args(argc, argv, "2:", &key, &io, &opts);
+
+  kwnames[0] = rb_intern("chunk_size");
+  kwargs[0] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 1, kwargs);
+  if (kwargs[0] != Qundef)
+    chunk_size = NUM2LONG(kwargs[0]);
+  if (chunk_size <= 0)
+    rb_raise(rb_eArgError, "chunk_size must be positive");
+
+  Check_Type(key, T_STRING);
+
+  GetDatabase2(self, ctx, db);
+
+  // Index extractors need the whole value
+  if (ctx->nindexes > 0)
+    rb_raise(rb_path2class("UnQLite::UnsupportedException"),
+             "streaming writes are not supported on databases with secondary indexes");
+
+  unqliteRuby_bloom_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_cache_invalidate(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  unqliteRuby_write_begin(ctx);
+
+  // Replace the current value and its expiry, even if _io_ turns out to be empty
+  if (!append)
+  {
+    rc = unqlite_kv_store(db, RSTRING_PTR(key), RSTRING_LEN(key), "", 0);
+    CHECK(db, rc);
+    unqliteRuby_order_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+    rc = unqliteRuby_ttl_delete(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+    CHECK(db, rc);
+  }
+  else
+    unqliteRuby_ttl_purge(ctx, key);
+
+  buffer = rb_str_buf_new(chunk_size);
+  for (;;)
+  {
+    chunk = rb_funcall(io, id_read, 2, LONG2NUM(chunk_size), buffer);
+    if (NIL_P(chunk))
+      break;
+    StringValue(chunk);
+
+    // The IO may have closed the database
+    GetDatabase2(self, ctx, db);
+
+    rc = unqlite_kv_append(db, RSTRING_PTR(key), RSTRING_LEN(key), RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    CHECK(db, rc);
+    unqliteRuby_order_add(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+    written += RSTRING_LEN(chunk);
+  }
+
+  unqliteRuby_cache_invalidate(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+
+  return LL2NUM(written);
+}
+
+/*
+ * call-seq:
+ *     database.store_from(key, io, chunk_size: 65536) -> bytes
+ *
+ * Stores the contents of _io_ as the value of _key_, reading and
+ * appending _chunk_size_ bytes at a time. Returns the number of bytes
+ * stored. Like #store without _ttl_, it removes the expiry of _key_. If
+ * reading fails midway, _key_ holds what was written so far (use a
+ * transaction to make the write atomic). Not available on databases
+ * with secondary indexes.
+ */
+static VALUE unqlite_database_store_from(int argc, VALUE* argv, VALUE self)
+{
+  return unqliteRuby_stream_from(argc, argv, self, 0);
+}
+
+/*
+ * call-seq:
+ *     database.append_from(key, io, chunk_size: 65536) -> bytes
+ *
+ * Appends the contents of _io_ to the value of _key_, _chunk_size_
+ * bytes at a time. Returns the number of bytes appended.
+ */
+static VALUE unqlite_database_append_from(int argc, VALUE* argv, VALUE self)
+{
+  return unqliteRuby_stream_from(argc, argv, self, 1);
+}
+
+void Init_unqlite_stream()
+{
+  rb_define_method(cUnQLiteDatabase, "fetch_to", unqlite_database_fetch_to, 2);
+  rb_define_method(cUnQLiteDatabase, "store_from", unqlite_database_store_from, -1);
+  rb_define_method(cUnQLiteDatabase, "append_from", unqlite_database_append_from, -1);
+}
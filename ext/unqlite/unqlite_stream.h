@@ -0,0 +1,8 @@
+#ifndef UNQLITE_RUBY_STREAM
+#define UNQLITE_RUBY_STREAM
+
+#include <unqlite_ruby.h>
+
+void Init_unqlite_stream();
+
+#endif
@@ -0,0 +1,363 @@
+#include <unqlite_trace.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/*
+ * Optional I/O tracing: a VFS registered with UNQLITE_LIB_CONFIG_VFS
+ * that delegates every call to the built-in OS layer and counts reads,
+ * writes, syncs, truncates and lock requests (with the bytes and time
+ * spent) per file. The pager reads a page from the VFS only when it
+ * misses its own cache, so reads of the database file are page cache
+ * misses. Journal files are accounted with the database they belong to.
+ *
+ * unqlite only accepts a VFS before its first database is opened, and
+ * file handles may be used without the GVL (parallel_scan, backup_to),
+ * so the counters are plain C updated atomically.
+ */
+
+#ifdef HAVE_UNQLITEEXPORTBUILTINVFS
+/* Not part of unqlite.h, but exported by the library */
+const unqlite_vfs *unqliteExportBuiltinVfs(void);
+#endif
+
+#if defined(__GNUC__)
+#define TRACE_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define TRACE_LOAD(counter)   __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define TRACE_ADD(counter, n) ((counter) += (n))
+#define TRACE_LOAD(counter)   (counter)
+#endif
+
+typedef struct
+{
+  unqlite_file base;                /* MUST BE FIRST */
+  unqlite_file *real;               /* file of the built-in VFS, follows this struct */
+  unqliteRubyIoCounters *counters;
+} traceFile;
+
+/* Keep the wrapped file aligned */
+#define TRACE_FILE_SIZE ((sizeof(traceFile) + 7) & ~(size_t)7)
+
+static const unqlite_vfs *trace_builtin = NULL;
+static unqlite_vfs trace_vfs;
+static int trace_enabled = 0;
+
+static unqliteRubyIoStats *trace_stats = NULL;
+static unqliteRubyIoCounters trace_anonymous;   /* temporary files */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static uint64_t trace_clock()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Find (or create) the counters of _path_ */
+static unqliteRubyIoStats* trace_find(const char *path, size_t len, int create)
+{
+  unqliteRubyIoStats *stats;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&trace_lock);
+#endif
+
+  for (stats = trace_stats; stats; stats = stats->next)
+    if (strlen(stats->path) == len && memcmp(stats->path, path, len) == 0)
+      break;
+
+  // Never freed: open handles keep pointers to their counters
+  if (!stats && create)
+  {
+    stats = (unqliteRubyIoStats *)calloc(1, offsetof(unqliteRubyIoStats, path) + len + 1);
+    if (stats)
+    {
+      memcpy(stats->path, path, len);
+      stats->next = trace_stats;
+      trace_stats = stats;
+    }
+  }
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&trace_lock);
+#endif
+
+  return stats;
+}
+
+/* Counters a file opened as _name_ reports to */
+static unqliteRubyIoCounters* trace_counters(const char *name)
+{
+  size_t len, slen = strlen(UNQLITE_RUBY_JOURNAL_SUFFIX);
+  unqliteRubyIoStats *stats;
+  int journal = 0;
+
+  if (!name)
+    return &trace_anonymous;
+
+  len = strlen(name);
+  if (len > slen && strcmp(name + len - slen, UNQLITE_RUBY_JOURNAL_SUFFIX) == 0)
+  {
+    len -= slen;
+    journal = 1;
+  }
+
+  stats = trace_find(name, len, 1);
+  if (!stats)
+    return &trace_anonymous;
+  return journal ? &stats->journal : &stats->data;
+}
+
+static int trace_close(unqlite_file *file)
+{
+  traceFile *tf = (traceFile *)file;
+  return tf->real->pMethods->xClose(tf->real);
+}
+
+static int trace_read(unqlite_file *file, void *buf, unqlite_int64 amount, unqlite_int64 offset)
+{
+  traceFile *tf = (traceFile *)file;
+  uint64_t start = trace_clock();
+  int rc = tf->real->pMethods->xRead(tf->real, buf, amount, offset);
+
+  TRACE_ADD(tf->counters->read_ns, trace_clock() - start);
+  TRACE_ADD(tf->counters->reads, 1);
+  TRACE_ADD(tf->counters->bytes_read, (uint64_t)amount);
+  return rc;
+}
+
+static int trace_write(unqlite_file *file, const void *buf, unqlite_int64 amount, unqlite_int64 offset)
+{
+  traceFile *tf = (traceFile *)file;
+  uint64_t start = trace_clock();
+  int rc = tf->real->pMethods->xWrite(tf->real, buf, amount, offset);
+
+  TRACE_ADD(tf->counters->write_ns, trace_clock() - start);
+  TRACE_ADD(tf->counters->writes, 1);
+  TRACE_ADD(tf->counters->bytes_written, (uint64_t)amount);
+  return rc;
+}
+
+static int trace_truncate(unqlite_file *file, unqlite_int64 size)
+{
+  traceFile *tf = (traceFile *)file;
+
+  TRACE_ADD(tf->counters->truncates, 1);
+  return tf->real->pMethods->xTruncate(tf->real, size);
+}
+
+static int trace_sync(unqlite_file *file, int flags)
+{
+  traceFile *tf = (traceFile *)file;
+  uint64_t start = trace_clock();
+  int rc = tf->real->pMethods->xSync(tf->real, flags);
+
+  TRACE_ADD(tf->counters->sync_ns, trace_clock() - start);
+  TRACE_ADD(tf->counters->syncs, 1);
+  return rc;
+}
+
+static int trace_file_size(unqlite_file *file, unqlite_int64 *size)
+{
+  traceFile *tf = (traceFile *)file;
+  return tf->real->pMethods->xFileSize(tf->real, size);
+}
+
+static int trace_lock_file(unqlite_file *file, int level)
+{
+  traceFile *tf = (traceFile *)file;
+  uint64_t start = trace_clock();
+  int rc = tf->real->pMethods->xLock(tf->real, level);
+
+  TRACE_ADD(tf->counters->lock_ns, trace_clock() - start);
+  TRACE_ADD(tf->counters->locks, 1);
+  if (rc == UNQLITE_BUSY)
+    TRACE_ADD(tf->counters->lock_busy, 1);
+  return rc;
+}
+
+static int trace_unlock_file(unqlite_file *file, int level)
+{
+  traceFile *tf = (traceFile *)file;
+  return tf->real->pMethods->xUnlock(tf->real, level);
+}
+
+static int trace_check_reserved_lock(unqlite_file *file, int *out)
+{
+  traceFile *tf = (traceFile *)file;
+  return tf->real->pMethods->xCheckReservedLock(tf->real, out);
+}
+
+static int trace_sector_size(unqlite_file *file)
+{
+  traceFile *tf = (traceFile *)file;
+  return tf->real->pMethods->xSectorSize(tf->real);
+}
+
+static const unqlite_io_methods trace_io_methods = {
+  1,
+  trace_close,
+  trace_read,
+  trace_write,
+  trace_truncate,
+  trace_sync,
+  trace_file_size,
+  trace_lock_file,
+  trace_unlock_file,
+  trace_check_reserved_lock,
+  trace_sector_size
+};
+
+static int trace_open(unqlite_vfs *vfs, const char *name, unqlite_file *file, unsigned int flags)
+{
+  traceFile *tf = (traceFile *)file;
+  unqlite_file *real = (unqlite_file *)((char *)file + TRACE_FILE_SIZE);
+  int rc;
+
+  rc = trace_builtin->xOpen((unqlite_vfs *)trace_builtin, name, real, flags);
+  if (rc != UNQLITE_OK)
+  {
+    // Nothing to close
+    tf->base.pMethods = NULL;
+    return rc;
+  }
+
+  tf->real = real;
+  tf->counters = trace_counters(name);
+  tf->base.pMethods = &trace_io_methods;
+  return UNQLITE_OK;
+}
+
+/*
+ * call-seq:
+ *     UnQLite.enable_io_tracing -> true
+ *
+ * Routes file I/O through a tracing layer counting reads, writes, syncs
+ * and lock requests per database file (see Database#io_stats). Must be
+ * called before the first database is opened; raises
+ * UnQLite::LockedException otherwise, and UnQLite::UnsupportedException
+ * if the linked unqlite does not export its built-in VFS.
+ */
+static VALUE unqlite_enable_io_tracing(VALUE self)
+{
+#ifdef HAVE_UNQLITEEXPORTBUILTINVFS
+  int rc;
+
+  if (trace_enabled)
+    return Qtrue;
+
+  trace_builtin = unqliteExportBuiltinVfs();
+
+  // Inherit everything but the file handles from the OS layer
+  memcpy(&trace_vfs, trace_builtin, sizeof(trace_vfs));
+  trace_vfs.zName = "unqlite_ruby_trace";
+  trace_vfs.szOsFile = (int)TRACE_FILE_SIZE + trace_builtin->szOsFile;
+  trace_vfs.xOpen = trace_open;
+
+  rc = unqlite_lib_config(UNQLITE_LIB_CONFIG_VFS, &trace_vfs);
+  if (rc == UNQLITE_LOCKED)
+    rb_raise(rb_path2class("UnQLite::LockedException"),
+             "I/O tracing must be enabled before the first database is opened");
+  CHECK(0, rc);
+
+  trace_enabled = 1;
+  return Qtrue;
+#else
+  rb_raise(rb_path2class("UnQLite::UnsupportedException"),
+           "the linked unqlite does not export its built-in VFS");
+#endif
+}
+
+/*
+ * call-seq:
+ *     UnQLite.io_tracing? -> true or false
+ *
+ * Returns true once UnQLite.enable_io_tracing succeeded.
+ */
+static VALUE unqlite_io_tracing_p(VALUE self)
+{
+  return trace_enabled ? Qtrue : Qfalse;
+}
+
+static VALUE trace_counters_hash(const unqliteRubyIoCounters *c)
+{
+  VALUE hash = rb_hash_new();
+
+#define TRACE_COUNT(name, field) \
+  rb_hash_aset(hash, ID2SYM(rb_intern(name)), ULL2NUM(TRACE_LOAD(c->field)))
+#define TRACE_TIME(name, field) \
+  rb_hash_aset(hash, ID2SYM(rb_intern(name)), DBL2NUM(TRACE_LOAD(c->field) / 1e9))
+
+  TRACE_COUNT("reads", reads);
+  TRACE_COUNT("bytes_read", bytes_read);
+  TRACE_TIME("read_time", read_ns);
+  TRACE_COUNT("writes", writes);
+  TRACE_COUNT("bytes_written", bytes_written);
+  TRACE_TIME("write_time", write_ns);
+  TRACE_COUNT("syncs", syncs);
+  TRACE_TIME("sync_time", sync_ns);
+  TRACE_COUNT("locks", locks);
+  TRACE_COUNT("lock_busy", lock_busy);
+  TRACE_TIME("lock_time", lock_ns);
+  TRACE_COUNT("truncates", truncates);
+
+#undef TRACE_COUNT
+#undef TRACE_TIME
+
+  return hash;
+}
+
+/*
+ * call-seq:
+ *     database.io_stats -> hash or nil
+ *
+ * Returns the I/O counters of the database file, accumulated by every
+ * handle on it since UnQLite.enable_io_tracing: +:reads+ (page cache
+ * misses), +:writes+, +:syncs+, +:locks+ and +:truncates+ calls,
+ * +:bytes_read+ and +:bytes_written+, the seconds spent in each kind of
+ * call (+:read_time+, +:write_time+, +:sync_time+, +:lock_time+),
+ * +:lock_busy+ (lock requests that failed) and the same counters for
+ * the rollback journal under +:journal+. Returns nil when tracing is
+ * off or the database has no file.
+ */
+static VALUE unqlite_database_io_stats(VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyIoStats *stats;
+  VALUE result;
+  char *path;
+
+  GetDatabase(self, ctx);
+
+  if (!trace_enabled)
+    return Qnil;
+
+  // Files are known by the full path the pager opened them with
+  path = ALLOCA_N(char, trace_builtin->mxPathname + 1);
+  if (trace_builtin->xFullPathname((unqlite_vfs *)trace_builtin, ctx->path, trace_builtin->mxPathname, path) != UNQLITE_OK)
+    strncpy(path, ctx->path, trace_builtin->mxPathname);
+  path[trace_builtin->mxPathname] = '\0';
+
+  stats = trace_find(path, strlen(path), 0);
+  if (!stats)
+    stats = trace_find(ctx->path, strlen(ctx->path), 0);
+  if (!stats)
+    return Qnil;
+
+  result = trace_counters_hash(&stats->data);
+  rb_hash_aset(result, ID2SYM(rb_intern("journal")), trace_counters_hash(&stats->journal));
+  return result;
+}
+
+void Init_unqlite_trace()
+{
+  rb_define_singleton_method(mUnQLite, "enable_io_tracing", unqlite_enable_io_tracing, 0);
+  rb_define_singleton_method(mUnQLite, "io_tracing?", unqlite_io_tracing_p, 0);
+  rb_define_method(cUnQLiteDatabase, "io_stats", unqlite_database_io_stats, 0);
+}
@@ -0,0 +1,37 @@
+#ifndef UNQLITE_RUBY_TRACE
+#define UNQLITE_RUBY_TRACE
+
+#include <unqlite_ruby.h>
+#include <stdint.h>
+
+/* Suffix unqlite appends to a database file name for its journal */
+#define UNQLITE_RUBY_JOURNAL_SUFFIX "_unqlite_journal"
+
+typedef struct
+{
+  uint64_t reads;
+  uint64_t bytes_read;
+  uint64_t read_ns;
+  uint64_t writes;
+  uint64_t bytes_written;
+  uint64_t write_ns;
+  uint64_t syncs;
+  uint64_t sync_ns;
+  uint64_t locks;
+  uint64_t lock_busy;       /* lock requests answered with UNQLITE_BUSY */
+  uint64_t lock_ns;
+  uint64_t truncates;
+} unqliteRubyIoCounters;
+
+/* Counters of one database file and of its journal */
+typedef struct _unqliteRubyIoStats
+{
+  struct _unqliteRubyIoStats *next;
+  unqliteRubyIoCounters data;
+  unqliteRubyIoCounters journal;
+  char path[1];
+} unqliteRubyIoStats;
+
+void Init_unqlite_trace();
+
+#endif
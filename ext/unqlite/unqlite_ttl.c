@@ -0,0 +1,777 @@
+#include <unqlite_ttl.h>
+#include <sys/time.h>
+
+/*
+ * Keys stored with a time-to-live get an expiry record under
+ * UNQLITE_RUBY_TTL_PREFIX holding their deadline (8 bytes, big endian,
+ * milliseconds since the epoch). Reads through a handle that knows
+ * about expiry check that record and treat expired keys as missing.
+ *
+ * The default hash engine does not keep keys in order, so the order by
+ * deadline is kept in memory: a min-heap fed by store(ttl:) and rebuilt
+ * from the expiry records by enable_expiry. The sweeper thread pops due
+ * keys and deletes them in small transactions. It runs Ruby-side (as a
+ * native thread holding the GVL only while it sweeps), so it never runs
+ * concurrently with a call on the same handle, and it skips its turn
+ * inside begin_transaction, with open cursors, while a call holds the
+ * handle, or when auto-commit is disabled and writes are pending:
+ * writers never wait for more than one batch and never see their
+ * transaction committed by the sweeper.
+ *
+ * When the handle has auto-committed writes pending, the sweep deletes
+ * its batch inside that same transaction and leaves it open, so a
+ * rollback still discards the writes, and the deletes with them. The
+ * keys deleted that way are held aside until the transaction ends and
+ * then queued again: those rolled back are expired anew, the others are
+ * found gone and dropped.
+ */
+
+#define TTL_DEFAULT_RATE  1000.0
+#define TTL_DEFAULT_BATCH 100
+
+/* Sweepers still running check this to know they were replaced */
+static unsigned long ttl_generation = 0;
+
+static int64_t ttl_now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void ttl_encode(char *p, int64_t deadline)
+{
+  int i;
+  for (i = 7; i >= 0; i--, deadline >>= 8)
+    p[i] = (char)(deadline & 0xff);
+}
+
+static int64_t ttl_decode(const char *p)
+{
+  uint64_t n = 0;
+  int i;
+  for (i = 0; i < 8; i++)
+    n = (n << 8) | (unsigned char)p[i];
+  return (int64_t)n;
+}
+
+/* Build the expiry record key of _key_ in _buf_ (len + prefix bytes) */
+static void ttl_record_key(char *buf, const char *key, long len)
+{
+  memcpy(buf, UNQLITE_RUBY_TTL_PREFIX, UNQLITE_RUBY_TTL_PREFIX_LEN);
+  memcpy(buf + UNQLITE_RUBY_TTL_PREFIX_LEN, key, len);
+}
+
+/* Read the deadline of _key_; UNQLITE_NOTFOUND if it does not expire */
+static int ttl_get(unqlite *db, const char *key, long len, int64_t *deadline)
+{
+  VALUE tmp;
+  char *rkey = ALLOCV_N(char, tmp, len + UNQLITE_RUBY_TTL_PREFIX_LEN);
+  char data[8];
+  unqlite_int64 n_bytes = sizeof(data);
+  int rc;
+
+  ttl_record_key(rkey, key, len);
+  rc = unqlite_kv_fetch(db, rkey, len + UNQLITE_RUBY_TTL_PREFIX_LEN, data, &n_bytes);
+  ALLOCV_END(tmp);
+
+  if (rc == UNQLITE_OK && n_bytes != sizeof(data))
+    rc = UNQLITE_CORRUPT;
+  if (rc == UNQLITE_OK)
+    *deadline = ttl_decode(data);
+  return rc;
+}
+
+/* Remove the expiry record of _key_, if any */
+static int ttl_remove(unqlite *db, const char *key, long len)
+{
+  VALUE tmp;
+  char *rkey = ALLOCV_N(char, tmp, len + UNQLITE_RUBY_TTL_PREFIX_LEN);
+  int rc;
+
+  ttl_record_key(rkey, key, len);
+  rc = unqlite_kv_delete(db, rkey, len + UNQLITE_RUBY_TTL_PREFIX_LEN);
+  ALLOCV_END(tmp);
+
+  return rc == UNQLITE_NOTFOUND ? UNQLITE_OK : rc;
+}
+
+static void ttl_push(unqliteRubyTtl *ttl, unqliteRubyTtlEntry *entry)
+{
+  size_t i;
+
+  if (ttl->count == ttl->cap)
+  {
+    ttl->cap = ttl->cap ? ttl->cap * 2 : 64;
+    REALLOC_N(ttl->heap, unqliteRubyTtlEntry *, ttl->cap);
+  }
+
+  // Sift up
+  i = ttl->count++;
+  while (i > 0 && ttl->heap[(i - 1) / 2]->deadline > entry->deadline)
+  {
+    ttl->heap[i] = ttl->heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  ttl->heap[i] = entry;
+}
+
+static unqliteRubyTtlEntry* ttl_pop(unqliteRubyTtl *ttl)
+{
+  unqliteRubyTtlEntry *top = ttl->heap[0], *last = ttl->heap[--ttl->count];
+  size_t i = 0, child;
+
+  // Sift the last entry down from the root
+  while ((child = 2 * i + 1) < ttl->count)
+  {
+    if (child + 1 < ttl->count && ttl->heap[child + 1]->deadline < ttl->heap[child]->deadline)
+      child++;
+    if (last->deadline <= ttl->heap[child]->deadline)
+      break;
+    ttl->heap[i] = ttl->heap[child];
+    i = child;
+  }
+  if (ttl->count > 0)
+    ttl->heap[i] = last;
+
+  return top;
+}
+
+static void ttl_enqueue(unqliteRubyTtl *ttl, const char *key, long len, int64_t deadline)
+{
+  unqliteRubyTtlEntry *entry;
+
+  entry = (unqliteRubyTtlEntry *)xmalloc(offsetof(unqliteRubyTtlEntry, key) + len);
+  entry->deadline = deadline;
+  entry->len = len;
+  memcpy(entry->key, key, len);
+  ttl_push(ttl, entry);
+}
+
+static void ttl_reset(unqliteRubyTtl *ttl)
+{
+  while (ttl->count > 0)
+    xfree(ttl->heap[--ttl->count]);
+  while (ttl->nheld > 0)
+    xfree(ttl->held[--ttl->nheld]);
+}
+
+/* Keep _entry_ aside until the caller's transaction ends */
+static void ttl_hold(unqliteRubyPtr ctx, unqliteRubyTtlEntry *entry)
+{
+  unqliteRubyTtl *ttl = ctx->ttl;
+
+  if (ttl->nheld == ttl->held_cap)
+  {
+    ttl->held_cap = ttl->held_cap ? ttl->held_cap * 2 : 16;
+    REALLOC_N(ttl->held, unqliteRubyTtlEntry *, ttl->held_cap);
+  }
+  ttl->held[ttl->nheld++] = entry;
+  ttl->held_transaction = ctx->transactions;
+}
+
+/*
+ * Once their transaction has ended, count the held keys that are gone
+ * and queue again those a rollback brought back
+ */
+static void ttl_release_held(unqliteRubyPtr ctx)
+{
+  unqliteRubyTtl *ttl = ctx->ttl;
+  unqliteRubyTtlEntry *entry;
+  int64_t deadline;
+  int rc;
+
+  if (ttl->nheld == 0 || (ctx->pending && ctx->transactions == ttl->held_transaction))
+    return;
+
+  while (ttl->nheld > 0)
+  {
+    entry = ttl->held[--ttl->nheld];
+    rc = ttl_get(ctx->pDb, entry->key, entry->len, &deadline);
+    if (rc == UNQLITE_NOTFOUND || (rc == UNQLITE_OK && deadline != entry->deadline))
+    {
+      ttl->expired++;
+      xfree(entry);
+    }
+    else
+      ttl_push(ttl, entry);
+  }
+}
+
+static unqliteRubyTtl* ttl_alloc(unqliteRubyPtr ctx)
+{
+  unqliteRubyTtl *ttl;
+
+  if (ctx->ttl)
+    return ctx->ttl;
+
+  ttl = ALLOC(unqliteRubyTtl);
+  memset(ttl, 0, sizeof(*ttl));
+  ttl->thread = Qnil;
+  ttl->interval = TTL_DEFAULT_BATCH / TTL_DEFAULT_RATE;
+  ttl->batch = TTL_DEFAULT_BATCH;
+  ctx->ttl = ttl;
+  return ttl;
+}
+
+/* Called once the database is open: expiry is on if any key ever had a TTL */
+void unqliteRuby_ttl_open(unqliteRubyPtr ctx)
+{
+  unqlite_int64 n_bytes;
+
+  if (unqlite_kv_fetch(ctx->pDb, UNQLITE_RUBY_TTL_PREFIX, UNQLITE_RUBY_TTL_PREFIX_LEN, NULL, &n_bytes) == UNQLITE_OK)
+    ttl_alloc(ctx)->marked = 1;
+}
+
+/* Lazy expiry: true if _key_ has a deadline in the past */
+int unqliteRuby_ttl_expired(unqliteRubyPtr ctx, const char *key, long len)
+{
+  int64_t deadline;
+
+  if (!ctx->ttl)
+    return 0;
+
+  if (ttl_get(ctx->pDb, key, len, &deadline) != UNQLITE_OK || deadline > ttl_now())
+    return 0;
+
+  unqliteRuby_cache_invalidate(ctx, key, len);
+  return 1;
+}
+
+/* Raise unless _ttl_ is nil or a positive number of seconds */
+void unqliteRuby_ttl_check(VALUE ttl)
+{
+  if (!NIL_P(ttl) && !(NUM2DBL(ttl) > 0))
+    rb_raise(rb_eArgError, "ttl must be positive");
+}
+
+/*
+ * Set (or, when _ttl_ is nil, remove) the expiry of a key just written.
+ * _ttl_ was checked by unqliteRuby_ttl_check before the write.
+ */
+void unqliteRuby_ttl_write(unqliteRubyPtr ctx, VALUE key, VALUE ttl)
+{
+  unqlite *db = ctx->pDb;
+  unqliteRubyTtl *rttl;
+  volatile VALUE rkey;
+  char data[8];
+  double seconds;
+  int64_t deadline;
+  int rc;
+
+  if (NIL_P(ttl))
+  {
+    if (ctx->ttl)
+    {
+      rc = ttl_remove(db, RSTRING_PTR(key), RSTRING_LEN(key));
+      CHECK(db, rc);
+    }
+    return;
+  }
+
+  seconds = NUM2DBL(ttl);
+  rttl = ttl_alloc(ctx);
+
+  // Let handles opened later know that some keys expire
+  if (!rttl->marked)
+  {
+    rc = unqlite_kv_store(db, UNQLITE_RUBY_TTL_PREFIX, UNQLITE_RUBY_TTL_PREFIX_LEN, "", 0);
+    CHECK(db, rc);
+    rttl->marked = 1;
+  }
+
+  deadline = ttl_now() + (int64_t)(seconds * 1000);
+  ttl_encode(data, deadline);
+
+  rkey = rb_str_buf_new(RSTRING_LEN(key) + UNQLITE_RUBY_TTL_PREFIX_LEN);
+  ttl_record_key(RSTRING_PTR(rkey), RSTRING_PTR(key), RSTRING_LEN(key));
+  rc = unqlite_kv_store(db, RSTRING_PTR(rkey), RSTRING_LEN(key) + UNQLITE_RUBY_TTL_PREFIX_LEN, data, sizeof(data));
+  CHECK(db, rc);
+
+  ttl_enqueue(rttl, RSTRING_PTR(key), RSTRING_LEN(key), deadline);
+}
+
+/* Drop the expiry of a deleted or overwritten key */
+int unqliteRuby_ttl_delete(unqliteRubyPtr ctx, const char *key, long len)
+{
+  if (!ctx->ttl)
+    return UNQLITE_OK;
+
+  return ttl_remove(ctx->pDb, key, len);
+}
+
+/* Delete _key_ if it expired, so writes building on its value start afresh */
+void unqliteRuby_ttl_purge(unqliteRubyPtr ctx, VALUE key)
+{
+  unqlite *db = ctx->pDb;
+  int rc;
+
+  if (!unqliteRuby_ttl_expired(ctx, RSTRING_PTR(key), RSTRING_LEN(key)))
+    return;
+
+  if (ctx->nindexes > 0)
+    unqliteRuby_index_write(ctx, key, Qnil, UNQLITE_RUBY_WRITE_DELETE);
+  else
+  {
+    rc = unqlite_kv_delete(db, RSTRING_PTR(key), RSTRING_LEN(key));
+    if (rc != UNQLITE_NOTFOUND)
+      CHECK(db, rc);
+  }
+
+  unqliteRuby_order_remove(ctx, RSTRING_PTR(key), RSTRING_LEN(key));
+  rc = ttl_remove(db, RSTRING_PTR(key), RSTRING_LEN(key));
+  CHECK(db, rc);
+}
+
+/* The database was cleared: expiry records and the marker are gone */
+void unqliteRuby_ttl_clear(unqliteRubyPtr ctx)
+{
+  if (!ctx->ttl)
+    return;
+
+  ttl_reset(ctx->ttl);
+  ctx->ttl->marked = 0;
+}
+
+/* Wrapped object: mark the sweeper thread */
+void unqliteRuby_ttl_mark(unqliteRubyPtr ctx)
+{
+  if (ctx->ttl)
+    UNQLITE_RUBY_MARK(ctx->ttl->thread);
+}
+
+void unqliteRuby_ttl_compact(unqliteRubyPtr ctx)
+{
+  if (ctx->ttl)
+    UNQLITE_RUBY_MOVE(ctx->ttl->thread);
+}
+
+size_t unqliteRuby_ttl_memsize(const struct _unqliteRuby *ctx)
+{
+  size_t size, i;
+
+  if (!ctx->ttl)
+    return 0;
+
+  size = sizeof(unqliteRubyTtl) + (ctx->ttl->cap + ctx->ttl->held_cap) * sizeof(unqliteRubyTtlEntry *);
+  for (i = 0; i < ctx->ttl->count; i++)
+    size += sizeof(unqliteRubyTtlEntry) + ctx->ttl->heap[i]->len;
+  for (i = 0; i < ctx->ttl->nheld; i++)
+    size += sizeof(unqliteRubyTtlEntry) + ctx->ttl->held[i]->len;
+  return size;
+}
+
+/* Release the expiry state; a running sweeper notices and exits */
+void unqliteRuby_ttl_free(unqliteRubyPtr ctx)
+{
+  if (!ctx->ttl)
+    return;
+
+  ttl_reset(ctx->ttl);
+  xfree(ctx->ttl->heap);
+  xfree(ctx->ttl->held);
+  xfree(ctx->ttl);
+  ctx->ttl = NULL;
+}
+
+struct ttl_index_delete_args
+{
+  unqliteRubyPtr ctx;
+  VALUE key;
+};
+
+static VALUE ttl_index_delete(VALUE arg)
+{
+  struct ttl_index_delete_args *args = (struct ttl_index_delete_args *)arg;
+  unqliteRuby_index_write(args->ctx, args->key, Qnil, UNQLITE_RUBY_WRITE_DELETE);
+  return Qnil;
+}
+
+/* Delete an expired key and its expiry record */
+static int ttl_expire(unqliteRubyPtr ctx, unqliteRubyTtlEntry *entry)
+{
+  unqlite *db = ctx->pDb;
+  int rc = UNQLITE_OK, state = 0;
+
+  unqliteRuby_cache_invalidate(ctx, entry->key, entry->len);
+
+  if (ctx->nindexes > 0)
+  {
+    // Index entries are maintained by the extractors, which may raise
+    struct ttl_index_delete_args args;
+    args.ctx = ctx;
+    args.key = rb_str_new(entry->key, entry->len);
+    rb_protect(ttl_index_delete, (VALUE)&args, &state);
+    RB_GC_GUARD(args.key);
+    if (state)
+    {
+      rb_set_errinfo(Qnil);
+      return UNQLITE_ABORT;
+    }
+    // Extractors may have closed the database
+    if (ctx->pDb != db)
+      return UNQLITE_ABORT;
+  }
+  else
+  {
+    rc = unqlite_kv_delete(db, entry->key, entry->len);
+    if (rc == UNQLITE_NOTFOUND)
+      rc = UNQLITE_OK;
+  }
+
+  if (rc == UNQLITE_OK)
+  {
+    unqliteRuby_order_remove(ctx, entry->key, entry->len);
+    rc = ttl_remove(db, entry->key, entry->len);
+  }
+  return rc;
+}
+
+/*
+ * Delete up to one batch of due keys in a transaction of its own, or in
+ * the auto-committed one the handle has open (see the top of the file)
+ */
+static void ttl_sweep(unqliteRubyPtr ctx)
+{
+  unqliteRubyTtl *ttl = ctx->ttl;
+  unqlite *db = ctx->pDb;
+  unqliteRubyTtlEntry **done;
+  long n = 0, i;
+  int64_t now, deadline;
+  int rc, joined;
+
+  ttl->sweeps++;
+
+  if (!ctx->busy && !ctx->compacting)
+    ttl_release_held(ctx);
+  now = ttl_now();
+  if (ttl->count == 0 || ttl->heap[0]->deadline > now)
+    return;
+
+  // Never touch a handle held by a call, an explicit transaction, nor cursors' records
+  if (ctx->busy || ctx->compacting || ctx->in_transaction || (ctx->no_auto_commit && ctx->pending) ||
+      ctx->cursors || ctx->ncursors_out > 0)
+  {
+    ttl->deferred++;
+    return;
+  }
+
+  joined = ctx->pending;
+  if (!joined)
+  {
+    rc = unqlite_begin(db);
+    if (rc == UNQLITE_OK)
+      rc = unqliteRuby_index_touch(ctx);
+    if (rc != UNQLITE_OK)
+    {
+      unqliteRuby_rollback(ctx);
+      ttl->deferred++;
+      return;
+    }
+  }
+
+  done = ALLOC_N(unqliteRubyTtlEntry *, ttl->batch);
+  while (n < ttl->batch && ttl->count > 0 && ttl->heap[0]->deadline <= now)
+  {
+    unqliteRubyTtlEntry *entry = ttl_pop(ttl);
+
+    // Skip keys stored again, or deleted, since they were queued
+    rc = ttl_get(db, entry->key, entry->len, &deadline);
+    if (rc != UNQLITE_OK || deadline != entry->deadline)
+    {
+      xfree(entry);
+      rc = UNQLITE_OK;
+      continue;
+    }
+
+    done[n++] = entry;
+    rc = ttl_expire(ctx, entry);
+    if (rc != UNQLITE_OK)
+      break;
+  }
+
+  if (ctx->pDb != db || ctx->ttl != ttl)
+  {
+    // Closed while index extractors ran
+    for (i = 0; i < n; i++)
+      xfree(done[i]);
+    xfree(done);
+    return;
+  }
+
+  if (joined)
+  {
+    // Committed or rolled back along with the caller's writes
+    if (rc != UNQLITE_OK)
+      ttl->deferred++;
+    for (i = 0; i < n; i++)
+      ttl_hold(ctx, done[i]);
+    xfree(done);
+    return;
+  }
+
+  if (rc == UNQLITE_OK)
+    rc = unqlite_commit(db);
+
+  if (rc == UNQLITE_OK)
+  {
+    ttl->expired += n;
+    for (i = 0; i < n; i++)
+      xfree(done[i]);
+  }
+  else
+  {
+    // Try again on the next sweep
+    unqliteRuby_rollback(ctx);
+    ttl->deferred++;
+    for (i = 0; i < n; i++)
+      ttl_push(ttl, done[i]);
+  }
+  xfree(done);
+}
+
+struct ttl_sweeper_args
+{
+  VALUE database;
+  unsigned long generation;
+};
+
+static VALUE ttl_sweeper(void *arg)
+{
+  struct ttl_sweeper_args *args = (struct ttl_sweeper_args *)arg;
+  volatile VALUE database = args->database;
+  unsigned long generation = args->generation;
+  unqliteRubyPtr ctx;
+  struct timeval tv;
+
+  xfree(args);
+  TypedData_Get_Struct(database, unqliteRuby, &unqliteRuby_type, ctx);
+
+  while (ctx->pDb && ctx->ttl && ctx->ttl->generation == generation)
+  {
+    tv.tv_sec = (time_t)ctx->ttl->interval;
+    tv.tv_usec = (long)((ctx->ttl->interval - tv.tv_sec) * 1e6);
+    rb_thread_wait_for(tv);
+
+    // Closed, disabled or replaced meanwhile?
+    if (!ctx->pDb || !ctx->ttl || ctx->ttl->generation != generation)
+      break;
+    ttl_sweep(ctx);
+  }
+
+  RB_GC_GUARD(database);
+  return Qnil;
+}
+
+/* Load the deadlines of every expiring key into the heap */
+static void ttl_rebuild(unqliteRubyPtr ctx)
+{
+  unqlite *db = ctx->pDb;
+  unqlite_kv_cursor *cursor;
+  char *buf = NULL, data[8];
+  int cap = 0, klen, rc;
+  unqlite_int64 n_bytes;
+
+  ttl_reset(ctx->ttl);
+
+  rc = unqliteRuby_cursor_acquire(ctx, &cursor);
+  CHECK(db, rc);
+
+  unqlite_kv_cursor_first_entry(cursor);
+  while (rc == UNQLITE_OK && unqlite_kv_cursor_valid_entry(cursor))
+  {
+    rc = unqlite_kv_cursor_key(cursor, NULL, &klen);
+    if (rc == UNQLITE_OK && klen > UNQLITE_RUBY_TTL_PREFIX_LEN)
+    {
+      if (klen > cap)
+      {
+        cap = klen;
+        REALLOC_N(buf, char, cap);
+      }
+      rc = unqlite_kv_cursor_key(cursor, buf, &klen);
+      if (rc == UNQLITE_OK && memcmp(buf, UNQLITE_RUBY_TTL_PREFIX, UNQLITE_RUBY_TTL_PREFIX_LEN) == 0)
+      {
+        n_bytes = sizeof(data);
+        rc = unqlite_kv_cursor_data(cursor, data, &n_bytes);
+        if (rc == UNQLITE_OK && n_bytes == sizeof(data))
+          ttl_enqueue(ctx->ttl, buf + UNQLITE_RUBY_TTL_PREFIX_LEN, klen - UNQLITE_RUBY_TTL_PREFIX_LEN, ttl_decode(data));
+      }
+    }
+    unqlite_kv_cursor_next_entry(cursor);
+  }
+
+  unqliteRuby_cursor_recycle(ctx, cursor);
+  xfree(buf);
+  CHECK(db, rc);
+}
+
+/* Load the deadlines and start a sweeper thread */
+static void ttl_start(unqliteRubyPtr ctx)
+{
+  unqliteRubyTtl *ttl = ctx->ttl;
+  struct ttl_sweeper_args *args;
+
+  ttl_rebuild(ctx);
+
+  args = ALLOC(struct ttl_sweeper_args);
+  args->database = ctx->self;
+  args->generation = ttl->generation = ++ttl_generation;
+  RB_OBJ_WRITE(ctx->self, &ttl->thread, rb_thread_create(ttl_sweeper, args));
+}
+
+/* Threads do not survive fork: restart the sweeper of a reopened handle */
+void unqliteRuby_ttl_after_fork(unqliteRubyPtr ctx)
+{
+  if (ctx->ttl && !NIL_P(ctx->ttl->thread))
+    ttl_start(ctx);
+}
+
+/*
+ * call-seq:
+ *     database.enable_expiry(rate: 1000, batch: 100) -> true
+ *
+ * Starts a background sweeper that deletes expired keys, at most
+ * _batch_ keys per transaction and _rate_ keys per second. The deadline
+ * of every expiring key is loaded first, which scans the database once.
+ * Calling it again updates _rate_ and _batch_.
+ *
+ * The sweeper skips its turn while a transaction begun with
+ * #begin_transaction is open, while cursors are open, and after
+ * #disable_auto_commit while writes are uncommitted. When auto-committed
+ * writes are pending, it deletes inside their transaction without
+ * committing it: #rollback discards both, and the keys are swept again.
+ * Those deletes count as +:expired+ once the transaction ends. It keeps
+ * the database object alive until #disable_expiry or #close is called.
+ */
+static VALUE unqlite_database_enable_expiry(int argc, VALUE* argv, VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyTtl *ttl;
+  VALUE opts;
+  VALUE kwargs[2];
+  ID kwnames[2];
+  double rate = TTL_DEFAULT_RATE;
+  long batch = TTL_DEFAULT_BATCH;
+
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  kwnames[0] = rb_intern("rate");
+  kwnames[1] = rb_intern("batch");
+  kwargs[0] = kwargs[1] = Qundef;
+  if (!NIL_P(opts))
+    rb_get_kwargs(opts, kwnames, 0, 2, kwargs);
+  if (kwargs[0] != Qundef)
+    rate = NUM2DBL(kwargs[0]);
+  if (kwargs[1] != Qundef)
+    batch = NUM2LONG(kwargs[1]);
+  if (!(rate > 0))
+    rb_raise(rb_eArgError, "rate must be positive");
+  if (batch <= 0)
+    rb_raise(rb_eArgError, "batch must be positive");
+
+  GetDatabase(self, ctx);
+
+  ttl = ttl_alloc(ctx);
+  ttl->batch = batch;
+  ttl->interval = batch / rate;
+
+  if (!NIL_P(ttl->thread) && RTEST(rb_funcall(ttl->thread, rb_intern("alive?"), 0)))
+    return Qtrue;
+
+  ttl_start(ctx);
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.disable_expiry -> true
+ *
+ * Stops the background sweeper. Expired keys are still hidden from
+ * reads, until they are stored again or deleted.
+ */
+static VALUE unqlite_database_disable_expiry(VALUE self)
+{
+  unqliteRubyPtr ctx;
+
+  GetDatabase(self, ctx);
+
+  if (ctx->ttl)
+  {
+    ctx->ttl->generation = ++ttl_generation;
+    ctx->ttl->thread = Qnil;
+  }
+
+  return Qtrue;
+}
+
+/*
+ * call-seq:
+ *     database.ttl(key) -> seconds or nil
+ *
+ * Returns the seconds left before _key_ expires, or nil if it does not
+ * expire (or does not exist).
+ */
+static VALUE unqlite_database_ttl(VALUE self, VALUE key)
+{
+  unqliteRubyPtr ctx;
+  unqlite* db;
+  int64_t deadline, now;
+  unqlite_int64 n_bytes;
+  int rc;
+
+  Check_Type(key, T_STRING);
+
+  GetDatabase2(self, ctx, db);
+
+  if (!ctx->ttl)
+    return Qnil;
+
+  rc = ttl_get(db, RSTRING_PTR(key), RSTRING_LEN(key), &deadline);
+  if (rc == UNQLITE_NOTFOUND)
+    return Qnil;
+  CHECK(db, rc);
+
+  // Expiry records may outlive keys deleted through other handles
+  rc = unqlite_kv_fetch(db, RSTRING_PTR(key), RSTRING_LEN(key), NULL, &n_bytes);
+  if (rc == UNQLITE_NOTFOUND)
+    return Qnil;
+  CHECK(db, rc);
+
+  now = ttl_now();
+  return DBL2NUM(deadline > now ? (deadline - now) / 1000.0 : 0.0);
+}
+
+/*
+ * call-seq:
+ *     database.expiry_stats -> hash
+ *
+ * Returns counters of the expiry sweeper: +:pending+ (keys waiting for
+ * their deadline), +:expired+ (keys deleted), +:sweeps+ and +:deferred+
+ * (sweeps skipped because the handle was busy).
+ */
+static VALUE unqlite_database_expiry_stats(VALUE self)
+{
+  unqliteRubyPtr ctx;
+  unqliteRubyTtl *ttl;
+  VALUE stats = rb_hash_new();
+
+  GetDatabase(self, ctx);
+  ttl = ctx->ttl;
+
+  rb_hash_aset(stats, ID2SYM(rb_intern("pending")), SIZET2NUM(ttl ? ttl->count : 0));
+  rb_hash_aset(stats, ID2SYM(rb_intern("expired")), ULL2NUM(ttl ? ttl->expired : 0));
+  rb_hash_aset(stats, ID2SYM(rb_intern("sweeps")), ULL2NUM(ttl ? ttl->sweeps : 0));
+  rb_hash_aset(stats, ID2SYM(rb_intern("deferred")), ULL2NUM(ttl ? ttl->deferred : 0));
+
+  return stats;
+}
+
+void Init_unqlite_ttl()
+{
+  rb_define_method(cUnQLiteDatabase, "enable_expiry", unqlite_database_enable_expiry, -1);
+  rb_define_method(cUnQLiteDatabase, "disable_expiry", unqlite_database_disable_expiry, 0);
+  rb_define_method(cUnQLiteDatabase, "ttl", unqlite_database_ttl, 1);
+  rb_define_method(cUnQLiteDatabase, "expiry_stats", unqlite_database_expiry_stats, 0);
+}
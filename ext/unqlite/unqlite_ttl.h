@@ -0,0 +1,56 @@
+#ifndef UNQLITE_RUBY_TTL
+#define UNQLITE_RUBY_TTL
+
+#include <unqlite_ruby.h>
+#include <stdint.h>
+
+struct _unqliteRuby;
+
+/* Expiry records live under this prefix, keyed by the expiring key */
+#define UNQLITE_RUBY_TTL_PREFIX     "\0exp\0"
+#define UNQLITE_RUBY_TTL_PREFIX_LEN 5
+
+typedef struct
+{
+  int64_t deadline;               /* milliseconds since the epoch */
+  long len;
+  char key[1];
+} unqliteRubyTtlEntry;
+
+typedef struct _unqliteRubyTtl
+{
+  unqliteRubyTtlEntry **heap;     /* min-heap ordered by deadline */
+  size_t count;
+  size_t cap;
+  int marked;                     /* the marker record is known to exist */
+
+  unqliteRubyTtlEntry **held;     /* expired inside a transaction of the caller */
+  size_t nheld;
+  size_t held_cap;
+  unsigned long held_transaction; /* that transaction (ctx->transactions) */
+
+  VALUE thread;                   /* sweeper thread, or Qnil */
+  unsigned long generation;       /* identifies the running sweeper */
+  double interval;                /* seconds between sweeps */
+  long batch;                     /* keys deleted per transaction */
+
+  uint64_t expired;
+  uint64_t sweeps;
+  uint64_t deferred;              /* sweeps skipped for a busy handle */
+} unqliteRubyTtl;
+
+void Init_unqlite_ttl();
+void unqliteRuby_ttl_open(struct _unqliteRuby *ctx);
+int unqliteRuby_ttl_expired(struct _unqliteRuby *ctx, const char *key, long len);
+void unqliteRuby_ttl_check(VALUE ttl);
+void unqliteRuby_ttl_write(struct _unqliteRuby *ctx, VALUE key, VALUE ttl);
+int unqliteRuby_ttl_delete(struct _unqliteRuby *ctx, const char *key, long len);
+void unqliteRuby_ttl_purge(struct _unqliteRuby *ctx, VALUE key);
+void unqliteRuby_ttl_clear(struct _unqliteRuby *ctx);
+void unqliteRuby_ttl_after_fork(struct _unqliteRuby *ctx);
+void unqliteRuby_ttl_mark(struct _unqliteRuby *ctx);
+void unqliteRuby_ttl_compact(struct _unqliteRuby *ctx);
+size_t unqliteRuby_ttl_memsize(const struct _unqliteRuby *ctx);
+void unqliteRuby_ttl_free(struct _unqliteRuby *ctx);
+
+#endif
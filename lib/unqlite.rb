@@ -1,5 +1,6 @@
-require 'unqlite/unqlite_native'
 require 'unqlite/errors'
+require 'unqlite/unqlite_native'
+require 'unqlite/fork'
 require 'unqlite/version'
 
 module UnQLite
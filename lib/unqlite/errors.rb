@@ -31,4 +31,6 @@ module UnQLite
   class ReadOnlyException < Exception; end
   class LockProtocolException < Exception; end
   class UnsupportedException < Exception; end
+  class CompileException < Exception; end # Jx9 script compilation
+  class VMException < Exception; end # Jx9 script execution
 end
@@ -0,0 +1,15 @@
+module UnQLite
+  # Process._fork hook keeping database handles safe to use across fork:
+  # pending writes are committed in the parent and write handles are
+  # reopened in the child (see UnQLite::Database.after_fork).
+  module ForkHook
+    def _fork
+      UnQLite::Database.before_fork
+      pid = super
+      UnQLite::Database.after_fork if pid == 0
+      pid
+    end
+  end
+
+  Process.singleton_class.prepend(ForkHook) if Process.respond_to?(:_fork)
+end
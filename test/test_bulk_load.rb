@@ -0,0 +1,69 @@
+require 'tmpdir'
+require 'stringio'
+require 'helper'
+
+module UnQLite
+  class TestBulkLoad < Minitest::Test
+    attr_reader :db_path
+
+    def setup
+      @db_path = "#{Dir.mktmpdir("unqlite-ruby-test")}/db"
+    end
+
+    def teardown
+      FileUtils.remove_entry(File.dirname(db_path))
+    end
+
+    def read_all
+      UnQLite::Database.open(db_path) do |db|
+        all = {}
+        db.each { |key, value| all[key] = value }
+        all
+      end
+    end
+
+    def test_tsv
+      source = StringIO.new("alpha\tfirst\nbeta\tsec\\tond\r\n\ngamma\tthird")
+      assert_equal 3, UnQLite.bulk_load(db_path, source)
+      assert_equal({ "alpha" => "first", "beta" => "sec\tond", "gamma" => "third" }, read_all)
+    end
+
+    def test_ndjson
+      source = StringIO.new(%Q({"key": "alpha", "value": "first"}\n{"value": "caf\\u00e9", "id": "x", "key": "beta"}\n))
+      assert_equal 2, UnQLite.bulk_load(db_path, source, format: :ndjson, presort: true)
+      all = read_all
+      assert_equal "first", all["alpha"]
+      assert_equal "café".b, all["beta"].b
+    end
+
+    def test_binary_lenprefixed
+      records = { "alpha" => "first", "beta" => "\0\n\t" }
+      source = StringIO.new(records.map { |k, v| [k.size, v.size, k, v].pack("NNa*a*") }.join)
+      assert_equal 2, UnQLite.bulk_load(db_path, source, format: :binary_lenprefixed)
+      assert_equal records, read_all
+    end
+
+    def test_progress
+      source = StringIO.new((1..100).map { |i| "key#{i}\tvalue#{i}\n" }.join)
+      progress = []
+      UnQLite.bulk_load(db_path, source, commit_every: 256) { |records, bytes| progress << records }
+      assert progress.size > 1
+      assert_equal 100, progress.last
+      assert_equal 100, read_all.size
+    end
+
+    def test_from_file
+      source = "#{db_path}.tsv"
+      File.binwrite(source, "alpha\tfirst\n")
+      assert_equal 1, UnQLite.bulk_load(db_path, source)
+      assert_equal({ "alpha" => "first" }, read_all)
+    end
+
+    def test_malformed
+      assert_raises(ArgumentError) { UnQLite.bulk_load(db_path, StringIO.new("alpha\n")) }
+      assert_raises(ArgumentError) { UnQLite.bulk_load(db_path, StringIO.new("{\"key\": \"a\"}\n"), format: :ndjson) }
+      assert_raises(ArgumentError) { UnQLite.bulk_load(db_path, StringIO.new("\0\0\0\5ab"), format: :binary_lenprefixed) }
+      assert_raises(ArgumentError) { UnQLite.bulk_load(db_path, StringIO.new(""), format: :csv) }
+    end
+  end
+end
@@ -0,0 +1,114 @@
+require 'tmpdir'
+require 'helper'
+
+module UnQLite
+  class TestCollection < Minitest::Test
+    def setup
+      @db_path = "#{Dir.mktmpdir("unqlite-ruby-test")}/db"
+      @db = UnQLite::Database.new(@db_path)
+      @events = @db.collection("events")
+    end
+
+    def teardown
+      @db.close
+    end
+
+    def test_insert_many
+      docs = Array.new(1000) { |i| { "n" => i, "name" => "event#{i}", "tags" => ["a", "b"], "ok" => i.even? } }
+      ids = @events.insert_many(docs)
+      assert_equal (0...1000).to_a, ids
+      assert_equal 1000, @events.count
+
+      doc = @events.fetch_by_id(42)
+      assert_equal 42, doc["n"]
+      assert_equal "event42", doc["name"]
+      assert_equal ["a", "b"], doc["tags"]
+      assert_equal true, doc["ok"]
+      assert_equal 42, doc["__id"]
+    end
+
+    def test_insert_fetch_all
+      assert_equal [], @events.fetch_all
+      assert_equal 0, @events.count
+      assert_nil @events.fetch_by_id(0)
+
+      assert_equal 0, @events.insert(name: "first", score: 1.5, extra: nil)
+      assert_equal 1, @events.insert("name" => "second", "nested" => { "depth" => 2 })
+
+      all = @events.fetch_all
+      assert_equal ["first", "second"], all.map { |doc| doc["name"] }
+      assert_equal 1.5, all[0]["score"]
+      assert_nil all[0]["extra"]
+      assert_equal({ "depth" => 2 }, all[1]["nested"])
+      assert_equal [], @events.insert_many([])
+    end
+
+    def test_invalid_documents
+      assert_raises(TypeError) { @events.insert("time" => Object.new) }
+      assert_raises(TypeError) { @events.insert_many(["not a hash"]) }
+      cyclic = {}
+      cyclic["self"] = cyclic
+      assert_raises(ArgumentError) { @events.insert(cyclic) }
+      assert_equal 0, @events.count
+    end
+
+    def test_drop
+      @events.insert("name" => "first")
+      assert_equal true, @events.drop
+      assert_equal false, @events.drop
+      assert_equal 0, @events.count
+    end
+
+    def test_collections_are_separate
+      @events.insert("name" => "first")
+      other = @db.collection("other")
+      assert_equal "other", other.name
+      assert_same @db, other.database
+      assert_equal 0, other.count
+      assert_equal 1, @events.count
+    end
+
+    def test_fetch_all_where
+      @events.insert_many(Array.new(20) { |i| { "n" => i, "name" => (i.even? ? "even#{i}" : "odd#{i}"), "ok" => i < 5 } })
+
+      evens = @events.fetch_all(where: 'prefix_match($rec.name, "even")')
+      assert_equal (0...20).step(2).to_a, evens.map { |doc| doc["n"] }
+
+      ranged = @events.fetch_all(where: 'in_range($rec.n, 3, 6)', fields: [:name])
+      assert_equal [{ "name" => "odd3" }, { "name" => "even4" }, { "name" => "odd5" }, { "name" => "even6" }], ranged
+      assert_equal [3, 4], @events.fetch_all(where: 'in_range($rec.n, null, 4) && $rec.n > 2').map { |doc| doc["n"] }
+
+      assert_equal [{ "n" => 0 }], @events.fetch_all(fields: ["n", "missing"]).first(1)
+      assert_equal 20, @events.fetch_all(where: 'true').size
+      assert_equal [], @db.collection("missing").fetch_all(where: 'true')
+      assert_raises(UnQLite::CompileException) { @events.fetch_all(where: '$rec.n >') }
+    end
+
+    def test_create_function
+      @events.insert_many(Array.new(10) { |i| { "n" => i } })
+      seen = []
+      @db.create_function(:pick) { |doc| seen << doc["n"]; doc["n"] % 3 == 0 }
+      assert_equal [0, 3, 6, 9], @events.fetch_all(where: 'pick($rec)').map { |doc| doc["n"] }
+      assert_equal (0...10).to_a, seen
+
+      # Registered functions reach scripts compiled before them, and can be replaced
+      @db.create_function("pick") { |doc| doc["n"] == 1 }
+      assert_equal [1], @events.fetch_all(where: 'pick($rec)').map { |doc| doc["n"] }
+      @db.create_function("label") { |n| { "value" => "n#{n}" } }
+      assert_equal [2], @events.fetch_all(where: 'label($rec.n).value == "n2"').map { |doc| doc["n"] }
+
+      assert_raises(ArgumentError) { @db.create_function("not a name") { } }
+      assert_raises(ArgumentError) { @db.create_function("1st") { } }
+    end
+
+    def test_create_function_exception
+      @events.insert_many(Array.new(10) { |i| { "n" => i } })
+      @db.create_function(:fail) { |doc| raise ArgumentError, "bad #{doc["n"]}" if doc["n"] == 4; true }
+      error = assert_raises(ArgumentError) { @events.fetch_all(where: 'fail($rec)') }
+      assert_equal "bad 4", error.message
+
+      @db.create_function(:fail) { |doc| true }
+      assert_equal 10, @events.fetch_all(where: 'fail($rec)').size
+    end
+  end
+end
@@ -71,6 +71,20 @@ module UnQLite
       assert_equal ["alpha", "beta", "gamma"], keys.sort! # order is undefined
     end
 
+    def test_next_prev
+      db.store "alpha", "first"
+      db.store "beta", "second"
+      cursor = UnQLite::Cursor.new(db)
+      cursor.first!
+      assert_equal true, cursor.next
+      assert_equal false, cursor.next
+      assert !cursor.valid?
+
+      cursor.last!
+      assert_equal true, cursor.prev
+      assert_equal false, cursor.prev
+    end
+
     def test_seek
       db.store "alpha", "first"
       db.store "beta", "second"
@@ -89,5 +103,84 @@ module UnQLite
       cursor.delete!
       assert_raises(UnQLite::NotFoundException) { @db.fetch "beta" }
     end
+
+    def test_next_pair
+      db.store "alpha", "first"
+      db.store "beta", "second"
+      cursor = UnQLite::Cursor.new(db)
+      cursor.first!
+      pairs = []
+      while (pair = cursor.next_pair)
+        pairs << pair
+      end
+      assert_equal [["alpha", "first"], ["beta", "second"]], pairs.sort
+      assert_nil cursor.next_pair
+    end
+
+    def test_prev_pair
+      db.store "alpha", "first"
+      db.store "beta", "second"
+      cursor = UnQLite::Cursor.new(db)
+      cursor.last!
+      pairs = []
+      while (pair = cursor.prev_pair)
+        pairs << pair
+      end
+      assert_equal [["alpha", "first"], ["beta", "second"]], pairs.sort
+    end
+
+    def test_read
+      db.store "alpha", "first"
+      db.store "beta", "second"
+      db.store "gamma", "third"
+      cursor = UnQLite::Cursor.new(db)
+      cursor.first!
+      batch = cursor.read(2)
+      assert_equal 2, batch.size
+      batch += cursor.read(2)
+      assert_equal [["alpha", "first"], ["beta", "second"], ["gamma", "third"]], batch.sort
+      assert_equal [], cursor.read(2)
+    end
+
+    def test_read_keys_only_reverse
+      db.store "alpha", "first"
+      db.store "beta", "second"
+      cursor = UnQLite::Cursor.new(db)
+      cursor.last!
+      assert_equal ["alpha", "beta"], cursor.read(10, keys_only: true, reverse: true).sort
+    end
+
+    def test_many_cursors
+      db.store "key", "value"
+      cursors = Array.new(50) { UnQLite::Cursor.new(db) }
+      cursors.each_with_index { |cursor, i| cursor.release if i.even? }
+      cursors.reject!.with_index { |cursor, i| i.even? }
+      cursors.each do |cursor|
+        cursor.first!
+        assert_equal "key", cursor.key
+      end
+      cursors.each(&:release)
+      cursor = UnQLite::Cursor.new(db)
+      cursor.first!
+      assert_equal "key", cursor.key
+    end
+
+    def test_close_database_releases_cursors
+      db.store "key", "value"
+      cursor = UnQLite::Cursor.new(db)
+      db.close
+      assert_raises(RuntimeError) { cursor.first! }
+      @db = UnQLite::Database.open(db_path)
+    end
+
+    def test_delete_invalidates_cache
+      db.enable_cache
+      db.store "alpha", "first"
+      assert_equal "first", db["alpha"]
+      cursor = UnQLite::Cursor.new(db)
+      cursor.seek "alpha"
+      cursor.delete!
+      assert_nil db["alpha"]
+    end
   end
 end
@@ -1,4 +1,7 @@
 require 'tempfile'
+require 'tmpdir'
+require 'stringio'
+require 'objspace'
 require 'helper'
 
 module UnQLite
@@ -25,12 +28,333 @@ module UnQLite
       assert_equal "stored content with appendix", @db.fetch("key")
     end
 
+    def test_compare_and_set
+      @db.store("key", "old")
+      assert_equal false, @db.compare_and_set("key", "other", "new")
+      assert_equal "old", @db.fetch("key")
+      assert_equal true, @db.compare_and_set("key", "old", "new")
+      assert_equal "new", @db.fetch("key")
+    end
+
+    def test_compare_and_set_missing_key
+      assert_equal false, @db.compare_and_set("key", "old", "new")
+      assert_equal true, @db.compare_and_set("key", nil, "new")
+      assert_equal "new", @db.fetch("key")
+      assert_equal true, @db.compare_and_set("key", "new", nil)
+      assert_nil @db["key"]
+    end
+
+    def test_update
+      @db.store("counter", "1")
+      assert_equal true, @db.update("counter") { |old| (old.to_i + 1).to_s }
+      assert_equal "2", @db.fetch("counter")
+      @db.update("fresh") { |old| old.nil? ? "created" : "overwritten" }
+      assert_equal "created", @db.fetch("fresh")
+    end
+
+    def test_index_delimiter
+      @db.add_index(:email, delimiter: ",", field: 1)
+      @db.store("user:1", "alice,alice@example.com")
+      @db.store("user:2", "bob,bob@example.com")
+      assert_equal ["user:1"], @db.lookup_by(:email, "alice@example.com")
+      @db.store("user:1", "alice,alice@example.org")
+      assert_equal [], @db.lookup_by(:email, "alice@example.com")
+      assert_equal ["user:1"], @db.lookup_by(:email, "alice@example.org")
+      @db.delete("user:2")
+      assert_equal [], @db.lookup_by(:email, "bob@example.com")
+    end
+
+    def test_index_offset_existing_records
+      @db.store("a", "XYrest")
+      @db.store("b", "XYother")
+      @db.add_index("code", offset: 0, length: 2)
+      assert_equal ["a", "b"], @db.lookup_by("code", "XY").sort
+      @db.drop_index("code")
+      assert_raises(ArgumentError) { @db.lookup_by("code", "XY") }
+    end
+
+    def test_index_block
+      @db.add_index(:size) { |key, value| value.bytesize.to_s }
+      @db.store("a", "123")
+      @db.append("a", "45")
+      assert_equal [], @db.lookup_by(:size, "3")
+      assert_equal ["a"], @db.lookup_by(:size, "5")
+    end
+
+    def test_index_cursor_delete
+      @db.add_index(:size) { |key, value| value.bytesize.to_s }
+      @db.store("a", "123", ttl: 60)
+      cursor = UnQLite::Cursor.new(@db)
+      cursor.first!
+      cursor.delete!
+      cursor.close
+      assert_equal [], @db.lookup_by(:size, "3")
+      assert_nil @db.ttl("a")
+      assert @db.empty?
+    end
+
+    def test_index_cursor_delete_all
+      @db.add_index(:size) { |key, value| value.bytesize.to_s }
+      # Each key is followed by its own index and expiry records
+      keys = %w[a bb ccc dddd]
+      keys.each { |key| @db.store(key, key, ttl: 60) }
+
+      deleted = []
+      cursor = UnQLite::Cursor.new(@db)
+      cursor.first!
+      while cursor.valid?
+        deleted << cursor.key
+        cursor.delete!
+      end
+      cursor.close
+
+      assert_equal keys.sort, deleted.sort
+      assert @db.empty?
+      keys.each { |key| assert_equal [], @db.lookup_by(:size, key.bytesize.to_s) }
+    end
+
+    def test_bloom_filter
+      @db.store("existing", "value")
+      @db.enable_bloom_filter(capacity: 1000, error_rate: 0.01)
+      @db.store("added", "value")
+      assert @db.has_key?("existing")
+      assert_equal "value", @db["added"]
+      assert_nil @db["missing"]
+      assert_raises(UnQLite::NotFoundException) { @db.fetch("missing") }
+      stats = @db.bloom_filter_stats
+      assert_equal 2, stats[:items]
+      assert_equal 4, stats[:checks]
+      assert_equal 2, stats[:negatives] + stats[:false_positives]
+    end
+
+    def test_bloom_filter_clear
+      @db.enable_bloom_filter
+      @db.store("key", "value")
+      @db.clear
+      assert_equal 0, @db.bloom_filter_stats[:items]
+      assert !@db.has_key?("key")
+      @db.disable_bloom_filter
+      assert_nil @db.bloom_filter_stats
+    end
+
+    def test_cache
+      @db.enable_cache(max_bytes: 1024 * 1024)
+      @db.store("key", "value")
+      assert_equal "value", @db.fetch("key")
+      assert @db["key"].frozen?
+      @db.store("key", "changed")
+      assert_equal "changed", @db["key"]
+      @db.append("key", "!")
+      assert_equal "changed!", @db["key"]
+      @db.delete("key")
+      assert_nil @db["key"]
+      stats = @db.cache_stats
+      assert_equal 1, stats[:hits]
+      assert stats[:hit_ratio] > 0
+    end
+
+    def test_cache_eviction
+      @db.enable_cache(max_bytes: 256)
+      10.times { |i| @db.store("key#{i}", "x" * 64) }
+      10.times { |i| @db["key#{i}"] }
+      stats = @db.cache_stats
+      assert stats[:bytes] <= 256
+      assert stats[:evictions] > 0
+    end
+
+    def test_cache_clear
+      @db.enable_cache
+      @db.store("key", "value")
+      @db["key"]
+      @db.clear
+      assert_nil @db["key"]
+      assert_equal 0, @db.cache_stats[:entries]
+    end
+
+    def test_parallel_scan
+      @db.store("user:1", "alice")
+      @db.store("user:2", "bob")
+      @db.store("post:1", "hello")
+      @db.add_index("by_name") { |key, value| value }
+      result = @db.parallel_scan(threads: 3, histogram: 4)
+      assert_equal 3, result[:count]
+      assert_equal 18, result[:key_bytes]
+      assert_equal 13, result[:value_bytes]
+      assert_equal({ "user" => 2, "post" => 1 }, result[:histogram])
+
+      result = @db.parallel_scan(threads: 2, prefix: "user:")
+      assert_equal 2, result[:count]
+      assert_nil result[:histogram]
+    end
+
+    def test_backup_restore
+      @db.store("alpha", "first")
+      @db.store("beta", "\0second\n")
+      backup = StringIO.new("".b)
+      assert_equal 2, @db.backup_to(backup, chunk_size: 8)
+
+      Dir.mktmpdir("unqlite-ruby-test") do |dir|
+        restored = "#{dir}/restored"
+        assert_equal 2, UnQLite.restore(restored, StringIO.new(backup.string))
+        UnQLite::Database.open(restored) do |db|
+          assert_equal "first", db.fetch("alpha")
+          assert_equal "\0second\n", db.fetch("beta")
+        end
+
+        corrupt = backup.string.dup
+        corrupt[-1] = (corrupt[-1].ord ^ 1).chr
+        assert_raises(UnQLite::CorruptException) { UnQLite.restore("#{dir}/corrupt", StringIO.new(corrupt)) }
+        assert_raises(UnQLite::CorruptException) { UnQLite.restore("#{dir}/truncated", StringIO.new(backup.string[0..-2])) }
+      end
+    end
+
+    def test_fetch_to
+      value = "x" * 300_000
+      @db.store("blob", value)
+      io = StringIO.new("".b)
+      assert_equal value.size, @db.fetch_to("blob", io)
+      assert_equal value, io.string
+      assert_raises(UnQLite::NotFoundException) { @db.fetch_to("missing", StringIO.new) }
+    end
+
+    def test_fetch_to_reentrant
+      @db.store("blob", "value")
+      db = @db
+      io = Object.new
+      io.define_singleton_method(:write) { |chunk| db.store("other", chunk) }
+      assert_raises(UnQLite::BusyException) { @db.fetch_to("blob", io) }
+      assert_nil @db["other"]
+    end
+
+    def test_store_from_append_from
+      @db.store("blob", "old")
+      assert_equal 10, @db.store_from("blob", StringIO.new("0123456789"), chunk_size: 3)
+      assert_equal "0123456789", @db.fetch("blob")
+      assert_equal 3, @db.append_from("blob", StringIO.new("abc"))
+      assert_equal "0123456789abc", @db.fetch("blob")
+      assert_equal 0, @db.store_from("blob", StringIO.new(""))
+      assert_equal "", @db.fetch("blob")
+    end
+
+    def test_store_ttl
+      @db.store("short", "value", ttl: 0.05)
+      @db.store("long", "value", ttl: 60)
+      @db.store("plain", "value")
+      assert_equal "value", @db["short"]
+      assert_in_delta 60, @db.ttl("long"), 1
+      assert_nil @db.ttl("plain")
+
+      sleep 0.1
+      assert_nil @db["short"]
+      assert !@db.has_key?("short")
+      assert_raises(UnQLite::NotFoundException) { @db.fetch("short") }
+      assert_equal "value", @db["long"]
+
+      @db.store("long", "value")
+      assert_nil @db.ttl("long")
+      assert_raises(ArgumentError) { @db.store("key", "value", ttl: 0) }
+    end
+
+    def test_store_invalid_ttl
+      assert_raises(ArgumentError) { @db.store("key", "value", ttl: 0) }
+      assert_raises(TypeError) { @db.store("key", "value", ttl: "soon") }
+      assert !@db.has_key?("key")
+    end
+
+    def test_writes_over_expired_keys
+      @db.store("append", "old", ttl: 0.01)
+      @db.store("cas", "old", ttl: 0.01)
+      @db.store("update", "old", ttl: 0.01)
+      @db.store("stream", "old", ttl: 60)
+      sleep 0.05
+
+      @db.append("append", "new")
+      assert_equal "new", @db["append"]
+      assert_nil @db.ttl("append")
+
+      assert_equal false, @db.compare_and_set("cas", "old", "new")
+      assert_equal true, @db.compare_and_set("cas", nil, "new")
+      assert_equal "new", @db["cas"]
+      assert_nil @db.ttl("cas")
+
+      @db.update("update") { |old| assert_nil old; "new" }
+      assert_equal "new", @db["update"]
+
+      @db.store_from("stream", StringIO.new("new"))
+      assert_nil @db.ttl("stream")
+    end
+
+    def test_expiry_sweeper
+      @db.store("doomed", "value", ttl: 0.01)
+      @db.store("kept", "value")
+      @db.commit
+      @db.enable_expiry(rate: 1000, batch: 10)
+
+      deadline = Time.now + 5
+      sleep 0.01 while @db.expiry_stats[:expired] == 0 && Time.now < deadline
+      @db.disable_expiry
+
+      assert_equal 1, @db.expiry_stats[:expired]
+      assert_equal 0, @db.expiry_stats[:pending]
+      keys = []
+      @db.each_key { |key| keys << key }
+      assert_equal ["kept"], keys
+    end
+
+    def wait_for_expiry(key, value)
+      deadline = Time.now + 5
+      sleep 0.01 while @db.expiry_stats[key] != value && Time.now < deadline
+      assert_equal value, @db.expiry_stats[key]
+    end
+
+    def test_expiry_sweeper_without_commit
+      @db.store("doomed", "value", ttl: 0.01)
+      @db.store("kept", "value")
+      @db.enable_expiry(rate: 1000, batch: 10)
+
+      # Deleted inside the pending auto-transaction, counted once it ends
+      wait_for_expiry(:pending, 0)
+      @db.commit
+      wait_for_expiry(:expired, 1)
+      @db.disable_expiry
+
+      assert_equal "value", @db["kept"]
+      assert_nil @db["doomed"]
+    end
+
+    def test_expiry_sweeper_waits_for_transaction
+      @db.store("doomed", "value", ttl: 0.01)
+      @db.commit
+      @db.begin_transaction
+      @db.store("kept", "value")
+      @db.enable_expiry(rate: 1000, batch: 10)
+
+      sleep 0.1
+      assert_equal 0, @db.expiry_stats[:expired]
+      assert @db.expiry_stats[:deferred] > 0
+      @db.rollback
+
+      deadline = Time.now + 5
+      sleep 0.01 while @db.expiry_stats[:expired] == 0 && Time.now < deadline
+      @db.disable_expiry
+      assert_equal 1, @db.expiry_stats[:expired]
+    end
+
     def test_fetch
       @db.store("key", "wabba")
 
       assert_equal("wabba", @db.fetch("key"))
     end
 
+    def test_fetch_default
+      @db.store("key", "value")
+      assert_equal "value", @db.fetch("key", "default")
+      assert_equal "default", @db.fetch("missing", "default")
+      assert_nil @db.fetch("missing", nil)
+      assert_equal "missing!", @db.fetch("missing") { |key| "#{key}!" }
+      assert_equal "value", @db.fetch("key") { flunk }
+    end
+
     def test_fetchlonger
       @db.store("key", "wabbawabba")
 
@@ -95,6 +419,20 @@ module UnQLite
       end
     end
 
+    def test_each_intern_keys_freeze
+      @db.store("alpha", "first")
+      @db.store("beta", "second")
+      @db.each(intern_keys: true, freeze: true) do |key, value|
+        assert key.frozen?
+        assert value.frozen?
+      end
+      keys = []
+      2.times { @db.each_key(intern_keys: true) { |key| keys << key } }
+      assert_equal 4, keys.size
+      assert_same keys[0], keys[2]
+      @db.each_value { |value| assert !value.frozen? }
+    end
+
     def test_each_key
       pairs = [ [ "alpha", "first" ], [ "beta", "second" ], [ "gamma", "third" ] ]
       pairs.each { |pair| @db.store(*pair) }
@@ -111,6 +449,17 @@ module UnQLite
       assert_equal pairs.map { |k,v| v }, all.sort
     end
 
+    def test_each_break
+      [ "alpha", "beta", "gamma" ].each { |key| @db.store(key, "value") }
+      20.times do
+        @db.each { |key, value| break }
+        assert_raises(RuntimeError) { @db.each_key { |key| raise "stop" } }
+      end
+      all = []
+      @db.each_key { |key| all << key }
+      assert_equal [ "alpha", "beta", "gamma" ], all.sort
+    end
+
     def test_aref
       @db["key"] = "data"
       assert_equal "data", @db["key"]
@@ -148,6 +497,26 @@ module UnQLite
       assert !@db.empty?
     end
 
+    def test_internal_records_hidden
+      @db.add_index(:size) { |key, value| value.bytesize.to_s }
+      @db.store("key", "value", ttl: 60)
+      @db.delete("key")
+      assert @db.empty?
+
+      @db.store("key", "value", ttl: 60)
+      keys = []
+      @db.each_key { |key| keys << key }
+      assert_equal ["key"], keys
+      values = []
+      @db.each_value { |value| values << value }
+      assert_equal ["value"], values
+
+      cursor = UnQLite::Cursor.new(@db)
+      cursor.first!
+      assert_equal [["key", "value"]], cursor.read(10)
+      cursor.close
+    end
+
     def test_max_page_cache
       UnQLite::Database.open(db_path) do |db|
         db.max_page_cache = 1024
@@ -176,6 +545,10 @@ module UnQLite
       @db_path = ":mem:"
       super(*args)
     end
+
+    def test_compact_unsupported
+      assert_raises(UnQLite::UnsupportedException) { @db.compact }
+    end
   end
 
   class TestDatabase < Minitest::Test
@@ -193,6 +566,18 @@ module UnQLite
       @tmp.unlink
     end
 
+    def test_compare_and_set_in_transaction
+      @db.store("key", "old")
+      @db.commit
+      @db.begin_transaction
+      @db.store("other", "value")
+      assert_equal true, @db.compare_and_set("key", "old", "new")
+      assert_equal "new", @db.fetch("key")
+      @db.rollback
+      assert_equal "old", @db.fetch("key")
+      assert_nil @db["other"]
+    end
+
     def test_automatic_transaction
       @db.store("auto", "wabba")
       @db.rollback
@@ -200,6 +585,22 @@ module UnQLite
       assert_raises(UnQLite::NotFoundException) { @db.fetch("auto") }
     end
 
+    def test_expiry_sweeper_keeps_automatic_transaction
+      @db.store("doomed", "value", ttl: 0.01)
+      @db.commit
+      @db.store("auto", "wabba")
+      @db.enable_expiry(rate: 1000, batch: 10)
+
+      wait_for_expiry(:pending, 0)
+      @db.rollback
+      assert_nil @db["auto"]
+
+      # The rollback brought the expired key back: it is swept again
+      wait_for_expiry(:expired, 1)
+      @db.disable_expiry
+      assert_nil @db["doomed"]
+    end
+
     def test_manual_transaction
       @db.begin_transaction
       @db.store("manual", "wabba")
@@ -216,6 +617,16 @@ module UnQLite
       assert_raises(UnQLite::NotFoundException) { @db.fetch("will_disapper") }
     end
 
+    def test_cache_rollback
+      @db.enable_cache
+      @db.store("key", "committed")
+      @db.commit
+      @db.store("key", "pending")
+      assert_equal "pending", @db["key"]
+      @db.rollback
+      assert_equal "committed", @db["key"]
+    end
+
     def test_end_transaction_commit
       @db.begin_transaction
       @db.store "manual", "wabba"
@@ -251,6 +662,141 @@ module UnQLite
       assert_raises(UnQLite::NotFoundException) { @db.fetch("beta") }
     end
 
+    def test_bloom_filter_sidecar
+      sidecar = "#{db_path}.bloom"
+      @db.enable_bloom_filter(path: sidecar)
+      @db.store("key", "value")
+      @db.close
+      assert File.exist?(sidecar)
+
+      @db = UnQLite::Database.new(db_path)
+      @db.enable_bloom_filter(path: sidecar)
+      assert_equal 1, @db.bloom_filter_stats[:items]
+      assert @db.has_key?("key")
+    ensure
+      File.unlink(sidecar) if File.exist?(sidecar)
+    end
+
+    def test_parallel_scan_export
+      export = "#{db_path}.export"
+      @db.store("alpha", "first")
+      @db.store("beta", "second")
+      assert_equal 1, @db.parallel_scan(threads: 4, prefix: "al", export: export)[:count]
+      assert_equal [5, 5, "alpha", "first"], File.binread(export).unpack("NNa5a5")
+    ensure
+      File.unlink(export) if File.exist?(export)
+    end
+
+    def test_backup_in_transaction
+      @db.store("committed", "1")
+      @db.commit
+      @db.begin_transaction
+      @db.store("pending", "2")
+      assert_equal 2, @db.backup_to(StringIO.new("".b))
+      @db.rollback
+      assert_nil @db["pending"]
+      assert_equal 1, @db.backup_to(StringIO.new("".b))
+    end
+
+    def test_parallel_scan_in_transaction
+      @db.store("committed", "1")
+      @db.commit
+      @db.begin_transaction
+      @db.store("pending", "2")
+      assert_equal 2, @db.parallel_scan(threads: 4)[:count]
+      @db.rollback
+      assert_nil @db["pending"]
+      assert_equal 1, @db.parallel_scan(threads: 4)[:count]
+    end
+
+    def test_compact
+      1000.times { |i| @db.store("key#{i}", "value" * 50) }
+      @db.commit
+      900.times { |i| @db.delete("key#{i}") }
+      @db.store("pending", "value")
+      cursor = UnQLite::Cursor.new(@db)
+
+      stats = @db.compact(order: :key, commit_every: 4096)
+      assert_equal 101, stats[:records]
+      assert_operator stats[:bytes_after], :<=, stats[:bytes_before]
+      assert_equal stats[:bytes_before] - stats[:bytes_after], stats[:reclaimed]
+      assert_kind_of Float, stats[:elapsed]
+      assert_raises(RuntimeError) { cursor.key }
+
+      assert_equal "value" * 50, @db.fetch("key999")
+      assert_equal "value", @db.fetch("pending")
+      assert !@db.has_key?("key0")
+      @db.store("after", "compaction")
+      assert_equal "compaction", @db["after"]
+    end
+
+    def test_compact_to_target
+      target = "#{db_path}.copy"
+      100.times { |i| @db.store("key#{i}", "value") }
+      assert_equal 100, @db.compact(target, rate: 10_000_000)[:records]
+      assert_equal "value", @db["key1"]
+
+      UnQLite::Database.open(target) do |copy|
+        assert_equal "value", copy["key99"]
+      end
+    ensure
+      File.unlink(target) if File.exist?(target)
+    end
+
+    def test_compact_existing_target
+      @db.store("key", "value")
+      @db.commit
+      assert_raises(Errno::EEXIST) { @db.compact(db_path) }
+      assert_equal "value", @db["key"]
+
+      target = "#{db_path}.copy"
+      File.write(target, "precious")
+      assert_raises(Errno::EEXIST) { @db.compact(target) }
+      assert_equal "precious", File.read(target)
+    ensure
+      File.unlink(target) if target && File.exist?(target)
+    end
+
+    def test_compact_in_transaction
+      @db.store("committed", "1")
+      @db.commit
+      @db.begin_transaction
+      @db.store("pending", "2")
+      assert_raises(UnQLite::BusyException) { @db.compact }
+      @db.rollback
+      assert_nil @db["pending"]
+      assert_equal 1, @db.compact[:records]
+    end
+
+    def test_index_rebuilt_after_unindexed_writes
+      @db.add_index("code", offset: 0, length: 2)
+      @db.store("a", "XYrest")
+      @db.close
+
+      @db = UnQLite::Database.new(db_path)
+      @db.store("b", "XYother")
+      @db.delete("a")
+      @db.close
+
+      @db = UnQLite::Database.new(db_path)
+      @db.add_index("code", offset: 0, length: 2)
+      assert_equal ["b"], @db.lookup_by("code", "XY")
+      @db.close
+
+      @db = UnQLite::Database.new(db_path)
+      @db.add_index("code", offset: 0, length: 1)
+      assert_equal ["b"], @db.lookup_by("code", "X")
+    end
+
+    def test_ttl_reopen
+      @db.store("key", "value", ttl: 0.05)
+      @db.close
+      sleep 0.1
+
+      @db = UnQLite::Database.new(db_path)
+      assert_nil @db["key"]
+    end
+
     def test_disable_auto_commit
       UnQLite::Database.open(db_path) do |db|
         db.disable_auto_commit
@@ -260,6 +806,30 @@ module UnQLite
         assert !db.include?("key")
       end
     end
+
+    def test_memsize
+      empty = ObjectSpace.memsize_of(@db)
+      @db.enable_cache(max_bytes: 1024 * 1024)
+      100.times { |i| @db.store("key#{i}", "value#{i}") }
+      100.times { |i| @db.fetch("key#{i}") }
+      assert_operator ObjectSpace.memsize_of(@db), :>, empty
+    end
+
+    def test_gc_compact
+      skip "GC.compact is not supported" unless GC.respond_to?(:compact)
+      @db.enable_cache(max_bytes: 1024)
+      @db.store("key", "value")
+      @db.fetch("key")
+      @db.create_function("twice") { |value| value * 2 }
+      cursor = UnQLite::Cursor.new(@db)
+      GC.compact
+
+      assert_equal "value", @db.fetch("key")
+      cursor.first!
+      assert_equal "key", cursor.key
+    ensure
+      cursor.release if cursor
+    end
   end
 
   class TestOpen < Minitest::Test
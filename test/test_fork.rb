@@ -0,0 +1,78 @@
+require 'tmpdir'
+require 'helper'
+
+module UnQLite
+  class TestFork < Minitest::Test
+    def setup
+      skip "fork is not supported" unless Process.respond_to?(:fork)
+      @dir = Dir.mktmpdir("unqlite-ruby-test")
+      @db = UnQLite::Database.new("#{@dir}/db")
+    end
+
+    def teardown
+      @db.close if @db
+    end
+
+    def fork_and_wait(&block)
+      pid = fork do
+        ok = begin
+          block.call
+        rescue ::Exception
+          false
+        end
+        exit!(ok ? 0 : 1)
+      end
+      Process.wait(pid)
+      $?.success?
+    end
+
+    def test_child_writes_through_reopened_handle
+      skip "Process._fork is not supported" unless Process.respond_to?(:_fork)
+      @db.store("parent", "1")
+      cursor = UnQLite::Cursor.new(@db)
+
+      assert fork_and_wait {
+        released = begin
+          cursor.first!
+          false
+        rescue RuntimeError
+          true
+        end
+        @db.store("child", "2")
+        @db.commit
+        released && @db.fetch("parent") == "1"
+      }
+
+      cursor.release
+      @db.close
+      @db = UnQLite::Database.new("#{@dir}/db")
+      assert_equal "1", @db.fetch("parent")
+      assert_equal "2", @db.fetch("child")
+    end
+
+    def test_read_only_handle_is_kept
+      @db.store("key", "value")
+      @db.commit
+      reader = UnQLite::Database.new("#{@dir}/db", UnQLite::READONLY)
+
+      assert fork_and_wait {
+        UnQLite::Database.before_fork
+        UnQLite::Database.after_fork
+        reader.fetch("key") == "value"
+      }
+    ensure
+      reader.close if reader
+    end
+
+    def test_after_fork_runs_once_per_child
+      @db.store("key", "value")
+      @db.commit
+      assert_equal 0, UnQLite::Database.after_fork
+
+      assert fork_and_wait {
+        UnQLite::Database.after_fork unless Process.respond_to?(:_fork)
+        UnQLite::Database.after_fork == 0 && @db.fetch("key") == "value"
+      }
+    end
+  end
+end
@@ -0,0 +1,53 @@
+require 'tmpdir'
+require 'helper'
+
+# Tracing must be on before the first database is opened, and test files
+# are all loaded before any test runs.
+begin
+  UnQLite.enable_io_tracing
+rescue UnQLite::UnsupportedException
+end
+
+module UnQLite
+  class TestIoTracing < Minitest::Test
+    def setup
+      skip "the linked unqlite does not export its built-in VFS" unless UnQLite.io_tracing?
+      @db_path = "#{Dir.mktmpdir("unqlite-ruby-test")}/db"
+      @db = UnQLite::Database.new(@db_path)
+    end
+
+    def teardown
+      @db.close if @db
+    end
+
+    def test_io_stats
+      100.times { |i| @db.store("key#{i}", "value" * 100) }
+      @db.commit
+
+      stats = @db.io_stats
+      assert_operator stats[:writes], :>, 0
+      assert_operator stats[:bytes_written], :>, 0
+      assert_operator stats[:syncs], :>, 0
+      assert_operator stats[:locks], :>, 0
+      assert_kind_of Float, stats[:write_time]
+      assert_kind_of Hash, stats[:journal]
+
+      @db.close
+      @db = UnQLite::Database.new(@db_path)
+      reads = @db.io_stats[:reads]
+      @db.fetch("key1")
+      assert_operator @db.io_stats[:reads], :>, reads
+    end
+
+    def test_io_stats_in_memory
+      UnQLite::Database.open(":mem:") do |db|
+        db.store("key", "value")
+        assert_nil db.io_stats
+      end
+    end
+
+    def test_enable_twice
+      assert UnQLite.enable_io_tracing
+    end
+  end
+end
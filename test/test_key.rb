@@ -0,0 +1,52 @@
+require 'tmpdir'
+require 'helper'
+
+module UnQLite
+  class TestKey < Minitest::Test
+    def test_round_trip
+      tuple = [-7, 2.5, Time.at(1_500_000_000, 123, :nsec), "name", "\0\xff".b, :sym, nil, true, false, [1, ["x"]]]
+      assert_equal tuple, UnQLite::Key.decode(UnQLite::Key.encode(tuple))
+      assert_equal Encoding::ASCII_8BIT, UnQLite::Key.encode(tuple).encoding
+      assert_equal UnQLite::Key.encode(["a"]), UnQLite::Key.encode("a")
+    end
+
+    def test_order
+      tuples = []
+      [-2**63, -1, 0, 1, 2**63 - 1].each do |id|
+        [-Float::INFINITY, -1.5, 0.0, 1e-9, 1.5].each do |score|
+          ["", "a", "a\0", "a\0b", "ab", "b"].each { |name| tuples << [id, score, name] }
+        end
+      end
+      assert_equal tuples, tuples.shuffle.sort_by { |tuple| UnQLite::Key.encode(tuple) }
+    end
+
+    def test_errors
+      assert_raises(TypeError) { UnQLite::Key.encode([Object.new]) }
+      assert_raises(RangeError) { UnQLite::Key.encode(2**64) }
+      assert_raises(ArgumentError) { UnQLite::Key.decode("\x41abc".b) }
+      assert_raises(ArgumentError) { UnQLite::Key.decode("\x10\x00".b) }
+    end
+
+    def test_each_range_tuple_bounds
+      Dir.mktmpdir("unqlite-ruby-test") do |dir|
+        UnQLite::Database.open("#{dir}/db") do |db|
+          [1, 2].each do |tenant|
+            (1..5).each { |ts| db.store(UnQLite::Key.encode([tenant, ts, "event"]), "#{tenant}:#{ts}") }
+          end
+
+          values = []
+          db.each_range([1], [1]) { |_, value| values << value }
+          assert_equal (1..5).map { |ts| "1:#{ts}" }, values
+
+          values = []
+          db.each_range([2, 2], [2, 4], reverse: true) { |_, value| values << value }
+          assert_equal ["2:4", "2:3", "2:2"], values
+
+          keys = []
+          db.each_range([2, 5], nil, keys_only: true) { |key| keys << UnQLite::Key.decode(key) }
+          assert_equal [[2, 5, "event"]], keys
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,116 @@
+require 'tmpdir'
+require 'helper'
+
+module UnQLite
+  class TestKeyOrder < Minitest::Test
+    def setup
+      @db_path = "#{Dir.mktmpdir("unqlite-ruby-test")}/db"
+      @db = UnQLite::Database.new(@db_path)
+      @keys = Array.new(500) { |i| "ts:%05d" % (i * 3) }
+      @keys.shuffle.each { |key| @db.store(key, key.upcase) }
+      @db.store("other", "1")
+    end
+
+    def teardown
+      @db.close
+    end
+
+    def range(from = nil, to = nil, **opts)
+      pairs = []
+      @db.each_range(from, to, **opts) { |*pair| pairs << pair }
+      pairs
+    end
+
+    def test_each_range
+      assert_equal false, @db.key_order?
+      all = range
+      assert_equal true, @db.key_order?
+      assert_equal (@keys + ["other"]).map { |key| [key, key.upcase] }, all
+
+      assert_equal ["ts:00030", "ts:00033", "ts:00036"], range("ts:00030", "ts:00036").map(&:first)
+      assert_equal ["ts:00033", "ts:00036"], range("ts:00031", "ts:00037").map(&:first)
+      assert_equal ["ts:00036", "ts:00033"], range("ts:00031", "ts:00037", reverse: true).map(&:first)
+      assert_equal [["other"], ["ts:01497"]], range(nil, nil, reverse: true, keys_only: true).first(2)
+      assert_equal [], range("ts:9", nil)
+      assert_equal "other", @db.first_key
+      assert_equal "ts:01497", @db.last_key
+    end
+
+    def test_writes_update_order
+      @db.enable_key_order
+      @db.store("ts:00001", "new")
+      @db.delete("ts:00000")
+      @db.append("ts:00002", "x")
+      assert_equal ["ts:00001", "ts:00002", "ts:00003"], range("ts:", "ts:00003").map(&:first)
+
+      @db.commit
+      @db.begin_transaction
+      @db.store("ts:00004", "rolled back")
+      @db.rollback
+      assert_equal ["ts:00001", "ts:00002", "ts:00003", "ts:00006"], range("ts:", "ts:00006").map(&:first)
+
+      @db.clear
+      assert_nil @db.first_key
+      assert_equal 0, @db.key_order_stats[:keys]
+    end
+
+    def test_writes_during_scan
+      seen = []
+      @db.each_range("ts:", "ts:00030", keys_only: true) do |key|
+        seen << key
+        following = "ts:%05d" % (key[3..-1].to_i + 3)
+        @db.delete(following) if @db.has_key?(following)
+        @db.store("ts:00029", "late") if key == "ts:00000"
+      end
+      assert_equal ["ts:00000", "ts:00006", "ts:00012", "ts:00018", "ts:00024", "ts:00029", "ts:00030"], seen
+    end
+
+    def test_stats
+      @db.enable_key_order
+      stats = @db.key_order_stats
+      assert_equal 501, stats[:keys]
+      assert_operator stats[:leaves], :>, 1
+      assert_operator stats[:height], :>, 1
+      assert_operator stats[:prefix_bytes_saved], :>, 0
+
+      @db.disable_key_order
+      assert_equal false, @db.key_order?
+      assert_equal 0, @db.key_order_stats[:keys]
+    end
+
+    def test_page
+      keys = []
+      token = nil
+      loop do
+        entries, token = @db.page(after: token, limit: 64, keys_only: true)
+        assert_operator entries.size, :<=, 64
+        keys.concat(entries)
+        break unless token
+      end
+      assert_equal @keys + ["other"], keys
+
+      entries, token = @db.page(limit: 2)
+      assert_equal [["other", "1"], ["ts:00000", "TS:00000"]], entries
+      @db.delete("ts:00000")
+      @db.store("ts:00001", "new")
+      entries, = @db.page(after: token, limit: 1)
+      assert_equal [["ts:00001", "new"]], entries
+
+      assert_raises(ArgumentError) { @db.page(after: "xyz") }
+      assert_raises(ArgumentError) { @db.page(limit: 0) }
+    end
+
+    def test_page_keys_deleted_elsewhere
+      @db.enable_key_order
+      @db.commit
+
+      other = UnQLite::Database.new(@db_path)
+      other.delete("other")
+      other.commit
+      other.close
+
+      entries, = @db.page(limit: 2, keys_only: true)
+      assert_equal ["ts:00000", "ts:00003"], entries
+    end
+  end
+end
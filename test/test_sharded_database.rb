@@ -0,0 +1,76 @@
+require 'tmpdir'
+require 'helper'
+
+module UnQLite
+  class TestShardedDatabase < Minitest::Test
+    attr_reader :dir, :db
+
+    def setup
+      @dir = "#{Dir.mktmpdir("unqlite-ruby-test")}/shards"
+      @db = UnQLite::ShardedDatabase.new(dir, shards: 4)
+    end
+
+    def teardown
+      db.close
+      FileUtils.remove_entry(File.dirname(dir))
+    end
+
+    def test_store_fetch_delete
+      100.times { |i| db.store("key#{i}", "value#{i}") }
+      assert_equal "value42", db.fetch("key42")
+      assert_equal "value7", db["key7"]
+      assert db.has_key?("key99")
+      db.delete("key42")
+      assert_raises(UnQLite::NotFoundException) { db.fetch("key42") }
+      assert db.shards.map(&:empty?).none?
+    end
+
+    def test_each
+      pairs = { "alpha" => "first", "beta" => "second", "gamma" => "third" }
+      pairs.each { |k, v| db[k] = v }
+      all = {}
+      db.each { |key, value| all[key] = value }
+      assert_equal pairs, all
+      keys = []
+      db.each_key(intern_keys: true) { |key| keys << key }
+      assert_equal pairs.keys, keys.sort
+    end
+
+    def test_fetch_many
+      50.times { |i| db.store("key#{i}", "value#{i}") }
+      db.store("empty", "")
+      db.commit
+      assert_equal ["value3", nil, "", "value49"], db.fetch_many(["key3", "missing", "empty", "key49"])
+      assert_equal [], db.fetch_many([])
+    end
+
+    def test_fetch_many_expired
+      db.store("short", "value", ttl: 0.01)
+      db.store("long", "value", ttl: 60)
+      db.commit
+      sleep 0.05
+      assert_equal [nil, "value"], db.fetch_many(["short", "long"])
+    end
+
+    def test_transaction
+      db.transaction("alpha") { |shard| shard.store("alpha", "first") }
+      assert_equal "first", db.fetch("alpha")
+      assert_same db.shard_for("alpha"), db.shards.find { |shard| shard.has_key?("alpha") }
+    end
+
+    def test_clear_close
+      db.store("alpha", "first")
+      db.clear
+      assert db.empty?
+      db.close
+      assert db.closed?
+      assert_raises(RuntimeError) { db.fetch("alpha") }
+    end
+
+    def test_shard_count_mismatch
+      db.close
+      assert_raises(ArgumentError) { UnQLite::ShardedDatabase.new(dir, shards: 8) }
+      @db = UnQLite::ShardedDatabase.new(dir, shards: 4)
+    end
+  end
+end